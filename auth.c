@@ -18,12 +18,409 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <syslog.h>
 #include <limits.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #include <gensio/gensio.h>
 
+#include "ser2net.h"
+
+/*
+ * A cache of what is in the authdirs, so a lot of clients connecting
+ * at once don't each have to go read the files.  There is an entry
+ * for each password file that has been read and each allowed_certs
+ * directory that has been looked for, keyed by the full path.
+ *
+ * With inotify, each user's directory is watched and any change
+ * there throws the whole cache away, and the watches with it; the
+ * events are picked up the next time the cache is used.  Without it, each entry remembers the
+ * stat of its file and is checked against a new stat when used,
+ * that's still less work than reading the file.
+ */
+#define AUTH_HASH_SIZE	256
+#define AUTH_MAX_PW	100
+
+struct auth_entry {
+    char *path;
+    bool exists; /* For allowed_certs, is the directory there? */
+    char *password; /* For a password file, its first line. */
+    size_t pwlen;
+#ifdef HAVE_SYS_INOTIFY_H
+    int wd; /* The watch on the file's directory. */
+#else
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+#endif
+    struct auth_entry *next;
+};
+
+static struct gensio_lock *auth_lock;
+static struct auth_entry *auth_cache[AUTH_HASH_SIZE];
+#ifdef HAVE_SYS_INOTIFY_H
+static int auth_inotify_fd = -1;
+#endif
+
+/*
+ * Clear a password.  A plain memset() before the memory is freed or
+ * goes out of scope may be optimized away, this won't be.
+ */
+static void
+auth_wipe(void *p, size_t len)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+    explicit_bzero(p, len);
+#else
+    volatile unsigned char *v = p;
+
+    while (len--)
+	*v++ = 0;
+#endif
+}
+
+static void
+auth_entry_free(struct auth_entry *e)
+{
+    if (e->password) {
+	/* Don't leave passwords lying around in free memory. */
+	auth_wipe(e->password, e->pwlen);
+	free(e->password);
+    }
+    free(e->path);
+    free(e);
+}
+
+static void
+auth_cache_flush(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < AUTH_HASH_SIZE; i++) {
+	while (auth_cache[i]) {
+	    struct auth_entry *e = auth_cache[i];
+
+	    auth_cache[i] = e->next;
+#ifdef HAVE_SYS_INOTIFY_H
+	    /*
+	     * Entries in the same directory share a watch, only the
+	     * first removal works, the rest just fail.
+	     */
+	    if (auth_inotify_fd != -1 && e->wd != -1)
+		inotify_rm_watch(auth_inotify_fd, e->wd);
+#endif
+	    auth_entry_free(e);
+	}
+    }
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Throw the cache away if anything changed.  Call with auth_lock held. */
+static void
+auth_cache_check(void)
+{
+    char buf[4096]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    bool changed = false;
+    ssize_t len, i;
+
+    if (auth_inotify_fd == -1)
+	return;
+    while ((len = read(auth_inotify_fd, buf, sizeof(buf))) > 0) {
+	/* Removing the watches in a flush reports IN_IGNORED, skip those. */
+	for (i = 0; i < len; i += sizeof(*ev) + ev->len) {
+	    ev = (struct inotify_event *) (buf + i);
+	    if (!(ev->mask & IN_IGNORED))
+		changed = true;
+	}
+    }
+    if (changed)
+	auth_cache_flush();
+}
+
+/*
+ * Watch the directory the given file is in.  This must be done
+ * before the file is read, so a change after reading it is seen.
+ * Returns the watch descriptor, or -1 on failure.
+ */
+static int
+auth_watch(const char *path)
+{
+    char dir[PATH_MAX];
+    char *s;
+
+    if (auth_inotify_fd == -1)
+	return -1;
+    snprintf(dir, sizeof(dir), "%s", path);
+    s = strrchr(dir, '/');
+    if (!s)
+	return -1;
+    *s = '\0';
+    return inotify_add_watch(auth_inotify_fd, dir,
+			     IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+			     IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE |
+			     IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+#else
+static void
+auth_cache_check(void)
+{
+}
+
+static bool
+auth_stat_same(struct auth_entry *e, struct stat *st)
+{
+    return (e->dev == st->st_dev && e->ino == st->st_ino &&
+	    e->size == st->st_size &&
+	    e->mtime.tv_sec == st->st_mtim.tv_sec &&
+	    e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	    e->ctime.tv_sec == st->st_ctim.tv_sec &&
+	    e->ctime.tv_nsec == st->st_ctim.tv_nsec);
+}
+#endif
+
+/*
+ * Find the entry for path.  Call with auth_lock held.  This returns
+ * NULL if there isn't one or it's out of date.
+ */
+static struct auth_entry *
+auth_cache_find(const char *path, unsigned int h)
+{
+    struct auth_entry *e, **prev;
+
+    auth_cache_check();
+    for (prev = &auth_cache[h]; *prev; prev = &(*prev)->next) {
+	e = *prev;
+	if (strcmp(e->path, path) == 0) {
+#ifndef HAVE_SYS_INOTIFY_H
+	    struct stat st;
+	    bool same;
+
+	    if (stat(path, &st) == -1)
+		same = !e->exists;
+	    else
+		same = e->exists && auth_stat_same(e, &st);
+	    if (!same) {
+		*prev = e->next;
+		auth_entry_free(e);
+		return NULL;
+	    }
+#endif
+	    return e;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Add an entry for path, call with auth_lock held.  st is the stat of
+ * the file if it exists, wd the watch from auth_cacheable().  If this
+ * runs out of memory the entry just doesn't get cached.
+ */
+static void
+auth_cache_add(const char *path, unsigned int h, bool exists,
+	       const char *password, struct stat *st, int wd)
+{
+    struct auth_entry *e;
+
+    e = malloc(sizeof(*e));
+    if (!e)
+	return;
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    if (!e->path)
+	goto out_err;
+    e->exists = exists;
+#ifdef HAVE_SYS_INOTIFY_H
+    e->wd = wd;
+#endif
+    if (password) {
+	e->pwlen = strlen(password);
+	e->password = strdup(password);
+	if (!e->password)
+	    goto out_err;
+    }
+#ifndef HAVE_SYS_INOTIFY_H
+    if (st) {
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->ctime = st->st_ctim;
+    }
+#endif
+    e->next = auth_cache[h];
+    auth_cache[h] = e;
+    return;
+
+ out_err:
+    auth_entry_free(e);
+}
+
+static unsigned int
+auth_hash(const char *path)
+{
+    return ser2net_strhash(path, strlen(path)) % AUTH_HASH_SIZE;
+}
+
+/*
+ * Can entries for path be cached?  Call with auth_lock held.  Returns
+ * -1 if not, otherwise what auth_cache_add() wants for wd.
+ */
+static int
+auth_cacheable(const char *path)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+    return auth_watch(path);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Get the first line of the password file at path into pw, which is
+ * AUTH_MAX_PW long.  Returns false if it can't be read.
+ */
+static bool
+auth_get_password(const char *path, char *pw, size_t *pwlen)
+{
+    unsigned int h = auth_hash(path);
+    struct auth_entry *e;
+    struct stat st;
+    bool rv = false;
+    int wd;
+    FILE *pwfile;
+    char *s;
+
+    so->lock(auth_lock);
+    e = auth_cache_find(path, h);
+    if (e && e->password) {
+	memcpy(pw, e->password, e->pwlen + 1);
+	*pwlen = e->pwlen;
+	rv = true;
+	goto out_unlock;
+    }
+
+    /*
+     * The lock is held while the file is read, so the cache can't be
+     * filled with something older than an event that flushed it.
+     */
+    wd = auth_cacheable(path);
+    pwfile = fopen(path, "r");
+    if (!pwfile) {
+	syslog(LOG_ERR, "Can't open password file %s: %s", path,
+	       strerror(errno));
+	goto out_unlock;
+    }
+    /* Read straight into pw, so no copy is left in a stdio buffer. */
+    setvbuf(pwfile, NULL, _IONBF, 0);
+    if (fstat(fileno(pwfile), &st) == -1)
+	wd = -1;
+    s = fgets(pw, AUTH_MAX_PW, pwfile);
+    fclose(pwfile);
+    if (!s) {
+	syslog(LOG_ERR, "Can't read password file %s: %s", path,
+	       strerror(errno));
+	goto out_unlock;
+    }
+    s = strchr(pw, '\n');
+    if (s)
+	*s = '\0';
+    *pwlen = strlen(pw);
+    if (wd != -1)
+	auth_cache_add(path, h, true, pw, &st, wd);
+    rv = true;
+
+ out_unlock:
+    so->unlock(auth_lock);
+    return rv;
+}
+
+/* Is there an allowed_certs directory at path? */
+static bool
+auth_certdir_exists(const char *path)
+{
+    unsigned int h = auth_hash(path);
+    struct auth_entry *e;
+    struct stat st;
+    bool rv;
+    int wd;
+
+    so->lock(auth_lock);
+    e = auth_cache_find(path, h);
+    if (e) {
+	rv = e->exists;
+    } else {
+	wd = auth_cacheable(path);
+	rv = stat(path, &st) == 0;
+	if (wd != -1)
+	    auth_cache_add(path, h, rv, NULL, rv ? &st : NULL, wd);
+    }
+    so->unlock(auth_lock);
+    return rv;
+}
+
+/*
+ * Compare a password without letting the time it takes tell how much
+ * of it matched.  All of what the user sent is always looked at.
+ */
+static bool
+auth_password_equal(const char *known, size_t knownlen,
+		    const char *given, size_t givenlen)
+{
+    volatile unsigned char diff = knownlen != givenlen;
+    size_t i;
+
+    for (i = 0; i < givenlen; i++)
+	diff |= ((unsigned char) given[i] ^
+		 (unsigned char) (knownlen ? known[i % knownlen] : 0));
+    return diff == 0;
+}
+
+int
+auth_init(void)
+{
+    auth_lock = so->alloc_lock(so);
+    if (!auth_lock)
+	return GE_NOMEM;
+#ifdef HAVE_SYS_INOTIFY_H
+    auth_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (auth_inotify_fd == -1)
+	syslog(LOG_WARNING, "Unable to set up inotify, authdir files will"
+	       " not be cached: %s", strerror(errno));
+#endif
+    return 0;
+}
+
+void
+auth_shutdown(void)
+{
+    if (!auth_lock)
+	return;
+    so->lock(auth_lock);
+    auth_cache_flush();
+    so->unlock(auth_lock);
+#ifdef HAVE_SYS_INOTIFY_H
+    if (auth_inotify_fd != -1)
+	close(auth_inotify_fd);
+    auth_inotify_fd = -1;
+#endif
+    so->free_lock(auth_lock);
+    auth_lock = NULL;
+}
+
 /*
  * The next few functions are for authentication handling.
  */
@@ -89,6 +486,14 @@ handle_precert(struct gensio *net, const char *authdir)
 	}
     }
 
+    /*
+     * If the user has no allowed_certs, gensio would just say so, and
+     * asking it means a directory lookup for every connection.
+     */
+    snprintf(filename, sizeof(filename), "%s/%s/allowed_certs",
+	     authdir, s);
+    if (!auth_certdir_exists(filename))
+	return GE_NOTSUP;
     snprintf(filename, sizeof(filename), "%s/%s/allowed_certs/",
 	     authdir, s);
     err = gensio_control(net, 0, false, GENSIO_CONTROL_CERT_AUTH,
@@ -106,8 +511,9 @@ handle_password(struct gensio *net, const char *authdir, const char *password)
     gensiods len;
     char username[100];
     char filename[PATH_MAX];
-    FILE *pwfile;
-    char readpw[100], *s;
+    char readpw[AUTH_MAX_PW];
+    size_t pwlen;
+    bool ok;
     int err;
 
     len = sizeof(username);
@@ -121,23 +527,13 @@ handle_password(struct gensio *net, const char *authdir, const char *password)
 
     snprintf(filename, sizeof(filename), "%s/%s/password",
 	     authdir, username);
-    pwfile = fopen(filename, "r");
-    if (!pwfile) {
-	syslog(LOG_ERR, "Can't open password file %s: %s", filename,
-	       strerror(errno));
+    if (!auth_get_password(filename, readpw, &pwlen)) {
+	auth_wipe(readpw, sizeof(readpw));
 	return GE_AUTHREJECT;
     }
-    s = fgets(readpw, sizeof(readpw), pwfile);
-    fclose(pwfile);
-    if (!s) {
-	syslog(LOG_ERR, "Can't read password file %s: %s", filename,
-	       strerror(errno));
-	return GE_AUTHREJECT;
-    }
-    s = strchr(readpw, '\n');
-    if (s)
-	*s = '\0';
-    if (strcmp(readpw, password) == 0)
+    ok = auth_password_equal(readpw, pwlen, password, strlen(password));
+    auth_wipe(readpw, sizeof(readpw));
+    if (ok)
 	return 0;
     return GE_NOTSUP;
 }
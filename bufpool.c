@@ -0,0 +1,168 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * The size classes are powers of two from BUFPOOL_MIN_SHIFT up to
+ * BUFPOOL_MAX_SHIFT, the biggest is a double buffered 64K
+ * dev-to-net-bufsize.  A freed buffer is linked into its class's
+ * list through its first bytes.  Each class keeps at most
+ * BUFPOOL_CLASS_CACHE bytes, but always at least one buffer, so a
+ * few busy ports churning don't go to malloc and a lot of ports
+ * going idle at once give most of their memory back.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <gensio/gensio.h>
+
+#include "ser2net.h"
+#include "bufpool.h"
+
+#define BUFPOOL_MIN_SHIFT	6
+#define BUFPOOL_MAX_SHIFT	17
+#define BUFPOOL_NUM_CLASSES	(BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+#define BUFPOOL_CLASS_CACHE	(256 * 1024)
+
+struct bufpool_free {
+    struct bufpool_free *next;
+};
+
+struct bufpool_class {
+    struct bufpool_free *free;
+    unsigned int nfree;
+};
+
+static struct gensio_lock *bufpool_lock;
+static struct bufpool_class bufpool_classes[BUFPOOL_NUM_CLASSES];
+static gensiods bufpool_in_use;
+static gensiods bufpool_cached;
+
+/* The class for the size, BUFPOOL_NUM_CLASSES if it's too big. */
+static unsigned int
+bufpool_class(gensiods size)
+{
+    unsigned int i;
+
+    for (i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+	if (size <= (gensiods) 1 << (i + BUFPOOL_MIN_SHIFT))
+	    break;
+    }
+    return i;
+}
+
+gensiods
+bufpool_size(gensiods size)
+{
+    unsigned int i = bufpool_class(size);
+
+    if (i == BUFPOOL_NUM_CLASSES)
+	return size;
+    return (gensiods) 1 << (i + BUFPOOL_MIN_SHIFT);
+}
+
+void *
+bufpool_get(gensiods size)
+{
+    unsigned int i = bufpool_class(size);
+    gensiods bsize = bufpool_size(size);
+    struct bufpool_free *f = NULL;
+
+    so->lock(bufpool_lock);
+    if (i < BUFPOOL_NUM_CLASSES && bufpool_classes[i].free) {
+	f = bufpool_classes[i].free;
+	bufpool_classes[i].free = f->next;
+	bufpool_classes[i].nfree--;
+	bufpool_cached -= bsize;
+    }
+    bufpool_in_use += bsize;
+    so->unlock(bufpool_lock);
+
+    if (!f) {
+	f = malloc(bsize);
+	if (!f) {
+	    so->lock(bufpool_lock);
+	    bufpool_in_use -= bsize;
+	    so->unlock(bufpool_lock);
+	}
+    }
+    return f;
+}
+
+void
+bufpool_put(void *buf, gensiods size)
+{
+    unsigned int i = bufpool_class(size);
+    gensiods bsize = bufpool_size(size);
+    struct bufpool_free *f = buf;
+
+    so->lock(bufpool_lock);
+    bufpool_in_use -= bsize;
+    if (i < BUFPOOL_NUM_CLASSES && (bufpool_classes[i].nfree == 0 ||
+		(bufpool_classes[i].nfree + 1) * bsize <= BUFPOOL_CLASS_CACHE)) {
+	f->next = bufpool_classes[i].free;
+	bufpool_classes[i].free = f;
+	bufpool_classes[i].nfree++;
+	bufpool_cached += bsize;
+	f = NULL;
+    }
+    so->unlock(bufpool_lock);
+
+    if (f)
+	free(f);
+}
+
+void
+bufpool_usage(gensiods *in_use, gensiods *cached)
+{
+    so->lock(bufpool_lock);
+    *in_use = bufpool_in_use;
+    *cached = bufpool_cached;
+    so->unlock(bufpool_lock);
+}
+
+int
+bufpool_init(void)
+{
+    bufpool_lock = so->alloc_lock(so);
+    if (!bufpool_lock)
+	return ENOMEM;
+    return 0;
+}
+
+void
+bufpool_shutdown(void)
+{
+    struct bufpool_free *f;
+    unsigned int i;
+
+    for (i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+	while (bufpool_classes[i].free) {
+	    f = bufpool_classes[i].free;
+	    bufpool_classes[i].free = f->next;
+	    free(f);
+	}
+	bufpool_classes[i].nfree = 0;
+    }
+    bufpool_cached = 0;
+    if (bufpool_lock) {
+	so->free_lock(bufpool_lock);
+	bufpool_lock = NULL;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <gensio/gensio.h>
+
+/*
+ * Data buffers shared by all the ports.  A port only holds its
+ * buffers while its device is open, and gives them back when the
+ * port closes.  Sizes are rounded up to a power of two and freed
+ * buffers are kept on a list for their size, up to a limit, so ports
+ * connecting and disconnecting reuse them instead of going to malloc
+ * each time.  Buffers bigger than the largest size class are just
+ * malloced and freed.
+ */
+
+/* Returns 0 or ENOMEM. */
+int bufpool_init(void);
+
+/* Free the cached buffers, everything must have been put back. */
+void bufpool_shutdown(void);
+
+/* Get a buffer of at least size bytes, NULL if out of memory. */
+void *bufpool_get(gensiods size);
+
+/* Return a buffer, size must be the same as given to bufpool_get(). */
+void bufpool_put(void *buf, gensiods size);
+
+/* The amount of memory buffers take when size is asked for. */
+gensiods bufpool_size(gensiods size);
+
+/*
+ * Buffer memory held by the ports and memory in freed buffers kept
+ * for reuse, in bytes.
+ */
+void bufpool_usage(gensiods *in_use, gensiods *cached);
+
+#endif /* BUFPOOL_H */
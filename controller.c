@@ -31,6 +31,7 @@
 #include "controller.h"
 #include "dataxfer.h"
 #include "readconfig.h"
+#include "tap.h"
 
 /** BASED ON sshd.c FROM openssh.com */
 #ifdef HAVE_TCPD_H
@@ -54,6 +55,32 @@ static int num_controller_ports = 0;	/* How many control connections
 
 #define INBUF_SIZE 255	/* The size of the maximum input command. */
 
+/*
+ * Output is queued in a list of chunks.  Appending never moves
+ * queued data, and the chunks are written with a single
+ * gensio_write_sg() as far as possible.
+ *
+ * Past OUTQUEUE_HIGH_WATER bytes queued, more output is dropped and
+ * counted, so a controller that doesn't read can't use up memory.
+ * The count is reported once the queue has been written out.
+ */
+#define OUTCHUNK_SIZE 4096
+#define OUTQUEUE_MAX_SG 16
+#define OUTQUEUE_HIGH_WATER (1024 * 1024)
+
+struct outchunk {
+    struct outchunk *next;
+    unsigned int start;		/* First byte not written yet. */
+    unsigned int end;		/* End of the data. */
+    char data[OUTCHUNK_SIZE];
+};
+
+struct outqueue {
+    struct outchunk *head;
+    struct outchunk *tail;
+    gensiods count;		/* Bytes queued. */
+};
+
 char *prompt = "-> ";
 
 /* This data structure is kept for each control connection. */
@@ -67,20 +94,24 @@ typedef struct controller_info {
     int  inbuf_count;			/* The number of bytes currently
 					   in the inbuf. */
 
-    char *outbuf;			/* The output buffer, NULL if
-					   no output. */
-    int  outbufsize;			/* Total size of the memory
-					   allocated in outbuf. */
-    int  outbuf_pos;			/* The current position in the
-					   output buffer. */
-    int  outbuf_count;			/* The number of bytes
-					   (starting at outbuf_pos)
-					   left to transmit. */
-
-    void *monitor_port_id;		/* When port monitoring, this is
-					   the id given when the monitoring
-					   is started.  It is used to stop
-					   monitoring. */
+    struct outqueue out;		/* Command output. */
+    gensiods out_dropped;		/* Over the high water mark. */
+
+    /*
+     * A command is running in a port's thread, see controller_op_done().
+     * Input is held until it finishes, and a close waits for it.
+     */
+    bool op_pending;
+    bool close_pending;
+
+    /*
+     * When port monitoring, this is the tap the data comes from.  It
+     * is also used to stop monitoring.  The data is queued in the tap,
+     * up to TAP_DEFAULT_MAX_LAG bytes, and the rest is dropped and
+     * counted.
+     */
+    struct tap_sub *monitor_port_id;
+    gensiods mon_dropped_total;		/* Dropped in this monitor. */
 
     struct controller_info *next;	/* Used to keep these items in
 					   a linked list. */
@@ -91,9 +122,97 @@ typedef struct controller_info {
 
 static struct gensio_waiter *controller_shutdown_waiter;
 
+static int process_inbuf(struct controller_info *cntlr, int read_start);
+
 /* List of current control connections. */
 controller_info_t *controllers = NULL;
 
+/* Add data to the queue, returns the amount added. */
+static gensiods
+outqueue_append(struct outqueue *q, const char *data, gensiods count)
+{
+    struct outchunk *c = q->tail;
+    gensiods done = 0, len;
+
+    while (done < count) {
+	if (!c || c->end == OUTCHUNK_SIZE) {
+	    c = malloc(sizeof(*c));
+	    if (!c)
+		/* Out of memory, just drop the rest. */
+		break;
+	    c->next = NULL;
+	    c->start = 0;
+	    c->end = 0;
+	    if (q->tail)
+		q->tail->next = c;
+	    else
+		q->head = c;
+	    q->tail = c;
+	}
+	len = OUTCHUNK_SIZE - c->end;
+	if (len > count - done)
+	    len = count - done;
+	memcpy(c->data + c->end, data + done, len);
+	c->end += len;
+	done += len;
+    }
+    q->count += done;
+    return done;
+}
+
+/* Point the sg entries at the queued data, returns the number used. */
+static gensiods
+outqueue_sg(struct outqueue *q, struct gensio_sg *sg)
+{
+    struct outchunk *c;
+    gensiods n = 0;
+
+    for (c = q->head; c && n < OUTQUEUE_MAX_SG; c = c->next) {
+	if (c->start == c->end)
+	    continue;
+	sg[n].buf = c->data + c->start;
+	sg[n].buflen = c->end - c->start;
+	n++;
+    }
+    return n;
+}
+
+/* Remove written data from the front of the queue. */
+static void
+outqueue_consume(struct outqueue *q, gensiods count)
+{
+    struct outchunk *c;
+    gensiods len;
+
+    q->count -= count;
+    while (count > 0 && (c = q->head)) {
+	len = c->end - c->start;
+	if (len > count)
+	    len = count;
+	c->start += len;
+	count -= len;
+	if (c->start == c->end && (c->next || c->end == OUTCHUNK_SIZE)) {
+	    q->head = c->next;
+	    if (!q->head)
+		q->tail = NULL;
+	    free(c);
+	}
+    }
+}
+
+static void
+outqueue_free(struct outqueue *q)
+{
+    struct outchunk *c;
+
+    while ((c = q->head)) {
+	q->head = c->next;
+	free(c);
+    }
+    q->tail = NULL;
+    q->count = 0;
+}
+
 static void
 controller_close_done(struct gensio *net, void *cb_data)
 {
@@ -106,14 +225,10 @@ controller_close_done(struct gensio *net, void *cb_data)
 
     gensio_free(net);
 
-    so->free_lock(cntlr->lock);
-
-    if (cntlr->outbuf != NULL) {
-	free(cntlr->outbuf);
-    }
-    cntlr->outbuf = NULL;
-
-    /* Remove it from the linked list. */
+    /*
+     * Remove it from the linked list first, controller_notify() may
+     * be looking at it.
+     */
     prev = NULL;
     so->lock(cntlr_lock);
     curr = controllers;
@@ -133,6 +248,9 @@ controller_close_done(struct gensio *net, void *cb_data)
     }
     so->unlock(cntlr_lock);
 
+    so->free_lock(cntlr->lock);
+    outqueue_free(&cntlr->out);
+
     shutdown_complete = cntlr->shutdown_complete;
     shutdown_complete_cb_data = cntlr->shutdown_complete_cb_data;
 
@@ -152,6 +270,13 @@ shutdown_controller(controller_info_t *cntlr)
 	return;
     }
 
+    if (cntlr->op_pending) {
+	/* controller_op_done() finishes this. */
+	cntlr->close_pending = true;
+	so->unlock(cntlr->lock);
+	return;
+    }
+
     if (cntlr->monitor_port_id != NULL) {
 	data_monitor_stop(cntlr, cntlr->monitor_port_id);
 	cntlr->monitor_port_id = NULL;
@@ -163,71 +288,22 @@ shutdown_controller(controller_info_t *cntlr)
     gensio_close(cntlr->net, controller_close_done, NULL);
 }
 
-/* Send some output to the control connection.  This allocates and
-   free a buffer in blocks of 1024 and increases the size of the
-   buffer as necessary. */
+/* Send some output to the control connection. */
 void
 controller_output(struct controller_info *cntlr,
 		  const char             *data,
 		  int                    count)
 {
-    if (cntlr->outbuf != NULL) {
-	/* Already outputting data, just add more onto it. */
-	int  new_size = cntlr->outbuf_count + count;
-
-	if (new_size <= cntlr->outbufsize) {
-	    /* It will fit into the current buffer, just move things
-	       around and append it. */
-	    if (cntlr->outbuf_pos > 0) {
-		int i;
-
-		for (i = 0; i < cntlr->outbuf_count; i++) {
-		    cntlr->outbuf[i] = cntlr->outbuf[cntlr->outbuf_pos + i];
-		}
-	    }
-	    memcpy(&(cntlr->outbuf[cntlr->outbuf_count]), data, count);
-	} else {
-	    /* We need to allocate a larger buffer. */
-	    char *newbuf;
-
-	    /* Allocate the next even multiple of 1024 bytes. */
-	    new_size = ((new_size / 1024) * 1024) + 1024;
-	    newbuf = malloc(new_size);
-
-	    if (newbuf == NULL) {
-		/* Out of memory, just ignore the request */
-		return;
-	    }
-
-	    cntlr->outbufsize = new_size;
-
-	    /* Copy all the data into a new buffer. */
-	    memcpy(newbuf,
-		   &(cntlr->outbuf[cntlr->outbuf_pos]),
-		   cntlr->outbuf_count);
-	    memcpy(newbuf + cntlr->outbuf_count, data, count);
-	    free(cntlr->outbuf);
-	    cntlr->outbuf = newbuf;
-	}
-	cntlr->outbuf_pos = 0;
-	cntlr->outbuf_count += count;
-    } else {
-	/* We are starting a new buffer, just get it. */
-	char *newbuf;
-	int  new_size = ((count / 1024) * 1024) + 1024;
-
-	newbuf = malloc(new_size);
-	if (newbuf == NULL) {
-	    /* Out of memory, just ignore thre request */
-	    return;
-	}
-
-	cntlr->outbufsize = new_size;
-
-	memcpy(newbuf, data, count);
-	cntlr->outbuf = newbuf;
-	cntlr->outbuf_pos = 0;
-	cntlr->outbuf_count = count;
+    bool was_empty = cntlr->out.count == 0;
+    gensiods len = count, room = 0;
+
+    if (cntlr->out.count < OUTQUEUE_HIGH_WATER)
+	room = OUTQUEUE_HIGH_WATER - cntlr->out.count;
+    if (len > room) {
+	cntlr->out_dropped += len - room;
+	len = room;
+    }
+    if (len && outqueue_append(&cntlr->out, data, len) && was_empty) {
 	gensio_set_read_callback_enable(cntlr->net, false);
 	gensio_set_write_callback_enable(cntlr->net, true);
     }
@@ -261,13 +337,73 @@ void controller_outs(struct controller_info *cntlr, char *s)
     controller_output (cntlr, s, strlen(s));
 }
 
+void
+controller_notify(const char *str, ...)
+{
+    controller_info_t *cntlr;
+    va_list ap;
+
+    if (!cntlr_lock) /* No admin port was ever set up. */
+	return;
+    so->lock(cntlr_lock);
+    for (cntlr = controllers; cntlr; cntlr = cntlr->next) {
+	so->lock(cntlr->lock);
+	if (!cntlr->in_shutdown) {
+	    va_start(ap, str);
+	    controller_voutputf(cntlr, str, ap);
+	    va_end(ap);
+	}
+	so->unlock(cntlr->lock);
+    }
+    so->unlock(cntlr_lock);
+}
+
 
-/* Write some data directly to the controllers output port. */
 void
-controller_write(struct controller_info *cntlr, const char *data,
-		 gensiods count)
+controller_op_done(struct controller_info *cntlr, const char *out, int count)
+{
+    so->lock(cntlr->lock);
+    cntlr->op_pending = false;
+    if (cntlr->close_pending) {
+	cntlr->close_pending = false;
+	shutdown_controller(cntlr); /* Releases the lock. */
+	return;
+    }
+    if (count)
+	controller_output(cntlr, out, count);
+    controller_outs(cntlr, prompt);
+
+    /* Now work on anything that came in while the command ran. */
+    if (process_inbuf(cntlr, 0))
+	return; /* Controller was shut down. */
+    so->unlock(cntlr->lock);
+}
+
+void
+controller_monitor_ready(void *cb_data)
+{
+    controller_info_t *cntlr = cb_data;
+
+    gensio_set_write_callback_enable(cntlr->net, true);
+}
+
+static void
+controller_monitor_idle(void *cb_data)
+{
+    controller_info_t *cntlr = cb_data;
+
+    gensio_set_write_callback_enable(cntlr->net, false);
+}
+
+/* Report and reset the monitor drop total, cntlr->lock must be held. */
+static void
+monitor_report_dropped(controller_info_t *cntlr, gensiods dropped)
 {
-    gensio_write(cntlr->net, NULL, data, count, NULL);
+    dropped += cntlr->mon_dropped_total;
+    cntlr->mon_dropped_total = 0;
+    if (dropped)
+	controller_outputf(cntlr, "Monitor dropped %lu bytes\r\n",
+			   (unsigned long) dropped);
 }
 
 static char *help_str =
@@ -275,13 +411,12 @@ static char *help_str =
 "help - display this help.\r\n"
 "version - display the version of this program.\r\n"
 "monitor <type> <tcp port> - display all the input for a given port on\r\n"
-"       the calling control port.  Only one direction may be monitored\r\n"
-"       at a time.  The type field may be 'tcp' or 'term' and specifies\r\n"
-"       whether to monitor data from the net port or from the serial port\r\n"
-"       Note that data monitoring is best effort, if the controller port\r\n"
-"       cannot keep up the data will be silently dropped.  A controller\r\n"
-"       may only monitor one thing and a port may only be monitored by\r\n"
-"       one controller.\r\n"
+"       the calling control port.  The type field may be 'tcp', 'term',\r\n"
+"       or 'both' and specifies whether to monitor data from the net\r\n"
+"       port, from the serial port, or both.  Note that data monitoring\r\n"
+"       is best effort, if the controller port cannot keep up the data\r\n"
+"       will be dropped and counted.  A controller may only monitor one\r\n"
+"       thing, but any number of controllers may monitor a port.\r\n"
 "monitor stop - stop the current monitor.\r\n"
 "disconnect <tcp port> - disconnect the tcp connection on the port.\r\n"
 "showport [<tcp port>] - Show information about a port. If no port is\r\n"
@@ -301,7 +436,9 @@ static char *help_str =
 "         on - The port is up and all I/O is transferred\r\n";
 
 /* Process a line of input.  This scans for commands, reads any
-   parameters, then calls the actual code to handle the command. */
+   parameters, then calls the actual code to handle the command.
+   Returns 1 if the controller was shut down, 2 if the command is
+   still running in another thread. */
 int
 process_input_line(controller_info_t *cntlr)
 {
@@ -345,10 +482,14 @@ process_input_line(controller_info_t *cntlr)
 	}
 	if (strcmp(tok, "stop") == 0) {
 	    if (cntlr->monitor_port_id != NULL) {
+		gensiods dropped;
+
+		dropped = tap_sub_take_dropped(cntlr->monitor_port_id);
 		start_maint_op();
 		data_monitor_stop(cntlr, cntlr->monitor_port_id);
 		end_maint_op();
 		cntlr->monitor_port_id = NULL;
+		monitor_report_dropped(cntlr, dropped);
 	    }
 	} else {
 	    if (cntlr->monitor_port_id != NULL) {
@@ -366,6 +507,7 @@ process_input_line(controller_info_t *cntlr)
 	    start_maint_op();
 	    cntlr->monitor_port_id = data_monitor_start(cntlr, tok, str);
 	    end_maint_op();
+	    cntlr->mon_dropped_total = 0;
 	}
     } else if (strcmp(tok, "disconnect") == 0) {
 	tok = strtok_r(NULL, " \t", &strtok_data);
@@ -375,8 +517,10 @@ process_input_line(controller_info_t *cntlr)
 	    goto out;
 	}
 	start_maint_op();
-	disconnect_port(cntlr, tok);
+	cntlr->op_pending = disconnect_port(cntlr, tok);
 	end_maint_op();
+	if (cntlr->op_pending)
+	    return 2; /* The prompt comes from controller_op_done(). */
     } else if (strcmp(tok, "setporttimeout") == 0) {
 	tok = strtok_r(NULL, " \t", &strtok_data);
 	if (tok == NULL) {
@@ -391,8 +535,10 @@ process_input_line(controller_info_t *cntlr)
 	    goto out;
 	}
 	start_maint_op();
-	setporttimeout(cntlr, tok, str);
+	cntlr->op_pending = setporttimeout(cntlr, tok, str);
 	end_maint_op();
+	if (cntlr->op_pending)
+	    return 2; /* The prompt comes from controller_op_done(). */
     } else if (strcmp(tok, "setportenable") == 0) {
 	tok = strtok_r(NULL, " \t", &strtok_data);
 	if (tok == NULL) {
@@ -407,8 +553,10 @@ process_input_line(controller_info_t *cntlr)
 	    goto out;
 	}
 	start_maint_op();
-	setportenable(cntlr, tok, str);
+	cntlr->op_pending = setportenable(cntlr, tok, str);
 	end_maint_op();
+	if (cntlr->op_pending)
+	    return 2; /* The prompt comes from controller_op_done(). */
     } else if (strcmp(tok, "setportcontrol") == 0) {
 	tok = strtok_r(NULL, " \t", &strtok_data);
 	if (tok == NULL) {
@@ -424,8 +572,10 @@ process_input_line(controller_info_t *cntlr)
 	    goto out;
 	}
 	start_maint_op();
-	setportcontrol(cntlr, tok, str);
+	cntlr->op_pending = setportcontrol(cntlr, tok, str);
 	end_maint_op();
+	if (cntlr->op_pending)
+	    return 2; /* The prompt comes from controller_op_done(). */
     } else {
 	char *err = "Unknown command: ";
 	controller_outs(cntlr, err);
@@ -455,36 +605,20 @@ remove_chars(controller_info_t *cntlr, int pos, int count) {
     return pos;
 }
 
-/* Data is ready to read on the TCP port. */
-static gensiods
-controller_read(struct gensio *net, int err,
-		unsigned char *buf, gensiods buflen)
+/*
+ * Handle the input from read_start on, cntlr->lock must be held.
+ * Returns 1 if the controller was shut down, which releases the lock.
+ * If a command is still running, the input after it is left in inbuf
+ * for controller_op_done().
+ */
+static int
+process_inbuf(controller_info_t *cntlr, int read_start)
 {
-    controller_info_t *cntlr = gensio_get_user_data(net);
-    int read_start;
-    int i;
-
-    so->lock(cntlr->lock);
-    if (cntlr->in_shutdown)
-	goto out_unlock;
+    int i, rv;
 
-    if (cntlr->inbuf_count == INBUF_SIZE)
-	goto inbuf_overflow;
-
-    if (err && err != GE_REMCLOSE) {
-	/* Got an error on the read, shut down the port. */
-	syslog(LOG_ERR, "read error for controller port: %s",
-	       gensio_err_to_str(err));
-	shutdown_controller(cntlr); /* Releases the lock */
-	goto out;
-    }
-
-    read_start = cntlr->inbuf_count;
-    if (buflen > INBUF_SIZE - read_start)
-	buflen = INBUF_SIZE - read_start;
-    memcpy(cntlr->inbuf + read_start, buf, buflen);
+    if (cntlr->op_pending)
+	return 0;
 
-    cntlr->inbuf_count += buflen;
     for (i = read_start; i < cntlr->inbuf_count; i++) {
 	if (cntlr->inbuf[i] == 0x0) {
 	    /* Ignore nulls. */
@@ -509,8 +643,9 @@ controller_read(struct gensio *net, int err,
 	    controller_outs(cntlr, "\r\n");
 
 	    cntlr->inbuf[i] ='\0';
-	    if (process_input_line(cntlr))
-		goto out; /* Controller was shut down. */
+	    rv = process_input_line(cntlr);
+	    if (rv == 1)
+		return 1; /* Controller was shut down. */
 
 	    /* Now copy any leftover data to the beginning of the buffer. */
 	    /* Don't use memcpy or strcpy because the memory might
@@ -520,12 +655,51 @@ controller_read(struct gensio *net, int err,
 	    for (j = 0; j < cntlr->inbuf_count; i++, j++) {
 		cntlr->inbuf[j] = cntlr->inbuf[i];
 	    }
+	    if (rv == 2) {
+		/* Stop reading until the command is done. */
+		gensio_set_read_callback_enable(cntlr->net, false);
+		return 0;
+	    }
 	    i = -1;
 	} else {
 	    /* It's a normal character, just echo it. */
 	    controller_output(cntlr, (char *) &(cntlr->inbuf[i]), 1);
 	}
     }
+    return 0;
+}
+
+/* Data is ready to read on the TCP port. */
+static gensiods
+controller_read(struct gensio *net, int err,
+		unsigned char *buf, gensiods buflen)
+{
+    controller_info_t *cntlr = gensio_get_user_data(net);
+    int read_start;
+
+    so->lock(cntlr->lock);
+    if (cntlr->in_shutdown)
+	goto out_unlock;
+
+    if (cntlr->inbuf_count == INBUF_SIZE)
+	goto inbuf_overflow;
+
+    if (err && err != GE_REMCLOSE) {
+	/* Got an error on the read, shut down the port. */
+	syslog(LOG_ERR, "read error for controller port: %s",
+	       gensio_err_to_str(err));
+	shutdown_controller(cntlr); /* Releases the lock */
+	goto out;
+    }
+
+    read_start = cntlr->inbuf_count;
+    if (buflen > INBUF_SIZE - read_start)
+	buflen = INBUF_SIZE - read_start;
+    memcpy(cntlr->inbuf + read_start, buf, buflen);
+
+    cntlr->inbuf_count += buflen;
+    if (process_inbuf(cntlr, read_start))
+	goto out; /* Controller was shut down. */
  out_unlock:
     so->unlock(cntlr->lock);
  out:
@@ -544,42 +718,85 @@ static void
 controller_write_ready(struct gensio *net)
 {
     controller_info_t *cntlr = gensio_get_user_data(net);
+    struct gensio_sg sg[OUTQUEUE_MAX_SG];
+    gensiods nsg, write_count;
     int err;
-    gensiods write_count;
 
     so->lock(cntlr->lock);
     if (cntlr->in_shutdown)
 	goto out;
 
-    err = gensio_write(net, &write_count,
-		       &(cntlr->outbuf[cntlr->outbuf_pos]),
-		       cntlr->outbuf_count, NULL);
-    if (err == EAGAIN) {
-	/* This again was due to O_NONBso->lock, just ignore it. */
-    } else if (err == EPIPE) {
-	goto out_fail;
-    } else if (err) {
-	/* Some other bad error. */
-	syslog(LOG_ERR, "The tcp write for controller had error: %m");
-	goto out_fail;
-    }
+    if (cntlr->out.count) {
+	nsg = outqueue_sg(&cntlr->out, sg);
+	err = gensio_write_sg(net, &write_count, sg, nsg, NULL);
+	if (err)
+	    goto out_err;
+	outqueue_consume(&cntlr->out, write_count);
+	if (cntlr->out.count)
+	    /* We didn't write all the data, continue writing. */
+	    goto out;
+	if (cntlr->out_dropped) {
+	    gensiods dropped = cntlr->out_dropped;
 
-    cntlr->outbuf_count -= write_count;
-    if (cntlr->outbuf_count != 0) {
-	/* We didn't write all the data, continue writing. */
-	cntlr->outbuf_pos += write_count;
-    } else {
+	    cntlr->out_dropped = 0;
+	    controller_outputf(cntlr, "\r\n[%lu bytes of output dropped]\r\n",
+			       (unsigned long) dropped);
+	    goto out;
+	}
 	/* We are done writing, turn the reader back on. */
-	free(cntlr->outbuf);
-	cntlr->outbuf = NULL;
-	gensio_set_read_callback_enable(net, true);
-	gensio_set_write_callback_enable(net, false);
+	if (!cntlr->op_pending)
+	    gensio_set_read_callback_enable(net, true);
     }
+
+    if (cntlr->monitor_port_id) {
+	struct tap_sub *mon = cntlr->monitor_port_id;
+	gensiods dropped;
+
+	/*
+	 * Monitor data only goes out between commands, so it doesn't
+	 * break up their output.  Only this function removes monitor
+	 * data, so what sg points to stays put while it is written.
+	 */
+	nsg = tap_sub_sg(mon, sg, OUTQUEUE_MAX_SG);
+	if (nsg) {
+	    err = gensio_write_sg(net, &write_count, sg, nsg, NULL);
+	    if (err)
+		goto out_err;
+	    tap_sub_consume(mon, write_count);
+	    goto out;
+	}
+
+	dropped = tap_sub_take_dropped(mon);
+	if (dropped) {
+	    /* Say where data went missing, after what was queued before. */
+	    cntlr->mon_dropped_total += dropped;
+	    controller_outputf(cntlr, "\r\n[monitor dropped %lu bytes]\r\n",
+			       (unsigned long) dropped);
+	    goto out;
+	}
+
+	if (tap_sub_closed(mon)) {
+	    controller_outs(cntlr, "\r\n[monitored port was deleted]\r\n");
+	    data_monitor_stop(cntlr, mon);
+	    cntlr->monitor_port_id = NULL;
+	    monitor_report_dropped(cntlr, 0);
+	    goto out;
+	}
+
+	/* If more data came in, we will just come back here. */
+	tap_sub_idle(mon, controller_monitor_idle, cntlr);
+	goto out;
+    }
+
+    gensio_set_write_callback_enable(net, false);
  out:
     so->unlock(cntlr->lock);
     return;
 
- out_fail:
+ out_err:
+    if (err != GE_REMCLOSE)
+	syslog(LOG_ERR, "The tcp write for controller had error: %s",
+	       gensio_err_to_str(err));
     shutdown_controller(cntlr); /* Releases the lock */
 }
 
@@ -632,7 +849,6 @@ controller_acc_new_child(struct gensio *net)
     gensio_set_callback(net, controller_io_event, cntlr);
 
     cntlr->inbuf_count = 0;
-    cntlr->outbuf = NULL;
     cntlr->monitor_port_id = NULL;
 
     controller_outs(cntlr, prompt);
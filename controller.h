@@ -52,11 +52,21 @@ int controller_outputf(struct controller_info *cntlr,
 int controller_voutputf(struct controller_info *cntlr,
 			const char *str, va_list ap);
 
-/* Write some data directly to the controllers output port. */
-void controller_write(struct controller_info *cntlr,
-		      const char *data, gensiods count);
+/* Monitor data is waiting for the controller, called from the data
+   path with the port lock held.  cb_data is the controller. */
+void controller_monitor_ready(void *cb_data);
 
 /*  output a string  */
 void controller_outs (struct controller_info *cntlr, char *s);
 
+/* A command that was handed to the port's thread is done, out is its
+   output.  This prints the prompt and goes on with the input.  No
+   port locks may be held. */
+void controller_op_done(struct controller_info *cntlr,
+			const char *out, int count);
+
+/* Send some output to all the controller ports.  This takes the
+   controller locks, so no port locks may be held. */
+void controller_notify(const char *str, ...);
+
 #endif /* CONTROLLER */
@@ -41,6 +41,13 @@
 #include "dataxfer.h"
 #include "readconfig.h"
 #include "led.h"
+#include "trace.h"
+#include "timewheel.h"
+#include "metrics.h"
+#include "tap.h"
+#include "match.h"
+#include "bufpool.h"
+#include "probes.h"
 
 #define SERIAL "term"
 #define NET    "tcp "
@@ -66,12 +73,36 @@ char *state_str[] = { "closed", "unconnected", "waiting input",
 
 char *enabled_str[] = { "off", "on" };
 
+/* The bool names are accepted so "chardelay: true" still works. */
+struct gensio_enum_val chardelay_enums[] = {
+    { "false", CHARDELAY_OFF },
+    { "off", CHARDELAY_OFF },
+    { "no", CHARDELAY_OFF },
+    { "0", CHARDELAY_OFF },
+    { "true", CHARDELAY_ON },
+    { "on", CHARDELAY_ON },
+    { "yes", CHARDELAY_ON },
+    { "1", CHARDELAY_ON },
+    { "adaptive", CHARDELAY_ADAPTIVE },
+    { NULL }
+};
+
+struct gensio_enum_val laggard_policy_enums[] = {
+    { "block", LAGGARD_BLOCK },
+    { "drop", LAGGARD_DROP },
+    { "skip", LAGGARD_SKIP },
+    { NULL }
+};
+
 typedef struct trace_info_s
 {
     bool hexdump;     /* output each block as a hexdump */
     bool timestamp;   /* preceed each line with a timestamp */
     char *filename;   /* open file.  NULL if not used */
-    int  fd;          /* open file.  -1 if not used */
+    struct trace_queue *q; /* output queue.  NULL if not used */
+    struct trace_tstamp tstamp; /* cached timestamp string */
+    enum trace_format format; /* text or binary records */
+    struct trace_bin *bin; /* binary trace file.  NULL if not used */
 } trace_info_t;
 
 typedef struct port_info port_info_t;
@@ -84,19 +115,6 @@ struct gbuf {
     gensiods pos;
 };
 
-static gensiods
-gbuf_room_left(struct gbuf *buf) {
-    return buf->maxsize - buf->cursize;
-}
-
-static void
-gbuf_append(struct gbuf *buf, unsigned char *data, gensiods len)
-{
-    memcpy(buf->buf + buf->pos, data, len);
-    buf->cursize += len;
-    buf->pos += len;
-}
-
 static gensiods
 gbuf_cursize(struct gbuf *buf)
 {
@@ -110,17 +128,65 @@ gbuf_reset(struct gbuf *buf)
     buf->pos = 0;
 }
 
-static int
-gbuf_init(struct gbuf *buf, gensiods size)
+
+/*
+ * A ring buffer with one producer (the device) and a read cursor per
+ * network connection.  Positions are byte counts since the buffer was
+ * last rebased; the offset into buf is the position modulo maxsize.
+ * The slowest cursor of a live connection is the tail, the space
+ * between the head and the tail may not be overwritten.
+ */
+struct rbuf {
+    unsigned char *buf;
+    gensiods maxsize;
+    gensiods head;		/* Position of the next byte to add. */
+    gensiods commit;		/* Data before this may be sent. */
+};
+
+static void
+rbuf_append(struct rbuf *buf, unsigned char *data, gensiods len)
 {
-    buf->buf = malloc(size);
-    if (!buf->buf)
-	return ENOMEM;
+    gensiods off = buf->head % buf->maxsize;
+    gensiods left = buf->maxsize - off;
+
+    if (len > left) {
+	memcpy(buf->buf + off, data, left);
+	memcpy(buf->buf, data + left, len - left);
+    } else {
+	memcpy(buf->buf + off, data, len);
+    }
+    buf->head += len;
+}
+
+/*
+ * Return a pointer to the contiguous data at pos, and the amount of it
+ * that may be sent in *len.
+ */
+static unsigned char *
+rbuf_data(struct rbuf *buf, gensiods pos, gensiods *len)
+{
+    gensiods off = pos % buf->maxsize;
+
+    *len = buf->commit - pos;
+    if (*len > buf->maxsize - off)
+	*len = buf->maxsize - off;
+    return buf->buf + off;
+}
+
+static void
+rbuf_reset(struct rbuf *buf)
+{
+    buf->head = 0;
+    buf->commit = 0;
+}
 
+/* The memory is not allocated until the port is used. */
+static void
+rbuf_init(struct rbuf *buf, gensiods size)
+{
+    buf->buf = NULL;
     buf->maxsize = size;
-    buf->cursize = 0;
-    buf->pos = 0;
-    return 0;
+    rbuf_reset(buf);
 }
 
 struct net_info {
@@ -139,20 +205,50 @@ struct net_info {
 					   address when data comes in. */
     const char *remote_str;
 
-    gensiods bytes_received;		/* Number of bytes read from the
-					   network port. */
-    gensiods bytes_sent;		/* Number of bytes written to the
-					   network port. */
+    /*
+     * For connect backs, whether an open is in progress, and with
+     * connect-back-persist the delay before the next retry (seconds)
+     * and when it is due (wheel time, zero if none).
+     */
+    bool connect_back_opening;
+    unsigned int connect_back_backoff;
+    unsigned long connect_back_retry_at;
+
+    /*
+     * Bytes read from and written to the network port this session.
+     * These can be read without the port lock, like the metrics.
+     */
+    metrics_counter bytes_received;
+    metrics_counter bytes_sent;
+
+    /*
+     * Totals for this connection slot, for all the connections that
+     * used it.  They are never reset, and are labelled by slot.
+     */
+    struct netcon_metrics {
+	metrics_counter read_bytes;
+	metrics_counter reads;
+	metrics_counter write_bytes;
+	metrics_counter writes;
+    } metrics;
 
     struct gbuf *banner;		/* Outgoing banner */
 
-    gensiods write_pos;			/* Our current position in the
-					   output buffer where we need
+    gensiods write_pos;			/* Our read cursor in the
+					   dev_to_net ring, where we need
 					   to start writing next. */
+    gensiods bytes_skipped;		/* Number of bytes lost because
+					   we could not keep up. */
 
-    int            timeout_left;	/* The amount of time left (in
-					   seconds) before the timeout
-					   goes off. */
+    unsigned int lat_next;		/* The next of the port's lat_sends
+					   this connection has to finish. */
+
+    bool is_packet;			/* The gensio keeps message
+					   boundaries, like UDP. */
+
+    unsigned long last_active;		/* When I/O was last done, in
+					   twheel_now() seconds, for the
+					   timeout. */
 
     /*
      * Close the session when all the output has been written to the
@@ -177,6 +273,24 @@ struct port_info
 {
     struct gensio_lock *lock;
 
+    /*
+     * References from the ports list and from port snapshots, the
+     * port is freed when this goes to zero.  Protected by
+     * port_snap_lock.
+     */
+    unsigned int refcount;
+
+    /* Another port in the ports list has the same device. */
+    bool dev_shared;
+
+    /*
+     * The shard the port's gensios and timers run in, and its os
+     * funcs.  Set from the thread option, or from the name.
+     */
+    unsigned int shard;
+    bool shard_set;
+    struct gensio_os_funcs *shard_so;
+
     /* If false, port is not accepting, if true it is. */
     bool enabled;
 
@@ -189,9 +303,13 @@ struct port_info
 					   wait without any I/O before
 					   we shut the port down. */
 
-    struct gensio_timer *timer;		/* Used to timeout when the no
-					   I/O has been seen for a
-					   certain period of time. */
+    /*
+     * Handles the inactivity timeout, the connect back retry, and the
+     * shutdown timeout.  It is only in the wheel while one of those
+     * is pending, see port_sched_housekeeping().
+     */
+    struct twheel *wheel;		/* The wheel for the port's shard. */
+    struct twheel_entry housekeeping;
 
     struct gensio_timer *send_timer;	/* Used to delay a bit when
 					   waiting for characters to
@@ -199,9 +317,10 @@ struct port_info
 					   as possible. */
     bool send_timer_running;
 
-    unsigned int nocon_read_enable_time_left;
+    unsigned long nocon_read_enable_at;
     /* Used if a connect back is requested an no connections could
-       be made, to try again. */
+       be made, to try again.  Zero if not pending. */
+    unsigned int nocon_backoff;		/* Delay for the next one. */
 
     /*
      * Used to count timeouts during a shutdown, to make sure close
@@ -209,6 +328,7 @@ struct port_info
      * means that shutdown_port_io() has already been called.
      */
     unsigned int shutdown_timeout_count;
+    unsigned long shutdown_deadline;
 
     struct gensio_runner *runshutdown;	/* Used to run things at the
 					   base context.  This way we
@@ -228,7 +348,7 @@ struct port_info
     unsigned int stopbits;
     unsigned int paritybits;
 
-    bool enable_chardelay;
+    enum chardelay_mode chardelay_mode;
 
     unsigned int chardelay_scale;	/* The number of character
 					   periods to wait for the
@@ -242,6 +362,47 @@ struct port_info
 					   time when we will send the
 					   data, no matter what, set
 					   by chardelay_max. */
+    struct timeval send_deadline;	/* When the data will be sent if
+					   no more comes in, the send
+					   timer is lazily moved out to
+					   this when it goes off. */
+    struct timeval send_timer_at;	/* When the send timer will go
+					   off. */
+
+    /*
+     * For chardelay: adaptive.  The delay is sized from the gaps seen
+     * between reads in a burst, and the batch is cut short so it can
+     * be drained by the network within chardelay_target.
+     */
+    unsigned int chardelay_target;	/* Latency goal, microseconds. */
+    unsigned int char_usec;		/* Time for one character. */
+    struct timeval batch_start;		/* When the first byte came in. */
+    struct timeval last_dev_read;
+    unsigned int gap_avg;		/* Average gap in a burst, in
+					   usecs times 8. */
+    unsigned int drain_rate;		/* Average bytes per ms that the
+					   network takes, 0 if unknown. */
+    struct timeval net_send_start;
+    gensiods net_send_len;
+
+    /*
+     * Measure the time from reading the first byte of each send from
+     * the device until each connection has written it all.  That is
+     * split into the chardelay wait, before the send starts, and the
+     * backpressure wait, until a connection takes it.  The sends are
+     * kept here until every connection has finished them, a
+     * connection that falls more than LAT_SENDS behind loses the old
+     * ones.
+     */
+    bool latency_stats;
+    struct timeval lat_first_read;	/* First byte of the pending data. */
+#define LAT_SENDS 8
+    struct lat_send {
+	gensiods end;			/* dev_to_net position of the end. */
+	struct timeval first_read;
+	struct timeval send_start;
+    } lat_sends[LAT_SENDS];
+    unsigned int lat_head;		/* Number of sends started. */
 
     /* Information about the network port. */
     char               *name;           /* The name given for the port. */
@@ -249,18 +410,91 @@ struct port_info
     struct gensio_accepter *accepter;	/* Used to receive new connections. */
     bool accepter_stopped;
 
+    /*
+     * Everything the port was made from, see port_set_config_key().
+     * On a reload a port whose key didn't change is left running.
+     * config_changed is set if the admin port changed the port, so
+     * a reload puts it back to what the config says.
+     */
+    char *cfgkey;
+    size_t cfgkey_len;
+    bool config_changed;
+
+    /* Used while applying a new config, see apply_new_ports(). */
+    struct port_info *new_hnext;
+    struct port_info *reload_match;
+    bool reload_keep;
+
+    /*
+     * Startup scheduling, see port_startup_queue().  startup_queued
+     * is set while waiting for a turn, startup_inflight while waiting
+     * for a connect back device to open.
+     */
+    struct gensio_runner *startup_runner;
+    bool startup_queued;
+    bool startup_inflight;
+    struct timeval startup_begin;
+    struct port_info *startup_next;
+
     bool               remaddr_set;	/* Did a remote address get set? */
     struct port_remaddr *remaddrs;	/* Remote addresses allowed. */
     bool has_connect_back;		/* We have connect back addresses. */
     unsigned int num_waiting_connect_backs;
 
+    /*
+     * Keep the connect backs open all the time instead of waiting
+     * for device data, and hold device data while they are down.
+     * Failed connects are retried starting at connect_back_retry_min
+     * seconds, doubling up to connect_back_retry_max.
+     */
+    bool connect_back_persist;
+    unsigned int connect_back_retry_min;
+    unsigned int connect_back_retry_max;
+
     unsigned int max_connections;	/* Maximum number of connections
 					   we can accept at a time for this
 					   port. */
     net_info_t *netcons;
 
-    gensiods dev_bytes_received;    /* Number of bytes read from the device. */
-    gensiods dev_bytes_sent;        /* Number of bytes written to the device. */
+    /*
+     * Bytes read from and written to the device this session, these
+     * can be read without the port lock.
+     */
+    metrics_counter dev_bytes_received;
+    metrics_counter dev_bytes_sent;
+    gensiods bytes_total;	    /* Bytes from all finished sessions. */
+
+    /*
+     * Statistics for the metrics output, only changed with the port
+     * lock held and never reset.  See port_counter_metrics[].
+     */
+    struct port_metrics {
+	metrics_counter dev_read_bytes;
+	metrics_counter dev_reads;
+	metrics_counter dev_write_bytes;
+	metrics_counter dev_writes;
+	metrics_counter dev_read_stalls;
+	metrics_counter dev_overruns;
+	metrics_counter net_read_stalls;
+	metrics_counter laggard_drops;
+	metrics_counter laggard_skipped_bytes;
+	metrics_counter accepts;
+	metrics_counter rejects;
+	metrics_counter kicks;
+	metrics_counter trace_drops;
+	struct metrics_hist net_send_time;
+
+	/* Only kept with latency_stats, see latency_send_start(). */
+	struct metrics_hist lat_chardelay;
+	struct metrics_hist lat_backpressure;
+	struct metrics_hist lat_total;
+    } metrics;
+
+    /*
+     * The rotators this port is in, they are told when the port has a
+     * free connection again.
+     */
+    struct rot_member *rot_members;
 
     /*
      * Informationd use when transferring information from the network
@@ -272,9 +506,6 @@ struct port_info
 
     struct gbuf    net_to_dev;			/* Buffer for network
 						   to dev transfers. */
-    struct controller_info *net_monitor; /* If non-null, send any input
-					    received from the network port
-					    to this controller port. */
     struct gbuf *devstr;		 /* Outgoing string */
 
     /*
@@ -285,7 +516,30 @@ struct port_info
 						   data from the device to
                                                    the network port. */
 
-    struct gbuf dev_to_net;
+    struct rbuf dev_to_net;
+    gensiods dev_to_net_bufsize;	/* Max data in one send. */
+    gensiods max_datagram;		/* Max size of one packet on
+					   packet connections, 0 for
+					   no limit. */
+
+    /*
+     * Keep reading from the device while a send is in progress.  The
+     * ring holds two sends worth of data, one being sent and one
+     * being filled.
+     */
+    bool dev_to_net_double_buffer;
+
+    /*
+     * Write device data straight to a single network connection when
+     * nothing else needs it, see dev_to_net_direct_netcon().
+     */
+    bool dev_to_net_direct;
+
+    /*
+     * What to do with a connection that falls so far behind that it
+     * keeps the device from reading.
+     */
+    enum laggard_policy laggard_policy;
 
     /*
      * We have called shutdown_port but the accepter has not yet been
@@ -293,9 +547,7 @@ struct port_info
      */
     bool shutdown_started;
 
-    struct controller_info *dev_monitor; /* If non-null, send any input
-					    received from the device
-					    to this controller port. */
+    struct tap_point *taps;		/* Watchers of the data, see tap.h. */
 
     struct port_info *next;		/* Used to keep a linked list
 					   of these. */
@@ -338,8 +590,30 @@ struct port_info
      * serial side, or NULL if none.
      */
     char *closeon;
-    gensiods closeon_pos;
     gensiods closeon_len;
+    bool closeon_seen;		/* Close when the closeon data is sent. */
+
+    /*
+     * The patterns watched for in the device data, the closeon string
+     * and the logon and notifyon ones, or NULL if none.  match_state
+     * carries a partial match from one read to the next.  Patterns to
+     * tell the controllers about are collected in notify_pending
+     * until notify_runner runs, it holds a port reference while set.
+     */
+    struct matcher *matcher;
+    unsigned int match_state;
+    uint32_t notify_pending;
+    struct gensio_runner *notify_runner;
+
+    /*
+     * Controller commands that change the port, waiting for ctl_runner
+     * to run them in the port's shard, see port_ctl_post().  ctl_lock
+     * only protects the list, so the controller never needs the port
+     * lock.
+     */
+    struct gensio_lock *ctl_lock;
+    struct port_ctl *ctl_head, *ctl_tail;
+    struct gensio_runner *ctl_runner;
 
     /*
      * File to read/write trace, NULL if none.  If the same, then
@@ -357,6 +631,13 @@ struct port_info
     trace_info_t *tw;
     trace_info_t *tb;
 
+    /* How much trace data to queue, and what to do if it fills up. */
+    gensiods trace_bufsize;
+    enum trace_overflow trace_overflow;
+
+    /* Total size of binary trace files. */
+    gensiods trace_file_size;
+
     char *devname;
     struct gensio *io; /* For handling I/O operation to the device */
     bool io_open;
@@ -493,31 +774,276 @@ remaddr_check(const struct port_remaddr *list,
 	 netcon < &(port->netcons[port->max_connections]);	\
 	 netcon++)
 
+/* The connection's place in the port, for the probes. */
+#define netcon_index(netcon) ((int) ((netcon) - (netcon)->port->netcons))
+
+#ifdef USE_USDT
+PROBE_SEMAPHORE(dev_read_enable);
+PROBE_SEMAPHORE(dev_write_enable);
+PROBE_SEMAPHORE(net_read_enable);
+PROBE_SEMAPHORE(net_write_enable);
+PROBE_SEMAPHORE(net_send_start);
+PROBE_SEMAPHORE(send_timeout);
+PROBE_SEMAPHORE(dev_read);
+PROBE_SEMAPHORE(dev_write);
+PROBE_SEMAPHORE(net_read);
+PROBE_SEMAPHORE(net_write);
+PROBE_SEMAPHORE(net_send_done);
+PROBE_SEMAPHORE(net_accept);
+PROBE_SEMAPHORE(net_close);
+PROBE_SEMAPHORE(port_shutdown);
+#endif
+
+/*
+ * All read and write callback enables go through these so the probes
+ * can see when data flow is held back.
+ */
+static void
+dev_set_read_enable(port_info_t *port, bool enabled)
+{
+    PROBE3(dev_read_enable, port->name, -1, enabled);
+    gensio_set_read_callback_enable(port->io, enabled);
+}
+
+static void
+dev_set_write_enable(port_info_t *port, bool enabled)
+{
+    PROBE3(dev_write_enable, port->name, -1, enabled);
+    gensio_set_write_callback_enable(port->io, enabled);
+}
+
+static void
+net_set_read_enable(net_info_t *netcon, bool enabled)
+{
+    PROBE3(net_read_enable, netcon->port->name, netcon_index(netcon),
+	   enabled);
+    gensio_set_read_callback_enable(netcon->net, enabled);
+}
+
+static void
+net_set_write_enable(net_info_t *netcon, bool enabled)
+{
+    PROBE3(net_write_enable, netcon->port->name, netcon_index(netcon),
+	   enabled);
+    gensio_set_write_callback_enable(netcon->net, enabled);
+}
+
 static struct gensio_lock *ports_lock;
 static port_info_t *ports = NULL; /* Linked list of ports. */
 static port_info_t *new_ports = NULL; /* New ports during config/reconfig. */
 static port_info_t *new_ports_end = NULL;
 
-static void shutdown_one_netcon(net_info_t *netcon, const char *reason);
-static int shutdown_port(port_info_t *port, const char *errreason);
+/* The names in new_ports, for catching duplicates, chained on new_hnext. */
+#define NEW_PORTS_HASH_SIZE 1024
+static port_info_t *new_ports_hash[NEW_PORTS_HASH_SIZE];
 
 /*
- * Like above but does a new line at the end of the output, generally
- * for error output.
+ * A read-only copy of the ports list with a hash index on the name.
+ * Changes to the ports list are made under ports_lock and then
+ * published as a new snapshot, so lookups and listings only need to
+ * take port_snap_lock long enough to get a reference.  A snapshot
+ * holds a reference to every port in it, so the ports stay valid as
+ * long as the snapshot is held.
  */
+struct port_snap {
+    unsigned int refcount; /* Protected by port_snap_lock. */
+    unsigned int count;
+    port_info_t **ports; /* In ports list order. */
+    unsigned int hash_mask;
+    port_info_t **hash; /* Open addressed, hash_mask + 1 entries. */
+    bool dev_shared; /* Some ports share a device. */
+};
+
+static struct gensio_lock *port_snap_lock;
+
+/* Timing wheels for port housekeeping, one per shard. */
+static struct twheel **port_wheels;
+static struct port_snap *port_snap;
+
+static void free_port(port_info_t *port);
+static void rotator_port_freed(port_info_t *port);
+static void port_sched_housekeeping(port_info_t *port);
+static void port_housekeeping(struct twheel_entry *e, void *data);
+static void port_ctl_run(struct gensio_runner *runner, void *cb_data);
+
+static unsigned int
+port_name_hash(const char *name)
+{
+    return ser2net_strhash(name, strlen(name));
+}
+
+static void
+port_ref(port_info_t *port)
+{
+    so->lock(port_snap_lock);
+    port->refcount++;
+    so->unlock(port_snap_lock);
+}
+
+static void
+port_deref(port_info_t *port)
+{
+    bool dofree;
+
+    so->lock(port_snap_lock);
+    dofree = --port->refcount == 0;
+    so->unlock(port_snap_lock);
+    if (dofree)
+	free_port(port);
+}
+
+/* Unlock a port from find_port_by_name() and drop its reference. */
+static void
+port_unlock_put(port_info_t *port)
+{
+    so->unlock(port->lock);
+    port_deref(port);
+}
+
+static struct port_snap *
+port_snap_get(void)
+{
+    struct port_snap *snap;
+
+    so->lock(port_snap_lock);
+    snap = port_snap;
+    if (snap)
+	snap->refcount++;
+    so->unlock(port_snap_lock);
+    return snap;
+}
+
+static void
+port_snap_put(struct port_snap *snap)
+{
+    unsigned int i;
+
+    if (!snap)
+	return;
+
+    so->lock(port_snap_lock);
+    if (--snap->refcount > 0) {
+	so->unlock(port_snap_lock);
+	return;
+    }
+    so->unlock(port_snap_lock);
+
+    for (i = 0; i < snap->count; i++)
+	port_deref(snap->ports[i]);
+    free(snap->ports);
+    free(snap->hash);
+    free(snap);
+}
+
+static port_info_t *
+port_snap_find(struct port_snap *snap, const char *name)
+{
+    unsigned int i;
+
+    if (!snap)
+	return NULL;
+
+    i = port_name_hash(name) & snap->hash_mask;
+    for (; snap->hash[i]; i = (i + 1) & snap->hash_mask) {
+	if (strcmp(snap->hash[i]->name, name) == 0)
+	    return snap->hash[i];
+    }
+    return NULL;
+}
+
 static int
-cntrl_abserrout(struct absout *o, const char *str, ...)
+cmp_port_devname(const void *a, const void *b)
 {
-    va_list ap;
-    int rv;
+    port_info_t * const *pa = a, * const *pb = b;
 
-    va_start(ap, str);
-    rv = controller_voutputf(o->data, str, ap);
-    va_end(ap);
-    rv += controller_outputf(o->data, "\r\n");
-    return rv;
+    return strcmp((*pa)->devname, (*pb)->devname);
+}
+
+/*
+ * Make a new snapshot of the ports list and make it the current one.
+ * Must be called with ports_lock held after any change to the list.
+ */
+static void
+publish_ports(void)
+{
+    struct port_snap *snap, *old;
+    port_info_t *port, **bydev = NULL;
+    unsigned int i, j, size;
+
+    snap = calloc(1, sizeof(*snap));
+    if (!snap)
+	goto out_nomem;
+    snap->refcount = 1;
+    for (port = ports; port; port = port->next)
+	snap->count++;
+    for (size = 8; size < snap->count * 2; size <<= 1)
+	;
+    snap->hash_mask = size - 1;
+    snap->hash = calloc(size, sizeof(*snap->hash));
+    snap->ports = calloc(snap->count + 1, sizeof(*snap->ports));
+    bydev = calloc(snap->count + 1, sizeof(*bydev));
+    if (!snap->hash || !snap->ports || !bydev)
+	goto out_nomem;
+
+    for (i = 0, port = ports; port; port = port->next, i++) {
+	snap->ports[i] = port;
+	bydev[i] = port;
+
+	/* The first port in the list wins on duplicate names. */
+	j = port_name_hash(port->name) & snap->hash_mask;
+	for (; snap->hash[j]; j = (j + 1) & snap->hash_mask) {
+	    if (strcmp(snap->hash[j]->name, port->name) == 0)
+		break;
+	}
+	if (!snap->hash[j])
+	    snap->hash[j] = port;
+    }
+
+    /*
+     * Sort by device to find ports sharing a device.  Connections to
+     * those have to check the other ports under ports_lock.
+     */
+    qsort(bydev, snap->count, sizeof(*bydev), cmp_port_devname);
+    for (i = 0; i < snap->count; i++) {
+	bool shared = ((i > 0 && cmp_port_devname(&bydev[i - 1],
+						  &bydev[i]) == 0) ||
+		       (i + 1 < snap->count &&
+			cmp_port_devname(&bydev[i], &bydev[i + 1]) == 0));
+
+	if (shared)
+	    snap->dev_shared = true;
+	if (bydev[i]->dev_shared != shared) {
+	    so->lock(bydev[i]->lock);
+	    bydev[i]->dev_shared = shared;
+	    so->unlock(bydev[i]->lock);
+	}
+    }
+    free(bydev);
+
+    so->lock(port_snap_lock);
+    for (i = 0; i < snap->count; i++)
+	snap->ports[i]->refcount++;
+    old = port_snap;
+    port_snap = snap;
+    so->unlock(port_snap_lock);
+
+    port_snap_put(old);
+    return;
+
+ out_nomem:
+    /* Lookups will use the old list until the next change. */
+    syslog(LOG_ERR, "Out of memory publishing the port list");
+    if (snap) {
+	free(snap->hash);
+	free(snap->ports);
+	free(snap);
+    }
+    free(bydev);
 }
 
+static void shutdown_one_netcon(net_info_t *netcon, const char *reason);
+static int shutdown_port(port_info_t *port, const char *errreason);
+
 static int
 num_connected_net(port_info_t *port)
 {
@@ -552,19 +1078,38 @@ init_port_data(port_info_t *port)
 
     port->net_to_dev_state = PORT_CLOSED;
     port->dev_to_net_state = PORT_CLOSED;
-    port->trace_read.fd = -1;
-    port->trace_write.fd = -1;
-    port->trace_both.fd = -1;
+    port->trace_read.q = NULL;
+    port->trace_write.q = NULL;
+    port->trace_both.q = NULL;
+    port->trace_read.bin = NULL;
+    port->trace_write.bin = NULL;
+    port->trace_both.bin = NULL;
+    port->trace_read.format = find_default_enum("trace-format");
+    port->trace_write.format = port->trace_read.format;
+    port->trace_both.format = port->trace_read.format;
 
     port->telnet_brk_on_sync = find_default_bool("telnet-brk-on-sync");
     port->kickolduser_mode = find_default_bool("kickolduser");
-    port->enable_chardelay = find_default_int("chardelay");
+    port->chardelay_mode = find_default_enum("chardelay");
     port->chardelay_scale = find_default_int("chardelay-scale");
     port->chardelay_min = find_default_int("chardelay-min");
     port->chardelay_max = find_default_int("chardelay-max");
-    port->dev_to_net.maxsize = find_default_int("dev-to-net-bufsize");
+    port->chardelay_target = find_default_int("chardelay-target");
+    port->dev_to_net_bufsize = find_default_int("dev-to-net-bufsize");
+    port->max_datagram = find_default_int("max-datagram-size");
+    port->dev_to_net_double_buffer =
+	find_default_bool("dev-to-net-double-buffer");
+    port->dev_to_net_direct = find_default_bool("dev-to-net-direct");
+    port->connect_back_persist = find_default_bool("connect-back-persist");
+    port->connect_back_retry_min = find_default_int("connect-back-retry-min");
+    port->connect_back_retry_max = find_default_int("connect-back-retry-max");
+    port->latency_stats = find_default_bool("latency-stats");
     port->net_to_dev.maxsize = find_default_int("net-to-dev-bufsize");
     port->max_connections = find_default_int("max-connections");
+    port->trace_bufsize = find_default_int("trace-bufsize");
+    port->trace_overflow = find_default_enum("trace-overflow");
+    port->trace_file_size = find_default_int("trace-file-size");
+    port->laggard_policy = find_default_enum("laggard-policy");
     if (find_default_str("authdir", &port->authdir))
 	return ENOMEM;
     if (find_default_str("signature", &port->signaturestr))
@@ -577,6 +1122,7 @@ init_port_data(port_info_t *port)
 	return ENOMEM;
     if (find_default_str("closeon", &port->closeon))
 	return ENOMEM;
+    port->closeon_len = port->closeon ? strlen(port->closeon) : 0;
 
     port->led_tx = NULL;
     port->led_rx = NULL;
@@ -587,139 +1133,111 @@ init_port_data(port_info_t *port)
 static void
 reset_timer(net_info_t *netcon)
 {
-    netcon->timeout_left = netcon->port->timeout;
+    port_info_t *port = netcon->port;
+
+    /* Just note the time, the timeout is checked when it could expire. */
+    if (port->timeout)
+	netcon->last_active = twheel_now(port->wheel);
 }
 
 
 static int
 timestamp(trace_info_t *t, char *buf, int size)
 {
-    time_t result;
     if (!t->timestamp)
         return 0;
-    result = time(NULL);
-    return strftime(buf, size, "%Y/%m/%d %H:%M:%S ", localtime(&result));
+    return trace_timestamp(&t->tstamp, buf, size);
 }
 
-static int
-trace_write_end(char *out, int size, const unsigned char *start, int col)
+static unsigned int
+trace_netcon_id(port_info_t *port, net_info_t *netcon)
 {
-    int pos = 0, w;
-
-    strncat(out, " |", size - pos);
-    pos += 2;
-    for(w = 0; w < col; w++) {
-        pos += snprintf(out + pos, size - pos, "%c",
-			isprint(start[w]) ? start[w] : '.');
-    }
-    strncat(out + pos, "|\n", size - pos);
-    pos += 2;
-    return pos;
+    if (!netcon)
+	return TRACE_NETCON_NONE;
+    return netcon - port->netcons;
 }
 
-int
-trace_write(port_info_t *port, trace_info_t *t, const unsigned char *buf,
-	    gensiods buf_len, const char *prefix)
+/* Write to a trace queue, counting anything the queue throws away. */
+static void
+trace_write(port_info_t *port, struct trace_queue *q,
+	    const void *data, size_t len)
 {
-    int rv = 0, w, col = 0, pos, file = t->fd;
-    gensiods q;
-    static char out[1024];
-    const unsigned char *start;
-
-    if (buf_len == 0)
-        return 0;
+    size_t dropped = trace_queue_dropped(q);
 
-    if (!t->hexdump)
-        return write(file, buf, buf_len);
-
-    pos = timestamp(t, out, sizeof(out));
-    pos += snprintf(out + pos, sizeof(out) - pos, "%s ", prefix);
-
-    start = buf;
-    for (q = 0; q < buf_len; q++) {
-        pos += snprintf(out + pos, sizeof(out) - pos, "%02x ", buf[q]);
-        col++;
-        if (col >= 8) {
-            trace_write_end(out + pos, sizeof(out) - pos, start, col);
-            rv = write(file, out, strlen(out));
-            if (rv < 0)
-                return rv;
-            pos = timestamp(t, out, sizeof(out));
-            pos += snprintf(out + pos, sizeof(out) - pos, "%s ", prefix);
-            col = 0;
-            start = buf + q + 1;
-        }
-    }
-    if (col > 0) {
-        for (w = 8; w > col; w--) {
-            strncat(out + pos, "   ", sizeof(out) - pos);
-            pos += 3;
-        }
-        trace_write_end(out + pos, sizeof(out) - pos, start, col);
-        rv = write(file, out, strlen(out));
-        if (rv < 0)
-            return rv;
-    }
-    return buf_len;
+    trace_queue_write(q, data, len);
+    dropped = trace_queue_dropped(q) - dropped;
+    if (dropped)
+	metrics_add(&port->metrics.trace_drops, dropped);
 }
 
 static void
-do_trace(port_info_t *port, trace_info_t *t, const unsigned char *buf,
-	 gensiods buf_len, const char *prefix)
+do_trace(port_info_t *port, trace_info_t *t, net_info_t *netcon,
+	 const unsigned char *buf, gensiods buf_len, enum trace_rec_type type)
 {
-    int rv;
-
-    while (buf_len > 0) {
-    retry_write:
-	rv = trace_write(port, t, buf, buf_len, prefix);
-	if (rv == -1) {
-	    char errbuf[128];
-	    int err = errno;
+    char hdr[64], out[TRACE_HEXDUMP_LINE_LEN(sizeof(hdr)) * 32];
+    size_t hdrlen, outlen, done;
 
-	    if (err == EINTR)
-		goto retry_write;
+    if (buf_len == 0)
+        return;
 
-	    /* Fatal error writing to the file, log it and close the file. */
+    if (t->bin) {
+	/* The record has its own timestamp, hexdump is done by the decoder. */
+	trace_bin_write(t->bin, type, trace_netcon_id(port, netcon),
+			buf, buf_len);
+	return;
+    }
 
-	    if (strerror_r(err, errbuf, sizeof(errbuf)) == -1)
-		syslog(LOG_ERR, "Unable write to trace file on port %s: %d",
-		       port->name, err);
-	    else
-		syslog(LOG_ERR, "Unable to write to trace file on port %s: %s",
-		       port->name, errbuf);
+    if (!t->hexdump) {
+        trace_write(port, t->q, buf, buf_len);
+        return;
+    }
 
-	    close(t->fd);
-	    t->fd = -1;
-	    return;
-	}
+    /* Every line of this block gets the same timestamp. */
+    hdrlen = timestamp(t, hdr, sizeof(hdr));
+    hdrlen += snprintf(hdr + hdrlen, sizeof(hdr) - hdrlen, "%s ",
+		       type == TRACE_REC_DEV ? SERIAL : NET);
 
-	/* Handle a partial write */
-	buf_len -= rv;
-	buf += rv;
+    while (buf_len > 0) {
+	done = trace_hexdump(out, sizeof(out), &outlen, hdr, hdrlen,
+			     buf, buf_len);
+	trace_write(port, t->q, out, outlen);
+	buf += done;
+	buf_len -= done;
     }
 }
 
 static void
-hf_out(port_info_t *port, char *buf, int len)
+hf_out_one(port_info_t *port, trace_info_t *t, net_info_t *netcon,
+	   char *buf, int len)
+{
+    /* Binary files always get events, text only with timestamps. */
+    if (t->bin)
+	trace_bin_write(t->bin, TRACE_REC_EVENT, trace_netcon_id(port, netcon),
+			buf, len);
+    else if (t->timestamp)
+	trace_write(port, t->q, buf, len);
+}
+
+static void
+hf_out(port_info_t *port, net_info_t *netcon, char *buf, int len)
 {
-    if (port->tr && port->tr->timestamp)
-        write_ignore_fail(port->tr->fd, buf, len);
+    if (port->tr)
+	hf_out_one(port, port->tr, netcon, buf, len);
 
     /* don't output to write file if it's the same as read file */
-    if (port->tw && port->tw != port->tr && port->tw->timestamp)
-        write_ignore_fail(port->tw->fd, buf, len);
+    if (port->tw && port->tw != port->tr)
+	hf_out_one(port, port->tw, netcon, buf, len);
 
     /* don't output to both file if it's the same as read or write file */
-    if (port->tb && port->tb != port->tr && port->tb != port->tw
-		&& port->tb->timestamp)
-        write_ignore_fail(port->tb->fd, buf, len);
+    if (port->tb && port->tb != port->tr && port->tb != port->tw)
+	hf_out_one(port, port->tb, netcon, buf, len);
 }
 
 static void
 header_trace(port_info_t *port, net_info_t *netcon)
 {
     char buf[1024];
-    trace_info_t tr = { 1, 1, NULL, -1 };
+    trace_info_t tr = { 1, 1, NULL, NULL };
     gensiods len = 0;
 
     len += timestamp(&tr, buf, sizeof(buf));
@@ -729,14 +1247,14 @@ header_trace(port_info_t *port, net_info_t *netcon)
     if (sizeof(buf) > len)
 	len += snprintf(buf + len, sizeof(buf) - len, ")\n");
 
-    hf_out(port, buf, len);
+    hf_out(port, netcon, buf, len);
 }
 
 static void
 footer_trace(port_info_t *port, char *type, const char *reason)
 {
     char buf[1024];
-    trace_info_t tr = { 1, 1, NULL, -1 };
+    trace_info_t tr = { 1, 1, NULL, NULL };
     int len = 0;
 
     len += timestamp(&tr, buf, sizeof(buf));
@@ -744,56 +1262,346 @@ footer_trace(port_info_t *port, char *type, const char *reason)
 	len += snprintf(buf + len, sizeof(buf) - len,
 			"CLOSE %s (%s)\n", type, reason);
 
-    hf_out(port, buf, len);
+    hf_out(port, NULL, buf, len);
 }
 
+/*
+ * Is the current send still in progress?  When blocking on laggards
+ * every connection has to finish, otherwise the send is done as soon
+ * as any connection has caught up and the slow ones drain out of the
+ * ring in the background.
+ */
 static bool
 any_net_data_to_write(port_info_t *port)
 {
     net_info_t *netcon;
+    bool data_to_write = false;
 
     for_each_connection(port, netcon) {
-	if (!netcon->net)
+	if (!netcon->net || netcon->closing)
 	    continue;
-	if (netcon->write_pos < port->dev_to_net.cursize)
-	    return true;
+	if (netcon->write_pos < port->dev_to_net.commit)
+	    data_to_write = true;
+	else if (port->laggard_policy != LAGGARD_BLOCK)
+	    return false;
     }
-    return false;
+    return data_to_write;
 }
 
-static void
-start_net_send(port_info_t *port)
+/* The position of the slowest live connection in the dev_to_net ring. */
+static gensiods
+dev_to_net_tail(port_info_t *port)
 {
     net_info_t *netcon;
+    gensiods tail = port->dev_to_net.head;
 
-    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR)
-	return;
-
-    gensio_set_read_callback_enable(port->io, false);
     for_each_connection(port, netcon) {
-	if (!netcon->net)
+	if (!netcon->net || netcon->closing)
 	    continue;
-	netcon->write_pos = 0;
-	gensio_set_write_callback_enable(netcon->net, true);
+	if (netcon->write_pos < tail)
+	    tail = netcon->write_pos;
     }
-    port->dev_to_net_state = PORT_WAITING_OUTPUT_CLEAR;
+    return tail;
 }
 
-void
-send_timeout(struct gensio_timer *timer, void *data)
+/*
+ * The amount of data that can be added before the next send must
+ * start.  This is limited by the slowest connection and by the size
+ * of a single send.
+ */
+static gensiods
+dev_to_net_room_left(port_info_t *port)
 {
-    port_info_t *port = (port_info_t *) data;
-
-    so->lock(port->lock);
+    struct rbuf *buf = &port->dev_to_net;
+    gensiods room, pending = buf->head - buf->commit;
 
-    if (port->dev_to_net_state == PORT_CLOSING) {
-	so->unlock(port->lock);
-	return;
-    }
+    room = buf->maxsize - (buf->head - dev_to_net_tail(port));
+    if (pending >= port->dev_to_net_bufsize)
+	return 0;
+    if (room > port->dev_to_net_bufsize - pending)
+	room = port->dev_to_net_bufsize - pending;
+    return room;
+}
 
-    port->send_timer_running = false;
-    if (port->dev_to_net.cursize)
-	start_net_send(port);
+/*
+ * With connect-back-persist, device data stays uncommitted in the dev
+ * to net ring while no connect back is up, up to dev-to-net-bufsize.
+ */
+static bool
+port_holding_data(port_info_t *port)
+{
+    net_info_t *netcon;
+
+    if (!port->connect_back_persist || !port->has_connect_back)
+	return false;
+
+    for_each_connection(port, netcon) {
+	if (netcon->net && !netcon->connect_back_opening && !netcon->closing)
+	    return false;
+    }
+    return true;
+}
+
+/*
+ * If every connection has sent everything, move everything back to
+ * the start of the ring so the next send is contiguous.
+ */
+static void
+dev_to_net_rebase(port_info_t *port)
+{
+    net_info_t *netcon;
+
+    if (dev_to_net_tail(port) != port->dev_to_net.head ||
+		port->dev_to_net.commit != port->dev_to_net.head)
+	return;
+
+    for_each_connection(port, netcon) {
+	netcon->write_pos = 0;
+	netcon->lat_next = port->lat_head;
+    }
+    rbuf_reset(&port->dev_to_net);
+}
+
+/*
+ * The connection skipped ahead, the sends that ended in what was
+ * skipped were never delivered to it, so don't count them.
+ */
+static void
+latency_netcon_skip(port_info_t *port, net_info_t *netcon)
+{
+    if (port->lat_head - netcon->lat_next > LAT_SENDS)
+	netcon->lat_next = port->lat_head - LAT_SENDS;
+    while (netcon->lat_next != port->lat_head &&
+	   port->lat_sends[netcon->lat_next % LAT_SENDS].end <=
+	   netcon->write_pos)
+	netcon->lat_next++;
+}
+
+/* Is there a connection that keeps message boundaries, like UDP? */
+static bool
+port_has_packet_netcon(port_info_t *port)
+{
+    net_info_t *netcon;
+
+    for_each_connection(port, netcon) {
+	if (netcon->net && netcon->is_packet)
+	    return true;
+    }
+    return false;
+}
+
+/*
+ * Make room for "want" bytes in the dev_to_net ring by dealing with
+ * the connections that are holding the tail back, per the laggard
+ * policy.  Data that has not been committed for sending is never
+ * thrown away.
+ */
+static void
+handle_dev_to_net_laggards(port_info_t *port, gensiods want)
+{
+    struct rbuf *buf = &port->dev_to_net;
+    net_info_t *netcon;
+    gensiods new_tail;
+
+    if (port->laggard_policy == LAGGARD_BLOCK)
+	return;
+
+    if (buf->head + want <= buf->maxsize)
+	return;
+    new_tail = buf->head + want - buf->maxsize;
+    if (new_tail > buf->commit)
+	new_tail = buf->commit;
+
+    for_each_connection(port, netcon) {
+	if (!netcon->net || netcon->closing || netcon->write_pos >= new_tail)
+	    continue;
+
+	if (port->laggard_policy == LAGGARD_DROP) {
+	    metrics_add(&port->metrics.laggard_drops, 1);
+	    shutdown_one_netcon(netcon, "connection lagging");
+	} else {
+	    metrics_add(&port->metrics.laggard_skipped_bytes,
+			new_tail - netcon->write_pos);
+	    netcon->bytes_skipped += new_tail - netcon->write_pos;
+	    netcon->write_pos = new_tail;
+	    latency_netcon_skip(port, netcon);
+	}
+    }
+}
+
+/*
+ * For chardelay: adaptive, learn the gaps between reads in a burst and
+ * return how long to wait for the next read.  Gaps longer than the
+ * target are between bursts, like a request/response turnaround, and
+ * are not counted.  The send time is also pulled in so the data can be
+ * drained by the network within the target.
+ */
+static int
+adaptive_chardelay(port_info_t *port, struct timeval *now)
+{
+    gensiods pending = port->dev_to_net.head - port->dev_to_net.commit;
+    int gap = sub_timeval_us(now, &port->last_dev_read);
+    unsigned int delay, budget, drain_us = 0;
+    struct timeval send_by;
+
+    port->last_dev_read = *now;
+    if (gap >= 0 && (unsigned int) gap < port->chardelay_target)
+	/* Exponential average with a weight of 1/8. */
+	port->gap_avg += gap - port->gap_avg / 8;
+
+    /* Wait twice the average gap, but at least a character time. */
+    delay = port->gap_avg / 4;
+    if (delay < port->char_usec)
+	delay = port->char_usec;
+    if (delay > port->chardelay_target)
+	delay = port->chardelay_target;
+
+    if (port->drain_rate)
+	drain_us = pending * 1000 / port->drain_rate;
+    budget = 0;
+    if (drain_us < port->chardelay_target)
+	budget = port->chardelay_target - drain_us;
+    send_by = port->batch_start;
+    add_usec_to_timeval(&send_by, budget);
+    if (sub_timeval_us(&send_by, &port->send_time) < 0)
+	port->send_time = send_by;
+
+    return delay;
+}
+
+/* All the network connections took the data, update the drain rate. */
+static void
+adaptive_drain_done(port_info_t *port)
+{
+    struct timeval now;
+    unsigned int rate;
+    int elapsed;
+
+    so->get_monotonic_time(so, &now);
+    elapsed = sub_timeval_us(&now, &port->net_send_start);
+    if (elapsed > 0) {
+	rate = port->net_send_len * 1000 / elapsed;
+	if (rate == 0)
+	    rate = 1;
+	if (port->drain_rate)
+	    port->drain_rate = (port->drain_rate * 7 + rate) / 8;
+	else
+	    port->drain_rate = rate;
+    }
+    port->net_send_len = 0;
+}
+
+static void
+latency_send_start(port_info_t *port)
+{
+    struct lat_send *ls = &port->lat_sends[port->lat_head % LAT_SENDS];
+
+    ls->end = port->dev_to_net.commit;
+    ls->first_read = port->lat_first_read;
+    ls->send_start = port->net_send_start;
+    port->lat_head++;
+    metrics_hist_add(&port->metrics.lat_chardelay,
+		     sub_timeval_us(&ls->send_start, &ls->first_read));
+}
+
+/* Record the sends the connection has finished writing. */
+static void
+latency_netcon_check(port_info_t *port, net_info_t *netcon)
+{
+    struct lat_send *ls;
+    struct timeval now;
+    bool have_now = false;
+
+    if (port->lat_head - netcon->lat_next > LAT_SENDS)
+	netcon->lat_next = port->lat_head - LAT_SENDS;
+    while (netcon->lat_next != port->lat_head) {
+	ls = &port->lat_sends[netcon->lat_next % LAT_SENDS];
+	if (netcon->write_pos < ls->end)
+	    break;
+	if (!have_now) {
+	    so->get_monotonic_time(so, &now);
+	    have_now = true;
+	}
+	metrics_hist_add(&port->metrics.lat_backpressure,
+			 sub_timeval_us(&now, &ls->send_start));
+	metrics_hist_add(&port->metrics.lat_total,
+			 sub_timeval_us(&now, &ls->first_read));
+	netcon->lat_next++;
+    }
+}
+
+static void
+start_net_send(port_info_t *port)
+{
+    net_info_t *netcon;
+    bool new_data;
+
+    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR)
+	/* With double buffering, this gets sent when the current send ends. */
+	return;
+
+    if (port_holding_data(port))
+	/* connect_back_flush() sends it. */
+	return;
+
+    /*
+     * Nothing after a closeon string goes to these connections, so
+     * don't read more until this send is done, even if double
+     * buffered.
+     */
+    if (!port->dev_to_net_double_buffer || port->closeon_seen)
+	dev_set_read_enable(port, false);
+    so->get_monotonic_time(so, &port->net_send_start);
+    if (port->chardelay_mode == CHARDELAY_ADAPTIVE)
+	port->net_send_len = port->dev_to_net.head - port->dev_to_net.commit;
+    new_data = port->dev_to_net.head != port->dev_to_net.commit;
+    PROBE3(net_send_start, port->name, -1,
+	   port->dev_to_net.head - port->dev_to_net.commit);
+    port->dev_to_net.commit = port->dev_to_net.head;
+    if (port->latency_stats && new_data)
+	latency_send_start(port);
+    for_each_connection(port, netcon) {
+	if (!netcon->net || netcon->closing)
+	    continue;
+	if (port->closeon_seen)
+	    netcon->close_on_output_done = true;
+	net_set_write_enable(netcon, true);
+    }
+    port->closeon_seen = false;
+    port->dev_to_net_state = PORT_WAITING_OUTPUT_CLEAR;
+}
+
+void
+send_timeout(struct gensio_timer *timer, void *data)
+{
+    port_info_t *port = (port_info_t *) data;
+
+    so->lock(port->lock);
+
+    if (port->dev_to_net_state == PORT_CLOSING) {
+	so->unlock(port->lock);
+	return;
+    }
+
+    port->send_timer_running = false;
+    PROBE3(send_timeout, port->name, -1,
+	   port->dev_to_net.head - port->dev_to_net.commit);
+    if (port->dev_to_net.head != port->dev_to_net.commit) {
+	struct timeval now;
+
+	/*
+	 * Reads move the deadline without touching the timer, if more
+	 * data came in, wait for the rest of the delay.
+	 */
+	so->get_monotonic_time(so, &now);
+	if (sub_timeval_us(&port->send_deadline, &now) > 0) {
+	    port->send_timer_at = port->send_deadline;
+	    so->start_timer_abs(port->send_timer, &port->send_timer_at);
+	    port->send_timer_running = true;
+	} else {
+	    start_net_send(port);
+	}
+    }
     so->unlock(port->lock);
 }
 
@@ -804,7 +1612,7 @@ disable_all_net_read(port_info_t *port)
 
     for_each_connection(port, netcon) {
 	if (netcon->net)
-	    gensio_set_read_callback_enable(netcon->net, false);
+	    net_set_read_enable(netcon, false);
     }
 }
 
@@ -815,8 +1623,63 @@ enable_all_net_read(port_info_t *port)
 
     for_each_connection(port, netcon) {
 	if (netcon->net)
-	    gensio_set_read_callback_enable(netcon->net, true);
+	    net_set_read_enable(netcon, true);
+    }
+}
+
+/*
+ * Return the delay in seconds before the next connect back attempt.
+ * This is *backoff with up to half of it taken off at random, so
+ * ports that failed together don't all retry together.  *backoff
+ * doubles for the next failure, up to the max, set it to zero when a
+ * connect works.
+ */
+static unsigned int
+connect_back_delay(port_info_t *port, unsigned int *backoff)
+{
+    struct timeval now;
+    unsigned int delay, half;
+
+    if (*backoff < port->connect_back_retry_min)
+	*backoff = port->connect_back_retry_min;
+    if (*backoff > port->connect_back_retry_max)
+	*backoff = port->connect_back_retry_max;
+    delay = *backoff;
+
+    half = delay / 2;
+    if (half) {
+	so->get_monotonic_time(so, &now);
+	delay -= now.tv_usec % (half + 1);
     }
+
+    if (*backoff < port->connect_back_retry_max / 2)
+	*backoff *= 2;
+    else
+	*backoff = port->connect_back_retry_max;
+
+    return delay;
+}
+
+/* Try a persistent connect back again later. */
+static void
+connect_back_retry(port_info_t *port, net_info_t *netcon)
+{
+    netcon->connect_back_retry_at = (twheel_now(port->wheel) +
+		connect_back_delay(port, &netcon->connect_back_backoff));
+    port_sched_housekeeping(port);
+}
+
+/*
+ * A persistent connect back came up, send it whatever was held while
+ * there was no connection.
+ */
+static void
+connect_back_flush(port_info_t *port, net_info_t *netcon)
+{
+    netcon->write_pos = port->dev_to_net.commit;
+    if (port->dev_to_net.head != port->dev_to_net.commit &&
+		port->dev_to_net_state == PORT_WAITING_INPUT)
+	start_net_send(port);
 }
 
 static void
@@ -826,57 +1689,109 @@ connect_back_done(struct gensio *net, int err, void *cb_data)
     port_info_t *port = netcon->port;
 
     so->lock(port->lock);
+    netcon->connect_back_opening = false;
     if (err) {
-	netcon->net = NULL;
-	gensio_free(net);
+	syslog(LOG_ERR, "Unable to connect back port %s, addr %s: %s\n",
+	       port->name, netcon->remote_str, gensio_err_to_str(err));
+	if (!netcon->closing) {
+	    /* If it's closing, the close finishes the job. */
+	    netcon->net = NULL;
+	    gensio_free(net);
+	    if (port->connect_back_persist)
+		connect_back_retry(port, netcon);
+	}
     } else {
+	netcon->connect_back_backoff = 0;
+	port->nocon_backoff = 0;
+	if (port->dev_to_net_state == PORT_UNCONNECTED) {
+	    /* Coming back after the last connection went away. */
+	    port->dev_to_net_state = PORT_WAITING_INPUT;
+	    port->net_to_dev_state = PORT_WAITING_INPUT;
+	}
 	setup_port(port, netcon);
+	if (port->connect_back_persist)
+	    connect_back_flush(port, netcon);
     }
     assert(port->num_waiting_connect_backs > 0);
     port->num_waiting_connect_backs--;
-    if (port->num_waiting_connect_backs == 0) {
-	if (num_connected_net(port) == 0)
+    if (port->num_waiting_connect_backs == 0 && !port->connect_back_persist) {
+	if (num_connected_net(port) == 0) {
 	    /* No connections could be made. */
-	    port->nocon_read_enable_time_left = 10;
-	else
-	    gensio_set_read_callback_enable(port->io, true);
+	    port->nocon_read_enable_at = (twheel_now(port->wheel) +
+			connect_back_delay(port, &port->nocon_backoff));
+	    port_sched_housekeeping(port);
+	} else
+	    dev_set_read_enable(port, true);
     }
     so->unlock(port->lock);
 }
 
+/* Start connecting a connect back, connect_back_done() gets the result. */
+static int
+connect_back_open(port_info_t *port, net_info_t *netcon)
+{
+    int err;
+
+    err = gensio_acc_str_to_gensio(port->accepter, netcon->remote_str,
+				   handle_net_event, netcon, &netcon->net);
+    if (err) {
+	syslog(LOG_ERR, "Unable to allocate connect back port %s,"
+	       " addr %s: %s\n", port->name, netcon->remote_str,
+	       gensio_err_to_str(err));
+	return err;
+    }
+    err = gensio_open(netcon->net, connect_back_done, netcon);
+    if (err) {
+	gensio_free(netcon->net);
+	netcon->net = NULL;
+	syslog(LOG_ERR, "Unable to open connect back port %s,"
+	       " addr %s: %s\n", port->name, netcon->remote_str,
+	       gensio_err_to_str(err));
+	return err;
+    }
+    netcon->connect_back_opening = true;
+    port->num_waiting_connect_backs++;
+    return 0;
+}
+
+/*
+ * With connect-back-persist, open the connect backs that are down and
+ * not waiting for a retry.
+ */
+static void
+port_start_connect_backs(port_info_t *port)
+{
+    net_info_t *netcon;
+
+    if (!port->connect_back_persist || !port->enabled || !port->io_open ||
+		port->shutdown_started || port->deleted ||
+		port->dev_to_net_state == PORT_CLOSING ||
+		port->net_to_dev_state == PORT_CLOSING)
+	return;
+
+    for_each_connection(port, netcon) {
+	if (!netcon->connect_back || netcon->net ||
+		netcon->connect_back_retry_at)
+	    continue;
+	if (connect_back_open(port, netcon))
+	    connect_back_retry(port, netcon);
+    }
+}
+
 static int
 port_check_connect_backs(port_info_t *port)
 {
     net_info_t *netcon;
     bool tried = false;
 
-    if (!port->has_connect_back)
+    /* Persistent connect backs are opened ahead of time. */
+    if (!port->has_connect_back || port->connect_back_persist)
 	return 0;
 
     for_each_connection(port, netcon) {
 	if (netcon->connect_back && !netcon->net) {
-	    int err;
-
 	    tried = true;
-	    err = gensio_acc_str_to_gensio(port->accepter, netcon->remote_str,
-					   handle_net_event, netcon,
-					   &netcon->net);
-	    if (err) {
-		syslog(LOG_ERR, "Unable to allocate connect back port %s,"
-		       " addr %s: %s\n", port->name, netcon->remote_str,
-		       gensio_err_to_str(err));
-		continue;
-	    }
-	    err = gensio_open(netcon->net, connect_back_done, netcon);
-	    if (err) {
-		gensio_free(netcon->net);
-		netcon->net = NULL;
-		syslog(LOG_ERR, "Unable to open connect back port %s,"
-		       " addr %s: %s\n", port->name, netcon->remote_str,
-		       gensio_err_to_str(err));
-		continue;
-	    }
-	    port->num_waiting_connect_backs++;
+	    connect_back_open(port, netcon);
 	}
     }
 
@@ -885,30 +1800,138 @@ port_check_connect_backs(port_info_t *port)
 	 * This is kind of a bad situation.  We got some data, attempted
 	 * connects, but failed.  Shut down the read enable for a while.
 	 */
-	port->nocon_read_enable_time_left = 10;
-	gensio_set_read_callback_enable(port->io, false);
+	port->nocon_read_enable_at = (twheel_now(port->wheel) +
+			connect_back_delay(port, &port->nocon_backoff));
+	port_sched_housekeeping(port);
+	dev_set_read_enable(port, false);
     } else if (port->num_waiting_connect_backs) {
-	gensio_set_read_callback_enable(port->io, false);
+	dev_set_read_enable(port, false);
     }
 
     return port->num_waiting_connect_backs;
 }
 
+/* Tell the controllers about the patterns the device sent. */
+static void
+port_notify_run(struct gensio_runner *runner, void *cb_data)
+{
+    port_info_t *port = cb_data;
+    uint32_t pending;
+    unsigned int i;
+
+    so->lock(port->lock);
+    pending = port->notify_pending;
+    port->notify_pending = 0;
+    so->unlock(port->lock);
+
+    for (i = 0; pending; i++, pending >>= 1) {
+	if (pending & 1)
+	    controller_notify("\r\n[%s: device sent %s]\r\n", port->name,
+			      matcher_pattern_str(port->matcher, i));
+    }
+    port_deref(port);
+}
+
+/*
+ * Handle the patterns that just ended in the device data.  Returns
+ * true if the connections should be closed.
+ */
+static bool
+port_handle_match(port_info_t *port, uint32_t matched)
+{
+    unsigned int i, actions;
+    bool do_close = false;
+
+    for (i = 0; i < MATCH_MAX_PATTERNS; i++) {
+	if (!(matched & (1U << i)))
+	    continue;
+	actions = matcher_pattern_actions(port->matcher, i);
+	if (actions & MATCH_LOG)
+	    syslog(LOG_NOTICE, "Device on port %s sent %s", port->name,
+		   matcher_pattern_str(port->matcher, i));
+	if (actions & MATCH_NOTIFY) {
+	    if (!port->notify_pending) {
+		port_ref(port);
+		if (so->run(port->notify_runner)) {
+		    port_deref(port); /* The port list still has a ref. */
+		    continue;
+		}
+	    }
+	    port->notify_pending |= 1U << i;
+	}
+	if (actions & MATCH_CLOSE)
+	    do_close = true;
+    }
+    return do_close;
+}
+
+static int net_fd_write_data(port_info_t *port, net_info_t *netcon,
+			     const unsigned char *data, gensiods len,
+			     gensiods *count);
+
+/*
+ * With dev-to-net-direct, device data may be written straight from
+ * the gensio's read buffer to the network connection, without a copy
+ * into the dev_to_net ring, if nothing needs to see it on the way.
+ * That is checked on every read, so starting a trace, tap, or similar
+ * at runtime goes back to the normal path.  Return the connection to
+ * write to, or NULL to use the ring.
+ */
+static net_info_t *
+dev_to_net_direct_netcon(port_info_t *port)
+{
+    net_info_t *netcon, *rv = NULL;
+
+    if (!port->dev_to_net_direct ||
+		port->dev_to_net_state != PORT_WAITING_INPUT ||
+		port->dev_to_net.head != port->dev_to_net.commit ||
+		port->matcher || port->tr || port->tb ||
+		port->latency_stats || port->has_connect_back ||
+		tap_active(port->taps))
+	return NULL;
+
+    for_each_connection(port, netcon) {
+	if (!netcon->net)
+	    continue;
+	/* Only one connection, and it must be caught up. */
+	if (rv || netcon->closing || netcon->banner || netcon->is_packet ||
+		netcon->write_pos != port->dev_to_net.head)
+	    return NULL;
+	rv = netcon;
+    }
+    return rv;
+}
+
 /* Data is ready to read on the serial port. */
 static int
 handle_dev_read(port_info_t *port, int err, unsigned char *buf,
 		gensiods buflen)
 {
-    gensiods count = 0;
+    gensiods count = 0, room, direct = 0, offered = buflen;
     bool send_now = false;
     int nr_handlers = 0;
+    net_info_t *netcon;
 
     so->lock(port->lock);
-    if (port->dev_to_net_state != PORT_WAITING_INPUT)
+    if (port->dev_to_net_state != PORT_WAITING_INPUT &&
+		!(port->dev_to_net_double_buffer &&
+		  port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR) &&
+		!(port->has_connect_back &&
+		  port->dev_to_net_state == PORT_UNCONNECTED))
+	goto out_unlock;
+
+    if (port->closeon_seen)
+	/* Reads are off until the closeon send starts, see below. */
 	goto out_unlock;
 
     if (err) {
-	if (port->dev_to_net.cursize) {
+	if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR) {
+	    /* Handle the error after the current send finishes. */
+	    dev_set_read_enable(port, false);
+	    goto out_unlock;
+	}
+	if (port->dev_to_net.head != port->dev_to_net.commit &&
+		!port_holding_data(port)) {
 	    /* Let the output drain before shutdown. */
 	    count = 0;
 	    send_now = true;
@@ -927,85 +1950,143 @@ handle_dev_read(port_info_t *port, int err, unsigned char *buf,
     if (nr_handlers > 0)
 	goto out_unlock;
 
-    if (gbuf_room_left(&port->dev_to_net) < buflen)
-	buflen = gbuf_room_left(&port->dev_to_net);
+    netcon = err ? NULL : dev_to_net_direct_netcon(port);
+    if (netcon) {
+	if (net_fd_write_data(port, netcon, buf, buflen, &direct))
+	    goto out_unlock;
+	metrics_add(&port->dev_bytes_received, direct);
+	metrics_add(&port->metrics.dev_read_bytes, direct);
+	metrics_add(&port->metrics.dev_reads, 1);
+	if (port->led_rx)
+	    led_flash(port->led_rx);
+	reset_timer(netcon);
+	if (direct == buflen)
+	    goto out_unlock;
+
+	/* The rest goes in the ring, to be sent when the net is ready. */
+	buf += direct;
+	buflen -= direct;
+	send_now = true;
+    }
+
+    room = dev_to_net_room_left(port);
+    if (room < buflen) {
+	handle_dev_to_net_laggards(port, buflen);
+	room = dev_to_net_room_left(port);
+	if (room < buflen)
+	    buflen = room;
+    }
     count = buflen;
 
     if (count == 0) {
-	gensio_set_read_callback_enable(port->io, false);
+	/* The send in progress will turn this back on when it finishes. */
+	metrics_add(&port->metrics.dev_read_stalls, 1);
+	dev_set_read_enable(port, false);
 	goto out_unlock;
     }
 
-    if (port->closeon) {
-	int i;
-
-	for (i = 0; i < count; i++) {
-	    if (buf[i] == port->closeon[port->closeon_pos]) {
-		port->closeon_pos++;
-		if (port->closeon_pos >= port->closeon_len) {
-		    net_info_t *netcon;
+    if (port->matcher) {
+	gensiods pos = 0, end;
+	uint32_t matched;
 
-		    for_each_connection(port, netcon)
-			netcon->close_on_output_done = true;
-		    /* Ignore everything after the closeon string */
-		    count = i + 1;
-		    break;
-		}
-	    } else {
-		port->closeon_pos = 0;
+	while (pos < count &&
+	       matcher_scan(port->matcher, &port->match_state, buf + pos,
+			    count - pos, &end, &matched)) {
+	    pos += end;
+	    if (port_handle_match(port, matched)) {
+		/*
+		 * The connections are closed after the data up to
+		 * here is sent, see start_net_send().  Leave
+		 * everything after the closeon string for later, and
+		 * stop reading in case the send has to wait for the
+		 * current one with double buffering.
+		 */
+		port->closeon_seen = true;
+		dev_set_read_enable(port, false);
+		send_now = true;
+		count = pos;
+		port->match_state = MATCH_STATE_INIT;
+		break;
 	    }
 	}
     }
 
     if (port->tr)
 	/* Do read tracing, ignore errors. */
-	do_trace(port, port->tr, buf, count, SERIAL);
+	do_trace(port, port->tr, NULL, buf, count, TRACE_REC_DEV);
     if (port->tb)
 	/* Do both tracing, ignore errors. */
-	do_trace(port, port->tb, buf, count, SERIAL);
+	do_trace(port, port->tb, NULL, buf, count, TRACE_REC_DEV);
 
     if (port->led_rx)
 	led_flash(port->led_rx);
 
-    if (port->dev_monitor != NULL)
-	controller_write(port->dev_monitor, (char *) buf, count);
+    if (tap_active(port->taps))
+	tap_send(port->taps, TAP_DEV, buf, count);
 
  do_send:
     if (nr_handlers < 0) /* Nobody to handle the data. */
 	goto out_unlock;
 
-    gbuf_append(&port->dev_to_net, buf, count);
-    port->dev_bytes_received += count;
-
-    if (send_now || gbuf_room_left(&port->dev_to_net) == 0 ||
-		port->chardelay == 0) {
+    if (port->latency_stats && count &&
+		port->dev_to_net.head == port->dev_to_net.commit)
+	so->get_monotonic_time(so, &port->lat_first_read);
+    rbuf_append(&port->dev_to_net, buf, count);
+    metrics_add(&port->dev_bytes_received, count);
+    metrics_add(&port->metrics.dev_read_bytes, count);
+    metrics_add(&port->metrics.dev_reads, 1);
+
+    if (send_now || dev_to_net_room_left(port) == 0 ||
+		port->chardelay == 0 ||
+		(port->max_datagram &&
+		 port->dev_to_net.head - port->dev_to_net.commit >=
+		 port->max_datagram && port_has_packet_netcon(port))) {
     send_it:
 	start_net_send(port);
     } else {
-	struct timeval then;
-	int delay;
+	struct timeval now;
+	int delay, left;
 
-	so->get_monotonic_time(so, &then);
-	if (port->send_timer_running) {
-	    so->stop_timer(port->send_timer);
-	} else {
-	    port->send_time = then;
+	so->get_monotonic_time(so, &now);
+	if (!port->send_timer_running) {
+	    port->batch_start = now;
+	    port->send_time = now;
 	    add_usec_to_timeval(&port->send_time, port->chardelay_max);
 	}
-	delay = sub_timeval_us(&port->send_time, &then);
-	if (delay > port->chardelay)
+	if (port->chardelay_mode == CHARDELAY_ADAPTIVE)
+	    delay = adaptive_chardelay(port, &now);
+	else
 	    delay = port->chardelay;
-	else if (delay < 0) {
-	    port->send_timer_running = false;
+	left = sub_timeval_us(&port->send_time, &now);
+	if (left <= 0) {
+	    if (port->send_timer_running &&
+			so->stop_timer(port->send_timer) == 0)
+		port->send_timer_running = false;
 	    goto send_it;
 	}
-	add_usec_to_timeval(&then, delay);
-	so->start_timer_abs(port->send_timer, &then);
-	port->send_timer_running = true;
+	if (delay > left)
+	    delay = left;
+	port->send_deadline = now;
+	add_usec_to_timeval(&port->send_deadline, delay);
+
+	/*
+	 * Only touch the timer if it has to go off sooner, send_timeout()
+	 * takes care of moving it out.
+	 */
+	if (port->send_timer_running &&
+		sub_timeval_us(&port->send_deadline, &port->send_timer_at) < 0 &&
+		so->stop_timer(port->send_timer) == 0)
+	    port->send_timer_running = false;
+	if (!port->send_timer_running) {
+	    port->send_timer_at = port->send_deadline;
+	    so->start_timer_abs(port->send_timer, &port->send_timer_at);
+	    port->send_timer_running = true;
+	}
     }
  out_unlock:
+    PROBE4(dev_read, port->name, -1, offered, direct + count);
     so->unlock(port->lock);
-    return count;
+    return direct + count;
 }
 
 static void
@@ -1063,6 +2144,8 @@ handle_dev_event(struct gensio *io, void *user_data, int event, int err,
     case GENSIO_EVENT_SER_LINESTATE:
 	so->lock(port->lock);
 	port->last_linestate = *((unsigned int *) buf);
+	if (port->last_linestate & SERGENSIO_LINESTATE_OVERRUN_ERR)
+	    metrics_add(&port->metrics.dev_overruns, 1);
 	for_each_connection(port, netcon) {
 	    struct sergensio *sio;
 
@@ -1094,9 +2177,12 @@ gbuf_write(port_info_t *port, struct gbuf *buf)
 		       buf->cursize - buf->pos, NULL);
     if (err)
 	return err;
+    PROBE4(dev_write, port->name, -1, buf->cursize - buf->pos, written);
 
     buf->pos += written;
-    port->dev_bytes_sent += written;
+    metrics_add(&port->dev_bytes_sent, written);
+    metrics_add(&port->metrics.dev_write_bytes, written);
+    metrics_add(&port->metrics.dev_writes, 1);
     if (buf->pos >= buf->cursize) {
 	buf->pos = 0;
 	buf->cursize = 0;
@@ -1126,7 +2212,7 @@ dev_fd_write(port_info_t *port, struct gbuf *buf)
     if (gbuf_cursize(buf) == 0) {
 	/* We are done writing, turn the reader back on. */
 	enable_all_net_read(port);
-	gensio_set_write_callback_enable(port->io, false);
+	dev_set_write_enable(port, false);
 	port->net_to_dev_state = PORT_WAITING_INPUT;
     }
 }
@@ -1159,7 +2245,7 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
 		   unsigned char *buf, gensiods buflen)
 {
     port_info_t *port = netcon->port;
-    gensiods rv = 0;
+    gensiods rv = 0, written = 0, left;
     char *reason;
     int err;
 
@@ -1180,27 +2266,6 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
 	goto out_shutdown;
     }
 
-    if (buflen > port->net_to_dev.maxsize)
-	buflen = port->net_to_dev.maxsize;
-
-    netcon->bytes_received += buflen;
-
-    if (port->net_monitor != NULL)
-	controller_write(port->net_monitor, (char *) buf, buflen);
-
-    if (port->tw)
-	/* Do write tracing, ignore errors. */
-	do_trace(port, port->tw, buf, buflen, NET);
-    if (port->tb)
-	/* Do both tracing, ignore errors. */
-	do_trace(port, port->tb, buf, buflen, NET);
-
-    memcpy(port->net_to_dev.buf, buf, buflen);
-    port->net_to_dev.cursize = buflen;
-
-    port->net_to_dev.pos = 0;
-
-
     /*
      * Don't write anything to the device until devstr is written.
      * This can happen on UDP ports, we get the first packet before
@@ -1208,34 +2273,62 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
      * but there will also possibly be devstr data.  We want the
      * devstr data to go out first.
      */
-    if (port->devstr)
-	goto stop_read_start_write;
-
-    err = gbuf_write(port, &port->net_to_dev);
-    if (err) {
-	syslog(LOG_ERR, "The dev write for port %s had error: %m",
-	       port->name);
-	shutdown_port(port, "dev write error");
-	goto out_unlock;
-    } else {
+    if (!port->devstr) {
+	/* Write directly from the gensio's buffer, no need to copy. */
+	err = gensio_write(port->io, &written, buf, buflen, NULL);
+	if (err) {
+	    syslog(LOG_ERR, "The dev write for port %s had error: %s",
+		   port->name, gensio_err_to_str(err));
+	    shutdown_port(port, "dev write error");
+	    goto out_unlock;
+	}
+	PROBE4(dev_write, port->name, -1, buflen, written);
+	metrics_add(&port->dev_bytes_sent, written);
+	metrics_add(&port->metrics.dev_write_bytes, written);
+	metrics_add(&port->metrics.dev_writes, 1);
 	if (port->led_tx)
 	    led_flash(port->led_tx);
     }
 
-    if (gbuf_cursize(&port->net_to_dev)) {
-	/* We didn't write all the data, shut off the reader and
-	   start the write monitor. */
-    stop_read_start_write:
+    rv = written;
+    if (written < buflen) {
+	/*
+	 * Save what the device didn't take, as much as will fit.
+	 * gensio will give us the rest again when we re-enable read.
+	 */
+	left = buflen - written;
+	if (left > port->net_to_dev.maxsize)
+	    left = port->net_to_dev.maxsize;
+	memcpy(port->net_to_dev.buf, buf + written, left);
+	port->net_to_dev.cursize = left;
+	port->net_to_dev.pos = 0;
+	rv += left;
+
+	/* Shut off the reader and start the write monitor. */
+	metrics_add(&port->metrics.net_read_stalls, 1);
 	disable_all_net_read(port);
-	gensio_set_write_callback_enable(port->io, true);
+	dev_set_write_enable(port, true);
 	port->net_to_dev_state = PORT_WAITING_OUTPUT_CLEAR;
     }
 
-    reset_timer(netcon);
+    metrics_add(&netcon->bytes_received, rv);
+    metrics_add(&netcon->metrics.read_bytes, rv);
+    metrics_add(&netcon->metrics.reads, 1);
 
-    rv = buflen;
+    if (tap_active(port->taps))
+	tap_send(port->taps, TAP_NET, buf, rv);
+
+    if (port->tw)
+	/* Do write tracing, ignore errors. */
+	do_trace(port, port->tw, netcon, buf, rv, TRACE_REC_NET);
+    if (port->tb)
+	/* Do both tracing, ignore errors. */
+	do_trace(port, port->tb, netcon, buf, rv, TRACE_REC_NET);
+
+    reset_timer(netcon);
 
  out_unlock:
+    PROBE4(net_read, port->name, netcon_index(netcon), buflen, rv);
     so->unlock(port->lock);
     return rv;
 
@@ -1244,26 +2337,32 @@ handle_net_fd_read(net_info_t *netcon, struct gensio *net, int readerr,
     goto out_unlock;
 }
 
+static gensiods
+sg_total(const struct gensio_sg *sg, gensiods sglen)
+{
+    gensiods i, total = 0;
+
+    for (i = 0; i < sglen; i++)
+	total += sg[i].buflen;
+    return total;
+}
+
 /*
- * Write some network data from a buffer.  Returns -1 on something
- * causing the netcon to shut down, 0 if the write was incomplete, and
- * 1 if the write was completed.
+ * Write data to a network connection.  Returns -1 on something
+ * causing the netcon to shut down, 0 otherwise.  The amount written
+ * is returned in count.
  */
 static int
-net_fd_write(port_info_t *port, net_info_t *netcon,
-	     struct gbuf *buf, gensiods *pos)
+net_fd_write_sg(port_info_t *port, net_info_t *netcon,
+		const struct gensio_sg *sg, gensiods sglen, gensiods *count)
 {
-    int reterr, to_send;
-    gensiods count = 0;
-
-    to_send = buf->cursize - *pos;
-    if (to_send <= 0)
-	/* Don't send empty packets, that can confuse UDP clients. */
-	return 1;
+    int reterr;
 
-    /* Can't use buffer send operation here, multiple writers can send
-       from the buffers. */
-    reterr = gensio_write(netcon->net, &count, buf->buf + *pos, to_send, NULL);
+    *count = 0;
+    reterr = gensio_write_sg(netcon->net, count, sg, sglen, NULL);
+    if (PROBE_ENABLED(net_write))
+	PROBE4(net_write, port->name, netcon_index(netcon),
+	       sg_total(sg, sglen), *count);
     if (reterr == GE_REMCLOSE) {
 	shutdown_one_netcon(netcon, "Remote closed");
 	return -1;
@@ -1274,8 +2373,41 @@ net_fd_write(port_info_t *port, net_info_t *netcon,
 	shutdown_one_netcon(netcon, "network write error");
 	return -1;
     }
+    metrics_add(&netcon->bytes_sent, *count);
+    metrics_add(&netcon->metrics.write_bytes, *count);
+    metrics_add(&netcon->metrics.writes, 1);
+
+    return 0;
+}
+
+static int
+net_fd_write_data(port_info_t *port, net_info_t *netcon,
+		  const unsigned char *data, gensiods len, gensiods *count)
+{
+    struct gensio_sg sg = { data, len };
+
+    return net_fd_write_sg(port, netcon, &sg, 1, count);
+}
+
+/*
+ * Write some network data from a buffer.  Returns -1 on something
+ * causing the netcon to shut down, 0 if the write was incomplete, and
+ * 1 if the write was completed.
+ */
+static int
+net_fd_write(port_info_t *port, net_info_t *netcon,
+	     struct gbuf *buf, gensiods *pos)
+{
+    gensiods count;
+
+    if (*pos >= buf->cursize)
+	/* Don't send empty packets, that can confuse UDP clients. */
+	return 1;
+
+    if (net_fd_write_data(port, netcon, buf->buf + *pos, buf->cursize - *pos,
+			  &count))
+	return -1;
     *pos += count;
-    netcon->bytes_sent += count;
 
     if (*pos < buf->cursize)
 	return 0;
@@ -1283,19 +2415,142 @@ net_fd_write(port_info_t *port, net_info_t *netcon,
     return 1;
 }
 
+/*
+ * Write the committed data to a packet connection.  Each write is one
+ * datagram, so the data is cut at max_datagram and a datagram that
+ * wraps in the ring is written with scatter-gather instead of being
+ * split in two.  This keeps writing until the gensio stops taking
+ * datagrams, so a whole send goes out in one write ready callback.
+ */
+static int
+dev_to_net_write_packets(port_info_t *port, net_info_t *netcon)
+{
+    struct rbuf *buf = &port->dev_to_net;
+    struct gensio_sg sg[2];
+    gensiods len, count, sglen;
+
+    while (netcon->write_pos < buf->commit) {
+	len = buf->commit - netcon->write_pos;
+	if (port->max_datagram && len > port->max_datagram)
+	    len = port->max_datagram;
+
+	sg[0].buf = rbuf_data(buf, netcon->write_pos, &sg[0].buflen);
+	sglen = 1;
+	if (sg[0].buflen > len) {
+	    sg[0].buflen = len;
+	} else if (sg[0].buflen < len) {
+	    sg[1].buf = buf->buf;
+	    sg[1].buflen = len - sg[0].buflen;
+	    sglen = 2;
+	}
+
+	if (net_fd_write_sg(port, netcon, sg, sglen, &count))
+	    return -1;
+	netcon->write_pos += count;
+	if (port->latency_stats && count)
+	    latency_netcon_check(port, netcon);
+	if (count < len)
+	    return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Write what is pending for the netcon, the rest of the banner and the
+ * committed data in the dev_to_net ring from the netcon's cursor.  On
+ * a stream this is gathered into one write, so the banner and the
+ * first data share a TLS record and a syscall, and data that wraps in
+ * the ring doesn't take two writes.  Packet connections write the
+ * data as datagrams, the banner must be written before calling this.
+ * Return values are the same as net_fd_write().
+ */
+static int
+dev_to_net_write(port_info_t *port, net_info_t *netcon)
+{
+    struct rbuf *buf = &port->dev_to_net;
+    struct gbuf *banner = netcon->banner;
+    struct gensio_sg sg[3];
+    gensiods sglen = 0, len, count, total, blen = 0;
+    int rv = 1;
+
+    if (netcon->is_packet)
+	return dev_to_net_write_packets(port, netcon);
+
+    if (banner && banner->pos < banner->cursize) {
+	blen = banner->cursize - banner->pos;
+	sg[sglen].buf = banner->buf + banner->pos;
+	sg[sglen++].buflen = blen;
+    }
+    total = blen;
+    if (netcon->write_pos < buf->commit) {
+	total += buf->commit - netcon->write_pos;
+	sg[sglen].buf = rbuf_data(buf, netcon->write_pos, &len);
+	sg[sglen++].buflen = len;
+	if (netcon->write_pos + len < buf->commit) {
+	    /* The data wraps, add the part at the start of the ring. */
+	    sg[sglen].buf = buf->buf;
+	    sg[sglen++].buflen = buf->commit - netcon->write_pos - len;
+	}
+    }
+    if (sglen == 0)
+	return 1;
+
+    if (net_fd_write_sg(port, netcon, sg, sglen, &count))
+	return -1;
+    if (count < total)
+	rv = 0;
+
+    /* The banner went first, the rest of what was written is data. */
+    len = count < blen ? count : blen;
+    if (len) {
+	banner->pos += len;
+	count -= len;
+    }
+    if (count) {
+	netcon->write_pos += count;
+	if (port->latency_stats)
+	    latency_netcon_check(port, netcon);
+    }
+
+    return rv;
+}
+
 static void
 finish_dev_to_net_write(port_info_t *port)
 {
+    gensiods pending;
+
     if (any_net_data_to_write(port))
 	return;
 
-    port->dev_to_net.cursize = 0;
-    port->dev_to_net.pos = 0;
+    if (port->chardelay_mode == CHARDELAY_ADAPTIVE && port->net_send_len)
+	adaptive_drain_done(port);
+
+    dev_to_net_rebase(port);
+
+    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR &&
+		port->net_to_dev_state != PORT_CLOSING) {
+	struct timeval now;
+
+	so->get_monotonic_time(so, &now);
+	metrics_hist_add(&port->metrics.net_send_time,
+			 sub_timeval_us(&now, &port->net_send_start));
+	PROBE3(net_send_done, port->name, -1,
+	       sub_timeval_us(&now, &port->net_send_start));
 
-    if (port->net_to_dev_state != PORT_CLOSING) {
 	/* We are done writing on this port, turn the reader back on. */
-	gensio_set_read_callback_enable(port->io, true);
+	dev_set_read_enable(port, true);
 	port->dev_to_net_state = PORT_WAITING_INPUT;
+
+	/*
+	 * Data that came in during the send goes out now if it is
+	 * ready, otherwise the send timer will get it.
+	 */
+	pending = port->dev_to_net.head - port->dev_to_net.commit;
+	if (pending && (!port->send_timer_running || port->chardelay == 0 ||
+			pending >= port->dev_to_net_bufsize))
+	    start_net_send(port);
     }
 }
 
@@ -1306,10 +2561,12 @@ static void
 handle_net_fd_write_ready(net_info_t *netcon, struct gensio *net)
 {
     port_info_t *port = netcon->port;
+    bool have_data;
     int rv = 1;
 
     so->lock(port->lock);
-    if (netcon->banner) {
+    if (netcon->banner && netcon->is_packet) {
+	/* The banner is a datagram of its own. */
 	rv = net_fd_write(port, netcon, netcon->banner, &netcon->banner->pos);
 	if (rv <= 0)
 	    goto out_unlock;
@@ -1319,13 +2576,21 @@ handle_net_fd_write_ready(net_info_t *netcon, struct gensio *net)
 	netcon->banner = NULL;
     }
 
-    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR) {
-	rv = net_fd_write(port, netcon,
-			  &port->dev_to_net, &netcon->write_pos);
+    have_data = netcon->write_pos < port->dev_to_net.commit;
+    if (netcon->banner || have_data) {
+	rv = dev_to_net_write(port, netcon);
 
 	if (rv == 0)
 	    goto out_unlock;
 
+	if (rv > 0 && netcon->banner) {
+	    free(netcon->banner->buf);
+	    free(netcon->banner);
+	    netcon->banner = NULL;
+	}
+	if (!have_data)
+	    goto out_unlock;
+
 	if (netcon->close_on_output_done) {
 	    netcon->close_on_output_done = false;
 	    shutdown_one_netcon(netcon, "port closing");
@@ -1336,7 +2601,7 @@ handle_net_fd_write_ready(net_info_t *netcon, struct gensio *net)
 
  out_unlock:
     if (rv > 0)
-	gensio_set_write_callback_enable(netcon->net, false);
+	net_set_write_enable(netcon, false);
 
     if (rv >= 0)
 	reset_timer(netcon);
@@ -1693,6 +2958,9 @@ is_device_already_inuse(port_info_t *check_port)
 {
     port_info_t *port = ports;
 
+    if (!check_port->dev_shared)
+	return 0;
+
     while (port != NULL) {
 	if (port != check_port) {
 	    if ((strcmp(port->devname, check_port->devname) == 0)
@@ -2128,32 +3396,46 @@ open_trace_file(port_info_t *port,
                 struct timeval *tv,
                 trace_info_t **out)
 {
-    int rv;
+    int rv, err;
     char *trfile;
 
+    t->q = NULL;
+    t->bin = NULL;
     trfile = process_str_to_str(port, NULL, t->filename, tv, NULL, 1);
     if (!trfile) {
 	syslog(LOG_ERR, "Unable to translate trace file %s", t->filename);
-	t->fd = -1;
 	return;
     }
 
+    if (t->format == TRACE_FORMAT_BINARY) {
+	err = trace_bin_open(trfile, port->trace_file_size, &t->bin);
+	if (err)
+	    syslog(LOG_ERR, "Unable to open binary trace file %s: %s",
+		   trfile, strerror(err));
+	else
+	    *out = t;
+	goto out;
+    }
+
     rv = open(trfile, O_WRONLY | O_CREAT | O_APPEND, 0600);
     if (rv == -1) {
-	char errbuf[128];
-	int err = errno;
+	syslog(LOG_ERR, "Unable to open trace file %s: %s",
+	       trfile, strerror(errno));
+	goto out;
+    }
 
-	if (strerror_r(err, errbuf, sizeof(errbuf)) == -1)
-	    syslog(LOG_ERR, "Unable to open trace file %s: %d",
-		   trfile, err);
-	else
-	    syslog(LOG_ERR, "Unable to open trace file %s: %s",
-		   trfile, errbuf);
+    err = trace_queue_alloc(rv, trfile, port->trace_bufsize,
+			    port->trace_overflow, &t->q);
+    if (err) {
+	syslog(LOG_ERR, "Unable to allocate trace queue for %s: %s",
+	       trfile, strerror(err));
+	close(rv);
+	goto out;
     }
+    *out = t;
 
+ out:
     free(trfile);
-    t->fd = rv;
-    *out = t;
 }
 
 static void
@@ -2197,12 +3479,13 @@ recalc_port_chardelay(port_info_t *port)
     unsigned int bpc = port->bpc + port->stopbits + port->paritybits + 1;
 
     /* delay is (((1 / bps) * bpc) * scale) seconds */
-    if (!port->enable_chardelay) {
+    if (port->chardelay_mode == CHARDELAY_OFF) {
 	port->chardelay = 0;
 	return;
     }
 
     /* We are working in microseconds here. */
+    port->char_usec = (bpc * 1000000) / port->bps;
     port->chardelay = (bpc * 100000 * port->chardelay_scale) / port->bps;
     if (port->chardelay < port->chardelay_min)
 	port->chardelay = port->chardelay_min;
@@ -2213,13 +3496,14 @@ finish_setup_net(port_info_t *port, net_info_t *netcon)
 {
     gensio_set_callback(netcon->net, handle_net_event, netcon);
 
-    gensio_set_read_callback_enable(netcon->net, true);
+    net_set_read_enable(netcon, true);
 
-    gensio_set_write_callback_enable(netcon->net, true);
+    net_set_write_enable(netcon, true);
 
     header_trace(port, netcon);
 
     reset_timer(netcon);
+    port_sched_housekeeping(port);
 }
 
 static void
@@ -2270,14 +3554,72 @@ extract_bps_bpc(port_info_t *port)
     port->bpc = 8;
 }
 
+static void port_startup_done(port_info_t *port, int err, bool skipped);
+static void port_startup_put(port_info_t *port);
+
+/*
+ * The data buffers come from the pool when the device is opened, and
+ * go back to it when the port goes idle, so ports nobody is using
+ * don't hold any.
+ */
+static void
+port_put_bufs(port_info_t *port)
+{
+    if (port->dev_to_net.buf) {
+	bufpool_put(port->dev_to_net.buf, port->dev_to_net.maxsize);
+	port->dev_to_net.buf = NULL;
+    }
+    if (port->net_to_dev.buf) {
+	bufpool_put(port->net_to_dev.buf, port->net_to_dev.maxsize);
+	port->net_to_dev.buf = NULL;
+    }
+}
+
+static int
+port_get_bufs(port_info_t *port)
+{
+    if (!port->dev_to_net.buf) {
+	port->dev_to_net.buf = bufpool_get(port->dev_to_net.maxsize);
+	if (!port->dev_to_net.buf)
+	    return GE_NOMEM;
+    }
+    if (!port->net_to_dev.buf) {
+	port->net_to_dev.buf = bufpool_get(port->net_to_dev.maxsize);
+	if (!port->net_to_dev.buf) {
+	    port_put_bufs(port);
+	    return GE_NOMEM;
+	}
+    }
+    return 0;
+}
+
+/* The memory the port's data buffers take, 0 if it is idle. */
+static gensiods
+port_buf_memory(port_info_t *port)
+{
+    gensiods size = 0;
+
+    if (port->dev_to_net.buf)
+	size += bufpool_size(port->dev_to_net.maxsize);
+    if (port->net_to_dev.buf)
+	size += bufpool_size(port->net_to_dev.maxsize);
+    return size;
+}
+
 static void
 port_dev_open_done(struct gensio *io, int err, void *cb_data)
 {
     port_info_t *port = cb_data;
     net_info_t *netcon;
-    struct timeval timeout;
+    bool startup_done = false;
 
     so->lock(port->lock);
+    if (port->startup_inflight) {
+	/* The last step of starting a connect back port. */
+	port->startup_inflight = false;
+	port_startup_done(port, err, false);
+	startup_done = true;
+    }
     if (err) {
 	char errstr[200];
 
@@ -2291,6 +3633,8 @@ port_dev_open_done(struct gensio *io, int err, void *cb_data)
 	    netcon->net = NULL;
 	}
 	port->dev_to_net_state = PORT_UNCONNECTED;
+	port_put_bufs(port);
+	rotator_port_freed(port);
 	goto out_unlock;
     }
 
@@ -2308,24 +3652,23 @@ port_dev_open_done(struct gensio *io, int err, void *cb_data)
 	port->dev_write_handler = handle_dev_fd_normal_write;
 
     if (port->devstr)
-	gensio_set_write_callback_enable(port->io, true);
-    gensio_set_read_callback_enable(port->io, true);
+	dev_set_write_enable(port, true);
+    dev_set_read_enable(port, true);
     port->dev_to_net_state = PORT_WAITING_INPUT;
 
     setup_trace(port);
 
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    so->start_timer(port->timer, &timeout);
-
     for_each_connection(port, netcon) {
 	if (!netcon->net)
 	    continue;
 	finish_setup_net(port, netcon);
     }
     port->net_to_dev_state = PORT_WAITING_INPUT;
+    port_start_connect_backs(port);
  out_unlock:
     so->unlock(port->lock);
+    if (startup_done)
+	port_startup_put(port);
 }
 
 static int
@@ -2334,9 +3677,15 @@ port_dev_enable(port_info_t *port)
     int err;
     char auxdata[2] = "1";
 
-    err = gensio_open(port->io, port_dev_open_done, port);
+    err = port_get_bufs(port);
     if (err)
 	return err;
+
+    err = gensio_open(port->io, port_dev_open_done, port);
+    if (err) {
+	port_put_bufs(port);
+	return err;
+    }
     port->io_open = true;
 
     err = gensio_control(port->io, GENSIO_CONTROL_DEPTH_ALL, false,
@@ -2355,6 +3704,10 @@ setup_port(port_info_t *port, net_info_t *netcon)
     int err;
     char auxdata[2] = "1";
 
+    /* Only send data that comes in after the connection. */
+    netcon->write_pos = port->dev_to_net.head;
+    netcon->lat_next = port->lat_head;
+
     err = gensio_control(netcon->net, GENSIO_CONTROL_DEPTH_ALL, false,
 			 GENSIO_CONTROL_NODELAY, auxdata, NULL);
     if (err)
@@ -2378,6 +3731,7 @@ setup_port(port_info_t *port, net_info_t *netcon)
 	    gensio_write(netcon->net, NULL, errstr, strlen(errstr), NULL);
 	    gensio_free(netcon->net);
 	    netcon->net = NULL;
+	    rotator_port_freed(port);
 	}
 	return;
     }
@@ -2385,55 +3739,58 @@ setup_port(port_info_t *port, net_info_t *netcon)
     finish_setup_net(port, netcon);
 }
 
-/* Returns with the port locked, if non-NULL. */
-static port_info_t *
-find_rotator_port(const char *portname, struct gensio *net,
-		  unsigned int *netconnum)
+enum rot_port_check {
+    ROT_PORT_FREE,	/* The port can take the connection. */
+    ROT_PORT_BUSY,	/* Not usable until rotator_port_freed() is called. */
+    ROT_PORT_REJECTED	/* Free, but not for this connection. */
+};
+
+/*
+ * See if the port can take the new connection.  Must be called with
+ * the port locked.  The netcon to use is returned in netconnum.
+ */
+static enum rot_port_check
+rot_check_port(port_info_t *port, struct gensio *net, unsigned int *netconnum)
 {
-    port_info_t *port = ports;
+    unsigned int i;
+    struct sockaddr_storage addr;
+    gensiods socklen;
+    int err;
 
-    while (port) {
-	if (strcmp(port->name, portname) == 0) {
-	    unsigned int i;
-	    struct sockaddr_storage addr;
-	    gensiods socklen;
-	    int err;
+    if (!port->enabled)
+	return ROT_PORT_BUSY;
+    if (port->dev_to_net_state == PORT_CLOSING)
+	return ROT_PORT_BUSY;
 
-	    so->lock(port->lock);
-	    if (!port->enabled)
-		goto next;
-	    if (port->dev_to_net_state == PORT_CLOSING)
-		goto next;
-	    socklen = sizeof(addr);
-	    err = gensio_get_raddr(net, &addr, &socklen);
-	    if (err)
-		goto next;
-	    if (!remaddr_check(port->remaddrs,
-			       (struct sockaddr *) &addr, socklen))
-		goto next;
-	    if (port->net_to_dev_state == PORT_UNCONNECTED &&
-		is_device_already_inuse(port))
-		goto next;
-
-	    for (i = 0; i < port->max_connections; i++) {
-		if (!port->netcons[i].net) {
-		    *netconnum = i;
-		    return port;
-		}
-	    }
-	next:
-	    so->unlock(port->lock);
-	}
-	port = port->next;
+    for (i = 0; i < port->max_connections; i++) {
+	if (!port->netcons[i].net)
+	    break;
     }
+    if (i == port->max_connections)
+	return ROT_PORT_BUSY;
 
-    return NULL;
+    socklen = sizeof(addr);
+    err = gensio_get_raddr(net, &addr, &socklen);
+    if (err)
+	return ROT_PORT_REJECTED;
+    if (!remaddr_check(port->remaddrs,
+		       (struct sockaddr *) &addr, socklen))
+	return ROT_PORT_REJECTED;
+    if (port->net_to_dev_state == PORT_UNCONNECTED &&
+	is_device_already_inuse(port))
+	return ROT_PORT_REJECTED;
+
+    *netconnum = i;
+    return ROT_PORT_FREE;
 }
 
 static void
 handle_new_net(port_info_t *port, struct gensio *net, net_info_t *netcon)
 {
     netcon->net = net;
+    netcon->is_packet = gensio_is_packet(net);
+    metrics_add(&port->metrics.accepts, 1);
+    PROBE2(net_accept, port->name, netcon_index(netcon));
 
     /* XXX log netcon->remote */
     setup_port(port, netcon);
@@ -2463,10 +3820,61 @@ do_gensio_log(const char *name, struct gensio_loginfo *i)
     syslog(gensio_log_level_to_syslog(i->level), "%s: %s", name, buf);
 }
 
+enum rotator_policy {
+    ROTATOR_ROUND_ROBIN,
+    ROTATOR_LEAST_RECENTLY_USED,
+    ROTATOR_LEAST_BYTES
+};
+
+static struct gensio_enum_val rotator_policy_enums[] = {
+    { "round-robin", ROTATOR_ROUND_ROBIN },
+    { "least-recently-used", ROTATOR_LEAST_RECENTLY_USED },
+    { "least-bytes", ROTATOR_LEAST_BYTES },
+    { NULL }
+};
+
+#define ROT_NONE UINT_MAX
+#define ROT_MAP_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/*
+ * A rotator's ports, resolved against one port snapshot.  The ports
+ * that may have a free connection are marked in freemap and are on a
+ * list in the order they became free.  A port found to be busy is
+ * dropped and rotator_port_freed() puts it back, so a new connection
+ * doesn't have to look at the busy ports.  Protected by the rotator
+ * lock.
+ */
+struct rot_set {
+    struct rotator *rot;
+    struct port_snap *snap;
+    unsigned int count;
+    port_info_t **ports;	/* NULL if the port wasn't found. */
+    struct rot_member *members;	/* Linked into each port's rot_members. */
+    unsigned long *freemap;
+    unsigned int *free_next;
+    unsigned int *free_prev;
+    unsigned int free_head;
+    unsigned int free_tail;
+    gensiods *bytes;		/* The port's bytes_total, for least-bytes. */
+};
+
+/* Protected by the port lock. */
+struct rot_member {
+    struct rot_set *set;
+    unsigned int idx;
+    struct rot_member *next;
+};
+
 typedef struct rotator
 {
-    /* Rotators use the ports_lock for mutex. */
-    int curr_port;
+    struct gensio_lock *lock;
+
+    /* Held while replacing set, taken before any port lock. */
+    struct gensio_lock *set_lock;
+    struct rot_set *set;
+
+    enum rotator_policy policy;
+    unsigned int curr_port;
     const char **portv;
     int portc;
 
@@ -2482,86 +3890,368 @@ typedef struct rotator
 
 static rotator_t *rotators = NULL;
 
-/* A connection request has come in on a port. */
-static int
-rot_new_con(rotator_t *rot, struct gensio *net)
+static bool
+rot_set_is_free(struct rot_set *set, unsigned int idx)
 {
-    int i;
-    const char *err;
+    return set->freemap[idx / ROT_MAP_BITS] & (1UL << (idx % ROT_MAP_BITS));
+}
 
-    so->lock(ports_lock);
-    i = rot->curr_port;
-    do {
-	unsigned int netconnum = 0;
-	port_info_t *port = find_rotator_port(rot->portv[i], net, &netconnum);
-
-	if (++i >= rot->portc)
-	    i = 0;
-	if (port) {
-	    rot->curr_port = i;
-	    so->unlock(ports_lock);
-	    handle_new_net(port, net, &port->netcons[netconnum]);
-	    so->unlock(port->lock);
-	    return 0;
-	}
-    } while (i != rot->curr_port);
-    so->unlock(ports_lock);
+static void
+rot_set_free_add(struct rot_set *set, unsigned int idx, gensiods bytes)
+{
+    set->bytes[idx] = bytes;
+    if (rot_set_is_free(set, idx))
+	return;
 
-    err = "No free port found\r\n";
-    gensio_write(net, NULL, err, strlen(err), NULL);
-    gensio_free(net);
-    return 0;
+    set->freemap[idx / ROT_MAP_BITS] |= 1UL << (idx % ROT_MAP_BITS);
+    set->free_next[idx] = ROT_NONE;
+    set->free_prev[idx] = set->free_tail;
+    if (set->free_tail == ROT_NONE)
+	set->free_head = idx;
+    else
+	set->free_next[set->free_tail] = idx;
+    set->free_tail = idx;
 }
 
-static int
-handle_rot_child_event(struct gensio_accepter *accepter, void *user_data,
-		       int event, void *data)
+static void
+rot_set_free_del(struct rot_set *set, unsigned int idx)
 {
-    rotator_t *rot = user_data;
+    set->freemap[idx / ROT_MAP_BITS] &= ~(1UL << (idx % ROT_MAP_BITS));
+    if (set->free_prev[idx] == ROT_NONE)
+	set->free_head = set->free_next[idx];
+    else
+	set->free_next[set->free_prev[idx]] = set->free_next[idx];
+    if (set->free_next[idx] == ROT_NONE)
+	set->free_tail = set->free_prev[idx];
+    else
+	set->free_prev[set->free_next[idx]] = set->free_prev[idx];
+}
 
-    if (event == GENSIO_ACC_EVENT_LOG) {
-	do_gensio_log(rot->accstr, data);
-	return 0;
+/* The first free port at or after start, wrapping around. */
+static unsigned int
+rot_set_next_free(struct rot_set *set, unsigned int start)
+{
+    unsigned int nwords = (set->count + ROT_MAP_BITS - 1) / ROT_MAP_BITS;
+    unsigned int w, n, bit;
+    unsigned long word;
+
+    if (start >= set->count)
+	start = 0;
+    w = start / ROT_MAP_BITS;
+    word = set->freemap[w] & (~0UL << (start % ROT_MAP_BITS));
+    for (n = 0; n <= nwords; n++) {
+	if (word) {
+	    for (bit = 0; !(word & (1UL << bit)); bit++)
+		;
+	    return w * ROT_MAP_BITS + bit;
+	}
+	if (++w >= nwords)
+	    w = 0;
+	word = set->freemap[w];
     }
+    return ROT_NONE;
+}
 
-    switch (event) {
-    case GENSIO_ACC_EVENT_NEW_CONNECTION:
-	return rot_new_con(rot, data);
+/* Take the next port to try off the free list, per the policy. */
+static unsigned int
+rot_set_pick(rotator_t *rot, struct rot_set *set)
+{
+    unsigned int idx, i;
+
+    if (set->free_head == ROT_NONE)
+	return ROT_NONE;
+
+    switch (rot->policy) {
+    case ROTATOR_LEAST_RECENTLY_USED:
+	idx = set->free_head;
+	break;
+
+    case ROTATOR_LEAST_BYTES:
+	/* Only the free ports are scanned, ties go to the LRU one. */
+	idx = set->free_head;
+	for (i = set->free_next[idx]; i != ROT_NONE; i = set->free_next[i]) {
+	    if (set->bytes[i] < set->bytes[idx])
+		idx = i;
+	}
+	break;
 
+    case ROTATOR_ROUND_ROBIN:
     default:
-	return handle_acc_auth_event(rot->authdir, event, data);
+	idx = rot_set_next_free(set, rot->curr_port);
+	rot->curr_port = idx + 1;
+	break;
     }
-}
 
-static struct gensio_waiter *rotator_shutdown_wait;
+    rot_set_free_del(set, idx);
+    return idx;
+}
 
+/*
+ * Tell the rotators the port has a free connection.  Must be called
+ * with the port locked.
+ */
 static void
-handle_rot_shutdown_done(struct gensio_accepter *accepter, void *cb_data)
+rotator_port_freed(port_info_t *port)
 {
-    so->wake(rotator_shutdown_wait);
+    struct rot_member *m;
+
+    for (m = port->rot_members; m; m = m->next) {
+	so->lock(m->set->rot->lock);
+	rot_set_free_add(m->set, m->idx, port->bytes_total);
+	so->unlock(m->set->rot->lock);
+    }
 }
 
 static void
-free_rotator(rotator_t *rot)
+free_rot_set(struct rot_set *set)
 {
-    if (rot->accepter) {
-	gensio_acc_shutdown(rot->accepter, handle_rot_shutdown_done, NULL);
-	so->wait(rotator_shutdown_wait, 1, NULL);
-	gensio_acc_free(rot->accepter);
+    struct rot_member **mp;
+    port_info_t *port;
+    unsigned int i;
+
+    for (i = 0; i < set->count; i++) {
+	port = set->ports[i];
+	if (!port)
+	    continue;
+	so->lock(port->lock);
+	for (mp = &port->rot_members; *mp; mp = &(*mp)->next) {
+	    if (*mp == &set->members[i]) {
+		*mp = set->members[i].next;
+		break;
+	    }
+	}
+	so->unlock(port->lock);
     }
-    if (rot->authdir)
-	free(rot->authdir);
-    if (rot->name)
-	free(rot->name);
-    if (rot->accstr)
-	free(rot->accstr);
-    if (rot->portv)
-	gensio_argv_free(so, rot->portv);
-    free(rot);
+    port_snap_put(set->snap);
+    free(set->ports);
+    free(set->members);
+    free(set->freemap);
+    free(set->free_next);
+    free(set->free_prev);
+    free(set->bytes);
+    free(set);
 }
 
-void
-free_rotators(void)
+/*
+ * Resolve the rotator's ports against snap, if that hasn't been done
+ * already.  This only happens after the ports change.
+ */
+static void
+rot_update_set(rotator_t *rot, struct port_snap *snap)
+{
+    struct rot_set *set, *old;
+    port_info_t *port;
+    unsigned int i, count = rot->portc;
+
+    so->lock(rot->lock);
+    old = rot->set;
+    so->unlock(rot->lock);
+    if (old && old->snap == snap)
+	return;
+
+    so->lock(rot->set_lock);
+    if (rot->set != old)
+	/* Someone else got here first. */
+	old = rot->set;
+    if (old && old->snap == snap)
+	goto out_unlock;
+
+    set = calloc(1, sizeof(*set));
+    if (!set)
+	goto out_nomem;
+    set->rot = rot;
+    set->count = count;
+    set->free_head = ROT_NONE;
+    set->free_tail = ROT_NONE;
+    set->ports = calloc(count + 1, sizeof(*set->ports));
+    set->members = calloc(count + 1, sizeof(*set->members));
+    set->freemap = calloc(count / ROT_MAP_BITS + 1, sizeof(*set->freemap));
+    set->free_next = calloc(count + 1, sizeof(*set->free_next));
+    set->free_prev = calloc(count + 1, sizeof(*set->free_prev));
+    set->bytes = calloc(count + 1, sizeof(*set->bytes));
+    if (!set->ports || !set->members || !set->freemap || !set->free_next ||
+		!set->free_prev || !set->bytes) {
+	set->count = 0;
+	free_rot_set(set);
+	goto out_nomem;
+    }
+    set->snap = snap;
+    so->lock(port_snap_lock);
+    snap->refcount++;
+    so->unlock(port_snap_lock);
+
+    /*
+     * Start with every port free, the busy ones get dropped the first
+     * time they are tried.  That way a port freed while this is being
+     * set up can't be missed.
+     */
+    for (i = 0; i < count; i++) {
+	port = port_snap_find(snap, rot->portv[i]);
+	if (!port)
+	    continue;
+	set->ports[i] = port;
+	set->members[i].set = set;
+	set->members[i].idx = i;
+	so->lock(port->lock);
+	set->bytes[i] = port->bytes_total;
+	set->members[i].next = port->rot_members;
+	port->rot_members = &set->members[i];
+	so->unlock(port->lock);
+	rot_set_free_add(set, i, set->bytes[i]);
+    }
+
+    so->lock(rot->lock);
+    rot->set = set;
+    so->unlock(rot->lock);
+    so->unlock(rot->set_lock);
+
+    if (old)
+	free_rot_set(old);
+    return;
+
+ out_nomem:
+    /* Keep using the old ports until the next try. */
+    syslog(LOG_ERR, "Out of memory updating the ports for rotator %s",
+	   rot->name);
+ out_unlock:
+    so->unlock(rot->set_lock);
+}
+
+/* A connection request has come in on a port. */
+static int
+rot_new_con(rotator_t *rot, struct gensio *net)
+{
+    struct port_snap *snap = port_snap_get();
+    port_info_t *port, **rejected = NULL;
+    unsigned int idx, netconnum = 0, nrejected = 0;
+    enum rot_port_check check;
+    bool lock_ports;
+    const char *err;
+
+    if (snap)
+	rot_update_set(rot, snap);
+
+    /*
+     * ports_lock is only needed for is_device_already_inuse(), skip
+     * it if no ports share a device.
+     */
+    lock_ports = snap && snap->dev_shared;
+    if (lock_ports)
+	so->lock(ports_lock);
+    for (;;) {
+	so->lock(rot->lock);
+	idx = ROT_NONE;
+	if (rot->set)
+	    idx = rot_set_pick(rot, rot->set);
+	if (idx == ROT_NONE) {
+	    so->unlock(rot->lock);
+	    break;
+	}
+	port = rot->set->ports[idx];
+	port_ref(port);
+	so->unlock(rot->lock);
+
+	so->lock(port->lock);
+	check = rot_check_port(port, net, &netconnum);
+	if (check == ROT_PORT_FREE) {
+	    handle_new_net(port, net, &port->netcons[netconnum]);
+	    if (rot_check_port(port, net, &netconnum) != ROT_PORT_BUSY)
+		/* Still has room, put it back for the next one. */
+		rotator_port_freed(port);
+	    port_unlock_put(port);
+	    net = NULL;
+	    break;
+	}
+	if (check == ROT_PORT_REJECTED) {
+	    /* Put it back after this connection is handled. */
+	    if (!rejected)
+		rejected = calloc(rot->portc, sizeof(*rejected));
+	    if (!rejected || nrejected >= (unsigned int) rot->portc) {
+		rotator_port_freed(port);
+		port_unlock_put(port);
+		break;
+	    }
+	    rejected[nrejected++] = port;
+	    so->unlock(port->lock);
+	    continue;
+	}
+	port_unlock_put(port);
+    }
+    if (lock_ports)
+	so->unlock(ports_lock);
+
+    while (nrejected > 0) {
+	port = rejected[--nrejected];
+	so->lock(port->lock);
+	rotator_port_freed(port);
+	port_unlock_put(port);
+    }
+    free(rejected);
+    port_snap_put(snap);
+
+    if (net) {
+	err = "No free port found\r\n";
+	gensio_write(net, NULL, err, strlen(err), NULL);
+	gensio_free(net);
+    }
+    return 0;
+}
+
+static int
+handle_rot_child_event(struct gensio_accepter *accepter, void *user_data,
+		       int event, void *data)
+{
+    rotator_t *rot = user_data;
+
+    if (event == GENSIO_ACC_EVENT_LOG) {
+	do_gensio_log(rot->accstr, data);
+	return 0;
+    }
+
+    switch (event) {
+    case GENSIO_ACC_EVENT_NEW_CONNECTION:
+	return rot_new_con(rot, data);
+
+    default:
+	return handle_acc_auth_event(rot->authdir, event, data);
+    }
+}
+
+static struct gensio_waiter *rotator_shutdown_wait;
+
+static void
+handle_rot_shutdown_done(struct gensio_accepter *accepter, void *cb_data)
+{
+    so->wake(rotator_shutdown_wait);
+}
+
+static void
+free_rotator(rotator_t *rot)
+{
+    if (rot->accepter) {
+	gensio_acc_shutdown(rot->accepter, handle_rot_shutdown_done, NULL);
+	so->wait(rotator_shutdown_wait, 1, NULL);
+	gensio_acc_free(rot->accepter);
+    }
+    if (rot->authdir)
+	free(rot->authdir);
+    if (rot->name)
+	free(rot->name);
+    if (rot->accstr)
+	free(rot->accstr);
+    if (rot->set)
+	free_rot_set(rot->set);
+    if (rot->portv)
+	gensio_argv_free(so, rot->portv);
+    if (rot->set_lock)
+	so->free_lock(rot->set_lock);
+    if (rot->lock)
+	so->free_lock(rot->lock);
+    free(rot);
+}
+
+void
+free_rotators(void)
 {
     rotator_t *rot, *next;
 
@@ -2586,6 +4276,18 @@ add_rotator(const char *name, const char *accstr, int portc, const char **ports,
 	return ENOMEM;
     memset(rot, 0, sizeof(*rot));
 
+    rot->lock = so->alloc_lock(so);
+    if (!rot->lock) {
+	free_rotator(rot);
+	return ENOMEM;
+    }
+
+    rot->set_lock = so->alloc_lock(so);
+    if (!rot->set_lock) {
+	free_rotator(rot);
+	return ENOMEM;
+    }
+
     rot->name = strdup(name);
     if (!rot->name) {
 	free_rotator(rot);
@@ -2608,6 +4310,13 @@ add_rotator(const char *name, const char *accstr, int portc, const char **ports,
 	const char *str;
 
 	for (i = 0; options[i]; i++) {
+	    int val;
+
+	    if (gensio_check_keyenum(options[i], "policy",
+				     rotator_policy_enums, &val) > 0) {
+		rot->policy = val;
+		continue;
+	    }
 	    if (gensio_check_keyvalue(options[i], "authdir", &str) > 0) {
 		if (rot->authdir)
 		    free(rot->authdir);
@@ -2630,7 +4339,8 @@ add_rotator(const char *name, const char *accstr, int portc, const char **ports,
     rot->portc = portc;
     rot->portv = ports;
 
-    rv = str_to_gensio_accepter(rot->accstr, so,
+    rv = str_to_gensio_accepter(rot->accstr,
+				ser2net_shard_so(ser2net_shard_by_name(name)),
 				handle_rot_child_event, rot, &rot->accepter);
     if (rv) {
 	syslog(LOG_ERR, "accepter was invalid on line %d", lineno);
@@ -2669,6 +4379,7 @@ kick_old_user(port_info_t *port, net_info_t *netcon, struct gensio *new_net)
 
     /* Wait it to be unconnected and clean, restart the process. */
     netcon->new_net = new_net;
+    metrics_add(&port->metrics.kicks, 1);
 
     shutdown_one_netcon(netcon, err);
 }
@@ -2703,8 +4414,14 @@ port_new_con(port_info_t *port, struct gensio *net)
     unsigned int i, j;
     struct sockaddr_storage addr;
     gensiods socklen;
+    struct port_snap *snap = port_snap_get();
+    bool dev_shared = snap && snap->dev_shared;
 
-    so->lock(ports_lock); /* For is_device_already_inuse() */
+    port_snap_put(snap);
+
+    /* For is_device_already_inuse(), only needed with shared devices. */
+    if (dev_shared)
+	so->lock(ports_lock);
     so->lock(port->lock);
 
     if (port->net_to_dev_state == PORT_CLOSING) {
@@ -2754,8 +4471,10 @@ port_new_con(port_info_t *port, struct gensio *net)
 
     if (err) {
     out_err:
+	metrics_add(&port->metrics.rejects, 1);
 	so->unlock(port->lock);
-	so->unlock(ports_lock);
+	if (dev_shared)
+	    so->unlock(ports_lock);
 	gensio_write(net, NULL, err, strlen(err), NULL);
 	gensio_free(net);
 	return 0;
@@ -2766,7 +4485,8 @@ port_new_con(port_info_t *port, struct gensio *net)
     handle_new_net(port, net, &(port->netcons[i]));
  out:
     so->unlock(port->lock);
-    so->unlock(ports_lock);
+    if (dev_shared)
+	so->unlock(ports_lock);
     return 0;
 }
 
@@ -2819,6 +4539,7 @@ startup_port(struct absout *eout, port_info_t *port)
     }
     port->dev_to_net_state = PORT_UNCONNECTED;
     port->net_to_dev_state = PORT_UNCONNECTED;
+    rotator_port_freed(port);
 
     if (port->has_connect_back) {
 	err = port_dev_enable(port);
@@ -2838,12 +4559,268 @@ startup_port(struct absout *eout, port_info_t *port)
     return err;
 }
 
+/*
+ * Starting a port can be slow, a TLS or SCTP accepter or a USB serial
+ * device that takes a while to open.  So ports are started from their
+ * shard's runner, up to startup-concurrency at a time, instead of one
+ * after another while the config is applied.  When a batch is done
+ * the time it took and the slowest ports are logged.
+ */
+#define STARTUP_SLOWEST 5
+
+static struct gensio_lock *startup_lock;
+static struct gensio_waiter *startup_waiter;
+static port_info_t *startup_q;
+static port_info_t *startup_q_end;
+static port_info_t *startup_unrun; /* Runner couldn't be queued. */
+static unsigned int startup_running;
+static unsigned int startup_outstanding; /* Queue references held. */
+static unsigned int startup_max_running;
+static bool startup_batch_active;
+static struct timeval startup_batch_begin;
+static unsigned int startup_started;
+static unsigned int startup_failed;
+static struct {
+    char name[64];
+    int usecs;
+} startup_slowest[STARTUP_SLOWEST];
+
+static void startup_report(void);
+
+/*
+ * Start as many queued ports as allowed, must be called with
+ * startup_lock held.  A port whose runner can't be queued counts as
+ * failed and goes on startup_unrun, the caller must call
+ * startup_drop_unrun() once it holds no port locks.
+ */
+static void
+startup_kick(void)
+{
+    port_info_t *port;
+    int rv;
+
+    while (startup_q && startup_running < startup_max_running) {
+	port = startup_q;
+	startup_q = port->startup_next;
+	if (!startup_q)
+	    startup_q_end = NULL;
+	port->startup_next = NULL;
+	startup_running++;
+	rv = so->run(port->startup_runner);
+	if (rv) {
+	    startup_running--;
+	    startup_started++;
+	    startup_failed++;
+	    syslog(LOG_ERR, "Unable to start connection %s: %s", port->name,
+		   gensio_err_to_str(rv));
+	    port->startup_next = startup_unrun;
+	    startup_unrun = port;
+	}
+    }
+    if (!startup_q && startup_running == 0 && startup_batch_active) {
+	startup_batch_active = false;
+	startup_report();
+	so->wake(startup_waiter);
+    }
+}
+
+/*
+ * Give up on the ports startup_kick() couldn't run, must be called
+ * without any port locked.
+ */
+static void
+startup_drop_unrun(void)
+{
+    port_info_t *port;
+
+    so->lock(startup_lock);
+    while (startup_unrun) {
+	port = startup_unrun;
+	startup_unrun = port->startup_next;
+	port->startup_next = NULL;
+	so->unlock(startup_lock);
+
+	so->lock(port->lock);
+	port->startup_queued = false;
+	port->enabled = false;
+	so->unlock(port->lock);
+	port_deref(port);
+
+	so->lock(startup_lock);
+	startup_outstanding--;
+    }
+    so->unlock(startup_lock);
+}
+
+/* Must be called with startup_lock held. */
+static void
+startup_report(void)
+{
+    char slow[STARTUP_SLOWEST * 80] = "";
+    struct timeval now;
+    unsigned int i;
+    size_t len = 0;
+    int usecs;
+
+    for (i = 0; i < STARTUP_SLOWEST && startup_slowest[i].name[0]; i++) {
+	len += snprintf(slow + len, sizeof(slow) - len, "%s%s %d.%03ds",
+			i ? ", " : ", slowest: ", startup_slowest[i].name,
+			startup_slowest[i].usecs / 1000000,
+			(startup_slowest[i].usecs / 1000) % 1000);
+	if (len >= sizeof(slow))
+	    break;
+    }
+
+    so->get_monotonic_time(so, &now);
+    usecs = sub_timeval_us(&now, &startup_batch_begin);
+    syslog(LOG_INFO, "Started %u connections in %d.%06d seconds,"
+	   " %u failed%s", startup_started, usecs / 1000000, usecs % 1000000,
+	   startup_failed, slow);
+}
+
+/*
+ * A port is done starting, must be called with the port locked.  The
+ * caller must drop the queue's reference to the port with
+ * port_startup_put() after unlocking it.
+ */
+static void
+port_startup_done(port_info_t *port, int err, bool skipped)
+{
+    struct timeval now;
+    unsigned int i;
+    int usecs;
+
+    so->lock(startup_lock);
+    startup_running--;
+    if (!skipped) {
+	so->get_monotonic_time(so, &now);
+	usecs = sub_timeval_us(&now, &port->startup_begin);
+	for (i = 0; i < STARTUP_SLOWEST; i++) {
+	    if (!startup_slowest[i].name[0] || usecs > startup_slowest[i].usecs)
+		break;
+	}
+	if (i < STARTUP_SLOWEST) {
+	    memmove(startup_slowest + i + 1, startup_slowest + i,
+		    sizeof(startup_slowest[0]) * (STARTUP_SLOWEST - i - 1));
+	    snprintf(startup_slowest[i].name, sizeof(startup_slowest[i].name),
+		     "%s", port->name);
+	    startup_slowest[i].usecs = usecs;
+	}
+	startup_started++;
+	if (err) {
+	    startup_failed++;
+	    syslog(LOG_ERR, "Unable to start connection %s: %s", port->name,
+		   gensio_err_to_str(err));
+	}
+    }
+    startup_kick();
+    so->unlock(startup_lock);
+}
+
+/*
+ * Drop the queue's reference.  Shutdown waits for all of these, the
+ * runners may still be pending for ports that are already off the
+ * port list.
+ */
+static void
+port_startup_put(port_info_t *port)
+{
+    port_deref(port);
+    so->lock(startup_lock);
+    startup_outstanding--;
+    so->unlock(startup_lock);
+    startup_drop_unrun();
+}
+
+static void
+port_startup_run(struct gensio_runner *runner, void *cb_data)
+{
+    port_info_t *port = cb_data;
+    bool skipped = false, done = true;
+    int err = 0;
+
+    so->lock(port->lock);
+    port->startup_queued = false;
+    if (port->deleted || !port->enabled ||
+		port->dev_to_net_state != PORT_CLOSED) {
+	/* Changed while it was waiting. */
+	skipped = true;
+    } else {
+	so->get_monotonic_time(so, &port->startup_begin);
+	port->startup_inflight = port->has_connect_back;
+	err = startup_port(NULL, port);
+	if (err) {
+	    port->enabled = false;
+	    port->startup_inflight = false;
+	}
+	/* A connect back port finishes in port_dev_open_done(). */
+	done = !port->startup_inflight;
+    }
+    if (done)
+	port_startup_done(port, err, skipped);
+    so->unlock(port->lock);
+    if (done)
+	port_startup_put(port);
+}
+
+/*
+ * Queue the port to be started, must be called with the port locked.
+ * The caller must call startup_drop_unrun() after unlocking it.
+ */
+static void
+port_startup_queue(port_info_t *port)
+{
+    if (port->startup_queued || port->startup_inflight)
+	return;
+
+    port_ref(port);
+    port->startup_queued = true;
+    so->lock(startup_lock);
+    startup_outstanding++;
+    if (!startup_batch_active) {
+	startup_batch_active = true;
+	so->get_monotonic_time(so, &startup_batch_begin);
+	startup_started = 0;
+	startup_failed = 0;
+	memset(startup_slowest, 0, sizeof(startup_slowest));
+	startup_max_running = find_default_int("startup-concurrency");
+    }
+    port->startup_next = NULL;
+    if (startup_q_end)
+	startup_q_end->startup_next = port;
+    else
+	startup_q = port;
+    startup_q_end = port;
+    startup_kick();
+    so->unlock(startup_lock);
+}
+
+void
+dataxfer_wait_startup(void)
+{
+    so->lock(startup_lock);
+    while (startup_batch_active) {
+	so->unlock(startup_lock);
+	so->wait(startup_waiter, 1, NULL);
+	so->lock(startup_lock);
+    }
+    so->unlock(startup_lock);
+}
+
 static void
 free_port(port_info_t *port)
 {
     net_info_t *netcon;
     struct port_remaddr *r;
 
+    /*
+     * This waits for a running housekeeping handler, which takes the
+     * port lock while holding the shard's wheel callback lock, so do
+     * it first and never call this with a port lock held.
+     */
+    if (port->wheel)
+	twheel_del_sync(port->wheel, &port->housekeeping);
+
     if (port->netcons) {
 	for_each_connection(port, netcon) {
 	    char *err = "Port was deleted\n\r";
@@ -2854,6 +4831,8 @@ free_port(port_info_t *port)
 	}
     }
 
+    if (port->taps)
+	tap_point_close(port->taps);
     so->free_lock(port->lock);
     while (port->remaddrs) {
 	r = port->remaddrs;
@@ -2864,16 +4843,13 @@ free_port(port_info_t *port)
     }
     if (port->accepter)
 	gensio_acc_free(port->accepter);
-    if (port->dev_to_net.buf)
-	free(port->dev_to_net.buf);
-    if (port->net_to_dev.buf)
-	free(port->net_to_dev.buf);
-    if (port->timer)
-	so->free_timer(port->timer);
+    port_put_bufs(port);
     if (port->send_timer)
 	so->free_timer(port->send_timer);
     if (port->runshutdown)
 	so->free_runner(port->runshutdown);
+    if (port->startup_runner)
+	so->free_runner(port->startup_runner);
     if (port->io)
 	gensio_free(port->io);
     if (port->trace_read.filename)
@@ -2902,17 +4878,42 @@ free_port(port_info_t *port)
 	free(port->closestr);
     if (port->closeon)
 	free(port->closeon);
+    if (port->matcher)
+	matcher_free(port->matcher);
+    if (port->notify_runner)
+	so->free_runner(port->notify_runner);
+    if (port->ctl_runner)
+	so->free_runner(port->ctl_runner);
+    if (port->ctl_lock)
+	so->free_lock(port->ctl_lock);
     if (port->netcons)
 	free(port->netcons);
+    if (port->cfgkey)
+	free(port->cfgkey);
     if (port->orig_devname)
 	free(port->orig_devname);
     free(port);
 }
 
+/*
+ * A reload replaced the port with new, move the monitors and other
+ * taps over so they keep watching it.  Both ports must be locked or
+ * not visible to the data path yet.
+ */
+static void
+port_move_taps(port_info_t *old, port_info_t *new)
+{
+    struct tap_point *tmp = new->taps;
+
+    new->taps = old->taps;
+    old->taps = tmp;
+}
+
 static void
 finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 {
     port_info_t *port = cb_data;
+    net_info_t *netcon;
 
     so->lock(ports_lock);
     so->lock(port->lock);
@@ -2930,9 +4931,19 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 	free(port->devstr);
 	port->devstr = NULL;
     }
-    gbuf_reset(&port->dev_to_net);
-    port->dev_bytes_received = 0;
-    port->dev_bytes_sent = 0;
+    rbuf_reset(&port->dev_to_net);
+    port_put_bufs(port);
+    for_each_connection(port, netcon)
+	netcon->connect_back_retry_at = 0;
+    port->nocon_backoff = 0;
+    port->closeon_seen = false;
+    port->match_state = MATCH_STATE_INIT;
+    port->bytes_total += (metrics_get(&port->dev_bytes_received) +
+			  metrics_get(&port->dev_bytes_sent));
+    metrics_reset(&port->dev_bytes_received);
+    metrics_reset(&port->dev_bytes_sent);
+    port->drain_rate = 0;
+    port->net_send_len = 0;
 
     if (gensio_acc_exit_on_close(port->accepter))
 	/* This was a zero port (for stdin/stdout), this is only
@@ -2946,6 +4957,8 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 
 	new = port->new_config;
 	port->new_config = NULL;
+	if (new)
+	    port_move_taps(port, new);
 
 	prev = NULL;
 	for (curr = ports; curr && curr != port; curr = curr->next)
@@ -2958,13 +4971,7 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 	}
 	so->unlock(port->lock);
 
-	free_port(port);
-
-	/* Start the replacement port if it was set. */
 	if (new) {
-	    int err;
-
-	    so->lock(new->lock);
 	    if (prev) {
 		new->next = prev->next;
 		prev->next = new;
@@ -2972,6 +4979,22 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 		new->next = ports;
 		ports = new;
 	    }
+	}
+	publish_ports();
+
+	/*
+	 * Lookups may still hold a reference to the old port, but free
+	 * the accepter now so the replacement can use its address.
+	 */
+	gensio_acc_free(port->accepter);
+	port->accepter = NULL;
+	port_deref(port);
+
+	/* Start the replacement port if it was set. */
+	if (new) {
+	    int err;
+
+	    so->lock(new->lock);
 	    if (new->enabled) {
 		err = startup_port(NULL, new);
 		if (err)
@@ -2983,6 +5006,8 @@ finish_shutdown_port(struct gensio_runner *runner, void *cb_data)
 	return; /* We have to return here because we no longer have a port. */
     } else {
 	gensio_acc_set_accept_callback_enable(port->accepter, true);
+	if (port->enabled)
+	    rotator_port_freed(port);
     }
     so->unlock(port->lock);
     so->unlock(ports_lock);
@@ -3002,17 +5027,29 @@ shutdown_port_io(port_info_t *port)
 {
     int err = 1;
 
-    if (port->trace_write.fd != -1) {
-	close(port->trace_write.fd);
-	port->trace_write.fd = -1;
+    if (port->trace_write.q) {
+	trace_queue_free(port->trace_write.q);
+	port->trace_write.q = NULL;
+    }
+    if (port->trace_read.q) {
+	trace_queue_free(port->trace_read.q);
+	port->trace_read.q = NULL;
+    }
+    if (port->trace_both.q) {
+	trace_queue_free(port->trace_both.q);
+	port->trace_both.q = NULL;
+    }
+    if (port->trace_write.bin) {
+	trace_bin_close(port->trace_write.bin);
+	port->trace_write.bin = NULL;
     }
-    if (port->trace_read.fd != -1) {
-	close(port->trace_read.fd);
-	port->trace_read.fd = -1;
+    if (port->trace_read.bin) {
+	trace_bin_close(port->trace_read.bin);
+	port->trace_read.bin = NULL;
     }
-    if (port->trace_both.fd != -1) {
-	close(port->trace_both.fd);
-	port->trace_both.fd = -1;
+    if (port->trace_both.bin) {
+	trace_bin_close(port->trace_both.bin);
+	port->trace_both.bin = NULL;
     }
 
     port->tw = port->tr = port->tb = NULL;
@@ -3026,17 +5063,6 @@ shutdown_port_io(port_info_t *port)
     }
 }
 
-static void
-timer_shutdown_done(struct gensio_timer *timer, void *cb_data)
-{
-    port_info_t *port = cb_data;
-
-    so->lock(port->lock);
-    gensio_set_write_callback_enable(port->io, false);
-    shutdown_port_io(port);
-    so->unlock(port->lock);
-}
-
 /* Output any pending data and the devstr buffer. */
 static void
 handle_dev_fd_close_write(port_info_t *port)
@@ -3063,9 +5089,10 @@ handle_dev_fd_close_write(port_info_t *port)
 closeit:
     if (port->shutdown_timeout_count) {
 	port->shutdown_timeout_count = 0;
-	gensio_set_write_callback_enable(port->io, false);
-	if (so->stop_timer_with_done(port->timer, timer_shutdown_done, port))
-	    shutdown_port_io(port);
+	dev_set_write_enable(port, false);
+	/* A running handler will see the count is zero and do nothing. */
+	twheel_del(port->wheel, &port->housekeeping);
+	shutdown_port_io(port);
     }
 }
 
@@ -3083,7 +5110,7 @@ start_shutdown_port_io(port_info_t *port)
     }
     port->devstr = process_str_to_buf(port, NULL, port->closestr);
     port->dev_write_handler = handle_dev_fd_close_write;
-    gensio_set_write_callback_enable(port->io, true);
+    dev_set_write_enable(port, true);
 }
 
 static void
@@ -3097,8 +5124,9 @@ netcon_finish_shutdown(net_info_t *netcon)
     }
 
     netcon->closing = false;
-    netcon->bytes_received = 0;
-    netcon->bytes_sent = 0;
+    metrics_reset(&netcon->bytes_received);
+    metrics_reset(&netcon->bytes_sent);
+    netcon->bytes_skipped = 0;
     netcon->write_pos = 0;
     if (netcon->banner) {
 	free(netcon->banner->buf);
@@ -3107,17 +5135,28 @@ netcon_finish_shutdown(net_info_t *netcon)
     }
 
     check_port_new_net(port, netcon);
+    if (!netcon->net)
+	rotator_port_freed(port);
     if (num_connected_net(port) == 0) {
 	if (port->net_to_dev_state == PORT_CLOSING) {
 	    start_shutdown_port_io(port);
 	} else if (port->has_connect_back && port->enabled) {
-	    /* Leave the device open for connect backs. */
+	    /*
+	     * Leave the device open for connect backs.  A send may
+	     * have been in progress, the next device data starts the
+	     * connect backs again.
+	     */
 	    port->dev_to_net_state = PORT_UNCONNECTED;
 	    port->net_to_dev_state = PORT_UNCONNECTED;
+	    dev_set_read_enable(port, true);
 	} else {
 	    shutdown_port(port, NULL);
 	}
     }
+
+    if (netcon->connect_back && !netcon->net && port->connect_back_persist &&
+		port->enabled && port->net_to_dev_state != PORT_CLOSING)
+	connect_back_retry(port, netcon);
 }
 
 static void
@@ -3139,6 +5178,9 @@ shutdown_one_netcon(net_info_t *netcon, const char *reason)
     if (netcon->closing)
 	return;
 
+    PROBE4(net_close, netcon->port->name, netcon_index(netcon),
+	   metrics_get(&netcon->bytes_received),
+	   metrics_get(&netcon->bytes_sent));
     netcon->write_pos = 0;
     footer_trace(netcon->port, "netcon", reason);
 
@@ -3158,7 +5200,7 @@ shutdown_all_netcons(port_info_t *port)
 	if (netcon->net) {
 	    some_to_close = true;
 	    netcon->close_on_output_done = false;
-	    netcon->write_pos = port->dev_to_net.cursize;
+	    netcon->write_pos = port->dev_to_net.commit;
 	    shutdown_one_netcon(netcon, "port closing");
 	}
     }
@@ -3202,9 +5244,9 @@ accept_read_disabled(struct gensio_accepter *acc, void *cb_data)
 	gensio_acc_set_accept_callback_enable(port->accepter, true);
 	for_each_connection(port, netcon) {
 	    if (netcon->net)
-		gensio_set_read_callback_enable(netcon->net, true);
+		net_set_read_enable(netcon, true);
 	}
-	gensio_set_read_callback_enable(port->io, true);
+	dev_set_read_enable(port, true);
 	goto out_unlock;
     }
 
@@ -3212,6 +5254,8 @@ accept_read_disabled(struct gensio_accepter *acc, void *cb_data)
 
     /* FIXME - this should be calculated somehow, not a raw number .*/
     port->shutdown_timeout_count = 4;
+    port->shutdown_deadline = twheel_now(port->wheel) + 4;
+    port_sched_housekeeping(port);
 
     if (port->shutdown_reason)
 	footer_trace(port, "port", port->shutdown_reason);
@@ -3234,8 +5278,7 @@ accept_read_disabled(struct gensio_accepter *acc, void *cb_data)
 		netcon->new_net = NULL;
 	    }
 
-	    if (port->dev_to_net_state == PORT_WAITING_OUTPUT_CLEAR &&
-			netcon->write_pos < port->dev_to_net.cursize)
+	    if (netcon->write_pos < port->dev_to_net.commit)
 		/* Net has data to send, wait until it's done. */
 		netcon->close_on_output_done = true;
 	    else
@@ -3281,6 +5324,9 @@ shutdown_port(port_info_t *port, const char *errreason)
 		port->shutdown_started)
 	return GE_INUSE;
 
+    PROBE4(port_shutdown, port->name, -1,
+	   metrics_get(&port->dev_bytes_received),
+	   metrics_get(&port->dev_bytes_sent));
     port->shutdown_reason = errreason;
     if (errreason)
 	/* It's an error, force a shutdown.  Don't set dev_to_net_state yet. */
@@ -3295,60 +5341,100 @@ shutdown_port(port_info_t *port, const char *errreason)
 
     for_each_connection(port, netcon) {
 	if (netcon->net)
-	    gensio_set_read_callback_enable(netcon->net, false);
+	    net_set_read_enable(netcon, false);
     }
-    gensio_set_read_callback_enable(port->io, false);
+    dev_set_read_enable(port, false);
     return 0;
 }
 
-void
-got_timeout(struct gensio_timer *timer, void *data)
+/*
+ * Put the port in the wheel for its next deadline, or take it out if
+ * it doesn't have one.  Must be called with the port locked whenever
+ * a deadline is set.
+ */
+static void
+port_sched_housekeeping(port_info_t *port)
 {
-    port_info_t *port = (port_info_t *) data;
-    struct timeval timeout;
+    unsigned long next = 0, t;
+    net_info_t *netcon;
+
+    if (port->dev_to_net_state == PORT_CLOSING) {
+	if (port->shutdown_timeout_count)
+	    next = port->shutdown_deadline;
+	goto out;
+    }
+
+    if (port->nocon_read_enable_at)
+	next = port->nocon_read_enable_at;
+
+    for_each_connection(port, netcon) {
+	t = netcon->connect_back_retry_at;
+	if (t && (!next || t < next))
+	    next = t;
+    }
+
+    if (port->timeout) {
+	for_each_connection(port, netcon) {
+	    if (!netcon->net)
+		continue;
+	    t = netcon->last_active + port->timeout + 1;
+	    if (!next || t < next)
+		next = t;
+	}
+    }
+
+ out:
+    if (next)
+	twheel_add(port->wheel, &port->housekeeping, next);
+    else
+	twheel_del(port->wheel, &port->housekeeping);
+}
+
+static void
+port_housekeeping(struct twheel_entry *e, void *data)
+{
+    port_info_t *port = data;
+    unsigned long now = twheel_now(port->wheel);
     net_info_t *netcon;
+    bool retry;
 
     so->lock(port->lock);
 
     if (port->dev_to_net_state == PORT_CLOSING) {
-	if (port->shutdown_timeout_count <= 1) {
-	    int count = port->shutdown_timeout_count;
-	    bool dotimer = false;
-
+	if (port->shutdown_timeout_count && now >= port->shutdown_deadline) {
 	    port->shutdown_timeout_count = 0;
-	    if (count == 1)
-		dotimer = handle_shutdown_timeout(port);
-	    so->unlock(port->lock);
-	    if (dotimer)
-		goto out;
-	    return;
-	} else {
-	    port->shutdown_timeout_count--;
-	    goto out;
+	    handle_shutdown_timeout(port);
 	}
+	goto out;
     }
 
-    if (port->nocon_read_enable_time_left) {
-	port->nocon_read_enable_time_left--;
-	if (port->nocon_read_enable_time_left == 0)
-	    gensio_set_read_callback_enable(port->io, true);
-	goto out;
+    if (port->nocon_read_enable_at && now >= port->nocon_read_enable_at) {
+	port->nocon_read_enable_at = 0;
+	dev_set_read_enable(port, true);
+    }
+
+    retry = false;
+    for_each_connection(port, netcon) {
+	if (netcon->connect_back_retry_at &&
+		now >= netcon->connect_back_retry_at) {
+	    netcon->connect_back_retry_at = 0;
+	    retry = true;
+	}
     }
+    if (retry)
+	port_start_connect_backs(port);
 
     if (port->timeout && port_in_use(port)) {
 	for_each_connection(port, netcon) {
 	    if (!netcon->net)
 		continue;
-	    netcon->timeout_left--;
-	    if (netcon->timeout_left < 0)
+	    if (now - netcon->last_active > port->timeout)
 		shutdown_one_netcon(netcon, "timeout");
 	}
     }
 
  out:
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    so->start_timer(port->timer, &timeout);
+    port_sched_housekeeping(port);
     so->unlock(port->lock);
 }
 
@@ -3432,6 +5518,25 @@ matchstr(const char *parms[], const char *c, const char **newval)
     return false;
 }
 
+/* Add a logon or notifyon pattern to the port. */
+static int
+port_add_pattern(port_info_t *port, struct absout *eout, const char *what,
+		 const char *val, unsigned int actions)
+{
+    int err = GE_NOMEM;
+
+    if (!port->matcher)
+	port->matcher = matcher_alloc();
+    if (port->matcher)
+	err = matcher_add(port->matcher, val, strlen(val), actions);
+    if (err) {
+	eout->out(eout, "Unable to add %s pattern %s: %s", what, val,
+		  gensio_err_to_str(err));
+	return -1;
+    }
+    return 0;
+}
+
 static int
 myconfig(port_info_t *port, struct absout *eout, const char *pos)
 {
@@ -3483,6 +5588,22 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
     } else if (gensio_check_keyvalue(pos, "tb", &val) > 0) {
 	/* trace both directions. */
 	port->trace_both.filename = find_tracefile(val);
+    } else if (gensio_check_keyds(pos, "trace-bufsize",
+				  &port->trace_bufsize) > 0) {
+	if (port->trace_bufsize < 1024)
+	    port->trace_bufsize = 1024;
+    } else if (gensio_check_keyenum(pos, "trace-overflow",
+				    trace_overflow_enums, &rv) > 0) {
+	port->trace_overflow = rv;
+    } else if (gensio_check_keyenum(pos, "trace-format",
+				    trace_format_enums, &rv) > 0) {
+	port->trace_read.format = rv;
+	port->trace_write.format = rv;
+	port->trace_both.format = rv;
+    } else if (gensio_check_keyds(pos, "trace-file-size",
+				  &port->trace_file_size) > 0) {
+	if (port->trace_file_size < 4096)
+	    port->trace_file_size = 4096;
     } else if (gensio_check_keyvalue(pos, "led-rx", &val) > 0) {
 	/* LED for UART RX traffic */
 	port->led_rx = find_led(val);
@@ -3499,18 +5620,43 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 	}
     } else if (gensio_check_keybool(pos, "telnet-brk-on-sync",
 				    &port->telnet_brk_on_sync) > 0) {
-    } else if (gensio_check_keybool(pos, "chardelay",
-				    &port->enable_chardelay) > 0) {
+    } else if (strcmp(pos, "chardelay") == 0) {
+	port->chardelay_mode = CHARDELAY_ON;
+    } else if (gensio_check_keyenum(pos, "chardelay", chardelay_enums,
+				    &rv) > 0) {
+	port->chardelay_mode = rv;
+    } else if (gensio_check_keyuint(pos, "thread", &port->shard) > 0) {
+	port->shard_set = true;
     } else if (gensio_check_keyuint(pos, "chardelay-scale",
 				   &port->chardelay_scale) > 0) {
     } else if (gensio_check_keyuint(pos, "chardelay-min",
 				   &port->chardelay_min) > 0) {
     } else if (gensio_check_keyuint(pos, "chardelay-max",
 				   &port->chardelay_max) > 0) {
+    } else if (gensio_check_keyuint(pos, "chardelay-target",
+				   &port->chardelay_target) > 0) {
     } else if (gensio_check_keyds(pos, "dev-to-net-bufsize",
-				  &port->dev_to_net.maxsize) > 0) {
-	if (port->dev_to_net.maxsize < 2)
-	    port->dev_to_net.maxsize = 2;
+				  &port->dev_to_net_bufsize) > 0) {
+	if (port->dev_to_net_bufsize < 2)
+	    port->dev_to_net_bufsize = 2;
+    } else if (gensio_check_keyds(pos, "max-datagram-size",
+				  &port->max_datagram) > 0) {
+    } else if (gensio_check_keybool(pos, "dev-to-net-double-buffer",
+				    &port->dev_to_net_double_buffer) > 0) {
+    } else if (gensio_check_keybool(pos, "dev-to-net-direct",
+				    &port->dev_to_net_direct) > 0) {
+    } else if (gensio_check_keybool(pos, "connect-back-persist",
+				    &port->connect_back_persist) > 0) {
+    } else if (gensio_check_keyuint(pos, "connect-back-retry-min",
+				    &port->connect_back_retry_min) > 0) {
+	if (port->connect_back_retry_min < 1)
+	    port->connect_back_retry_min = 1;
+    } else if (gensio_check_keyuint(pos, "connect-back-retry-max",
+				    &port->connect_back_retry_max) > 0) {
+	if (port->connect_back_retry_max < 1)
+	    port->connect_back_retry_max = 1;
+    } else if (gensio_check_keybool(pos, "latency-stats",
+				    &port->latency_stats) > 0) {
     } else if (gensio_check_keyds(pos, "net-to-dev-bufsize",
 				  &port->net_to_dev.maxsize) > 0) {
 	if (port->net_to_dev.maxsize < 2)
@@ -3519,6 +5665,9 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 				   &port->max_connections) > 0) {
 	if (port->max_connections < 1)
 	    port->max_connections = 1;
+    } else if (gensio_check_keyenum(pos, "laggard-policy",
+				    laggard_policy_enums, &rv) > 0) {
+	port->laggard_policy = rv;
     } else if (gensio_check_keyvalue(pos, "authdir", &val) > 0) {
 	fval = strdup(val);
 	if (!fval) {
@@ -3571,6 +5720,13 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
 	if (port->closeon)
 	    free(port->closeon);
 	port->closeon = fval;
+	port->closeon_len = strlen(fval);
+    } else if (gensio_check_keyvalue(pos, "logon", &val) > 0) {
+	if (port_add_pattern(port, eout, "logon", val, MATCH_LOG))
+	    return -1;
+    } else if (gensio_check_keyvalue(pos, "notifyon", &val) > 0) {
+	if (port_add_pattern(port, eout, "notifyon", val, MATCH_NOTIFY))
+	    return -1;
     } else if (gensio_check_keyvalue(pos, "signature", &val) > 0) {
 	fval = strdup(val);
 	if (!fval) {
@@ -3613,7 +5769,7 @@ myconfig(port_info_t *port, struct absout *eout, const char *pos)
     } else if (strcmp(pos, "-telnet_brk_on_sync") == 0) {
 	port->telnet_brk_on_sync = 0;
     } else if (strcmp(pos, "-chardelay") == 0) {
-	port->enable_chardelay = false;
+	port->chardelay_mode = CHARDELAY_OFF;
 
     /* Banner and friend handling. */
     } else if ((s = find_str(pos, &stype, &len))) {
@@ -3660,6 +5816,52 @@ process_remaddr(struct absout *eout, port_info_t *port, struct port_remaddr *r)
 		  " for the max-connections given");
 }
 
+/*
+ * Save everything that went into making the port, and a hash of the
+ * defaults and other things from the config it used (see
+ * config_context_begin()), so a reload can tell if anything changed.
+ * The strings keep their terminating nils so they stay apart.
+ */
+static int
+port_set_config_key(port_info_t *port, const char *name, const char *accstr,
+		    const char *state, unsigned int timeout,
+		    const char *devname, const char * const *devcfg)
+{
+    char head[40];
+    const char *strs[5];
+    size_t len, pos;
+    unsigned int i, nstrs = 0;
+
+    snprintf(head, sizeof(head), "%016llx %u",
+	     (unsigned long long) config_context_end(), timeout);
+    strs[nstrs++] = head;
+    strs[nstrs++] = name;
+    strs[nstrs++] = accstr;
+    strs[nstrs++] = state ? state : "";
+    strs[nstrs++] = devname ? devname : "";
+
+    len = 0;
+    for (i = 0; i < nstrs; i++)
+	len += strlen(strs[i]) + 1;
+    for (i = 0; devcfg && devcfg[i]; i++)
+	len += strlen(devcfg[i]) + 1;
+
+    port->cfgkey = malloc(len);
+    if (!port->cfgkey)
+	return GE_NOMEM;
+    pos = 0;
+    for (i = 0; i < nstrs; i++) {
+	strcpy(port->cfgkey + pos, strs[i]);
+	pos += strlen(strs[i]) + 1;
+    }
+    for (i = 0; devcfg && devcfg[i]; i++) {
+	strcpy(port->cfgkey + pos, devcfg[i]);
+	pos += strlen(devcfg[i]) + 1;
+    }
+    port->cfgkey_len = len;
+    return 0;
+}
+
 /* Create a port based on a set of parameters passed in. */
 int
 portconfig(struct absout *eout,
@@ -3680,7 +5882,7 @@ portconfig(struct absout *eout,
     struct port_remaddr *r;
 
     so->lock(ports_lock);
-    curr = new_ports;
+    curr = new_ports_hash[port_name_hash(name) % NEW_PORTS_HASH_SIZE];
     while (curr) {
 	if (strcmp(curr->name, name) == 0) {
 	    /* We don't allow duplicate names. */
@@ -3688,7 +5890,7 @@ portconfig(struct absout *eout,
 	    eout->out(eout, "Duplicate connection name: %s", name);
 	    return -1;
 	}
-	curr = curr->next;
+	curr = curr->new_hnext;
     }
     so->unlock(ports_lock);
 
@@ -3698,6 +5900,7 @@ portconfig(struct absout *eout,
 	return -1;
     }
     memset(new_port, 0, sizeof(*new_port));
+    new_port->refcount = 1;
 
     new_port->lock = so->alloc_lock(so);
     if (!new_port->lock) {
@@ -3705,22 +5908,20 @@ portconfig(struct absout *eout,
 	goto errout;
     }
 
-    new_port->timer = so->alloc_timer(so, got_timeout, new_port);
-    if (!new_port->timer) {
-	eout->out(eout, "Could not allocate timer data");
+    new_port->ctl_lock = so->alloc_lock(so);
+    if (!new_port->ctl_lock) {
+	eout->out(eout, "Could not allocate lock");
 	goto errout;
     }
 
-    new_port->send_timer = so->alloc_timer(so, send_timeout, new_port);
-    if (!new_port->send_timer) {
-	eout->out(eout, "Could not allocate timer data");
+    new_port->taps = tap_point_alloc();
+    if (!new_port->taps) {
+	eout->out(eout, "Could not allocate tap point");
 	goto errout;
     }
 
-    new_port->runshutdown = so->alloc_runner(so, finish_shutdown_port,
-					     new_port);
-    if (!new_port->runshutdown)
-	goto errout;
+    /* Record what the port looks up, for port_set_config_key(). */
+    config_context_begin();
 
     new_port->devname = find_str(devname, &str_type, NULL);
     if (new_port->devname) {
@@ -3788,6 +5989,68 @@ portconfig(struct absout *eout,
 	    goto errout;
     }
 
+    if (new_port->closeon && new_port->closeon_len > 0) {
+	if (!new_port->matcher)
+	    new_port->matcher = matcher_alloc();
+	err = GE_NOMEM;
+	if (new_port->matcher)
+	    err = matcher_add(new_port->matcher, new_port->closeon,
+			      new_port->closeon_len, MATCH_CLOSE);
+	if (err) {
+	    eout->out(eout, "Unable to use closeon: %s",
+		      gensio_err_to_str(err));
+	    goto errout;
+	}
+    }
+    if (new_port->matcher && matcher_compile(new_port->matcher)) {
+	eout->out(eout, "Out of memory compiling the device patterns");
+	goto errout;
+    }
+
+    /* Everything that runs the port goes into the port's shard. */
+    if (!new_port->shard_set)
+	new_port->shard = ser2net_shard_by_name(new_port->name);
+    new_port->shard %= ser2net_num_shards;
+    new_port->shard_so = ser2net_shard_so(new_port->shard);
+
+    new_port->wheel = port_wheels[new_port->shard];
+    twheel_entry_init(&new_port->housekeeping, port_housekeeping, new_port);
+
+    new_port->send_timer = new_port->shard_so->alloc_timer(new_port->shard_so,
+							   send_timeout,
+							   new_port);
+    if (!new_port->send_timer) {
+	eout->out(eout, "Could not allocate timer data");
+	goto errout;
+    }
+
+    new_port->runshutdown =
+	new_port->shard_so->alloc_runner(new_port->shard_so,
+					 finish_shutdown_port, new_port);
+    if (!new_port->runshutdown)
+	goto errout;
+
+    new_port->startup_runner =
+	new_port->shard_so->alloc_runner(new_port->shard_so,
+					 port_startup_run, new_port);
+    if (!new_port->startup_runner)
+	goto errout;
+
+    new_port->ctl_runner =
+	new_port->shard_so->alloc_runner(new_port->shard_so,
+					 port_ctl_run, new_port);
+    if (!new_port->ctl_runner)
+	goto errout;
+
+    if (new_port->matcher &&
+		matcher_actions(new_port->matcher) & MATCH_NOTIFY) {
+	new_port->notify_runner =
+	    new_port->shard_so->alloc_runner(new_port->shard_so,
+					     port_notify_run, new_port);
+	if (!new_port->notify_runner)
+	    goto errout;
+    }
+
     if (write_only) {
 	err = strdupcat(&new_port->devname, "WRONLY");
 	if (err) {
@@ -3806,15 +6069,15 @@ portconfig(struct absout *eout,
 	}
     }
 
-    err = str_to_gensio(new_port->devname, so, handle_dev_event, new_port,
-			&new_port->io);
+    err = str_to_gensio(new_port->devname, new_port->shard_so,
+			handle_dev_event, new_port, &new_port->io);
     if (err) {
 	eout->out(eout, "device configuration %s invalid: %s",
 		  new_port->devname, gensio_err_to_str(err));
 	goto errout;
     }
 
-    err = str_to_gensio_accepter(new_port->accstr, so,
+    err = str_to_gensio_accepter(new_port->accstr, new_port->shard_so,
 				handle_port_child_event, new_port,
 				&new_port->accepter);
     if (err) {
@@ -3829,7 +6092,7 @@ portconfig(struct absout *eout,
 	if (new_port->allow_2217)
 	    str = "telnet(rfc2217=true)";
 	err = str_to_gensio_accepter_child(new_port->accepter, str,
-					   so,
+					   new_port->shard_so,
 					   handle_port_child_event,
 					   new_port, &parent);
 	if (err)
@@ -3837,17 +6100,9 @@ portconfig(struct absout *eout,
 	new_port->accepter = parent;
     }
 
-    if (gbuf_init(&new_port->dev_to_net, new_port->dev_to_net.maxsize))
-    {
-	eout->out(eout, "Could not allocate dev to net buffer");
-	goto errout;
-    }
-
-    if (gbuf_init(&new_port->net_to_dev, new_port->net_to_dev.maxsize))
-    {
-	eout->out(eout, "Could not allocate net to dev buffer");
-	goto errout;
-    }
+    rbuf_init(&new_port->dev_to_net,
+	      new_port->dev_to_net_bufsize *
+	      (new_port->dev_to_net_double_buffer ? 2 : 1));
 
     /*
      * Don't handle the remaddr default until here, we don't want to
@@ -3879,32 +6134,143 @@ portconfig(struct absout *eout,
     for (r = new_port->remaddrs; r; r = r->next)
 	process_remaddr(eout, new_port, r);
 
+    if (port_set_config_key(new_port, name, accstr, state, timeout,
+			    devname, devcfg)) {
+	eout->out(eout, "Could not allocate port config key");
+	goto errout;
+    }
+
     /* Link it on the end of new_ports for now. */
     if (new_ports_end)
 	new_ports_end->next = new_port;
     else
 	new_ports = new_port;
     new_ports_end = new_port;
+    i = port_name_hash(new_port->name) % NEW_PORTS_HASH_SIZE;
+    new_port->new_hnext = new_ports_hash[i];
+    new_ports_hash[i] = new_port;
 
     return 0;
 
 errout:
+    config_context_end();
     free_port(new_port);
     return -1;
 }
 
+static int
+port_name_cmp(const void *a, const void *b)
+{
+    const port_info_t *pa = *(const port_info_t **) a;
+    const port_info_t *pb = *(const port_info_t **) b;
+
+    return strcmp(pa->name, pb->name);
+}
+
+/* Find a current port by name, index may be NULL if it couldn't be made. */
+static port_info_t *
+reload_find_port(port_info_t **index, unsigned int count, const char *name)
+{
+    unsigned int lo = 0, hi = count, mid;
+    port_info_t *port;
+    int c;
+
+    if (!index) {
+	for (port = ports; port; port = port->next) {
+	    if (strcmp(port->name, name) == 0)
+		return port;
+	}
+	return NULL;
+    }
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	c = strcmp(name, index[mid]->name);
+	if (c == 0)
+	    return index[mid];
+	if (c < 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return NULL;
+}
+
+/* Does the new config for a port match what it is running with? */
+static bool
+port_config_same(port_info_t *old, port_info_t *new)
+{
+    return !old->deleted && !old->config_changed &&
+	old->cfgkey && new->cfgkey &&
+	old->cfgkey_len == new->cfgkey_len &&
+	memcmp(old->cfgkey, new->cfgkey, new->cfgkey_len) == 0;
+}
+
+static void
+reload_append(port_info_t **list, port_info_t **end, port_info_t *port)
+{
+    port->next = NULL;
+    if (*end)
+	(*end)->next = port;
+    else
+	*list = port;
+    *end = port;
+}
+
+/*
+ * Switch to the ports in new_ports.  Only ports whose config changed
+ * are touched, a port with the same config, defaults, and strings as
+ * before is left running as it is, accepter and all.
+ */
 void
 apply_new_ports(void)
 {
-    port_info_t *new, *curr, *next, *prev, *new_prev;
-    int err;
+    port_info_t *new, *curr, *next, *list = NULL, *list_end = NULL;
+    port_info_t *old_new = NULL;
+    port_info_t *nuke = NULL, **index = NULL;
+    unsigned int nports = 0, i;
+    unsigned int nkept = 0, nchanged = 0, nadded = 0, nremoved = 0;
+    struct timeval start, end;
+    long usecs;
 
+    so->get_monotonic_time(so, &start);
     so->lock(ports_lock);
-    /* First turn off all the accepters. */
+
+    for (curr = ports; curr; curr = curr->next) {
+	curr->reload_match = NULL;
+	curr->reload_keep = false;
+	nports++;
+    }
+    if (nports) {
+	index = malloc(sizeof(*index) * nports);
+	if (index) {
+	    for (i = 0, curr = ports; curr; curr = curr->next)
+		index[i++] = curr;
+	    qsort(index, nports, sizeof(*index), port_name_cmp);
+	} else {
+	    syslog(LOG_WARNING, "Out of memory indexing ports for reload,"
+		   " this may be slow");
+	}
+    }
+
+    /* Pair up the new ports with the old ones and see what changed. */
+    for (new = new_ports; new; new = new->next) {
+	curr = reload_find_port(index, nports, new->name);
+	new->reload_match = curr;
+	if (!curr)
+	    continue;
+	curr->reload_match = new;
+	so->lock(curr->lock);
+	curr->reload_keep = port_config_same(curr, new);
+	so->unlock(curr->lock);
+    }
+    free(index);
+
+    /* Turn off the accepters of the ports that are changing or going. */
     for (curr = ports; curr; curr = curr->next) {
 	int err;
 
-	if (curr->deleted)
+	if (curr->deleted || curr->reload_keep || curr->startup_queued)
 	    continue;
 
 	if (curr->enabled) {
@@ -3926,83 +6292,98 @@ apply_new_ports(void)
 	}
     }
 
-    /* At this point we can't get any new accepts. */
+    /* At this point we can't get any new accepts on changing ports. */
+
+    /* Old ports without a new config go away. */
+    for (curr = ports; curr; curr = next) {
+	next = curr->next;
+	if (!curr->reload_match) {
+	    curr->next = nuke;
+	    nuke = curr;
+	    nremoved++;
+	}
+    }
+
+    /* Build the new list in the order of the new config. */
+    for (new = new_ports; new; new = next) {
+	next = new->next;
+	curr = new->reload_match;
+	if (!curr) {
+	    reload_append(&list, &list_end, new);
+	    nadded++;
+	    continue;
+	}
 
-    /*
-     * See if the port already exists, and link it to this port.  We
-     * put the old port in the new port's place for now.
-     */
-    for (new_prev = NULL, new = new_ports; new;
-			new_prev = new, new = new->next) {
 	so->lock(new->lock);
-	for (prev = NULL, curr = ports; curr; prev = curr, curr = curr->next) {
-	    so->lock(curr->lock);
-	    if (strcmp(curr->name, new->name) == 0) {
-		if (port_in_use(curr)) {
-		    /* If we are disabling, kick off old users. */
-		    if (!new->enabled && curr->enabled)
-			shutdown_all_netcons(curr);
-		} else {
-		    if (strcmp(curr->accstr, new->accstr) == 0 &&
-					curr->enabled) {
-			/*
-			 * Accepter didn't change and was on, just
-			 * move it over.  This avoid issues with a
-			 * connection coming in during a reconfig.
-			 */
-			struct gensio_accepter *tmp;
-			tmp = new->accepter;
-			new->accepter = curr->accepter;
-			new->accepter_stopped = true;
-			curr->accepter = tmp;
-			curr->accepter_stopped = false;
-			gensio_acc_set_user_data(curr->accepter, curr);
-			gensio_acc_set_user_data(new->accepter, new);
-		    }
-		    /* Just let the old one get deleted. */
-		    so->unlock(curr->lock);
-		    break;
-		}
+	so->lock(curr->lock);
+	if (curr->reload_keep) {
+	    /*
+	     * Nothing changed, leave the old port running.  The LEDs
+	     * are looked up again on every read, so take the new ones.
+	     */
+	    curr->led_rx = new->led_rx;
+	    curr->led_tx = new->led_tx;
+	    reload_append(&list, &list_end, curr);
+	    so->unlock(curr->lock);
+	    so->unlock(new->lock);
+	    free_port(new);
+	    nkept++;
+	    continue;
+	}
 
-		/* We are reconfiguring this port. */
-		if (curr->new_config)
-		    free_port(curr->new_config);
-		curr->new_config = new;
+	nchanged++;
+	if (port_in_use(curr)) {
+	    /* If we are disabling, kick off old users. */
+	    if (!new->enabled && curr->enabled)
+		shutdown_all_netcons(curr);
 
+	    /*
+	     * We are reconfiguring this port when the users leave.
+	     * A previous pending config is freed after the locks are
+	     * released, see free_port().
+	     */
+	    old_new = curr->new_config;
+	    curr->new_config = new;
+	    gensio_acc_disable(curr->accepter);
+	    curr->deleted = true;
+	    reload_append(&list, &list_end, curr);
+	} else {
+	    if (strcmp(curr->accstr, new->accstr) == 0 && curr->enabled &&
+			!curr->startup_queued) {
 		/*
-		 * Put the current entry into the place of the new entry
-		 * in the new_ports array.
+		 * Accepter didn't change and was on, just move it
+		 * over.  This avoid issues with a connection coming
+		 * in during a reconfig.
 		 */
-		if (prev)
-		    prev->next = curr->next;
-		else
-		    ports = curr->next;
-
-		curr->next = new->next;
-		if (new_prev)
-		    new_prev->next = curr;
-		else
-		    new_ports = curr;
-
-		if (new_ports_end == new)
-		    new_ports_end = curr;
-
-		gensio_acc_disable(curr->accepter);
-		curr->deleted = true;
-		so->unlock(new->lock);
-		new = curr;
-		break;
+		struct gensio_accepter *tmp;
+		tmp = new->accepter;
+		new->accepter = curr->accepter;
+		new->accepter_stopped = true;
+		curr->accepter = tmp;
+		curr->accepter_stopped = false;
+		gensio_acc_set_user_data(curr->accepter, curr);
+		gensio_acc_set_user_data(new->accepter, new);
 	    }
-	    so->unlock(curr->lock);
+	    port_move_taps(curr, new);
+	    reload_append(&list, &list_end, new);
+
+	    /* Just let the old one get deleted. */
+	    curr->next = nuke;
+	    nuke = curr;
 	}
+	so->unlock(curr->lock);
 	so->unlock(new->lock);
+	if (old_new) {
+	    free_port(old_new);
+	    old_new = NULL;
+	}
     }
 
     /*
      * We nuke any old port without a new config.  Do this first so
      * new ports can use the given port numbers that might be in these.
      */
-    for (curr = ports; curr; curr = next) {
+    for (curr = nuke; curr; curr = next) {
 	next = curr->next;
 	so->lock(curr->lock);
 	if (curr->accepter_stopped && curr->enabled)
@@ -4010,26 +6391,32 @@ apply_new_ports(void)
 	curr->deleted = true;
 	curr->enabled = false;
 	if (!port_in_use(curr)) {
+	    gensio_acc_free(curr->accepter);
+	    curr->accepter = NULL;
 	    so->unlock(curr->lock);
-	    free_port(curr);
+	    port_deref(curr);
 	} else {
 	    /* Leave it in the new ports for shutdown when the user closes. */
-	    if (new_ports_end)
-		new_ports_end->next = curr;
-	    curr->next = NULL;
-	    new_ports_end = curr;
+	    reload_append(&list, &list_end, curr);
 	    so->unlock(curr->lock);
 	}
     }
 
     /* Now start up the new ports. */
-    ports = new_ports;
+    ports = list;
     new_ports = NULL;
     new_ports_end = NULL;
+    memset(new_ports_hash, 0, sizeof(new_ports_hash));
+    publish_ports();
 
     for (curr = ports; curr; curr = curr->next) {
+	bool keep;
+
 	so->lock(curr->lock);
-	if (!curr->deleted) {
+	keep = curr->reload_keep;
+	curr->reload_keep = false;
+	curr->reload_match = NULL;
+	if (!curr->deleted && !keep) {
 	    curr->dev_to_net_state = PORT_CLOSED;
 	    curr->net_to_dev_state = PORT_CLOSED;
 	    if (curr->accepter_stopped) {
@@ -4041,23 +6428,32 @@ apply_new_ports(void)
 		} else {
 		    gensio_acc_disable(curr->accepter);
 		}
-	    } else {
-		if (curr->enabled) {
-		    err = startup_port(NULL, curr);
-		    if (err)
-			curr->enabled = false;
-		}
+	    } else if (curr->enabled) {
+		port_startup_queue(curr);
 	    }
 	}
 	so->unlock(curr->lock);
     }
     so->unlock(ports_lock);
+    startup_drop_unrun();
+
+    so->get_monotonic_time(so, &end);
+    usecs = sub_timeval_us(&end, &start);
+    syslog(LOG_INFO, "Configuration applied in %ld.%06ld seconds:"
+	   " %u unchanged, %u changed, %u added, %u removed",
+	   usecs / 1000000, usecs % 1000000,
+	   nkept, nchanged, nadded, nremoved);
 }
 
 #define REMOTEADDR_COLUMN_WIDTH \
     (INET6_ADDRSTRLEN - 1 /* terminating NUL */ + 1 /* comma */ + 5 /* strlen("65535") */)
 
-/* Print information about a port to the control port given in cntlr. */
+/*
+ * Print information about a port to the control port given in cntlr.
+ * The caller holds a reference to the port but not the lock, the lock
+ * is only held to copy out the state that needs it, so a show doesn't
+ * hold up the data.  The byte counts are read without the lock.
+ */
 static void
 showshortport(struct controller_info *cntlr, port_info_t *port)
 {
@@ -4065,42 +6461,54 @@ showshortport(struct controller_info *cntlr, port_info_t *port)
     int count;
     int err;
     net_info_t *netcon = NULL;
-    unsigned int bytes_recv = 0, bytes_sent = 0;
+    const char *enabled;
+    int timeout, net_to_dev_state, dev_to_net_state;
+    bool in_use;
 
-    controller_outputf(cntlr, "%-22s ", port->name);
+    so->lock(port->lock);
     if (port->deleted)
-	controller_outputf(cntlr, "%-6s ", "DEL");
+	enabled = "DEL";
     else
-	controller_outputf(cntlr, "%-6s ", enabled_str[port->enabled]);
-    controller_outputf(cntlr, "%7d ", port->timeout);
+	enabled = enabled_str[port->enabled];
+    timeout = port->timeout;
+    net_to_dev_state = port->net_to_dev_state;
+    dev_to_net_state = port->dev_to_net_state;
 
     netcon = first_live_net_con(port);
     if (!netcon)
 	netcon = &(port->netcons[0]);
 
-    if (port_in_use(port)) {
+    in_use = port_in_use(port);
+    if (in_use)
 	gensio_raddr_to_str(netcon->net, NULL, buffer, sizeof(buffer));
+    so->unlock(port->lock);
+
+    controller_outputf(cntlr, "%-22s ", port->name);
+    controller_outputf(cntlr, "%-6s ", enabled);
+    controller_outputf(cntlr, "%7d ", timeout);
+
+    if (in_use)
 	count = controller_outputf(cntlr, "%s", buffer);
-    } else {
+    else
 	count = controller_outputf(cntlr, "unconnected");
-    }
 
     while (count < REMOTEADDR_COLUMN_WIDTH + 1) {
 	controller_outs(cntlr, " ");
 	count++;
     }
 
-    bytes_recv = netcon->bytes_received;
-    bytes_sent = netcon->bytes_sent;
-
     controller_outputf(cntlr, "%-22s ", port->accstr);
     controller_outputf(cntlr, "%-22s ", port->devname);
-    controller_outputf(cntlr, "%-14s ", state_str[port->net_to_dev_state]);
-    controller_outputf(cntlr, "%-14s ", state_str[port->dev_to_net_state]);
-    controller_outputf(cntlr, "%9d ", bytes_recv);
-    controller_outputf(cntlr, "%9d ", bytes_sent);
-    controller_outputf(cntlr, "%9d ", port->dev_bytes_received);
-    controller_outputf(cntlr, "%9d ", port->dev_bytes_sent);
+    controller_outputf(cntlr, "%-14s ", state_str[net_to_dev_state]);
+    controller_outputf(cntlr, "%-14s ", state_str[dev_to_net_state]);
+    controller_outputf(cntlr, "%9llu ", (unsigned long long)
+		       metrics_get(&netcon->bytes_received));
+    controller_outputf(cntlr, "%9llu ", (unsigned long long)
+		       metrics_get(&netcon->bytes_sent));
+    controller_outputf(cntlr, "%9llu ", (unsigned long long)
+		       metrics_get(&port->dev_bytes_received));
+    controller_outputf(cntlr, "%9llu ", (unsigned long long)
+		       metrics_get(&port->dev_bytes_sent));
 
     err = gensio_raddr_to_str(port->io, NULL, buffer, sizeof(buffer));
     if (!err)
@@ -4109,28 +6517,91 @@ showshortport(struct controller_info *cntlr, port_info_t *port)
     controller_outs(cntlr, "\r\n");
 }
 
-/* Print information about a port to the control port given in cntlr. */
+/* Print the p50/p90/p99 of a latency histogram. */
+static void
+show_latency(struct controller_info *cntlr, const char *name,
+	     struct metrics_hist *h)
+{
+    controller_outputf(cntlr, "    %s: %llu/%llu/%llu (%llu samples)\r\n",
+		       name,
+		       (unsigned long long) metrics_hist_percentile(h, 50),
+		       (unsigned long long) metrics_hist_percentile(h, 90),
+		       (unsigned long long) metrics_hist_percentile(h, 99),
+		       (unsigned long long) metrics_get(&h->count));
+}
+
+/*
+ * Print information about a port to the control port given in cntlr.
+ * Like showshortport(), the lock is only held while copying out the
+ * state that needs it, once for the port and once per connection, and
+ * not while talking to the device or formatting the output.
+ */
 static void
 showport(struct controller_info *cntlr, port_info_t *port)
 {
     char buffer[NI_MAXHOST + NI_MAXSERV + 2], *cfg, *oth = NULL;
     net_info_t *netcon;
     int err;
+    int enabled, timeout, net_to_dev_state, dev_to_net_state;
+    gensiods bufmem, behind, skipped, tr_dropped = 0, tw_dropped = 0;
+    gensiods tb_dropped = 0, tap_dropped;
+    unsigned int ntaps;
+    bool connected, reconfig, deleted, show_tr, show_tw, show_tb;
+
+    so->lock(port->lock);
+    enabled = port->enabled;
+    timeout = port->timeout;
+    net_to_dev_state = port->net_to_dev_state;
+    dev_to_net_state = port->dev_to_net_state;
+    bufmem = port_buf_memory(port);
+    reconfig = port->new_config != NULL;
+    deleted = port->deleted;
+    tap_dropped = port->taps->dropped;
+    ntaps = atomic_load(&port->taps->nsubs);
+    show_tr = port->tr && port->tr->q;
+    if (show_tr)
+	tr_dropped = trace_queue_dropped(port->tr->q);
+    show_tw = port->tw && port->tw != port->tr && port->tw->q;
+    if (show_tw)
+	tw_dropped = trace_queue_dropped(port->tw->q);
+    show_tb = (port->tb && port->tb != port->tr && port->tb != port->tw
+	       && port->tb->q);
+    if (show_tb)
+	tb_dropped = trace_queue_dropped(port->tb->q);
+    so->unlock(port->lock);
 
     controller_outputf(cntlr, "Port %s\r\n", port->name);
     controller_outputf(cntlr, "  accepter: %s\r\n", port->accstr);
     controller_outputf(cntlr, "  enable state: %s\r\n",
-		       enabled_str[port->enabled]);
-    controller_outputf(cntlr, "  timeout: %d\r\n", port->timeout);
+		       enabled_str[enabled]);
+    controller_outputf(cntlr, "  timeout: %d\r\n", timeout);
+    controller_outputf(cntlr, "  laggard policy: %s\r\n",
+		       laggard_policy_enums[port->laggard_policy].name);
+    if (ser2net_num_shards > 1)
+	controller_outputf(cntlr, "  thread: %u\r\n", port->shard);
 
     for_each_connection(port, netcon) {
-	if (netcon->net) {
+	so->lock(port->lock);
+	connected = netcon->net != NULL;
+	if (connected) {
 	    gensio_raddr_to_str(netcon->net, NULL, buffer, sizeof(buffer));
+	    behind = port->dev_to_net.head - netcon->write_pos;
+	    skipped = netcon->bytes_skipped;
+	}
+	so->unlock(port->lock);
+
+	if (connected) {
 	    controller_outputf(cntlr, "  connected to: %s\r\n", buffer);
-	    controller_outputf(cntlr, "    bytes read from TCP: %d\r\n",
-			       netcon->bytes_received);
-	    controller_outputf(cntlr, "    bytes written to TCP: %d\r\n",
-			       netcon->bytes_sent);
+	    controller_outputf(cntlr, "    bytes read from TCP: %llu\r\n",
+			       (unsigned long long)
+			       metrics_get(&netcon->bytes_received));
+	    controller_outputf(cntlr, "    bytes written to TCP: %llu\r\n",
+			       (unsigned long long)
+			       metrics_get(&netcon->bytes_sent));
+	    controller_outputf(cntlr, "    bytes behind device: %lu\r\n",
+			       (unsigned long) behind);
+	    controller_outputf(cntlr, "    bytes skipped: %lu\r\n",
+			       (unsigned long) skipped);
 	} else {
 	    controller_outputf(cntlr, "  unconnected\r\n");
 	}
@@ -4167,52 +6638,250 @@ showport(struct controller_info *cntlr, port_info_t *port)
     }
 
     controller_outputf(cntlr, "  tcp to device state: %s\r\n",
-		      state_str[port->net_to_dev_state]);
+		      state_str[net_to_dev_state]);
 
     controller_outputf(cntlr, "  device to tcp state: %s\r\n",
-		      state_str[port->dev_to_net_state]);
-
-    controller_outputf(cntlr, "  bytes read from device: %d\r\n",
-		      port->dev_bytes_received);
-
-    controller_outputf(cntlr, "  bytes written to device: %d\r\n",
-		      port->dev_bytes_sent);
-
-    if (port->new_config != NULL) {
+		      state_str[dev_to_net_state]);
+
+    controller_outputf(cntlr, "  bytes read from device: %llu\r\n",
+		      (unsigned long long)
+		      metrics_get(&port->dev_bytes_received));
+
+    controller_outputf(cntlr, "  bytes written to device: %llu\r\n",
+		      (unsigned long long) metrics_get(&port->dev_bytes_sent));
+
+    controller_outputf(cntlr, "  buffer memory: %lu\r\n",
+		      (unsigned long) bufmem);
+
+    if (port->latency_stats) {
+	controller_outputf(cntlr, "  dev to net latency (usecs, p50/p90/p99):"
+			   "\r\n");
+	show_latency(cntlr, "chardelay", &port->metrics.lat_chardelay);
+	show_latency(cntlr, "backpressure", &port->metrics.lat_backpressure);
+	show_latency(cntlr, "total", &port->metrics.lat_total);
+    }
+
+    if (ntaps)
+	controller_outputf(cntlr, "  taps: %u\r\n", ntaps);
+    if (tap_dropped)
+	controller_outputf(cntlr, "  tap bytes dropped: %lu\r\n",
+			   (unsigned long) tap_dropped);
+
+    if (show_tr)
+	controller_outputf(cntlr, "  trace read bytes dropped: %lu\r\n",
+			   (unsigned long) tr_dropped);
+    if (show_tw)
+	controller_outputf(cntlr, "  trace write bytes dropped: %lu\r\n",
+			   (unsigned long) tw_dropped);
+    if (show_tb)
+	controller_outputf(cntlr, "  trace both bytes dropped: %lu\r\n",
+			   (unsigned long) tb_dropped);
+
+    if (reconfig) {
 	controller_outputf(cntlr, "  Port will be reconfigured when current"
 			   " session closes.\r\n");
-    } else if (port->deleted) {
+    } else if (deleted) {
 	controller_outputf(cntlr, "  Port will be deleted when current"
 			   " session closes.\r\n");
     }
 }
 
+#define PORT_METRIC(field, name, help) \
+    { offsetof(struct port_metrics, field), "ser2net_" name, help }
+
+static const struct {
+    size_t offset;
+    const char *name;
+    const char *help;
+} port_counter_metrics[] = {
+    PORT_METRIC(dev_read_bytes, "dev_read_bytes_total",
+		"Bytes read from the device."),
+    PORT_METRIC(dev_reads, "dev_reads_total",
+		"Reads from the device."),
+    PORT_METRIC(dev_write_bytes, "dev_write_bytes_total",
+		"Bytes written to the device."),
+    PORT_METRIC(dev_writes, "dev_writes_total",
+		"Writes to the device."),
+    PORT_METRIC(dev_read_stalls, "dev_read_stalls_total",
+		"Times device reads were stopped waiting for network output."),
+    PORT_METRIC(dev_overruns, "dev_overruns_total",
+		"Overrun errors the device reported in its line state."),
+    PORT_METRIC(net_read_stalls, "net_read_stalls_total",
+		"Times network reads were stopped waiting for device output."),
+    PORT_METRIC(laggard_drops, "laggard_drops_total",
+		"Connections closed for falling behind."),
+    PORT_METRIC(laggard_skipped_bytes, "laggard_skipped_bytes_total",
+		"Bytes skipped on connections that fell behind."),
+    PORT_METRIC(accepts, "accepts_total",
+		"Network connections accepted."),
+    PORT_METRIC(rejects, "rejects_total",
+		"Network connections refused."),
+    PORT_METRIC(kicks, "kicks_total",
+		"Connections kicked off for a new user."),
+    PORT_METRIC(trace_drops, "trace_drops_total",
+		"Trace bytes thrown away because the trace queue was full."),
+    { 0 }
+};
+
+#define NETCON_METRIC(field, name, help) \
+    { offsetof(struct netcon_metrics, field), "ser2net_net_" name, help }
+
+static const struct {
+    size_t offset;
+    const char *name;
+    const char *help;
+} netcon_counter_metrics[] = {
+    NETCON_METRIC(read_bytes, "read_bytes_total",
+		  "Bytes read from network connections on this slot."),
+    NETCON_METRIC(reads, "reads_total",
+		  "Reads from network connections on this slot."),
+    NETCON_METRIC(write_bytes, "write_bytes_total",
+		  "Bytes written to network connections on this slot."),
+    NETCON_METRIC(writes, "writes_total",
+		  "Writes to network connections on this slot."),
+    { 0 }
+};
+
+static const struct {
+    size_t offset;
+    const char *name;
+    const char *help;
+} latency_metrics[] = {
+    PORT_METRIC(lat_chardelay, "latency_chardelay_seconds",
+		"Time device data waited for chardelay before sending."),
+    PORT_METRIC(lat_backpressure, "latency_backpressure_seconds",
+		"Time from starting a send until a connection wrote it."),
+    PORT_METRIC(lat_total, "latency_total_seconds",
+		"Time from reading device data until a connection wrote it."),
+    { 0 }
+};
+
+static void
+metrics_port_labels(struct metrics_buf *b, port_info_t *port)
+{
+    metrics_printf(b, "port=\"");
+    metrics_label(b, port->name);
+    metrics_printf(b, "\"");
+}
+
 /*
- * Find a port data structure given a port name.  Returns with port->lock
- * held, if it returns a non-NULL port.
+ * Output all the port statistics.  This only reads atomic counters
+ * from the current port snapshot, no port locks are taken.
  */
-static port_info_t *
-find_port_by_name(char *name, bool allow_deleted)
+void
+dataxfer_metrics(struct metrics_buf *b)
 {
+    struct port_snap *snap = port_snap_get();
+    struct metrics_buf labels = { NULL, 0, 0, false };
     port_info_t *port;
+    unsigned int i, j, k;
+    gensiods in_use, cached;
 
-    so->lock(ports_lock);
-    port = ports;
-    while (port != NULL) {
-	if (strcmp(name, port->name) == 0) {
-	    so->lock(port->lock);
-	    so->unlock(ports_lock);
-	    if (port->deleted && !allow_deleted) {
-		so->unlock(port->lock);
-		return NULL;
+    if (!snap)
+	return;
+
+    bufpool_usage(&in_use, &cached);
+    metrics_header(b, "ser2net_buffer_bytes", "gauge",
+		   "Memory in port data buffers, in use by active ports "
+		   "or cached for reuse.");
+    metrics_printf(b, "ser2net_buffer_bytes{state=\"in_use\"} %lu\n",
+		   (unsigned long) in_use);
+    metrics_printf(b, "ser2net_buffer_bytes{state=\"cached\"} %lu\n",
+		   (unsigned long) cached);
+
+    for (i = 0; port_counter_metrics[i].name; i++) {
+	metrics_header(b, port_counter_metrics[i].name, "counter",
+		       port_counter_metrics[i].help);
+	for (j = 0; j < snap->count; j++) {
+	    port = snap->ports[j];
+	    metrics_printf(b, "%s{", port_counter_metrics[i].name);
+	    metrics_port_labels(b, port);
+	    metrics_printf(b, "} %llu\n", (unsigned long long)
+			   metrics_get((metrics_counter *)
+				       ((char *) &port->metrics +
+					port_counter_metrics[i].offset)));
+	}
+    }
+
+    for (i = 0; netcon_counter_metrics[i].name; i++) {
+	metrics_header(b, netcon_counter_metrics[i].name, "counter",
+		       netcon_counter_metrics[i].help);
+	for (j = 0; j < snap->count; j++) {
+	    port = snap->ports[j];
+	    for (k = 0; k < port->max_connections; k++) {
+		metrics_printf(b, "%s{", netcon_counter_metrics[i].name);
+		metrics_port_labels(b, port);
+		metrics_printf(b, ",slot=\"%u\"} %llu\n", k,
+			       (unsigned long long)
+			       metrics_get((metrics_counter *)
+					   ((char *) &port->netcons[k].metrics +
+					    netcon_counter_metrics[i].offset)));
 	    }
-	    return port;
 	}
-	port = port->next;
     }
 
-    so->unlock(ports_lock);
-    return NULL;
+    metrics_header(b, "ser2net_net_send_seconds", "histogram",
+		   "Time from starting a send of device data until all "
+		   "the network connections took it.");
+    for (j = 0; j < snap->count; j++) {
+	port = snap->ports[j];
+	labels.len = 0;
+	metrics_port_labels(&labels, port);
+	if (labels.failed) {
+	    b->failed = true;
+	    break;
+	}
+	metrics_hist_output(b, "ser2net_net_send_seconds", labels.buf,
+			    &port->metrics.net_send_time);
+    }
+    for (i = 0; !b->failed && latency_metrics[i].name; i++) {
+	metrics_header(b, latency_metrics[i].name, "histogram",
+		       latency_metrics[i].help);
+	for (j = 0; j < snap->count; j++) {
+	    port = snap->ports[j];
+	    if (!port->latency_stats)
+		continue;
+	    labels.len = 0;
+	    metrics_port_labels(&labels, port);
+	    if (labels.failed) {
+		b->failed = true;
+		break;
+	    }
+	    metrics_hist_output(b, latency_metrics[i].name, labels.buf,
+				(struct metrics_hist *)
+				((char *) &port->metrics +
+				 latency_metrics[i].offset));
+	}
+    }
+    free(labels.buf);
+
+    port_snap_put(snap);
+}
+
+/*
+ * Find a port data structure given a port name.  Returns with port->lock
+ * held and a reference to the port, if it returns a non-NULL port.
+ * Use port_unlock_put() to release it.
+ */
+static port_info_t *
+find_port_by_name(char *name, bool allow_deleted)
+{
+    struct port_snap *snap = port_snap_get();
+    port_info_t *port;
+
+    port = port_snap_find(snap, name);
+    if (port)
+	port_ref(port);
+    port_snap_put(snap);
+    if (!port)
+	return NULL;
+
+    so->lock(port->lock);
+    if (port->deleted && !allow_deleted) {
+	port_unlock_put(port);
+	return NULL;
+    }
+    return port;
 }
 
 /* Handle a showport command from the control port. */
@@ -4222,23 +6891,21 @@ showports(struct controller_info *cntlr, char *portspec)
     port_info_t *port;
 
     if (portspec == NULL) {
-	so->lock(ports_lock);
+	struct port_snap *snap = port_snap_get();
+	unsigned int i;
+
 	/* Dump everything. */
-	port = ports;
-	while (port != NULL) {
-	    so->lock(port->lock);
-	    showport(cntlr, port);
-	    so->unlock(port->lock);
-	    port = port->next;
-	}
-	so->unlock(ports_lock);
+	for (i = 0; snap && i < snap->count; i++)
+	    showport(cntlr, snap->ports[i]);
+	port_snap_put(snap);
     } else {
 	port = find_port_by_name(portspec, true);
 	if (port == NULL) {
 	    controller_outputf(cntlr, "Invalid port number: %s\r\n", portspec);
 	} else {
-	    showport(cntlr, port);
 	    so->unlock(port->lock);
+	    showport(cntlr, port);
+	    port_deref(port);
 	}
     }
 }
@@ -4266,285 +6933,517 @@ showshortports(struct controller_info *cntlr, char *portspec)
 	    "Dev out",
 	    "State");
     if (portspec == NULL) {
-	so->lock(ports_lock);
+	struct port_snap *snap = port_snap_get();
+	unsigned int i;
+
 	/* Dump everything. */
-	port = ports;
-	while (port != NULL) {
-	    so->lock(port->lock);
-	    showshortport(cntlr, port);
-	    so->unlock(port->lock);
-	    port = port->next;
-	}
-	so->unlock(ports_lock);
+	for (i = 0; snap && i < snap->count; i++)
+	    showshortport(cntlr, snap->ports[i]);
+	port_snap_put(snap);
     } else {
 	port = find_port_by_name(portspec, true);
 	if (port == NULL) {
 	    controller_outputf(cntlr, "Invalid port number: %s\r\n", portspec);
 	} else {
-	    showshortport(cntlr, port);
 	    so->unlock(port->lock);
+	    showshortport(cntlr, port);
+	    port_deref(port);
 	}
     }
 }
 
-/* Set the timeout on a port.  The port number and timeout are passed
-   in as strings, this code will convert them, return any errors, and
-   perform the operation. */
-void
-setporttimeout(struct controller_info *cntlr, char *portspec, char *timeout)
+/*
+ * Controller commands that change a port are run in the port's shard,
+ * with the rest of its data path, instead of taking the port lock in
+ * the controller's thread.  The output is collected in out and handed
+ * back with controller_op_done().
+ */
+enum port_ctl_op {
+    PORT_CTL_TIMEOUT,
+    PORT_CTL_CONTROL,
+    PORT_CTL_ENABLE,
+    PORT_CTL_DISCONNECT
+};
+
+struct port_ctl {
+    struct port_ctl *next;
+    enum port_ctl_op op;
+    struct controller_info *cntlr;
+    port_info_t *port;		/* Holds a reference. */
+    bool allow_deleted;
+    const char *badport;	/* Format for a port that is not there. */
+    int val;
+    char *controls;
+    char out[256];
+    int outlen;
+};
+
+static void
+port_ctl_voutf(struct port_ctl *ctl, const char *str, va_list ap)
 {
-    port_info_t *port;
-    net_info_t *netcon;
+    int left = sizeof(ctl->out) - ctl->outlen;
+    int rv;
 
-    port = find_port_by_name(portspec, true);
-    if (port == NULL) {
-	controller_outputf(cntlr, "Invalid port number: %s\r\n", portspec);
-    } else {
-	int timeout_num = scan_int(timeout);
+    rv = vsnprintf(ctl->out + ctl->outlen, left, str, ap);
+    if (rv < 0)
+	return;
+    if (rv >= left)
+	rv = left - 1;
+    ctl->outlen += rv;
+}
 
-	if (timeout_num == -1) {
-	    controller_outputf(cntlr, "Invalid timeout: %s\r\n", timeout);
-	} else {
-	    port->timeout = timeout_num;
+static void
+port_ctl_outf(struct port_ctl *ctl, const char *str, ...)
+{
+    va_list ap;
 
-	    for_each_connection(port, netcon) {
-		if (netcon->net)
-		    reset_timer(netcon);
-	    }
-	}
-	so->unlock(port->lock);
-    }
+    va_start(ap, str);
+    port_ctl_voutf(ctl, str, ap);
+    va_end(ap);
 }
 
-/* Modify the controls of a port.  The port number and configuration
-   are passed in as strings, this code will get the port and then call
-   the code to control the device. */
-void
-setportcontrol(struct controller_info *cntlr, char *portspec, char *controls)
+static int
+port_ctl_abserrout(struct absout *o, const char *str, ...)
 {
+    struct port_ctl *ctl = o->data;
+    va_list ap;
+
+    va_start(ap, str);
+    port_ctl_voutf(ctl, str, ap);
+    va_end(ap);
+    port_ctl_outf(ctl, "\r\n");
+    return 0;
+}
+
+/*
+ * Get a command for the named port, or print badport and return NULL
+ * if there is no such port.  Only a reference is taken, whether the
+ * port is deleted is checked when the command runs.
+ */
+static struct port_ctl *
+port_ctl_alloc(struct controller_info *cntlr, char *portspec,
+	       enum port_ctl_op op, bool allow_deleted, const char *badport)
+{
+    struct port_snap *snap = port_snap_get();
+    struct port_ctl *ctl;
     port_info_t *port;
 
-    port = find_port_by_name(portspec, false);
-    if (port == NULL) {
-	controller_outputf(cntlr, "Invalid port number: %s\r\n", portspec);
-	goto out;
-    } else if (!port_in_use(port)) {
-	controller_outputf(cntlr, "Port is not currently connected: %s\r\n",
-			   portspec);
+    port = port_snap_find(snap, portspec);
+    if (port)
+	port_ref(port);
+    port_snap_put(snap);
+    if (!port) {
+	controller_outputf(cntlr, badport, portspec);
+	return NULL;
+    }
+
+    ctl = calloc(1, sizeof(*ctl));
+    if (!ctl) {
+	controller_outputf(cntlr, "Out of memory\r\n");
+	port_deref(port);
+	return NULL;
+    }
+    ctl->op = op;
+    ctl->cntlr = cntlr;
+    ctl->port = port;
+    ctl->allow_deleted = allow_deleted;
+    ctl->badport = badport;
+    return ctl;
+}
+
+static void
+port_ctl_free(struct port_ctl *ctl)
+{
+    port_deref(ctl->port);
+    if (ctl->controls)
+	free(ctl->controls);
+    free(ctl);
+}
+
+/*
+ * Queue the command for the port's shard.  Returns true if it was
+ * queued, controller_op_done() is called when it finishes.
+ */
+static bool
+port_ctl_post(struct port_ctl *ctl)
+{
+    port_info_t *port = ctl->port;
+    int rv = 0;
+
+    ctl->next = NULL;
+    so->lock(port->ctl_lock);
+    if (!port->ctl_head) {
+	rv = so->run(port->ctl_runner);
+	if (!rv)
+	    port->ctl_head = ctl;
     } else {
-	char *pos, *strtok_data;
-	struct sergensio *sio = gensio_to_sergensio(port->io);
+	port->ctl_tail->next = ctl;
+    }
+    if (!rv)
+	port->ctl_tail = ctl;
+    so->unlock(port->ctl_lock);
 
-	if (!sio)
-	    goto out_unlock;
-	pos = strtok_r(controls, " \t", &strtok_data);
-	while (pos) {
-	    if (strcmp(pos, "RTSHI") == 0)
-		sergensio_rts(sio, SERGENSIO_RTS_ON, NULL, NULL);
-	    else if (strcmp(pos, "RTSLO") == 0)
-		sergensio_rts(sio, SERGENSIO_RTS_OFF, NULL, NULL);
-	    else if (strcmp(pos, "DTRHI") == 0)
-		sergensio_rts(sio, SERGENSIO_DTR_ON, NULL, NULL);
-	    else if (strcmp(pos, "DTRLO") == 0)
-		sergensio_rts(sio, SERGENSIO_DTR_OFF, NULL, NULL);
-	    else
-		controller_outputf(cntlr, "Invalid device control: %s\r\n",
-				   pos);
-	    pos = strtok_r(NULL, " \t", &strtok_data);
-	}
+    if (rv) {
+	controller_outputf(ctl->cntlr, "Unable to run the command: %s\r\n",
+			   gensio_err_to_str(rv));
+	port_ctl_free(ctl);
+	return false;
     }
- out_unlock:
-    so->unlock(port->lock);
- out:
-    return;
+    return true;
 }
 
-/* Set the enable state of a port. */
-void
-setportenable(struct controller_info *cntlr, char *portspec, char *enable)
+static void
+port_ctl_timeout(port_info_t *port, struct port_ctl *ctl)
 {
-    port_info_t *port;
-    bool new_enable;
-    struct absout eout = { .out = cntrl_abserrout, .data = cntlr };
-    int rv;
+    net_info_t *netcon;
 
-    port = find_port_by_name(portspec, false);
-    if (port == NULL) {
-	controller_outputf(cntlr, "Invalid port: %s\r\n", portspec);
+    port->timeout = ctl->val;
+    port->config_changed = true;
+
+    for_each_connection(port, netcon) {
+	if (netcon->net)
+	    reset_timer(netcon);
+    }
+    port_sched_housekeeping(port);
+}
+
+static void
+port_ctl_control(port_info_t *port, struct port_ctl *ctl)
+{
+    char *pos, *strtok_data;
+    struct sergensio *sio;
+
+    if (!port_in_use(port)) {
+	port_ctl_outf(ctl, "Port is not currently connected: %s\r\n",
+		      port->name);
 	return;
     }
 
-    if (strcmp(enable, "off") == 0) {
-	new_enable = false;
-    } else if (strcmp(enable, "on") == 0) {
-	new_enable = true;
-    } else if (strcmp(enable, "raw") == 0) {
-	new_enable = true;
-    } else {
-	controller_outputf(cntlr, "Invalid enable: %s\r\n", enable);
-	goto out_unlock;
+    sio = gensio_to_sergensio(port->io);
+    if (!sio)
+	return;
+    pos = strtok_r(ctl->controls, " \t", &strtok_data);
+    while (pos) {
+	if (strcmp(pos, "RTSHI") == 0)
+	    sergensio_rts(sio, SERGENSIO_RTS_ON, NULL, NULL);
+	else if (strcmp(pos, "RTSLO") == 0)
+	    sergensio_rts(sio, SERGENSIO_RTS_OFF, NULL, NULL);
+	else if (strcmp(pos, "DTRHI") == 0)
+	    sergensio_rts(sio, SERGENSIO_DTR_ON, NULL, NULL);
+	else if (strcmp(pos, "DTRLO") == 0)
+	    sergensio_rts(sio, SERGENSIO_DTR_OFF, NULL, NULL);
+	else
+	    port_ctl_outf(ctl, "Invalid device control: %s\r\n", pos);
+	pos = strtok_r(NULL, " \t", &strtok_data);
     }
+}
 
+static void
+port_ctl_enable(port_info_t *port, struct port_ctl *ctl)
+{
+    struct absout eout = { .out = port_ctl_abserrout, .data = ctl };
+    bool new_enable = ctl->val;
+    int rv;
 
     if (port->enabled == new_enable) {
-	controller_outputf(cntlr, "port was already in the given state");
-	goto out_unlock;
+	port_ctl_outf(ctl, "port was already in the given state");
+	return;
     }
 
     port->enabled = new_enable;
-    if (!new_enable) {
+    port->config_changed = true;
+    if (!new_enable && port->startup_queued) {
+	/* It hasn't started yet, it will be skipped. */
+	rv = 0;
+    } else if (!new_enable) {
 	rv = shutdown_port(port, "admin disable");
 	if (rv)
-	    controller_outputf(cntlr, "Error disabling port: %s",
-			       gensio_err_to_str(rv));
+	    port_ctl_outf(ctl, "Error disabling port: %s",
+			  gensio_err_to_str(rv));
     } else {
 	rv = startup_port(&eout, port);
     }
     if (rv)
 	port->enabled = !new_enable;
+}
 
- out_unlock:
-    so->unlock(port->lock);
+static void
+port_ctl_disconnect(port_info_t *port, struct port_ctl *ctl)
+{
+    if (!port_in_use(port)) {
+	port_ctl_outf(ctl, "Port not connected: %s\r\n", port->name);
+	return;
+    }
+
+    shutdown_port(port, "admin disconnect");
 }
 
-/* Start data monitoring on the given port, type may be either "tcp" or
-   "term" and only one direction may be monitored.  This return NULL if
-   the monitor fails.  The monitor output will go to "fd". */
-void *
-data_monitor_start(struct controller_info *cntlr,
-		   char                   *type,
-		   char                   *portspec)
+/* Run the queued controller commands, in the port's shard. */
+static void
+port_ctl_run(struct gensio_runner *runner, void *cb_data)
 {
-    port_info_t *port;
+    port_info_t *port = cb_data;
+    struct port_ctl *ctl, *done = NULL;
 
-    port = find_port_by_name(portspec, true);
-    if (port == NULL) {
-	char *err = "Invalid port number: ";
-	controller_outs(cntlr, err);
-	controller_outs(cntlr, portspec);
-	controller_outs(cntlr, "\r\n");
-	goto out;
+    so->lock(port->ctl_lock);
+    while ((ctl = port->ctl_head)) {
+	port->ctl_head = ctl->next;
+	if (!port->ctl_head)
+	    port->ctl_tail = NULL;
+	so->unlock(port->ctl_lock);
+
+	so->lock(port->lock);
+	if (port->deleted && !ctl->allow_deleted) {
+	    port_ctl_outf(ctl, ctl->badport, port->name);
+	} else {
+	    switch (ctl->op) {
+	    case PORT_CTL_TIMEOUT: port_ctl_timeout(port, ctl); break;
+	    case PORT_CTL_CONTROL: port_ctl_control(port, ctl); break;
+	    case PORT_CTL_ENABLE: port_ctl_enable(port, ctl); break;
+	    case PORT_CTL_DISCONNECT: port_ctl_disconnect(port, ctl); break;
+	    }
+	}
+	so->unlock(port->lock);
+
+	controller_op_done(ctl->cntlr, ctl->out, ctl->outlen);
+
+	/*
+	 * Each command holds a port reference, keep them until the
+	 * list is not touched any more.
+	 */
+	ctl->next = done;
+	done = ctl;
+	so->lock(port->ctl_lock);
     }
+    so->unlock(port->ctl_lock);
 
-    if ((port->net_monitor != NULL) || (port->dev_monitor != NULL)) {
-	char *err = "Port is already being monitored";
-	controller_outs(cntlr, err);
-	controller_outs(cntlr, "\r\n");
-	goto out_unlock;
+    while ((ctl = done)) {
+	done = ctl->next;
+	port_ctl_free(ctl);
+    }
+}
+
+/* Set the timeout on a port.  The port number and timeout are passed
+   in as strings, this code will convert them, return any errors, and
+   queue the operation. */
+bool
+setporttimeout(struct controller_info *cntlr, char *portspec, char *timeout)
+{
+    struct port_ctl *ctl;
+    int timeout_num;
+
+    ctl = port_ctl_alloc(cntlr, portspec, PORT_CTL_TIMEOUT, true,
+			 "Invalid port number: %s\r\n");
+    if (!ctl)
+	return false;
+
+    timeout_num = scan_int(timeout);
+    if (timeout_num == -1) {
+	controller_outputf(cntlr, "Invalid timeout: %s\r\n", timeout);
+	port_ctl_free(ctl);
+	return false;
     }
+    ctl->val = timeout_num;
+    return port_ctl_post(ctl);
+}
+
+/* Modify the controls of a port.  The port number and configuration
+   are passed in as strings, this code will get the port and then
+   queue the controls for the device. */
+bool
+setportcontrol(struct controller_info *cntlr, char *portspec, char *controls)
+{
+    struct port_ctl *ctl;
+
+    ctl = port_ctl_alloc(cntlr, portspec, PORT_CTL_CONTROL, false,
+			 "Invalid port number: %s\r\n");
+    if (!ctl)
+	return false;
+
+    ctl->controls = strdup(controls);
+    if (!ctl->controls) {
+	controller_outputf(cntlr, "Out of memory\r\n");
+	port_ctl_free(ctl);
+	return false;
+    }
+    return port_ctl_post(ctl);
+}
+
+/* Set the enable state of a port. */
+bool
+setportenable(struct controller_info *cntlr, char *portspec, char *enable)
+{
+    struct port_ctl *ctl;
+
+    ctl = port_ctl_alloc(cntlr, portspec, PORT_CTL_ENABLE, false,
+			 "Invalid port: %s\r\n");
+    if (!ctl)
+	return false;
+
+    if (strcmp(enable, "off") == 0) {
+	ctl->val = false;
+    } else if (strcmp(enable, "on") == 0) {
+	ctl->val = true;
+    } else if (strcmp(enable, "raw") == 0) {
+	ctl->val = true;
+    } else {
+	controller_outputf(cntlr, "Invalid enable: %s\r\n", enable);
+	port_ctl_free(ctl);
+	return false;
+    }
+    return port_ctl_post(ctl);
+}
+
+int
+dataxfer_tap_subscribe(const char *name, unsigned int dirs, gensiods max_lag,
+		       void (*ready)(void *cb_data), void *cb_data,
+		       struct tap_sub **rsub)
+{
+    port_info_t *port;
+    struct tap_sub *sub;
+
+    port = find_port_by_name((char *) name, true);
+    if (!port)
+	return GE_NOTFOUND;
+    sub = tap_subscribe(port->taps, dirs, max_lag, ready, cb_data);
+    port_unlock_put(port);
+    if (!sub)
+	return GE_NOMEM;
+    *rsub = sub;
+    return 0;
+}
+
+/* Start data monitoring on the given port, type may be "tcp", "term",
+   or "both".  This return NULL if the monitor fails.  The monitor
+   output will go to the controller. */
+struct tap_sub *
+data_monitor_start(struct controller_info *cntlr,
+		   char                   *type,
+		   char                   *portspec)
+{
+    struct tap_sub *sub = NULL;
+    unsigned int dirs;
+    int rv;
 
     if (strcmp(type, "tcp") == 0) {
-	port->net_monitor = cntlr;
+	dirs = TAP_NET;
     } else if (strcmp(type, "term") == 0) {
-	port->dev_monitor = cntlr;
+	dirs = TAP_DEV;
+    } else if (strcmp(type, "both") == 0) {
+	dirs = TAP_DEV | TAP_NET;
     } else {
 	char *err = "invalid monitor type: ";
 	controller_outs(cntlr, err);
 	controller_outs(cntlr, type);
 	controller_outs(cntlr, "\r\n");
-	so->unlock(port->lock);
-	port = NULL;
-	goto out;
+	return NULL;
     }
- out_unlock:
-    so->unlock(port->lock);
- out:
-    return port;
+
+    rv = dataxfer_tap_subscribe(portspec, dirs, TAP_DEFAULT_MAX_LAG,
+				controller_monitor_ready, cntlr, &sub);
+    if (rv == GE_NOTFOUND) {
+	char *err = "Invalid port number: ";
+	controller_outs(cntlr, err);
+	controller_outs(cntlr, portspec);
+	controller_outs(cntlr, "\r\n");
+    } else if (rv) {
+	controller_outs(cntlr, "Could not start the monitor\r\n");
+    }
+    return sub;
 }
 
 /* Stop monitoring the given id. */
 void
 data_monitor_stop(struct controller_info *cntlr,
-		  void                   *monitor_id)
+		  struct tap_sub         *monitor_id)
 {
-    port_info_t *port = (port_info_t *) monitor_id;
-    port_info_t *curr;
-
-    so->lock(ports_lock);
-    curr = ports;
-    while (curr) {
-	if (curr == port) {
-	    so->lock(port->lock);
-	    port->net_monitor = NULL;
-	    port->dev_monitor = NULL;
-	    so->unlock(port->lock);
-	    break;
-	}
-	curr = curr->next;
-    }
-    so->unlock(ports_lock);
+    tap_unsubscribe(monitor_id);
 }
 
-void
+bool
 disconnect_port(struct controller_info *cntlr,
 		char *portspec)
 {
-    port_info_t *port;
+    struct port_ctl *ctl;
 
-    port = find_port_by_name(portspec, true);
-    if (port == NULL) {
-	char *err = "Invalid port number: ";
-	controller_outs(cntlr, err);
-	controller_outs(cntlr, portspec);
-	controller_outs(cntlr, "\r\n");
-	goto out;
-    } else if (!port_in_use(port)) {
-	char *err = "Port not connected: ";
-	controller_outs(cntlr, err);
-	controller_outs(cntlr, portspec);
-	controller_outs(cntlr, "\r\n");
-	goto out_unlock;
-    }
-
-    shutdown_port(port, "admin disconnect");
- out_unlock:
-    so->unlock(port->lock);
- out:
-    return;
+    ctl = port_ctl_alloc(cntlr, portspec, PORT_CTL_DISCONNECT, true,
+			 "Invalid port number: %s\r\n");
+    if (!ctl)
+	return false;
+    return port_ctl_post(ctl);
 }
 
 void
 shutdown_ports(void)
 {
-    port_info_t *port, *next, *prev;
+    port_info_t *port, *next, *prev, *new;
 
     so->lock(ports_lock);
     prev = NULL;
     for (port = ports; port; port = next) {
 	next = port->next;
 	so->lock(port->lock);
-	if (port->enabled) {
-	    if (port->new_config) {
-		free_port(port->new_config);
-		port->new_config = NULL;
-	    }
+	if (port->enabled && !port->startup_queued) {
+	    new = port->new_config;
+	    port->new_config = NULL;
 	    port->deleted = true;
 	    port->enabled = false;
 	    shutdown_port(port, "program shutdown");
 	    so->unlock(port->lock);
+	    if (new)
+		free_port(new);
 	    prev = port;
 	} else {
 	    if (prev)
 		prev->next = port->next;
 	    else
 		ports = port->next;
-	    free_port(port);
+	    port->deleted = true;
+	    so->unlock(port->lock);
+	    port_deref(port);
 	}
     }
+    publish_ports();
     so->unlock(ports_lock);
 }
 
 int
 check_ports_shutdown(void)
 {
-    return ports == NULL;
+    bool done;
+
+    so->lock(startup_lock);
+    done = ports == NULL && startup_outstanding == 0;
+    so->unlock(startup_lock);
+    return done;
 }
 
 void
 shutdown_dataxfer(void)
 {
+    trace_shutdown();
     if (rotator_shutdown_wait)
 	so->free_waiter(rotator_shutdown_wait);
+    if (startup_waiter)
+	so->free_waiter(startup_waiter);
+    if (startup_lock)
+	so->free_lock(startup_lock);
+    if (port_snap_lock) {
+	port_snap_put(port_snap);
+	port_snap = NULL;
+	so->free_lock(port_snap_lock);
+    }
+    if (port_wheels) {
+	unsigned int i;
+
+	for (i = 0; i < ser2net_num_shards; i++) {
+	    if (port_wheels[i])
+		twheel_free(port_wheels[i]);
+	}
+	free(port_wheels);
+	port_wheels = NULL;
+    }
+    bufpool_shutdown();
     if (ports_lock)
 	so->free_lock(ports_lock);
 }
@@ -4552,14 +7451,40 @@ shutdown_dataxfer(void)
 int
 init_dataxfer(void)
 {
+    unsigned int i;
+
     ports_lock = so->alloc_lock(so);
     if (!ports_lock)
 	goto out_nomem;
 
+    if (bufpool_init())
+	goto out_nomem;
+
+    port_snap_lock = so->alloc_lock(so);
+    if (!port_snap_lock)
+	goto out_nomem;
+
+    port_wheels = calloc(ser2net_num_shards, sizeof(*port_wheels));
+    if (!port_wheels)
+	goto out_nomem;
+    for (i = 0; i < ser2net_num_shards; i++) {
+	port_wheels[i] = twheel_alloc(ser2net_shard_so(i));
+	if (!port_wheels[i])
+	    goto out_nomem;
+    }
+
     rotator_shutdown_wait = so->alloc_waiter(so);
     if (!rotator_shutdown_wait)
 	goto out_nomem;
 
+    startup_lock = so->alloc_lock(so);
+    if (!startup_lock)
+	goto out_nomem;
+
+    startup_waiter = so->alloc_waiter(so);
+    if (!startup_waiter)
+	goto out_nomem;
+
     return 0;
 
  out_nomem:
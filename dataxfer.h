@@ -20,6 +20,7 @@
 #ifndef DATAXFER
 #define DATAXFER
 
+#include <gensio/gensio.h>
 #include "controller.h"
 
 #ifdef linux
@@ -36,6 +37,23 @@
 
 #endif /* linux */
 
+/*
+ * What to do when a network connection falls so far behind the device
+ * that the dev to net buffer is full.  Block stops reading from the
+ * device until it catches up, drop closes the connection, and skip
+ * throws away the oldest data for that connection.
+ */
+enum laggard_policy { LAGGARD_BLOCK, LAGGARD_DROP, LAGGARD_SKIP };
+extern struct gensio_enum_val laggard_policy_enums[];
+
+/*
+ * How to wait for more characters before sending device data to the
+ * network.  On uses a delay computed from the bit rate, adaptive
+ * learns it from the traffic.
+ */
+enum chardelay_mode { CHARDELAY_OFF, CHARDELAY_ON, CHARDELAY_ADAPTIVE };
+extern struct gensio_enum_val chardelay_enums[];
+
 /* Create a port given the criteria. */
 int portconfig(struct absout *eout,
 	       const char *name,
@@ -46,6 +64,12 @@ int portconfig(struct absout *eout,
 	       const char * const *devcfg);
 void apply_new_ports(void);
 
+/*
+ * Ports are started in the background after apply_new_ports(), wait
+ * until they all have been.
+ */
+void dataxfer_wait_startup(void);
+
 /* Shut down all the ports, and provide a way to check when done. */
 void shutdown_ports(void);
 int check_ports_shutdown(void);
@@ -61,39 +85,56 @@ void showports(struct controller_info *cntlr, char *portspec);
 /* Show information about a port (as above) but in a one-line format. */
 void showshortports(struct controller_info *cntlr, char *portspec);
 
+/*
+ * The following commands are run in the port's thread.  They return
+ * true if the command was queued, then controller_op_done() is called
+ * with its output when it is done.  On false, the error is already
+ * output to the controller.
+ */
+
 /* Set the port's timeout.  The parameters are all strings that the
    routine will convert to integers.  Error output will be generated
    on invalid data. */
-void setporttimeout(struct controller_info *cntlr,
+bool setporttimeout(struct controller_info *cntlr,
 		    char *portspec,
 		    char *timeout);
 
 /* Modify the DTR and RTS lines for the port. */
-void setportcontrol(struct controller_info *cntlr,
+bool setportcontrol(struct controller_info *cntlr,
 		    char *portspec,
 		    char *controls);
 
 /* Set the enable state of a port (off, raw, telnet).  The parameters
    are all strings that the routine will convert to integers.  Error
    output will be generated on invalid data. */
-void setportenable(struct controller_info *cntlr,
+bool setportenable(struct controller_info *cntlr,
 		   char *portspec,
 		   char *enable);
 
-/* Start data monitoring on the given port, type may be either "tcp" or
-   "term" and only one direction may be monitored.  This return NULL if
-   the monitor fails.  The monitor output will go to the controller
-   via the controller_write() call. */
-void *data_monitor_start(struct controller_info *cntlr,
-			 char *type,
-			 char *portspec);
+struct tap_sub;
+
+/* Start data monitoring on the given port, type may be "tcp", "term",
+   or "both".  This return NULL if the monitor fails.  The monitor
+   output will go to the controller, controller_monitor_ready() is
+   called when there is data. */
+struct tap_sub *data_monitor_start(struct controller_info *cntlr,
+				   char *type,
+				   char *portspec);
 
 /* Stop monitoring the given id. */
 void data_monitor_stop(struct controller_info *cntlr,
-		       void   *monitor_id);
-
-/* Shut down the port, if it is connected. */
-void disconnect_port(struct controller_info *cntlr,
+		       struct tap_sub *monitor_id);
+
+/* Subscribe to the data of the named port, see tap_subscribe().
+   Returns GE_NOTFOUND if there is no such port. */
+int dataxfer_tap_subscribe(const char *name, unsigned int dirs,
+			   gensiods max_lag,
+			   void (*ready)(void *cb_data), void *cb_data,
+			   struct tap_sub **rsub);
+
+/* Shut down the port, if it is connected.  This is run in the port's
+   thread, like setporttimeout(). */
+bool disconnect_port(struct controller_info *cntlr,
 		     char *portspec);
 
 struct devio;
@@ -110,4 +151,9 @@ int add_rotator(const char *name, const char *accstr,
 
 void free_rotators(void);
 
+struct metrics_buf;
+
+/* Add the statistics for all the ports to b, see metrics.h. */
+void dataxfer_metrics(struct metrics_buf *b);
+
 #endif /* DATAXFER */
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <syslog.h>
 
+#include "ser2net.h"
 #include "led.h"
 #include "led_sysfs.h"
 
@@ -68,6 +69,68 @@ led_driver_register(struct led_driver_s *led_driver)
     return 0;
 }
 
+static void
+led_finish_free(struct led_s *led)
+{
+    if (led->timer)
+	so->free_timer(led->timer);
+    if (led->lock)
+	so->free_lock(led->lock);
+    free(led->name);
+    free(led);
+}
+
+static void
+led_timeout(struct gensio_timer *timer, void *cb_data)
+{
+    struct led_s *led = cb_data;
+    struct timeval timeout;
+
+    so->lock(led->lock);
+    if (led->closing) {
+	so->unlock(led->lock);
+	led_finish_free(led);
+	return;
+    }
+
+    if (led->flash_pending) {
+	/* Keep the timer going until a period passes with no flashes. */
+	led->flash_pending = false;
+	led->driver->flash(led->drv_data);
+	timeout.tv_sec = led->period_ms / 1000;
+	timeout.tv_usec = (led->period_ms % 1000) * 1000;
+	so->start_timer(led->timer, &timeout);
+    } else {
+	led->timer_running = false;
+    }
+    so->unlock(led->lock);
+}
+
+static void
+led_timer_stopped(struct gensio_timer *timer, void *cb_data)
+{
+    led_finish_free(cb_data);
+}
+
+static int
+led_setup_timer(struct led_s *led)
+{
+    led->period_ms = led->driver->flash_period(led->drv_data);
+    if (led->period_ms == 0)
+	return 0;
+
+    led->lock = so->alloc_lock(so);
+    if (!led->lock)
+	return -1;
+    led->timer = so->alloc_timer(so, led_timeout, led);
+    if (!led->timer) {
+	so->free_lock(led->lock);
+	led->lock = NULL;
+	return -1;
+    }
+    return 0;
+}
+
 struct led_s *
 find_led(const char *name)
 {
@@ -139,6 +202,17 @@ add_led(const char *name, const char *driverstr, const char * const *options,
 	}
     }
 
+    if (led->driver->flash_period && led_setup_timer(led) < 0) {
+	syslog(LOG_ERR, "Out of memory handling LED '%s' on %d", name, lineno);
+	if (led->driver->deconfigure)
+	    led->driver->deconfigure(led->drv_data);
+	if (led->driver->free)
+	    led->driver->free(led);
+	free(led->name);
+	free(led);
+	return -1;
+    }
+
     led->next = leds;
     leds = led;
     return 0;
@@ -149,23 +223,60 @@ free_leds(void)
 {
     while (leds) {
 	struct led_s *led = leds;
+	bool finish = true;
+
 	leds = leds->next;
 
-	/* let driver deconfigure the LED */
+	if (led->lock) {
+	    so->lock(led->lock);
+	    led->closing = true;
+	}
+
+	/*
+	 * let driver deconfigure the LED.  Do this now even if the timer
+	 * is still running, a new config may set up the same LED.
+	 */
 	if (led->driver->deconfigure)
-	    led->driver->deconfigure(led);
+	    led->driver->deconfigure(led->drv_data);
 
 	/* let driver free its own data when it registered a cleanup function */
 	if (led->driver->free)
 	    led->driver->free(led);
 
-	free(led->name);
-	free(led);
+	if (led->lock) {
+	    if (led->timer_running) {
+		/*
+		 * Either the stop done handler or the timeout handler,
+		 * if it is already running, will finish the free.
+		 */
+		finish = false;
+		so->stop_timer_with_done(led->timer, led_timer_stopped, led);
+	    }
+	    so->unlock(led->lock);
+	}
+
+	if (finish)
+	    led_finish_free(led);
     }
 }
 
 int
 led_flash(struct led_s *led)
 {
-    return led->driver->flash(led->drv_data);
+    struct timeval timeout = { 0, 0 };
+
+    if (!led->timer)
+	return led->driver->flash(led->drv_data);
+
+    /* The actual flash is done from the timer. */
+    so->lock(led->lock);
+    if (!led->closing) {
+	led->flash_pending = true;
+	if (!led->timer_running) {
+	    led->timer_running = true;
+	    so->start_timer(led->timer, &timeout);
+	}
+    }
+    so->unlock(led->lock);
+    return 0;
 }
@@ -21,7 +21,11 @@
 #ifndef LED_H
 #define LED_H
 
+#include <stdbool.h>
+
 struct led_driver_s;
+struct gensio_lock;
+struct gensio_timer;
 
 struct led_s
 {
@@ -30,6 +34,18 @@ struct led_s
 
     struct led_driver_s *driver;
     void *drv_data;
+
+    /*
+     * For drivers with a flash period, flashes are coalesced here and
+     * the driver's flash is called from the timer, at most once a
+     * period.
+     */
+    struct gensio_lock *lock;
+    struct gensio_timer *timer;
+    unsigned int period_ms;
+    bool flash_pending;
+    bool timer_running;
+    bool closing;
 };
 
 struct led_driver_s {
@@ -48,6 +64,14 @@ struct led_driver_s {
     /* required: called when data transfer should be signaled */
     int (*flash)(void *drv_data);
 
+    /*
+     * optional: returns the time in milliseconds one flash takes.  If
+     * given, flash is only called from a timer, at most once in this
+     * period no matter how often led_flash() is called.  Called after
+     * configure.
+     */
+    unsigned int (*flash_period)(void *drv_data);
+
     /* optional: called during deinitialization, could switch the LED off */
     int (*deconfigure)(void *drv_data);
 };
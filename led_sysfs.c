@@ -42,6 +42,9 @@ struct led_sysfs_s
     char *device;
     int state;
     int duration;
+
+    /* Kept open so flashing is a single write. */
+    int activate_fd;
 };
 
 static int
@@ -87,7 +90,7 @@ led_write(const char *led, const char *property, const char *buf, int lineno)
     if ((fd = open(filename, O_WRONLY | O_TRUNC)) == -1) {
 	if (lineno)
 	    snprintf(linestr, sizeof(linestr), " on line %d", lineno);
-	syslog(LOG_ERR, "Unable to open to LED %s%s: %s", linestr, led,
+	syslog(LOG_ERR, "Unable to open LED %s%s: %s", led, linestr,
 	       strerror(errno));
 	return -1;
     }
@@ -95,7 +98,7 @@ led_write(const char *led, const char *property, const char *buf, int lineno)
     if (write(fd, buf, strlen(buf)) != strlen(buf)) {
 	if (lineno)
 	    snprintf(linestr, sizeof(linestr), " on line %d", lineno);
-	syslog(LOG_ERR, "Unable to write to LED %s%s: %s", linestr, led,
+	syslog(LOG_ERR, "Unable to write to LED %s%s: %s", led, linestr,
 	       strerror(errno));
 	close(fd);
 	return -1;
@@ -122,6 +125,7 @@ led_sysfs_init(struct led_s *led, const char * const *options, int lineno)
 
     /* preset to detect default and/or wrong user input */
     drv_data->state = -1;
+    drv_data->activate_fd = -1;
 
     for (i = 0; options[i]; i++) {
 	value = strchr(options[i], '=');
@@ -212,6 +216,7 @@ led_sysfs_configure(void *led_driver_data, int lineno)
 {
     struct led_sysfs_s *ctx = (struct led_sysfs_s *)led_driver_data;
     char buffer[255];
+    char linestr[100] = "";
     int rv = 0;
 
     /* check whether we can enable the transient trigger for this led */
@@ -233,8 +238,21 @@ led_sysfs_configure(void *led_driver_data, int lineno)
 
     snprintf(buffer, sizeof(buffer), "%d", ctx->state);
     rv |= led_write(ctx->device, "state", buffer, lineno);
+    if (rv)
+	return rv;
 
-    return rv;
+    snprintf(buffer, sizeof(buffer), "%s/%s/activate",
+	     SYSFS_LED_BASE, ctx->device);
+    ctx->activate_fd = open(buffer, O_WRONLY | O_CLOEXEC);
+    if (ctx->activate_fd == -1) {
+	if (lineno)
+	    snprintf(linestr, sizeof(linestr), " on line %d", lineno);
+	syslog(LOG_ERR, "Unable to open LED %s%s: %s", ctx->device, linestr,
+	       strerror(errno));
+	return -1;
+    }
+
+    return 0;
 }
 
 static int
@@ -242,7 +260,25 @@ led_sysfs_flash(void *led_driver_data)
 {
     struct led_sysfs_s *ctx = (struct led_sysfs_s *)led_driver_data;
 
-    return led_write(ctx->device, "activate", "1", 0);
+    if (ctx->activate_fd == -1)
+	return -1;
+
+    /* sysfs attributes are always written from the start. */
+    if (pwrite(ctx->activate_fd, "1", 1, 0) != 1) {
+	syslog(LOG_ERR, "Unable to write to LED %s: %s", ctx->device,
+	       strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+static unsigned int
+led_sysfs_flash_period(void *led_driver_data)
+{
+    struct led_sysfs_s *ctx = (struct led_sysfs_s *)led_driver_data;
+
+    /* The transient trigger keeps the LED on for the duration. */
+    return ctx->duration;
 }
 
 static int
@@ -251,6 +287,10 @@ led_sysfs_deconfigure(void *led_driver_data)
     struct led_sysfs_s *ctx = (struct led_sysfs_s *)led_driver_data;
     int rv = 0;
 
+    if (ctx->activate_fd != -1) {
+	close(ctx->activate_fd);
+	ctx->activate_fd = -1;
+    }
 
     rv |= led_write(ctx->device, "trigger", "none", 0);
     rv |= led_write(ctx->device, "brightness", "0", 0);
@@ -266,6 +306,7 @@ static struct led_driver_s led_sysfs_driver = {
 
     .configure   = led_sysfs_configure,
     .flash       = led_sysfs_flash,
+    .flash_period = led_sysfs_flash_period,
     .deconfigure = led_sysfs_deconfigure,
 };
 
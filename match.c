@@ -0,0 +1,327 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/*
+ * The automaton is a full transition table, a row of 256 next states
+ * for each state, built from a trie of the patterns with the usual
+ * Aho-Corasick failure links folded in.  There is a state for each
+ * byte of the patterns plus the start, so the limit on the pattern
+ * size keeps the table small.  Each state has the mask of patterns
+ * that end there, including ones that are suffixes of others.
+ *
+ * For skipping, the bytes that leave the start state are kept.  With
+ * up to MATCH_MEMCHR_MAX of them, memchr() looks for each and the
+ * nearest one wins, remembering how far each search got so nothing
+ * is searched twice.  With more, it's a loop over the start row.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <gensio/gensio.h>
+
+#include "match.h"
+
+#define MATCH_MEMCHR_MAX	3
+#define MATCH_NO_STATE		0xffff
+
+struct match_pattern {
+    char *data;
+    gensiods len;
+    unsigned int actions;
+    char *str;
+};
+
+struct matcher {
+    struct match_pattern pats[MATCH_MAX_PATTERNS];
+    unsigned int npats;
+    gensiods total_len;
+    unsigned int actions;
+
+    /* Set up by matcher_compile(). */
+    bool compiled;
+    unsigned int nstates;
+    uint16_t *next;		/* nstates rows of 256. */
+    uint32_t *out;		/* Patterns that end in each state. */
+    unsigned int nstart;	/* Bytes that leave the start state. */
+    unsigned char start[MATCH_MEMCHR_MAX];
+};
+
+struct matcher *
+matcher_alloc(void)
+{
+    struct matcher *m = malloc(sizeof(*m));
+
+    if (m)
+	memset(m, 0, sizeof(*m));
+    return m;
+}
+
+static void
+matcher_uncompile(struct matcher *m)
+{
+    if (m->next)
+	free(m->next);
+    if (m->out)
+	free(m->out);
+    m->next = NULL;
+    m->out = NULL;
+    m->compiled = false;
+}
+
+void
+matcher_free(struct matcher *m)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->npats; i++) {
+	free(m->pats[i].data);
+	free(m->pats[i].str);
+    }
+    matcher_uncompile(m);
+    free(m);
+}
+
+/* Make a printable copy of the pattern for logs. */
+static char *
+pattern_to_str(const char *data, gensiods len)
+{
+    char *s, *p;
+    gensiods i;
+
+    s = malloc(len * 4 + 1);
+    if (!s)
+	return NULL;
+    for (p = s, i = 0; i < len; i++) {
+	unsigned char c = data[i];
+
+	if (isprint(c) && c != '\\')
+	    *p++ = c;
+	else
+	    p += sprintf(p, "\\x%2.2x", c);
+    }
+    *p = '\0';
+    return s;
+}
+
+int
+matcher_add(struct matcher *m, const char *pattern, gensiods len,
+	    unsigned int actions)
+{
+    struct match_pattern *p;
+
+    if (len == 0)
+	return GE_INVAL;
+    if (m->npats >= MATCH_MAX_PATTERNS || m->total_len + len > MATCH_MAX_LEN)
+	return GE_TOOBIG;
+
+    p = &m->pats[m->npats];
+    p->data = malloc(len);
+    if (!p->data)
+	return GE_NOMEM;
+    memcpy(p->data, pattern, len);
+    p->str = pattern_to_str(pattern, len);
+    if (!p->str) {
+	free(p->data);
+	return GE_NOMEM;
+    }
+    p->len = len;
+    p->actions = actions;
+    m->npats++;
+    m->total_len += len;
+    m->actions |= actions;
+    matcher_uncompile(m);
+    return 0;
+}
+
+int
+matcher_compile(struct matcher *m)
+{
+    unsigned int i, s, t, nstates, head, tail, c;
+    uint16_t *next, *queue = NULL, *fail = NULL;
+    uint32_t *out;
+    gensiods j;
+
+    matcher_uncompile(m);
+    nstates = m->total_len + 1;
+    next = malloc(sizeof(*next) * 256 * nstates);
+    out = malloc(sizeof(*out) * nstates);
+    queue = malloc(sizeof(*queue) * nstates);
+    fail = malloc(sizeof(*fail) * nstates);
+    if (!next || !out || !queue || !fail)
+	goto out_nomem;
+    for (i = 0; i < 256 * nstates; i++)
+	next[i] = MATCH_NO_STATE;
+    memset(out, 0, sizeof(*out) * nstates);
+
+    /* The trie. */
+    nstates = 1;
+    for (i = 0; i < m->npats; i++) {
+	const unsigned char *d = (const unsigned char *) m->pats[i].data;
+
+	for (s = 0, j = 0; j < m->pats[i].len; j++) {
+	    if (next[s * 256 + d[j]] == MATCH_NO_STATE)
+		next[s * 256 + d[j]] = nstates++;
+	    s = next[s * 256 + d[j]];
+	}
+	out[s] |= 1U << i;
+    }
+
+    /*
+     * Go through the states breadth first, so a state's failure state
+     * is always done before it.  A row only has trie edges until it is
+     * done, the missing ones come from the failure state's row.
+     */
+    head = tail = 0;
+    for (c = 0; c < 256; c++) {
+	t = next[c];
+	if (t == MATCH_NO_STATE) {
+	    next[c] = 0;
+	} else {
+	    fail[t] = 0;
+	    queue[tail++] = t;
+	}
+    }
+    while (head < tail) {
+	s = queue[head++];
+	out[s] |= out[fail[s]];
+	for (c = 0; c < 256; c++) {
+	    t = next[s * 256 + c];
+	    if (t == MATCH_NO_STATE) {
+		next[s * 256 + c] = next[fail[s] * 256 + c];
+	    } else {
+		fail[t] = next[fail[s] * 256 + c];
+		queue[tail++] = t;
+	    }
+	}
+    }
+
+    m->nstart = 0;
+    for (c = 0; c < 256; c++) {
+	if (next[c] == 0)
+	    continue;
+	if (m->nstart < MATCH_MEMCHR_MAX)
+	    m->start[m->nstart] = c;
+	m->nstart++;
+    }
+
+    free(queue);
+    free(fail);
+    m->next = next;
+    m->out = out;
+    m->nstates = nstates;
+    m->compiled = true;
+    return 0;
+
+ out_nomem:
+    if (next)
+	free(next);
+    if (out)
+	free(out);
+    if (queue)
+	free(queue);
+    if (fail)
+	free(fail);
+    return GE_NOMEM;
+}
+
+unsigned int
+matcher_actions(const struct matcher *m)
+{
+    return m->actions;
+}
+
+unsigned int
+matcher_pattern_actions(const struct matcher *m, unsigned int n)
+{
+    return m->pats[n].actions;
+}
+
+const char *
+matcher_pattern_str(const struct matcher *m, unsigned int n)
+{
+    return m->pats[n].str;
+}
+
+/*
+ * Return the position of the first byte at or after pos that can
+ * start a pattern, or len if none.  found[] holds where the last
+ * memchr() for each start byte found it, or len if it isn't there,
+ * and only needs to be searched again once pos catches up with it.
+ */
+static gensiods
+match_skip(const struct matcher *m, const unsigned char *data,
+	   gensiods pos, gensiods len, gensiods *found)
+{
+    const unsigned char *p;
+    gensiods best = len;
+    unsigned int i;
+
+    if (m->nstart > MATCH_MEMCHR_MAX) {
+	while (pos < len && m->next[data[pos]] == 0)
+	    pos++;
+	return pos;
+    }
+
+    for (i = 0; i < m->nstart; i++) {
+	if (found[i] <= pos) {
+	    p = memchr(data + pos, m->start[i], len - pos);
+	    found[i] = p ? p - data : len;
+	}
+	if (found[i] < best)
+	    best = found[i];
+    }
+    return best;
+}
+
+bool
+matcher_scan(const struct matcher *m, unsigned int *state,
+	     const unsigned char *data, gensiods len,
+	     gensiods *end, uint32_t *matched)
+{
+    unsigned int s = *state;
+    gensiods pos = 0, found[MATCH_MEMCHR_MAX];
+    unsigned int i;
+
+    for (i = 0; i < MATCH_MEMCHR_MAX; i++)
+	found[i] = 0;
+    if (m->nstart == 0) {
+	pos = len;
+	goto out;
+    }
+    while (pos < len) {
+	if (s == 0) {
+	    pos = match_skip(m, data, pos, len, found);
+	    if (pos >= len)
+		break;
+	}
+	s = m->next[s * 256 + data[pos++]];
+	if (m->out[s]) {
+	    *state = s;
+	    *end = pos;
+	    *matched = m->out[s];
+	    return true;
+	}
+    }
+ out:
+    *state = s;
+    return false;
+}
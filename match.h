@@ -0,0 +1,86 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gensio/gensio.h>
+
+/*
+ * Look for several patterns in a stream of data in one pass.  The
+ * patterns are compiled into an Aho-Corasick automaton, so
+ * overlapping matches are found, and the state is kept by the caller
+ * so a match can be split across reads.  When nothing is partly
+ * matched, memchr() skips ahead to a byte that can start a pattern,
+ * so data that doesn't match costs little more than a memchr().
+ */
+
+/* What to do when a pattern is seen, as a bitmask. */
+#define MATCH_CLOSE	(1 << 0)	/* Close the connections. */
+#define MATCH_LOG	(1 << 1)	/* Log it. */
+#define MATCH_NOTIFY	(1 << 2)	/* Tell the controllers. */
+
+/* Limits, patterns are reported in a 32 bit mask. */
+#define MATCH_MAX_PATTERNS	32
+#define MATCH_MAX_LEN		1024	/* Of all the patterns together. */
+
+struct matcher;
+
+/* Returns NULL on out of memory. */
+struct matcher *matcher_alloc(void);
+void matcher_free(struct matcher *m);
+
+/*
+ * Add a pattern with the given actions.  Returns GE_INVAL for an empty
+ * pattern, GE_TOOBIG if over the limits, or GE_NOMEM.  Adding a
+ * pattern undoes matcher_compile().
+ */
+int matcher_add(struct matcher *m, const char *pattern, gensiods len,
+		unsigned int actions);
+
+/* Build the automaton after adding patterns.  Returns 0 or GE_NOMEM. */
+int matcher_compile(struct matcher *m);
+
+/* The actions of all the patterns or'ed together. */
+unsigned int matcher_actions(const struct matcher *m);
+
+/* The actions of pattern n, and a printable version of it. */
+unsigned int matcher_pattern_actions(const struct matcher *m, unsigned int n);
+const char *matcher_pattern_str(const struct matcher *m, unsigned int n);
+
+/* The state when nothing has been seen. */
+#define MATCH_STATE_INIT	0
+
+/*
+ * Scan len bytes of data starting in *state, which must have been
+ * compiled.  If a pattern ends in the data, this returns true with
+ * *end set to the number of bytes up to and including the end of the
+ * pattern and *matched set to the bit for each pattern that ended
+ * there.  Call again with the rest of the data to look for more.  If
+ * it returns false, all the data was looked at.  *state is updated to
+ * carry on with the next data either way.
+ */
+bool matcher_scan(const struct matcher *m, unsigned int *state,
+		  const unsigned char *data, gensiods len,
+		  gensiods *end, uint32_t *matched);
+
+#endif /* MATCH_H */
@@ -0,0 +1,490 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * This file holds the statistics output and the HTTP accepter that
+ * serves it in the Prometheus text format.  The HTTP side is as
+ * simple as it can be: read one request, answer it, and close.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <gensio/gensio.h>
+
+#include "ser2net.h"
+#include "dataxfer.h"
+#include "readconfig.h"
+#include "metrics.h"
+
+void
+metrics_hist_add(struct metrics_hist *h, uint64_t usecs)
+{
+    unsigned int i;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+	if (usecs <= (1ULL << i))
+	    break;
+    }
+    metrics_add(&h->buckets[i], 1);
+    metrics_add(&h->sum, usecs);
+    metrics_add(&h->count, 1);
+}
+
+uint64_t
+metrics_hist_percentile(struct metrics_hist *h, unsigned int pct)
+{
+    uint64_t count = 0, total = 0, want, n, low, high;
+    unsigned int i;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS; i++)
+	total += metrics_get(&h->buckets[i]);
+    if (total == 0)
+	return 0;
+
+    /* The rank of the value we want, starting at 1. */
+    want = (total * pct + 99) / 100;
+    if (want == 0)
+	want = 1;
+    for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+	n = metrics_get(&h->buckets[i]);
+	if (count + n >= want)
+	    break;
+	count += n;
+    }
+    if (i == METRICS_HIST_BUCKETS - 1)
+	/* Off the end, all we know is that it's bigger than this. */
+	return 1ULL << (i - 1);
+
+    low = i ? 1ULL << (i - 1) : 0;
+    high = 1ULL << i;
+    return low + (high - low) * (want - count) / n;
+}
+
+void
+metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    if (b->failed)
+	return;
+ retry:
+    va_start(ap, fmt);
+    len = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+	b->failed = true;
+	return;
+    }
+    if ((size_t) len >= b->size - b->len) {
+	size_t nsize = b->size ? b->size * 2 : 4096;
+	char *nbuf;
+
+	while (nsize - b->len <= (size_t) len)
+	    nsize *= 2;
+	nbuf = realloc(b->buf, nsize);
+	if (!nbuf) {
+	    b->failed = true;
+	    return;
+	}
+	b->buf = nbuf;
+	b->size = nsize;
+	goto retry;
+    }
+    b->len += len;
+}
+
+void
+metrics_label(struct metrics_buf *b, const char *str)
+{
+    for (; *str; str++) {
+	if (*str == '\\')
+	    metrics_printf(b, "\\\\");
+	else if (*str == '"')
+	    metrics_printf(b, "\\\"");
+	else if (*str == '\n')
+	    metrics_printf(b, "\\n");
+	else
+	    metrics_printf(b, "%c", *str);
+    }
+}
+
+void
+metrics_header(struct metrics_buf *b, const char *name,
+	       const char *type, const char *help)
+{
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void
+metrics_hist_output(struct metrics_buf *b, const char *name,
+		    const char *labels, struct metrics_hist *h)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+	total += metrics_get(&h->buckets[i]);
+	metrics_printf(b, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+		       (1ULL << i) / 1e6, (unsigned long long) total);
+    }
+    total += metrics_get(&h->buckets[i]);
+    metrics_printf(b, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+		   (unsigned long long) total);
+    metrics_printf(b, "%s_sum{%s} %g\n", name, labels,
+		   metrics_get(&h->sum) / 1e6);
+    metrics_printf(b, "%s_count{%s} %llu\n", name, labels,
+		   (unsigned long long) metrics_get(&h->count));
+}
+
+#define MAX_METRICS_CONNS	8
+#define MAX_REQUEST_SIZE	4096
+
+struct metrics_conn {
+    struct gensio *net;
+    char req[MAX_REQUEST_SIZE];
+    size_t reqlen;
+    char *out;
+    size_t outlen;
+    size_t outpos;
+    bool closing;
+    struct metrics_conn *next;
+};
+
+static struct gensio_lock *metrics_lock;
+static struct gensio_accepter *metrics_accepter;
+static struct gensio_waiter *metrics_waiter;
+/* Separate from metrics_waiter, a connection closing must not wake it. */
+static struct gensio_waiter *metrics_acc_waiter;
+static char *metrics_authdir;
+static struct metrics_conn *metrics_conns;
+static unsigned int num_metrics_conns;
+
+static void
+metrics_close_done(struct gensio *net, void *cb_data)
+{
+    struct metrics_conn *c = cb_data, **cp;
+
+    gensio_free(net);
+    so->lock(metrics_lock);
+    for (cp = &metrics_conns; *cp; cp = &(*cp)->next) {
+	if (*cp == c) {
+	    *cp = c->next;
+	    break;
+	}
+    }
+    num_metrics_conns--;
+    so->unlock(metrics_lock);
+    free(c->out);
+    free(c);
+    so->wake(metrics_waiter);
+}
+
+/* Must be called with metrics_lock held. */
+static void
+metrics_close(struct metrics_conn *c)
+{
+    if (c->closing)
+	return;
+    c->closing = true;
+    gensio_set_read_callback_enable(c->net, false);
+    gensio_set_write_callback_enable(c->net, false);
+    if (gensio_close(c->net, metrics_close_done, c)) {
+	struct metrics_conn **cp;
+
+	/* Already closed underneath us, just free it. */
+	for (cp = &metrics_conns; *cp; cp = &(*cp)->next) {
+	    if (*cp == c) {
+		*cp = c->next;
+		break;
+	    }
+	}
+	num_metrics_conns--;
+	gensio_free(c->net);
+	free(c->out);
+	free(c);
+	so->wake(metrics_waiter);
+    }
+}
+
+static void
+metrics_respond(struct metrics_conn *c, const char *status,
+		struct metrics_buf *body)
+{
+    struct metrics_buf b = { NULL, 0, 0, false };
+
+    metrics_printf(&b, "HTTP/1.0 %s\r\n"
+		   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		   "Content-Length: %lu\r\n"
+		   "Connection: close\r\n\r\n",
+		   status, (unsigned long) (body ? body->len : 0));
+    if (body && body->len)
+	metrics_printf(&b, "%.*s", (int) body->len, body->buf);
+    if (b.failed) {
+	free(b.buf);
+	metrics_close(c);
+	return;
+    }
+    c->out = b.buf;
+    c->outlen = b.len;
+    c->outpos = 0;
+    gensio_set_write_callback_enable(c->net, true);
+}
+
+/* A full request header is in, answer it. */
+static void
+metrics_handle_request(struct metrics_conn *c)
+{
+    struct metrics_buf body = { NULL, 0, 0, false };
+    char *path, *end;
+
+    gensio_set_read_callback_enable(c->net, false);
+    c->req[c->reqlen] = '\0';
+    if (strncmp(c->req, "GET ", 4) != 0) {
+	metrics_respond(c, "405 Method Not Allowed", NULL);
+	return;
+    }
+    path = c->req + 4;
+    end = path + strcspn(path, " ?\r\n");
+    if (end - path != 8 || strncmp(path, "/metrics", 8) != 0) {
+	metrics_respond(c, "404 Not Found", NULL);
+	return;
+    }
+
+    dataxfer_metrics(&body);
+    if (body.failed)
+	metrics_respond(c, "500 Internal Server Error", NULL);
+    else
+	metrics_respond(c, "200 OK", &body);
+    free(body.buf);
+}
+
+static gensiods
+metrics_read(struct metrics_conn *c, int err, unsigned char *buf,
+	     gensiods buflen)
+{
+    gensiods count = buflen;
+
+    if (err) {
+	metrics_close(c);
+	return buflen;
+    }
+
+    if (count > sizeof(c->req) - 1 - c->reqlen)
+	count = sizeof(c->req) - 1 - c->reqlen;
+    memcpy(c->req + c->reqlen, buf, count);
+    c->reqlen += count;
+    c->req[c->reqlen] = '\0';
+    if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n"))
+	metrics_handle_request(c);
+    else if (c->reqlen >= sizeof(c->req) - 1)
+	metrics_respond(c, "431 Request Header Fields Too Large", NULL);
+
+    return buflen;
+}
+
+static void
+metrics_write_ready(struct metrics_conn *c)
+{
+    gensiods count;
+    int err;
+
+    err = gensio_write(c->net, &count, c->out + c->outpos,
+		       c->outlen - c->outpos, NULL);
+    if (err) {
+	metrics_close(c);
+	return;
+    }
+    c->outpos += count;
+    if (c->outpos >= c->outlen)
+	metrics_close(c);
+}
+
+static int
+metrics_io_event(struct gensio *net, void *user_data, int event, int err,
+		 unsigned char *buf, gensiods *buflen,
+		 const char *const *auxdata)
+{
+    struct metrics_conn *c = user_data;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	so->lock(metrics_lock);
+	if (!c->closing && !c->out)
+	    *buflen = metrics_read(c, err, buf, *buflen);
+	so->unlock(metrics_lock);
+	return 0;
+
+    case GENSIO_EVENT_WRITE_READY:
+	so->lock(metrics_lock);
+	if (!c->closing && c->out)
+	    metrics_write_ready(c);
+	so->unlock(metrics_lock);
+	return 0;
+    }
+
+    return GE_NOTSUP;
+}
+
+static int
+metrics_new_con(struct gensio *net)
+{
+    struct metrics_conn *c;
+    const char *err = "HTTP/1.0 503 Service Unavailable\r\n\r\n";
+
+    so->lock(metrics_lock);
+    if (num_metrics_conns >= MAX_METRICS_CONNS)
+	goto out_err;
+    c = calloc(1, sizeof(*c));
+    if (!c)
+	goto out_err;
+    c->net = net;
+    c->next = metrics_conns;
+    metrics_conns = c;
+    num_metrics_conns++;
+    gensio_set_callback(net, metrics_io_event, c);
+    gensio_set_read_callback_enable(net, true);
+    so->unlock(metrics_lock);
+    return 0;
+
+ out_err:
+    so->unlock(metrics_lock);
+    gensio_write(net, NULL, err, strlen(err), NULL);
+    gensio_free(net);
+    return 0;
+}
+
+static int
+metrics_acc_event(struct gensio_accepter *accepter, void *user_data,
+		  int event, void *data)
+{
+    switch (event) {
+    case GENSIO_ACC_EVENT_NEW_CONNECTION:
+	return metrics_new_con(data);
+
+    default:
+	return handle_acc_auth_event(metrics_authdir, event, data);
+    }
+}
+
+static void
+metrics_acc_shutdown_done(struct gensio_accepter *acc, void *cb_data)
+{
+    so->wake(metrics_acc_waiter);
+}
+
+int
+metrics_init(const char *accstr, const char **options,
+	     struct absout *eout)
+{
+    unsigned int i;
+    const char *val;
+    int rv;
+
+    if (metrics_accepter) {
+	eout->out(eout, "Metrics accepter already configured");
+	return EBUSY;
+    }
+
+    if (!metrics_lock) {
+	metrics_lock = so->alloc_lock(so);
+	if (!metrics_lock)
+	    goto out_nomem;
+    }
+    if (!metrics_waiter) {
+	metrics_waiter = so->alloc_waiter(so);
+	if (!metrics_waiter)
+	    goto out_nomem;
+    }
+    if (!metrics_acc_waiter) {
+	metrics_acc_waiter = so->alloc_waiter(so);
+	if (!metrics_acc_waiter)
+	    goto out_nomem;
+    }
+
+    for (i = 0; options && options[i]; i++) {
+	if (gensio_check_keyvalue(options[i], "authdir-metrics", &val) > 0) {
+	    char *s = strdup(val);
+
+	    if (!s)
+		goto out_nomem;
+	    free(metrics_authdir);
+	    metrics_authdir = s;
+	    continue;
+	}
+	eout->out(eout, "Invalid option to metrics: %s", options[i]);
+	return EINVAL;
+    }
+
+    rv = str_to_gensio_accepter(accstr, so, metrics_acc_event, NULL,
+				&metrics_accepter);
+    if (rv) {
+	eout->out(eout, "Unable to allocate metrics accepter: %s",
+		  gensio_err_to_str(rv));
+	return rv;
+    }
+
+    rv = gensio_acc_startup(metrics_accepter);
+    if (rv) {
+	eout->out(eout, "Unable to start metrics accepter: %s",
+		  gensio_err_to_str(rv));
+	gensio_acc_free(metrics_accepter);
+	metrics_accepter = NULL;
+	return rv;
+    }
+    return 0;
+
+ out_nomem:
+    eout->out(eout, "Unable to allocate memory for metrics");
+    return ENOMEM;
+}
+
+void
+metrics_shutdown(void)
+{
+    struct metrics_conn *c, *next;
+
+    if (!metrics_accepter)
+	return;
+
+    if (!gensio_acc_shutdown(metrics_accepter, metrics_acc_shutdown_done,
+			     NULL))
+	so->wait(metrics_acc_waiter, 1, NULL);
+    gensio_acc_free(metrics_accepter);
+    metrics_accepter = NULL;
+
+    so->lock(metrics_lock);
+    for (c = metrics_conns; c; c = next) {
+	next = c->next;
+	metrics_close(c);
+    }
+    while (num_metrics_conns > 0) {
+	so->unlock(metrics_lock);
+	so->wait(metrics_waiter, 1, NULL);
+	so->lock(metrics_lock);
+    }
+    so->unlock(metrics_lock);
+
+    free(metrics_authdir);
+    metrics_authdir = NULL;
+}
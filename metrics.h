@@ -0,0 +1,113 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "absout.h"
+
+/*
+ * Statistics counters.  Each counter only has one writer at a time,
+ * the data path holding the port lock, so an add is a relaxed load
+ * and store, with no locked instructions.  Readers just load them,
+ * so a scrape never takes the port locks.
+ */
+typedef atomic_uint_fast64_t metrics_counter;
+
+static inline void
+metrics_add(metrics_counter *c, uint64_t v)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+			  memory_order_relaxed);
+}
+
+static inline uint64_t
+metrics_get(metrics_counter *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static inline void
+metrics_reset(metrics_counter *c)
+{
+    atomic_store_explicit(c, 0, memory_order_relaxed);
+}
+
+/*
+ * A latency histogram in microseconds.  Bucket i counts values up to
+ * 2^i usecs, the last bucket is everything bigger.
+ */
+#define METRICS_HIST_BUCKETS 22
+
+struct metrics_hist {
+    metrics_counter buckets[METRICS_HIST_BUCKETS];
+    metrics_counter sum;		/* In usecs. */
+    metrics_counter count;
+};
+
+void metrics_hist_add(struct metrics_hist *h, uint64_t usecs);
+
+/*
+ * Estimate the given percentile of a histogram, in usecs, by
+ * interpolating inside the bucket it falls in.  Returns 0 if the
+ * histogram is empty.
+ */
+uint64_t metrics_hist_percentile(struct metrics_hist *h, unsigned int pct);
+
+/* A growing buffer to format the metrics into. */
+struct metrics_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+    bool failed;			/* Ran out of memory. */
+};
+
+void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/* Output a label value with the needed escapes. */
+void metrics_label(struct metrics_buf *b, const char *str);
+
+/* Output "# HELP" and "# TYPE" lines for a metric. */
+void metrics_header(struct metrics_buf *b, const char *name,
+		    const char *type, const char *help);
+
+/*
+ * Output the bucket, sum, and count lines of a histogram, in seconds.
+ * labels is the label text for the metric, like port="x".
+ */
+void metrics_hist_output(struct metrics_buf *b, const char *name,
+			 const char *labels, struct metrics_hist *h);
+
+/*
+ * Start the HTTP accepter the metrics are read from, at /metrics.
+ * Errors are reported on eout.  Returns 0 or an errno.
+ */
+int metrics_init(const char *accstr, const char **options,
+		 struct absout *eout);
+
+/* Stop the accepter and close any connections. */
+void metrics_shutdown(void);
+
+#endif /* METRICS_H */
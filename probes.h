@@ -0,0 +1,69 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static (USDT) probes for systemtap and bpftrace, in the "ser2net"
+ * provider.  These are only built in with --with-usdt, otherwise they
+ * compile to nothing and their arguments are never evaluated, so the
+ * arguments must not have side effects.
+ *
+ * Every probe has the port name as arg0 and the connection index as
+ * arg1, -1 if it's about the device.  The rest are byte counts or
+ * flags, see the probe list in ser2net(8).
+ *
+ * When nothing is attached, the probe itself is a nop, but its
+ * arguments are still worked out.  Each probe has a semaphore that
+ * the tracer sets while it is attached, so an argument that takes
+ * real work can be guarded with PROBE_ENABLED().  The file with the
+ * probes defines their semaphores with PROBE_SEMAPHORE().
+ */
+
+#ifdef USE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short ser2net_##name##_semaphore \
+	__attribute__ ((unused)) __attribute__ ((section(".probes")))
+#define PROBE_ENABLED(name) \
+    __builtin_expect(ser2net_##name##_semaphore != 0, 0)
+
+#define PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(ser2net, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(ser2net, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(ser2net, name, a1, a2, a3, a4)
+#else
+#define PROBE_ENABLED(name) 0
+
+/* Still reference the arguments, so they don't look unused. */
+#define PROBE2(name, a1, a2) \
+    do { if (0) { (void) (a1); (void) (a2); } } while (0)
+#define PROBE3(name, a1, a2, a3) \
+    do { if (0) { (void) (a1); (void) (a2); (void) (a3); } } while (0)
+#define PROBE4(name, a1, a2, a3, a4) \
+    do { if (0) { (void) (a1); (void) (a2); (void) (a3); (void) (a4); } \
+    } while (0)
+#endif
+
+#endif /* PROBES_H */
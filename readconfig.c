@@ -29,6 +29,7 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <gensio/gensio.h>
 #include <gensio/argvutils.h>
 
@@ -36,11 +37,182 @@
 #include "dataxfer.h"
 #include "readconfig.h"
 #include "led.h"
+#include "trace.h"
 
 #define PORT_BUFSIZE	64	/* Default data transfer buffer size */
 
 static int lineno = 0;
 
+/*
+ * A hash of the things a connection picks up from the rest of the
+ * config, so a reload can tell if anything a connection depends on
+ * changed.  Between config_context_begin() and config_context_end()
+ * every default, named string, trace file and rs485 config the
+ * thread looks up is added with the value it got.  Defaults that
+ * only gensio reads can't be seen being looked up, so the current
+ * value of each one the config has set is added at the end.
+ */
+#define CONFIG_CONTEXT_INIT	0xcbf29ce484222325ULL	/* FNV-1a basis */
+#define CONFIG_CONTEXT_PRIME	0x100000001b3ULL
+
+static _Thread_local bool config_ctx_active;
+static _Thread_local uint64_t config_ctx;
+
+static uint64_t
+config_hash_mem(uint64_t h, const char *s, size_t len)
+{
+    size_t i;
+
+    if (!s)
+	/* NULL has to be different from an empty string. */
+	return (h ^ 0xff) * CONFIG_CONTEXT_PRIME;
+    for (i = 0; i < len; i++)
+	h = (h ^ (unsigned char) s[i]) * CONFIG_CONTEXT_PRIME;
+    return h * CONFIG_CONTEXT_PRIME;
+}
+
+static uint64_t
+config_hash_str(uint64_t h, const char *s)
+{
+    return config_hash_mem(h, s, s ? strlen(s) : 0);
+}
+
+/* Add a lookup and its result, if the thread is recording. */
+static void
+config_context_lookup(const char *kind, const char *name, const char *val,
+		      size_t len)
+{
+    if (!config_ctx_active)
+	return;
+    config_ctx = config_hash_str(config_ctx, kind);
+    config_ctx = config_hash_str(config_ctx, name);
+    config_ctx = config_hash_mem(config_ctx, val, len);
+}
+
+/* The defaults the config set, the last value for each class and name. */
+struct config_default {
+    char *class;
+    char *name;
+    char *value;
+    bool deleted;
+    struct config_default *next;
+};
+
+static struct config_default *config_defaults;
+
+/* Changes whenever a default is set or deleted, see find_default(). */
+static atomic_uint config_defaults_gen;
+
+static bool
+config_class_eq(const char *a, const char *b)
+{
+    if (!a || !b)
+	return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static void
+config_defaults_free(void)
+{
+    struct config_default *d;
+
+    while (config_defaults) {
+	d = config_defaults;
+	config_defaults = d->next;
+	free(d->class);
+	free(d->name);
+	free(d->value);
+	free(d);
+    }
+}
+
+void
+config_context_default(const char *class, const char *name,
+		       const char *value, bool deleted)
+{
+    struct config_default *d;
+
+    atomic_fetch_add(&config_defaults_gen, 1);
+    for (d = config_defaults; d; d = d->next) {
+	if (config_class_eq(d->class, class) && strcmp(d->name, name) == 0)
+	    break;
+    }
+    if (!d) {
+	d = calloc(1, sizeof(*d));
+	if (!d)
+	    goto out_nomem;
+	d->name = strdup(name);
+	if (class)
+	    d->class = strdup(class);
+	if (!d->name || (class && !d->class)) {
+	    free(d->name);
+	    free(d->class);
+	    free(d);
+	    goto out_nomem;
+	}
+	d->next = config_defaults;
+	config_defaults = d;
+    }
+    free(d->value);
+    d->value = NULL;
+    d->deleted = deleted;
+    if (value) {
+	d->value = strdup(value);
+	if (!d->value)
+	    goto out_nomem;
+    }
+    return;
+
+ out_nomem:
+    /* The worst this does is a connection not restarting on a reload. */
+    syslog(LOG_ERR, "Out of memory recording default %s", name);
+}
+
+void
+config_context_begin(void)
+{
+    config_ctx = CONFIG_CONTEXT_INIT;
+    config_ctx_active = true;
+}
+
+static bool is_ser2net_default(const char *name);
+
+uint64_t
+config_context_end(void)
+{
+    struct config_default *d;
+    uint64_t h, sum = 0;
+
+    config_ctx_active = false;
+    for (d = config_defaults; d; d = d->next) {
+	/* The ser2net ones were added when they were looked up. */
+	if ((!d->class || strcmp(d->class, "ser2net") == 0) &&
+		is_ser2net_default(d->name))
+	    continue;
+	h = config_hash_str(CONFIG_CONTEXT_INIT, d->class);
+	h = config_hash_str(h, d->name);
+	h = config_hash_str(h, d->value);
+	h = config_hash_mem(h, d->deleted ? "d" : "s", 1);
+	/* Added, so the order they were set in doesn't matter. */
+	sum += h;
+    }
+    return config_hash_mem(config_ctx, (char *) &sum, sizeof(sum));
+}
+
+/*
+ * The named strings, trace files and rs485 configs are looked up for
+ * every connection, so keep them in hash tables.  A later definition
+ * of a name goes on the front of its chain, so it overrides an
+ * earlier one like it always has.
+ */
+#define NAME_HASH_SIZE	64
+
+static unsigned int
+name_hash(const char *name)
+{
+    return ser2net_strhash(name, strlen(name)) % NAME_HASH_SIZE;
+}
+
 struct longstr_s
 {
     char *name;
@@ -51,7 +223,7 @@ struct longstr_s
 };
 
 /* All the strings in the system. */
-struct longstr_s *longstrs = NULL;
+static struct longstr_s *longstrs[NAME_HASH_SIZE];
 
 static int isoctdigit(char c)
 {
@@ -145,6 +317,7 @@ static void
 handle_longstr(const char *name, const char *line, enum str_type type)
 {
     struct longstr_s *longstr;
+    unsigned int h;
 
     /* If the user gave an empty string, we get a NULL. */
     if (!line)
@@ -184,8 +357,9 @@ handle_longstr(const char *name, const char *line, enum str_type type)
 	}
     }
 
-    longstr->next = longstrs;
-    longstrs = longstr;
+    h = name_hash(longstr->name);
+    longstr->next = longstrs[h];
+    longstrs[h] = longstr;
     return;
 
  out_err:
@@ -200,17 +374,22 @@ handle_longstr(const char *name, const char *line, enum str_type type)
 char *
 find_str(const char *name, enum str_type *type, unsigned int *len)
 {
-    struct longstr_s *longstr = longstrs;
+    struct longstr_s *longstr = longstrs[name_hash(name)];
 
     while (longstr) {
 	if (strcmp(name, longstr->name) == 0) {
 	    char *rv;
 
 	    /* Note that longstrs can contain \0, so be careful in handling */
+	    char typestr[2] = { 'a' + longstr->type, '\0' };
+
 	    if (type)
 		*type = longstr->type;
 	    if (len)
 		*len = longstr->length;
+	    config_context_lookup("longstr", name, typestr, 1);
+	    config_context_lookup("longstrval", name, longstr->str,
+				  longstr->length);
 	    rv = malloc(longstr->length + 1);
 	    if (!rv)
 		return NULL;
@@ -225,14 +404,17 @@ find_str(const char *name, enum str_type *type, unsigned int *len)
 void
 free_longstrs(void)
 {
+    unsigned int i;
 
-    while (longstrs) {
-	struct longstr_s *longstr = longstrs;
+    for (i = 0; i < NAME_HASH_SIZE; i++) {
+	while (longstrs[i]) {
+	    struct longstr_s *longstr = longstrs[i];
 
-	longstrs = longstrs->next;
-	free(longstr->name);
-	free(longstr->str);
-	free(longstr);
+	    longstrs[i] = longstr->next;
+	    free(longstr->name);
+	    free(longstr->str);
+	    free(longstr);
+	}
     }
 }
 
@@ -244,12 +426,13 @@ struct tracefile_s
 };
 
 /* All the tracefiles in the system. */
-struct tracefile_s *tracefiles = NULL;
+static struct tracefile_s *tracefiles[NAME_HASH_SIZE];
 
 static void
 handle_tracefile(char *name, char *fname)
 {
     struct tracefile_s *new_tracefile;
+    unsigned int h;
 
     new_tracefile = malloc(sizeof(*new_tracefile));
     if (!new_tracefile) {
@@ -272,20 +455,25 @@ handle_tracefile(char *name, char *fname)
 	return;
     }
 
-    new_tracefile->next = tracefiles;
-    tracefiles = new_tracefile;
+    h = name_hash(name);
+    new_tracefile->next = tracefiles[h];
+    tracefiles[h] = new_tracefile;
 }
 
 char *
 find_tracefile(const char *name)
 {
-    struct tracefile_s *tracefile = tracefiles;
+    struct tracefile_s *tracefile = tracefiles[name_hash(name)];
 
     while (tracefile) {
-	if (strcmp(name, tracefile->name) == 0)
+	if (strcmp(name, tracefile->name) == 0) {
+	    config_context_lookup("tracefile", name, tracefile->str,
+				  strlen(tracefile->str));
 	    return strdup(tracefile->str);
+	}
 	tracefile = tracefile->next;
     }
+    config_context_lookup("tracefile", name, NULL, 0);
     syslog(LOG_ERR, "Tracefile %s not found, it will be ignored", name);
     return NULL;
 }
@@ -293,13 +481,17 @@ find_tracefile(const char *name)
 void
 free_tracefiles(void)
 {
-    while (tracefiles) {
-	struct tracefile_s *tracefile = tracefiles;
+    unsigned int i;
 
-	tracefiles = tracefiles->next;
-	free(tracefile->name);
-	free(tracefile->str);
-	free(tracefile);
+    for (i = 0; i < NAME_HASH_SIZE; i++) {
+	while (tracefiles[i]) {
+	    struct tracefile_s *tracefile = tracefiles[i];
+
+	    tracefiles[i] = tracefile->next;
+	    free(tracefile->name);
+	    free(tracefile->str);
+	    free(tracefile);
+	}
     }
 }
 
@@ -311,12 +503,13 @@ struct rs485conf
 };
 
 /* All the RS485 configs in the system. */
-struct rs485conf *rs485confs = NULL;
+static struct rs485conf *rs485confs[NAME_HASH_SIZE];
 
 static void
 handle_rs485conf(char *name, char *str)
 {
     struct rs485conf *new_rs485conf;
+    unsigned int h;
 
     new_rs485conf = malloc(sizeof(*new_rs485conf));
     if (!new_rs485conf) {
@@ -337,8 +530,9 @@ handle_rs485conf(char *name, char *str)
 	goto out_err;
     }
 
-    new_rs485conf->next = rs485confs;
-    rs485confs = new_rs485conf;
+    h = name_hash(name);
+    new_rs485conf->next = rs485confs[h];
+    rs485confs[h] = new_rs485conf;
     return;
 
  out_err:
@@ -352,13 +546,17 @@ handle_rs485conf(char *name, char *str)
 char *
 find_rs485conf(const char *name)
 {
-    struct rs485conf *rs485 = rs485confs;
+    struct rs485conf *rs485 = rs485confs[name_hash(name)];
 
     while (rs485) {
-        if (strcmp(name, rs485->name) == 0)
+        if (strcmp(name, rs485->name) == 0) {
+	    config_context_lookup("rs485", name, rs485->str,
+				  strlen(rs485->str));
             return strdup(rs485->str);
+	}
         rs485 = rs485->next;
     }
+    config_context_lookup("rs485", name, NULL, 0);
     syslog(LOG_ERR, "RS485 configuration %s not found, it will be ignored",
 	   name);
     return NULL;
@@ -367,13 +565,17 @@ find_rs485conf(const char *name)
 void
 free_rs485confs(void)
 {
-    while (rs485confs) {
-	struct rs485conf *rs485 = rs485confs;
+    unsigned int i;
 
-        rs485 = rs485->next;
-        free(rs485->str);
-        free(rs485->name);
-        free(rs485);
+    for (i = 0; i < NAME_HASH_SIZE; i++) {
+	while (rs485confs[i]) {
+	    struct rs485conf *rs485 = rs485confs[i];
+
+	    rs485confs[i] = rs485->next;
+	    free(rs485->str);
+	    free(rs485->name);
+	    free(rs485);
+	}
     }
 }
 
@@ -424,19 +626,44 @@ struct default_data defaults[] = {
     /* All port types */
     { "telnet-brk-on-sync",GENSIO_DEFAULT_BOOL,.def.intval = 0 },
     { "kickolduser",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
-    { "chardelay",	GENSIO_DEFAULT_BOOL,	.def.intval = 1 },
+    { "chardelay",	GENSIO_DEFAULT_ENUM,	.enums = chardelay_enums,
+					.def.intval = CHARDELAY_ON },
     { "chardelay-scale",GENSIO_DEFAULT_INT,	.min = 1, .max = 1000,
 					.def.intval = 20 },
     { "chardelay-min",	GENSIO_DEFAULT_INT,	.min = 1, .max = 100000,
 					.def.intval = 1000 },
     { "chardelay-max",	GENSIO_DEFAULT_INT,	.min = 1, .max = 1000000,
 					.def.intval = 20000 },
+    { "chardelay-target",GENSIO_DEFAULT_INT,	.min = 1, .max = 1000000,
+					.def.intval = 5000 },
     { "dev-to-net-bufsize", GENSIO_DEFAULT_INT,.min = 1, .max = 65536,
 					.def.intval = PORT_BUFSIZE },
     { "net-to-dev-bufsize", GENSIO_DEFAULT_INT,.min = 1, .max = 65536,
 					.def.intval = PORT_BUFSIZE },
+    { "dev-to-net-double-buffer", GENSIO_DEFAULT_BOOL, .def.intval = 0 },
+    { "dev-to-net-direct", GENSIO_DEFAULT_BOOL, .def.intval = 0 },
+    { "connect-back-persist", GENSIO_DEFAULT_BOOL, .def.intval = 0 },
+    { "connect-back-retry-min", GENSIO_DEFAULT_INT, .min = 1, .max = 3600,
+					.def.intval = 1 },
+    { "connect-back-retry-max", GENSIO_DEFAULT_INT, .min = 1, .max = 86400,
+					.def.intval = 60 },
+    { "max-datagram-size", GENSIO_DEFAULT_INT,.min = 0, .max = 65507,
+					.def.intval = 0 },
+    { "latency-stats",	GENSIO_DEFAULT_BOOL,	.def.intval = 0 },
+    { "startup-concurrency", GENSIO_DEFAULT_INT, .min = 1, .max = 4096,
+					.def.intval = 16 },
     { "max-connections", GENSIO_DEFAULT_INT,	.min=1, .max=65536,
 					.def.intval = 1 },
+    { "laggard-policy",	GENSIO_DEFAULT_ENUM,	.enums = laggard_policy_enums,
+					.def.intval = LAGGARD_BLOCK },
+    { "trace-bufsize",	GENSIO_DEFAULT_INT,	.min = 1024, .max = 1 << 26,
+					.def.intval = 65536 },
+    { "trace-overflow",	GENSIO_DEFAULT_ENUM,	.enums = trace_overflow_enums,
+					.def.intval = TRACE_OVERFLOW_DROP },
+    { "trace-format",	GENSIO_DEFAULT_ENUM,	.enums = trace_format_enums,
+					.def.intval = TRACE_FORMAT_TEXT },
+    { "trace-file-size", GENSIO_DEFAULT_INT,	.min = 4096, .max = 1 << 30,
+					.def.intval = 1 << 20 },
     { "remaddr",	GENSIO_DEFAULT_STR,	.def.strval = NULL },
     { "authdir",	GENSIO_DEFAULT_STR,	.def.strval =
 						DATAROOT "/ser2net/auth" },
@@ -450,6 +677,19 @@ struct default_data defaults[] = {
     { NULL }
 };
 
+/* Is this one of the defaults above, that we look up ourself? */
+static bool
+is_ser2net_default(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; defaults[i].name; i++) {
+	if (strcmp(defaults[i].name, name) == 0)
+	    return true;
+    }
+    return false;
+}
+
 static int
 setup_ser2net_defaults(void)
 {
@@ -497,14 +737,149 @@ setup_defaults(void)
     return setup_ser2net_defaults();
 }
 
+/*
+ * gensio searches a list under a lock for each default, and every
+ * connection asks for a couple of dozen of them.  Cache the values
+ * here.  Setting or deleting a default changes config_defaults_gen,
+ * and that throws the cache away.  The default is changed before the
+ * generation, so a value looked up in between is thrown away, too.
+ */
+struct default_cache {
+    char *name;
+    enum gensio_default_type type;
+    int intval;
+    char *strval;
+    struct default_cache *next;
+};
+
+static struct gensio_lock *default_cache_lock;
+static struct default_cache *default_cache[NAME_HASH_SIZE];
+static unsigned int default_cache_gen;
+
+static void
+default_cache_flush(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < NAME_HASH_SIZE; i++) {
+	while (default_cache[i]) {
+	    struct default_cache *c = default_cache[i];
+
+	    default_cache[i] = c->next;
+	    free(c->name);
+	    if (c->strval)
+		free(c->strval);
+	    free(c);
+	}
+    }
+}
+
+/* Failing to allocate this just means the value doesn't get cached. */
+static void
+default_cache_add(unsigned int h, const char *name,
+		  enum gensio_default_type type, int intval, const char *strval)
+{
+    struct default_cache *c;
+
+    c = malloc(sizeof(*c));
+    if (!c)
+	return;
+    memset(c, 0, sizeof(*c));
+    c->name = strdup(name);
+    if (!c->name)
+	goto out_err;
+    if (strval) {
+	c->strval = strdup(strval);
+	if (!c->strval)
+	    goto out_err;
+    }
+    c->type = type;
+    c->intval = intval;
+    c->next = default_cache[h];
+    default_cache[h] = c;
+    return;
+
+ out_err:
+    if (c->name)
+	free(c->name);
+    free(c);
+}
+
+/*
+ * Get a default of the given type.  For a string a copy is returned
+ * in rstr, for the others the value goes in rval.
+ */
+static int
+find_default(const char *name, enum gensio_default_type type,
+	     char **rstr, int *rval)
+{
+    struct default_cache *c = NULL;
+    unsigned int h = name_hash(name);
+    char *val = NULL, *gval = NULL;
+    int err = 0, ival = 0;
+
+    if (default_cache_lock) {
+	so->lock(default_cache_lock);
+	if (default_cache_gen != atomic_load(&config_defaults_gen)) {
+	    default_cache_flush();
+	    default_cache_gen = atomic_load(&config_defaults_gen);
+	}
+	for (c = default_cache[h]; c; c = c->next) {
+	    if (c->type == type && strcmp(c->name, name) == 0)
+		break;
+	}
+    }
+
+    if (c) {
+	ival = c->intval;
+	if (c->strval) {
+	    val = strdup(c->strval);
+	    if (!val)
+		err = GE_NOMEM;
+	}
+    } else {
+	if (type == GENSIO_DEFAULT_STR)
+	    err = gensio_get_default(so, "ser2net", name, false, type,
+				     &gval, NULL);
+	else
+	    err = gensio_get_default(so, "ser2net", name, false, type,
+				     NULL, &ival);
+	if (!err && gval) {
+	    val = strdup(gval);
+	    so->free(so, gval);
+	    if (!val)
+		err = GE_NOMEM;
+	}
+	if (!err && default_cache_lock)
+	    default_cache_add(h, name, type, ival, val);
+    }
+
+    if (default_cache_lock)
+	so->unlock(default_cache_lock);
+
+    if (!err) {
+	if (type == GENSIO_DEFAULT_STR) {
+	    config_context_lookup("default", name, val, val ? strlen(val) : 0);
+	} else {
+	    char ibuf[16];
+
+	    snprintf(ibuf, sizeof(ibuf), "%d", ival);
+	    config_context_lookup("default", name, ibuf, strlen(ibuf));
+	}
+	if (rstr)
+	    *rstr = val;
+	if (rval)
+	    *rval = ival;
+    }
+    return err;
+}
+
 int
 find_default_int(const char *name)
 {
-    int err, val;
+    int val;
 
-    err = gensio_get_default(so, "ser2net", name, false, GENSIO_DEFAULT_INT,
-			     NULL, &val);
-    if (err)
+    if (find_default(name, GENSIO_DEFAULT_INT, NULL, &val))
 	abort();
 
     return val;
@@ -513,12 +888,20 @@ find_default_int(const char *name)
 bool
 find_default_bool(const char *name)
 {
-    int err;
     int val;
 
-    err = gensio_get_default(so, "ser2net", name, false, GENSIO_DEFAULT_BOOL,
-			     NULL, &val);
-    if (err)
+    if (find_default(name, GENSIO_DEFAULT_BOOL, NULL, &val))
+	abort();
+
+    return val;
+}
+
+int
+find_default_enum(const char *name)
+{
+    int val;
+
+    if (find_default(name, GENSIO_DEFAULT_ENUM, NULL, &val))
 	abort();
 
     return val;
@@ -528,21 +911,13 @@ int
 find_default_str(const char *name, char **rstr)
 {
     int err;
-    char *val;
-    char *newstr = NULL;
 
-    err = gensio_get_default(so, "ser2net", name, false, GENSIO_DEFAULT_STR,
-			     &val, NULL);
+    err = find_default(name, GENSIO_DEFAULT_STR, rstr, NULL);
+    if (err == GE_NOMEM)
+	return err;
     if (err)
 	abort();
 
-    if (val) {
-	newstr = strdup(val);
-	so->free(so, val);
-	if (!newstr)
-	    return GE_NOMEM;
-    }
-    *rstr = newstr;
     return 0;
 }
 
@@ -752,6 +1127,7 @@ handle_config_line(char *inbuf, int len)
 	}
 
 	err = gensio_set_default(so, class, name, str, 0);
+	config_context_default(class, name, str, false);
 	if (err)
 	    syslog(LOG_ERR, "error setting default value on line %d for %s: %s",
 		   lineno, name, strerror(err));
@@ -773,6 +1149,7 @@ handle_config_line(char *inbuf, int len)
 	}
 
 	err = gensio_del_default(so, class, name, false);
+	config_context_default(class, name, NULL, true);
 	if (err)
 	    syslog(LOG_ERR, "error deleting default value on line %d for %s: %s",
 		   lineno, name, strerror(err));
@@ -889,10 +1266,21 @@ handle_config_line(char *inbuf, int len)
 int
 readconfig_init(void)
 {
-    int err = setup_defaults();
+    int err;
 
+    if (!default_cache_lock) {
+	default_cache_lock = so->alloc_lock(so);
+	if (!default_cache_lock)
+	    return GE_NOMEM;
+    }
+
+    err = setup_defaults();
     if (err)
 	return err;
+    config_defaults_free();
+
+    /* The defaults were reset. */
+    atomic_fetch_add(&config_defaults_gen, 1);
     free_longstrs();
     free_tracefiles();
     free_rs485confs();
@@ -20,6 +20,7 @@
 #ifndef READCONFIG
 #define READCONFIG
 #include <stdio.h>
+#include <stdint.h>
 
 /* Handle one line of configuration. */
 int handle_config_line(char *inbuf, int len);
@@ -32,6 +33,12 @@ int readconfig_init(void);
 int readconfig(FILE *instream);
 int yaml_readconfig(FILE *f);
 
+/*
+ * Keep a cache of the parsed YAML config in the given file, so it
+ * doesn't have to be parsed again if it hasn't changed.
+ */
+void yaml_set_cache_file(const char *name);
+
 int readconfig_finalize(void);
 
 /*
@@ -57,12 +64,25 @@ char *find_tracefile(const char *name);
 /* Search for RS485 configuration by name. */
 char *find_rs485conf(const char *name);
 
-/* Return the default int/bool value for the given name. */
+/* Return the default int/bool/enum value for the given name. */
 int find_default_int(const char *name);
 bool find_default_bool(const char *name);
+int find_default_enum(const char *name);
 
 /* Return the default string value for the given name.  Return GE_NOMEM if
    out of memory.  The returned value must be freed. */
 int find_default_str(const char *name, char **rstr);
 
+/* Record a default the config set or deleted, for the config context. */
+void config_context_default(const char *class, const char *name,
+			    const char *value, bool deleted);
+
+/*
+ * Hash what a connection depends on besides its own config text.
+ * Everything the calling thread looks up between these goes into the
+ * hash, with the value it got, and config_context_end() returns it.
+ */
+void config_context_begin(void);
+uint64_t config_context_end(void);
+
 #endif /* READCONFIG */
@@ -20,6 +20,7 @@
 /* This is the entry point for the ser2net program.  It reads
    parameters, initializes everything, then starts the select loop. */
 
+#define _GNU_SOURCE /* For pthread_setaffinity_np() */
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -28,6 +29,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include <gensio/selector.h>
 #include <gensio/gensio_selector.h>
@@ -37,6 +39,8 @@
 #include "controller.h"
 #include "dataxfer.h"
 #include "led.h"
+#include "metrics.h"
+#include "tap.h"
 
 static char *config_file = SYSCONFDIR "/ser2net/ser2net.yaml";
 static bool config_file_set = false;
@@ -55,7 +59,25 @@ struct thread_info {
     pthread_t id;
 };
 struct thread_info *threads;
+
+/*
+ * In sharded mode each shard has its own selector and os funcs, run
+ * by one thread, and each port lives on one shard.  Shard 0 is the
+ * main selector.
+ */
+struct shard_info {
+    struct selector_s *sel;
+    struct gensio_os_funcs *so;
+    struct gensio_timer *stop_timer;
+    int cpu; /* CPU to pin the thread to, -1 if none. */
+    pthread_t id;
+};
+static struct shard_info *shards;
+static volatile int shards_stop;
+static int *shard_cpus;
+static unsigned int num_shard_cpus;
 #endif
+unsigned int ser2net_num_shards = 1;
 
 
 struct selector_s *ser2net_sel;
@@ -70,6 +92,8 @@ static char *help_string =
 "     line in the config file.  This disables the default config file,\n"
 "     you must specify a -c after the last -C to have it read a config\n"
 "     file, too.\n"
+"  -Y <cache file> - Keep a cache of the parsed YAML config file in the\n"
+"     given file, and use it if the config file has not changed\n"
 "  -p <controller port> - Start a controller session on the given TCP port\n"
 "  -P <file> - set location of pid file\n"
 "  -n - Don't detach from the controlling terminal\n"
@@ -78,6 +102,9 @@ static char *help_string =
 "  -u - Disable UUCP locking\n"
 #ifdef USE_PTHREADS
 "  -t <num threads> - Use the given number of threads, default 1\n"
+"  -T <num threads> - Use the given number of threads, each with its own\n"
+"     event loop, and spread the ports across them\n"
+"  -A <cpu>[,<cpu>...] - Pin the -T threads to the given CPUs\n"
 #endif
 "  -b - unused (was Do CISCO IOS baud-rate negotiation, instead of RFC2217)\n"
 "  -v - print the program's version and exit\n"
@@ -120,14 +147,36 @@ fopen_config_file(bool *is_yaml)
     return instream;
 }
 
+uint32_t
+ser2net_strhash(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261U;
+
+    /* FNV-1a, it's quick and spreads similar names well. */
+    for (; len > 0; s++, len--) {
+	hash ^= (unsigned char) *s;
+	hash *= 16777619;
+    }
+    return hash;
+}
+
+unsigned int
+ser2net_shard_by_name(const char *name)
+{
+    return ser2net_strhash(name, strlen(name)) % ser2net_num_shards;
+}
+
 static void
 reread_config_file(void)
 {
     if (config_file) {
 	FILE *instream = NULL;
 	bool is_yaml;
+	struct timeval start, end;
+	int usecs;
 
 	syslog(LOG_INFO, "Got SIGHUP, re-reading configuration");
+	so->get_monotonic_time(so, &start);
 	readconfig_init();
 
 	instream = fopen_config_file(&is_yaml);
@@ -136,6 +185,8 @@ reread_config_file(void)
 
 	if (!admin_port_from_cmdline)
 	    controller_shutdown();
+	metrics_shutdown();
+	tap_shutdown();
 	if (is_yaml)
 	    yaml_readconfig(instream);
 	else
@@ -143,6 +194,10 @@ reread_config_file(void)
 	fclose(instream);
 
 	readconfig_finalize();
+	so->get_monotonic_time(so, &end);
+	usecs = sub_timeval_us(&end, &start);
+	syslog(LOG_INFO, "Configuration reloaded in %d.%06d seconds",
+	       usecs / 1000000, usecs % 1000000);
     }
  out:
     return;
@@ -370,6 +425,93 @@ op_loop(void *dummy)
     return NULL;
 }
 
+static void
+pin_thread(int cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t set;
+    int rv;
+
+    if (cpu < 0)
+	return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    rv = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rv)
+	syslog(LOG_ERR, "Unable to pin thread to CPU %d: %s", cpu,
+	       strerror(rv));
+#else
+    if (cpu >= 0)
+	syslog(LOG_WARNING, "CPU pinning is not supported on this system");
+#endif
+}
+
+struct gensio_os_funcs *
+ser2net_shard_so(unsigned int shard)
+{
+    if (!shards)
+	return so;
+    return shards[shard % ser2net_num_shards].so;
+}
+
+static void
+shard_stop_timeout(struct gensio_timer *t, void *cb_data)
+{
+    /* Nothing to do, this just wakes up the shard to see shards_stop. */
+}
+
+static void *
+shard_loop(void *data)
+{
+    struct shard_info *sh = data;
+    pthread_t self = pthread_self();
+
+    pin_thread(sh->cpu);
+    while (!shards_stop)
+	sel_select(sh->sel, wake_thread_send_sig, (long) &self, NULL, NULL);
+    return NULL;
+}
+
+static void
+start_shards(void)
+{
+    unsigned int i;
+    int rv;
+
+    if (!shards)
+	return;
+
+    /* The main thread runs shard 0. */
+    pin_thread(shards[0].cpu);
+    for (i = 1; i < ser2net_num_shards; i++) {
+	rv = pthread_create(&shards[i].id, NULL, shard_loop, &shards[i]);
+	if (rv) {
+	    syslog(LOG_ERR, "Unable to start shard thread: %s", strerror(rv));
+	    exit(1);
+	}
+    }
+}
+
+/*
+ * Called after all the ports are shut down, the shard threads have to
+ * keep running until then.
+ */
+static void
+stop_shards(void)
+{
+    struct timeval tv = { 0, 0 };
+    unsigned int i;
+
+    if (!shards)
+	return;
+
+    shards_stop = 1;
+    for (i = 1; i < ser2net_num_shards; i++) {
+	shards[i].so->start_timer(shards[i].stop_timer, &tv);
+	pthread_join(shards[i].id, NULL);
+    }
+}
+
 static void
 start_threads(void)
 {
@@ -400,6 +542,8 @@ start_threads(void)
 	    exit(1);
 	}
     }
+
+    start_shards();
 }
 
 static void
@@ -457,12 +601,77 @@ slock_unlock(sel_lock_t *l)
     pthread_mutex_unlock(&l->lock);
 }
 
+static int
+alloc_shards(void)
+{
+    unsigned int i;
+    int err;
+
+    shards = calloc(ser2net_num_shards, sizeof(*shards));
+    if (!shards)
+	return ENOMEM;
+
+    for (i = 0; i < ser2net_num_shards; i++) {
+	struct shard_info *sh = &shards[i];
+
+	sh->cpu = -1;
+	if (num_shard_cpus)
+	    sh->cpu = shard_cpus[i % num_shard_cpus];
+
+	if (i == 0) {
+	    sh->sel = ser2net_sel;
+	    sh->so = so;
+	    continue;
+	}
+
+	err = sel_alloc_selector_thread(&sh->sel, ser2net_wake_sig,
+					slock_alloc, slock_free,
+					slock_lock, slock_unlock, NULL);
+	if (err)
+	    return err;
+	sh->so = gensio_selector_alloc(sh->sel, ser2net_wake_sig);
+	if (!sh->so)
+	    return ENOMEM;
+	sh->so->vlog = so->vlog;
+	sh->stop_timer = sh->so->alloc_timer(sh->so, shard_stop_timeout, NULL);
+	if (!sh->stop_timer)
+	    return ENOMEM;
+    }
+    return 0;
+}
+
+static int
+parse_shard_cpus(const char *str)
+{
+    char *end;
+    unsigned int n = 1;
+    const char *c;
+
+    for (c = str; *c; c++) {
+	if (*c == ',')
+	    n++;
+    }
+    shard_cpus = malloc(sizeof(*shard_cpus) * n);
+    if (!shard_cpus)
+	return ENOMEM;
+
+    for (num_shard_cpus = 0; num_shard_cpus < n; num_shard_cpus++) {
+	shard_cpus[num_shard_cpus] = strtoul(str, &end, 10);
+	if (end == str || (*end != ',' && *end != '\0'))
+	    return EINVAL;
+	str = end + 1;
+    }
+    return 0;
+}
+
 #else
 int ser2net_wake_sig = 0;
 void start_maint_op(void) { }
 void end_maint_op(void) { }
 static void start_threads(void) { }
 static void stop_threads(void (*finish)(void)) { finish(); }
+static void stop_shards(void) { }
+struct gensio_os_funcs *ser2net_shard_so(unsigned int shard) { return so; }
 #define slock_alloc NULL
 #define slock_free NULL
 #define slock_lock NULL
@@ -483,6 +692,8 @@ finish_shutdown_cleanly(void)
     sel_clear_fd_handlers(ser2net_sel, sig_fd_watch);
     free_rotators();
     free_controllers();
+    metrics_shutdown();
+    tap_shutdown();
     shutdown_ports();
     do {
 	if (check_ports_shutdown())
@@ -492,11 +703,13 @@ finish_shutdown_cleanly(void)
 	sel_select(ser2net_sel, NULL, 0, NULL, &tv);
     } while(1);
 
+    stop_shards();
     shutdown_dataxfer();
 
     free_longstrs();
     free_tracefiles();
     free_rs485confs();
+    auth_shutdown();
 
     if (pid_file)
 	unlink(pid_file);
@@ -682,6 +895,15 @@ main(int argc, char *argv[])
 	    config_file_set = true;
 	    break;
 
+	case 'Y':
+	    i++;
+	    if (i == argc) {
+		fprintf(stderr, "No cache file specified with -Y\n");
+		arg_error(argv[0]);
+	    }
+	    yaml_set_cache_file(argv[i]);
+	    break;
+
 	case 'p':
 	    /* Get the control port. */
 	    i++;
@@ -737,6 +959,32 @@ main(int argc, char *argv[])
 		exit(1);
 	    }
             break;
+
+	case 'T':
+            i++;
+            if (i == argc) {
+	        fprintf(stderr, "No thread count specified\n");
+		exit(1);
+            }
+	    ser2net_num_shards = strtoul(argv[i], &end, 10);
+	    if (end == argv[i] || *end != '\0' || ser2net_num_shards == 0) {
+	        fprintf(stderr, "Invalid thread count specified: %s\n",
+			argv[i]);
+		exit(1);
+	    }
+            break;
+
+	case 'A':
+            i++;
+            if (i == argc) {
+	        fprintf(stderr, "No CPU list specified\n");
+		exit(1);
+            }
+	    if (parse_shard_cpus(argv[i])) {
+	        fprintf(stderr, "Invalid CPU list specified: %s\n", argv[i]);
+		exit(1);
+	    }
+            break;
 #endif
 
 	default:
@@ -746,7 +994,12 @@ main(int argc, char *argv[])
     }
 
 #ifdef USE_PTHREADS
-    if (num_threads > 1)
+    if (num_threads > 1 && ser2net_num_shards > 1) {
+	fprintf(stderr, "-t and -T may not be used together\n");
+	exit(1);
+    }
+
+    if (num_threads > 1 || ser2net_num_shards > 1)
 	err = sel_alloc_selector_thread(&ser2net_sel, ser2net_wake_sig,
 					slock_alloc, slock_free,
 					slock_lock, slock_unlock, NULL);
@@ -768,6 +1021,17 @@ main(int argc, char *argv[])
     }
     so->vlog = ser2net_gensio_logger;
 
+#ifdef USE_PTHREADS
+    if (ser2net_num_shards > 1 || num_shard_cpus) {
+	err = alloc_shards();
+	if (err) {
+	    fprintf(stderr, "Could not allocate threads: '%s'\n",
+		    strerror(err));
+	    exit(1);
+	}
+    }
+#endif
+
     config_lock = so->alloc_lock(so);
     if (!config_lock) {
 	fprintf(stderr, "Could not alloc ser2net config lock\n");
@@ -780,6 +1044,11 @@ main(int argc, char *argv[])
 	exit(1);
     }
 
+    if (auth_init()) {
+	fprintf(stderr, "Could not initialize authorization\n");
+	exit(1);
+    }
+
     setup_signals();
 
     err = init_dataxfer();
@@ -863,6 +1132,7 @@ main(int argc, char *argv[])
     make_pidfile();
 
     start_threads();
+    dataxfer_wait_startup();
 
     if (print_when_ready) {
 	printf("Ready\n");
@@ -20,6 +20,8 @@
 #ifndef SER2NET_H
 #define SER2NET_H
 
+#include <stdint.h>
+#include <stddef.h>
 #include <gensio/selector.h>
 #include <gensio/gensio_selector.h>
 
@@ -36,6 +38,21 @@ extern int ser2net_debug_level;
 
 extern int ser2net_wake_sig;
 
+/*
+ * With -T, there is one selector and os funcs per thread, called a
+ * shard.  Shard 0 is the main one, the one so uses.  Without -T there
+ * is only shard 0.
+ */
+extern unsigned int ser2net_num_shards;
+struct gensio_os_funcs *ser2net_shard_so(unsigned int shard);
+unsigned int ser2net_shard_by_name(const char *name);
+
+/*
+ * A quick string hash for the name lookup tables.  The string is
+ * len bytes long, it need not be nul terminated.
+ */
+uint32_t ser2net_strhash(const char *s, size_t len);
+
 void start_maint_op(void);
 void end_maint_op(void);
 
@@ -53,8 +70,12 @@ int sub_timeval_us(struct timeval *left, struct timeval *right);
 int scan_int(const char *str);
 
 /*
- * Handle authorization events from accepters.
+ * Handle authorization events from accepters.  What is read from the
+ * authdirs is cached, auth_init() must be called before any of this
+ * is used.
  */
 int handle_acc_auth_event(const char *authdir, int event, void *data);
+int auth_init(void);
+void auth_shutdown(void);
 
 #endif /* SER2NET_H */
@@ -0,0 +1,698 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * This file holds the data taps and the accepter for dedicated tap
+ * connections.
+ *
+ * Everything about a tap point and its subscribers is protected by
+ * the tap point's lock, which is taken with the port lock held and
+ * doesn't take any other locks itself.  The written data in a queued
+ * chunk never changes, so a subscriber can write it out without the
+ * lock, only the queue itself needs it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <gensio/gensio.h>
+
+#include "ser2net.h"
+#include "dataxfer.h"
+#include "readconfig.h"
+#include "tap.h"
+
+/*
+ * The most chunks a subscriber may have queued.  Reads are usually
+ * much bigger than a byte, so max_lag is normally hit first.
+ */
+#define TAP_SUB_RING 1024
+
+struct tap_chunk {
+    unsigned int refcount;
+    gensiods len;
+    unsigned char data[];
+};
+
+struct tap_sub {
+    struct tap_point *tp;
+    unsigned int dirs;
+    gensiods max_lag;
+    void (*ready)(void *cb_data);
+    void *cb_data;
+
+    struct tap_chunk *ring[TAP_SUB_RING];
+    unsigned int head;			/* First queued chunk. */
+    unsigned int count;			/* Chunks queued. */
+    gensiods offset;			/* Already written from the head. */
+    gensiods queued;			/* Bytes not written yet. */
+    gensiods dropped;
+
+    struct tap_sub *next;
+};
+
+static void
+tap_chunk_put(struct tap_chunk *c)
+{
+    if (--c->refcount == 0)
+	free(c);
+}
+
+struct tap_point *
+tap_point_alloc(void)
+{
+    struct tap_point *tp;
+
+    tp = calloc(1, sizeof(*tp));
+    if (!tp)
+	return NULL;
+    tp->lock = so->alloc_lock(so);
+    if (!tp->lock) {
+	free(tp);
+	return NULL;
+    }
+    tp->refcount = 1;
+    atomic_init(&tp->nsubs, 0);
+    return tp;
+}
+
+/* Must be called with tp->lock held, returns true if tp was freed. */
+static bool
+tap_point_deref(struct tap_point *tp)
+{
+    if (--tp->refcount > 0)
+	return false;
+    so->unlock(tp->lock);
+    so->free_lock(tp->lock);
+    free(tp);
+    return true;
+}
+
+void
+tap_point_close(struct tap_point *tp)
+{
+    struct tap_sub *s;
+
+    so->lock(tp->lock);
+    tp->closed = true;
+    for (s = tp->subs; s; s = s->next)
+	s->ready(s->cb_data);
+    if (!tap_point_deref(tp))
+	so->unlock(tp->lock);
+}
+
+void
+tap_send(struct tap_point *tp, unsigned int dir,
+	 const unsigned char *data, gensiods len)
+{
+    struct tap_chunk *c = NULL;
+    struct tap_sub *s;
+    bool was_empty;
+
+    if (len == 0)
+	return;
+
+    so->lock(tp->lock);
+    for (s = tp->subs; s; s = s->next) {
+	if (!(s->dirs & dir))
+	    continue;
+	if (s->queued + len > s->max_lag || s->count == TAP_SUB_RING)
+	    goto drop;
+	if (!c) {
+	    /* The only copy, everyone after this shares it. */
+	    c = malloc(sizeof(*c) + len);
+	    if (!c)
+		goto drop;
+	    c->refcount = 1;
+	    c->len = len;
+	    memcpy(c->data, data, len);
+	} else {
+	    c->refcount++;
+	}
+	s->ring[(s->head + s->count) % TAP_SUB_RING] = c;
+	s->count++;
+	was_empty = s->queued == 0;
+	s->queued += len;
+	if (was_empty)
+	    s->ready(s->cb_data);
+	continue;
+
+    drop:
+	s->dropped += len;
+	tp->dropped += len;
+    }
+    so->unlock(tp->lock);
+}
+
+struct tap_sub *
+tap_subscribe(struct tap_point *tp, unsigned int dirs, gensiods max_lag,
+	      void (*ready)(void *cb_data), void *cb_data)
+{
+    struct tap_sub *s;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+	return NULL;
+    s->tp = tp;
+    s->dirs = dirs;
+    s->max_lag = max_lag;
+    s->ready = ready;
+    s->cb_data = cb_data;
+
+    so->lock(tp->lock);
+    if (tp->closed) {
+	so->unlock(tp->lock);
+	free(s);
+	return NULL;
+    }
+    s->next = tp->subs;
+    tp->subs = s;
+    tp->refcount++;
+    atomic_store_explicit(&tp->nsubs,
+			  atomic_load_explicit(&tp->nsubs,
+					       memory_order_relaxed) + 1,
+			  memory_order_relaxed);
+    so->unlock(tp->lock);
+
+    return s;
+}
+
+void
+tap_unsubscribe(struct tap_sub *s)
+{
+    struct tap_point *tp = s->tp;
+    struct tap_sub **sp;
+
+    so->lock(tp->lock);
+    for (sp = &tp->subs; *sp; sp = &(*sp)->next) {
+	if (*sp == s) {
+	    *sp = s->next;
+	    break;
+	}
+    }
+    atomic_store_explicit(&tp->nsubs,
+			  atomic_load_explicit(&tp->nsubs,
+					       memory_order_relaxed) - 1,
+			  memory_order_relaxed);
+    while (s->count > 0) {
+	tap_chunk_put(s->ring[s->head]);
+	s->head = (s->head + 1) % TAP_SUB_RING;
+	s->count--;
+    }
+    if (!tap_point_deref(tp))
+	so->unlock(tp->lock);
+    free(s);
+}
+
+gensiods
+tap_sub_sg(struct tap_sub *s, struct gensio_sg *sg, gensiods maxsg)
+{
+    struct tap_chunk *c;
+    gensiods n = 0, off;
+
+    so->lock(s->tp->lock);
+    for (; n < s->count && n < maxsg; n++) {
+	c = s->ring[(s->head + n) % TAP_SUB_RING];
+	off = n == 0 ? s->offset : 0;
+	sg[n].buf = c->data + off;
+	sg[n].buflen = c->len - off;
+    }
+    so->unlock(s->tp->lock);
+
+    return n;
+}
+
+void
+tap_sub_consume(struct tap_sub *s, gensiods count)
+{
+    struct tap_chunk *c;
+    gensiods left;
+
+    so->lock(s->tp->lock);
+    while (count > 0 && s->count > 0) {
+	c = s->ring[s->head];
+	left = c->len - s->offset;
+	if (count < left) {
+	    s->offset += count;
+	    s->queued -= count;
+	    break;
+	}
+	count -= left;
+	s->queued -= left;
+	s->offset = 0;
+	s->head = (s->head + 1) % TAP_SUB_RING;
+	s->count--;
+	tap_chunk_put(c);
+    }
+    so->unlock(s->tp->lock);
+}
+
+bool
+tap_sub_idle(struct tap_sub *s, void (*idle)(void *data), void *data)
+{
+    bool rv = false;
+
+    so->lock(s->tp->lock);
+    if (s->queued == 0) {
+	idle(data);
+	rv = true;
+    }
+    so->unlock(s->tp->lock);
+
+    return rv;
+}
+
+gensiods
+tap_sub_take_dropped(struct tap_sub *s)
+{
+    gensiods rv;
+
+    so->lock(s->tp->lock);
+    rv = s->dropped;
+    s->dropped = 0;
+    so->unlock(s->tp->lock);
+
+    return rv;
+}
+
+bool
+tap_sub_closed(struct tap_sub *s)
+{
+    bool rv;
+
+    so->lock(s->tp->lock);
+    rv = s->tp->closed;
+    so->unlock(s->tp->lock);
+
+    return rv;
+}
+
+/*
+ * Dedicated tap connections.  The client sends a line with the
+ * connection name and optionally the direction, gets "OK" or an error
+ * line back, and then the raw data.  The connection is closed when
+ * the port goes away.  There is nowhere to say that data was dropped
+ * in a raw stream, the drops are counted in showport.
+ */
+
+#define MAX_TAP_CONNS		16
+#define MAX_TAP_REQUEST		256
+#define TAP_MAX_SG		16
+
+struct tap_conn {
+    struct gensio *net;
+    char req[MAX_TAP_REQUEST];
+    size_t reqlen;
+    const char *msg;			/* A reply to send. */
+    size_t msglen;
+    size_t msgpos;
+    bool close_after_msg;
+    struct tap_sub *sub;
+    bool closing;
+    struct tap_conn *next;
+};
+
+static struct gensio_lock *tap_lock;
+static struct gensio_accepter *tap_accepter;
+static struct gensio_waiter *tap_waiter;
+/* Separate from tap_waiter, a connection going away must not wake it. */
+static struct gensio_waiter *tap_acc_waiter;
+static char *tap_authdir;
+static gensiods tap_max_lag = TAP_DEFAULT_MAX_LAG;
+static struct tap_conn *tap_conns;
+static unsigned int num_tap_conns;
+
+static void
+tap_conn_free(struct tap_conn *c)
+{
+    struct tap_conn **cp;
+
+    for (cp = &tap_conns; *cp; cp = &(*cp)->next) {
+	if (*cp == c) {
+	    *cp = c->next;
+	    break;
+	}
+    }
+    num_tap_conns--;
+    free(c);
+    so->wake(tap_waiter);
+}
+
+static void
+tap_close_done(struct gensio *net, void *cb_data)
+{
+    struct tap_conn *c = cb_data;
+
+    gensio_free(net);
+    so->lock(tap_lock);
+    tap_conn_free(c);
+    so->unlock(tap_lock);
+}
+
+/* Must be called with tap_lock held. */
+static void
+tap_conn_close(struct tap_conn *c)
+{
+    if (c->closing)
+	return;
+    c->closing = true;
+    if (c->sub) {
+	/* After this the data path won't touch c->net. */
+	tap_unsubscribe(c->sub);
+	c->sub = NULL;
+    }
+    gensio_set_read_callback_enable(c->net, false);
+    gensio_set_write_callback_enable(c->net, false);
+    if (gensio_close(c->net, tap_close_done, c)) {
+	/* Already closed underneath us, just free it. */
+	gensio_free(c->net);
+	tap_conn_free(c);
+    }
+}
+
+static void
+tap_conn_reply(struct tap_conn *c, const char *msg, bool close_after)
+{
+    c->msg = msg;
+    c->msglen = strlen(msg);
+    c->msgpos = 0;
+    c->close_after_msg = close_after;
+    gensio_set_write_callback_enable(c->net, true);
+}
+
+/* Called from the data path, just get the writer going. */
+static void
+tap_conn_ready(void *cb_data)
+{
+    struct tap_conn *c = cb_data;
+
+    gensio_set_write_callback_enable(c->net, true);
+}
+
+static void
+tap_conn_idle(void *cb_data)
+{
+    struct tap_conn *c = cb_data;
+
+    gensio_set_write_callback_enable(c->net, false);
+}
+
+static void
+tap_handle_request(struct tap_conn *c)
+{
+    char *name, *dir, *tokstate = NULL;
+    unsigned int dirs = TAP_DEV | TAP_NET;
+    int err;
+
+    c->req[strcspn(c->req, "\r\n")] = '\0';
+    name = strtok_r(c->req, " \t", &tokstate);
+    if (!name) {
+	tap_conn_reply(c, "ERROR no connection name given\r\n", true);
+	return;
+    }
+    dir = strtok_r(NULL, " \t", &tokstate);
+    if (dir) {
+	if (strcmp(dir, "dev") == 0) {
+	    dirs = TAP_DEV;
+	} else if (strcmp(dir, "net") == 0) {
+	    dirs = TAP_NET;
+	} else if (strcmp(dir, "both") != 0) {
+	    tap_conn_reply(c, "ERROR invalid direction\r\n", true);
+	    return;
+	}
+    }
+
+    err = dataxfer_tap_subscribe(name, dirs, tap_max_lag,
+				 tap_conn_ready, c, &c->sub);
+    if (err == GE_NOTFOUND)
+	tap_conn_reply(c, "ERROR no such connection\r\n", true);
+    else if (err)
+	tap_conn_reply(c, "ERROR unable to start tap\r\n", true);
+    else
+	tap_conn_reply(c, "OK\r\n", false);
+}
+
+static gensiods
+tap_conn_read(struct tap_conn *c, int err, unsigned char *buf,
+	      gensiods buflen)
+{
+    gensiods count = buflen;
+
+    if (err) {
+	tap_conn_close(c);
+	return buflen;
+    }
+
+    if (c->sub || c->msg)
+	/* Anything after the request is ignored. */
+	return buflen;
+
+    if (count > sizeof(c->req) - 1 - c->reqlen)
+	count = sizeof(c->req) - 1 - c->reqlen;
+    memcpy(c->req + c->reqlen, buf, count);
+    c->reqlen += count;
+    c->req[c->reqlen] = '\0';
+    if (strchr(c->req, '\n'))
+	tap_handle_request(c);
+    else if (c->reqlen >= sizeof(c->req) - 1)
+	tap_conn_reply(c, "ERROR request too long\r\n", true);
+
+    return buflen;
+}
+
+static void
+tap_conn_write_ready(struct tap_conn *c)
+{
+    struct gensio_sg sg[TAP_MAX_SG];
+    gensiods count, nsg;
+    int err;
+
+    if (c->msg) {
+	err = gensio_write(c->net, &count, c->msg + c->msgpos,
+			   c->msglen - c->msgpos, NULL);
+	if (err)
+	    goto out_err;
+	c->msgpos += count;
+	if (c->msgpos < c->msglen)
+	    return;
+	c->msg = NULL;
+	if (c->close_after_msg)
+	    goto out_err;
+    }
+
+    if (!c->sub) {
+	gensio_set_write_callback_enable(c->net, false);
+	return;
+    }
+
+    nsg = tap_sub_sg(c->sub, sg, TAP_MAX_SG);
+    if (nsg) {
+	err = gensio_write_sg(c->net, &count, sg, nsg, NULL);
+	if (err)
+	    goto out_err;
+	tap_sub_consume(c->sub, count);
+	return;
+    }
+
+    if (tap_sub_closed(c->sub))
+	/* The port is gone and everything has been sent. */
+	goto out_err;
+    tap_sub_idle(c->sub, tap_conn_idle, c);
+    return;
+
+ out_err:
+    tap_conn_close(c);
+}
+
+static int
+tap_io_event(struct gensio *net, void *user_data, int event, int err,
+	     unsigned char *buf, gensiods *buflen,
+	     const char *const *auxdata)
+{
+    struct tap_conn *c = user_data;
+
+    switch (event) {
+    case GENSIO_EVENT_READ:
+	so->lock(tap_lock);
+	if (!c->closing)
+	    *buflen = tap_conn_read(c, err, buf, *buflen);
+	so->unlock(tap_lock);
+	return 0;
+
+    case GENSIO_EVENT_WRITE_READY:
+	so->lock(tap_lock);
+	if (!c->closing)
+	    tap_conn_write_ready(c);
+	so->unlock(tap_lock);
+	return 0;
+    }
+
+    return GE_NOTSUP;
+}
+
+static int
+tap_new_con(struct gensio *net)
+{
+    struct tap_conn *c;
+    const char *err = "ERROR too many tap connections\r\n";
+
+    so->lock(tap_lock);
+    if (num_tap_conns >= MAX_TAP_CONNS)
+	goto out_err;
+    c = calloc(1, sizeof(*c));
+    if (!c)
+	goto out_err;
+    c->net = net;
+    c->next = tap_conns;
+    tap_conns = c;
+    num_tap_conns++;
+    gensio_set_callback(net, tap_io_event, c);
+    gensio_set_read_callback_enable(net, true);
+    so->unlock(tap_lock);
+    return 0;
+
+ out_err:
+    so->unlock(tap_lock);
+    gensio_write(net, NULL, err, strlen(err), NULL);
+    gensio_free(net);
+    return 0;
+}
+
+static int
+tap_acc_event(struct gensio_accepter *accepter, void *user_data,
+	      int event, void *data)
+{
+    switch (event) {
+    case GENSIO_ACC_EVENT_NEW_CONNECTION:
+	return tap_new_con(data);
+
+    default:
+	return handle_acc_auth_event(tap_authdir, event, data);
+    }
+}
+
+static void
+tap_acc_shutdown_done(struct gensio_accepter *acc, void *cb_data)
+{
+    so->wake(tap_acc_waiter);
+}
+
+int
+tap_init(const char *accstr, const char **options, struct absout *eout)
+{
+    unsigned int i, max_lag;
+    const char *val;
+    int rv;
+
+    if (tap_accepter) {
+	eout->out(eout, "Tap accepter already configured");
+	return EBUSY;
+    }
+
+    if (!tap_lock) {
+	tap_lock = so->alloc_lock(so);
+	if (!tap_lock)
+	    goto out_nomem;
+    }
+    if (!tap_waiter) {
+	tap_waiter = so->alloc_waiter(so);
+	if (!tap_waiter)
+	    goto out_nomem;
+    }
+    if (!tap_acc_waiter) {
+	tap_acc_waiter = so->alloc_waiter(so);
+	if (!tap_acc_waiter)
+	    goto out_nomem;
+    }
+
+    tap_max_lag = TAP_DEFAULT_MAX_LAG;
+    for (i = 0; options && options[i]; i++) {
+	if (gensio_check_keyvalue(options[i], "authdir-tap", &val) > 0) {
+	    char *s = strdup(val);
+
+	    if (!s)
+		goto out_nomem;
+	    free(tap_authdir);
+	    tap_authdir = s;
+	    continue;
+	}
+	if (gensio_check_keyuint(options[i], "max-lag", &max_lag) > 0) {
+	    if (max_lag == 0) {
+		eout->out(eout, "tap max-lag must be more than zero");
+		return EINVAL;
+	    }
+	    tap_max_lag = max_lag;
+	    continue;
+	}
+	eout->out(eout, "Invalid option to tap: %s", options[i]);
+	return EINVAL;
+    }
+
+    rv = str_to_gensio_accepter(accstr, so, tap_acc_event, NULL,
+				&tap_accepter);
+    if (rv) {
+	eout->out(eout, "Unable to allocate tap accepter: %s",
+		  gensio_err_to_str(rv));
+	return rv;
+    }
+
+    rv = gensio_acc_startup(tap_accepter);
+    if (rv) {
+	eout->out(eout, "Unable to start tap accepter: %s",
+		  gensio_err_to_str(rv));
+	gensio_acc_free(tap_accepter);
+	tap_accepter = NULL;
+	return rv;
+    }
+    return 0;
+
+ out_nomem:
+    eout->out(eout, "Unable to allocate memory for tap");
+    return ENOMEM;
+}
+
+void
+tap_shutdown(void)
+{
+    struct tap_conn *c, *next;
+
+    if (!tap_accepter)
+	return;
+
+    if (!gensio_acc_shutdown(tap_accepter, tap_acc_shutdown_done, NULL))
+	so->wait(tap_acc_waiter, 1, NULL);
+    gensio_acc_free(tap_accepter);
+    tap_accepter = NULL;
+
+    so->lock(tap_lock);
+    for (c = tap_conns; c; c = next) {
+	next = c->next;
+	tap_conn_close(c);
+    }
+    while (num_tap_conns > 0) {
+	so->unlock(tap_lock);
+	so->wait(tap_waiter, 1, NULL);
+	so->lock(tap_lock);
+    }
+    so->unlock(tap_lock);
+
+    free(tap_authdir);
+    tap_authdir = NULL;
+}
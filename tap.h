@@ -0,0 +1,127 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef TAP_H
+#define TAP_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <gensio/gensio.h>
+
+#include "absout.h"
+
+/*
+ * Data taps.  Each port has a tap point, and any number of
+ * subscribers can watch the data going through it.  Each piece of
+ * data is copied once into a refcounted chunk that all the
+ * subscribers share, and each subscriber has its own queue of chunks
+ * with a limit on how far it may fall behind.  Data past that limit
+ * is dropped for that subscriber only.
+ */
+
+/* Directions, as a bitmask. */
+#define TAP_DEV		(1 << 0)	/* Data read from the device. */
+#define TAP_NET		(1 << 1)	/* Data read from the network. */
+
+/* The default number of bytes a subscriber may fall behind. */
+#define TAP_DEFAULT_MAX_LAG	(64 * 1024)
+
+struct tap_point {
+    struct gensio_lock *lock;
+    unsigned int refcount;		/* The owner plus one per subscriber. */
+    atomic_uint nsubs;			/* Read without the lock. */
+    bool closed;
+    struct tap_sub *subs;
+    gensiods dropped;			/* Total for all subscribers. */
+};
+
+struct tap_sub;
+
+/* Returns NULL on out of memory. */
+struct tap_point *tap_point_alloc(void);
+
+/*
+ * The owner is done with the tap point.  Subscribers are told it is
+ * closed, and it is freed when the last one unsubscribes.
+ */
+void tap_point_close(struct tap_point *tp);
+
+/* Is anyone watching?  This is the only cost on the data path without taps. */
+static inline bool
+tap_active(struct tap_point *tp)
+{
+    return atomic_load_explicit(&tp->nsubs, memory_order_relaxed) > 0;
+}
+
+/*
+ * Give data to the subscribers watching the given direction.  The
+ * caller must serialize calls for a tap point, the port lock does
+ * that.
+ */
+void tap_send(struct tap_point *tp, unsigned int dir,
+	      const unsigned char *data, gensiods len);
+
+/*
+ * Add a subscriber for the given directions.  ready is called when
+ * data arrives on an empty queue and when the tap point is closed.
+ * It is called from the data path with locks held, so it must only
+ * do something like enabling a write callback.  Returns NULL on out
+ * of memory or if the tap point is closed.
+ */
+struct tap_sub *tap_subscribe(struct tap_point *tp, unsigned int dirs,
+			      gensiods max_lag,
+			      void (*ready)(void *cb_data), void *cb_data);
+
+/* Remove the subscriber.  ready is not called after this returns. */
+void tap_unsubscribe(struct tap_sub *s);
+
+/*
+ * Point sg at up to maxsg of the subscriber's queued chunks.  The
+ * data stays valid until it is consumed or the subscriber is removed.
+ * Only one thread may consume from a subscriber at a time.
+ */
+gensiods tap_sub_sg(struct tap_sub *s, struct gensio_sg *sg, gensiods maxsg);
+
+/* Remove count bytes that have been written from the front. */
+void tap_sub_consume(struct tap_sub *s, gensiods count);
+
+/*
+ * If the queue is empty, call idle with the subscriber's lock held
+ * and return true.  Use this to turn off a write callback so that it
+ * can't race with ready.
+ */
+bool tap_sub_idle(struct tap_sub *s, void (*idle)(void *data), void *data);
+
+/* Return and clear the bytes dropped since the last call. */
+gensiods tap_sub_take_dropped(struct tap_sub *s);
+
+/* Has the tap point been closed?  There may still be data queued. */
+bool tap_sub_closed(struct tap_sub *s);
+
+/*
+ * Start an accepter for tap connections.  A client sends a line with
+ * a connection name and optionally "dev", "net", or "both", and then
+ * gets the raw data for that direction.  Returns 0 or an errno.
+ */
+int tap_init(const char *accstr, const char **options, struct absout *eout);
+
+/* Stop the accepter and close the tap connections. */
+void tap_shutdown(void);
+
+#endif /* TAP_H */
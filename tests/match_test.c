@@ -0,0 +1,280 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Unit tests for the pattern matcher used by closeon, logon and
+ * notifyon.  The matcher is checked against a simple search over
+ * random data, fed in random sized pieces so matches get split
+ * across calls, with both the memchr() and the table skipping.
+ *
+ * Usage: match_test [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Pull in the matcher directly so this doesn't need the rest of ser2net. */
+#include "match.c"
+
+static int failures;
+
+#define check(cond, ...)				\
+    do {						\
+	if (!(cond)) {					\
+	    printf("%s:%d: ", __FILE__, __LINE__);	\
+	    printf(__VA_ARGS__);			\
+	    printf("\n");				\
+	    failures++;					\
+	}						\
+    } while (0)
+
+static struct matcher *
+make_matcher(const char **pats, unsigned int npats)
+{
+    struct matcher *m = matcher_alloc();
+    unsigned int i;
+    int rv;
+
+    if (!m) {
+	printf("Out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < npats; i++) {
+	rv = matcher_add(m, pats[i], strlen(pats[i]), MATCH_LOG);
+	if (rv) {
+	    printf("Unable to add pattern %s: %d\n", pats[i], rv);
+	    exit(1);
+	}
+    }
+    if (matcher_compile(m)) {
+	printf("Out of memory compiling\n");
+	exit(1);
+    }
+    return m;
+}
+
+/*
+ * Scan all of data in pieces of at most chunk bytes, returning where
+ * each match ended in ends[] and what matched in masks[].
+ */
+static unsigned int
+scan_all(struct matcher *m, const unsigned char *data, gensiods len,
+	 gensiods chunk, gensiods *ends, uint32_t *masks, unsigned int max)
+{
+    unsigned int state = MATCH_STATE_INIT, n = 0;
+    gensiods pos = 0, piece, end;
+    uint32_t matched;
+
+    while (pos < len) {
+	piece = len - pos;
+	if (chunk && piece > chunk)
+	    piece = chunk;
+	while (piece && matcher_scan(m, &state, data + pos, piece,
+				     &end, &matched)) {
+	    if (n < max) {
+		ends[n] = pos + end;
+		masks[n] = matched;
+	    }
+	    n++;
+	    pos += end;
+	    piece -= end;
+	}
+	pos += piece;
+    }
+    return n;
+}
+
+/* The same, the slow way. */
+static unsigned int
+naive_all(const char **pats, unsigned int npats,
+	  const unsigned char *data, gensiods len,
+	  gensiods *ends, uint32_t *masks, unsigned int max)
+{
+    unsigned int i, n = 0;
+    gensiods pos, plen;
+    uint32_t mask;
+
+    for (pos = 1; pos <= len; pos++) {
+	mask = 0;
+	for (i = 0; i < npats; i++) {
+	    plen = strlen(pats[i]);
+	    if (plen <= pos && memcmp(data + pos - plen, pats[i], plen) == 0)
+		mask |= 1U << i;
+	}
+	if (mask) {
+	    if (n < max) {
+		ends[n] = pos;
+		masks[n] = mask;
+	    }
+	    n++;
+	}
+    }
+    return n;
+}
+
+static void
+test_overlap(void)
+{
+    static const char *pats[] = { "he", "she", "his", "hers" };
+    struct matcher *m = make_matcher(pats, 4);
+    const unsigned char *data = (const unsigned char *) "ushers";
+    gensiods ends[4];
+    uint32_t masks[4];
+    unsigned int n;
+
+    /* "she" and "he" both end at the e, then "hers". */
+    n = scan_all(m, data, 6, 0, ends, masks, 4);
+    check(n == 2, "overlap: got %u matches, expected 2", n);
+    if (n == 2) {
+	check(ends[0] == 4 && masks[0] == 0x3,
+	      "overlap: first match %lu/%x", (unsigned long) ends[0],
+	      (unsigned int) masks[0]);
+	check(ends[1] == 6 && masks[1] == 0x8,
+	      "overlap: second match %lu/%x", (unsigned long) ends[1],
+	      (unsigned int) masks[1]);
+    }
+
+    /* One byte at a time carries the state between calls. */
+    n = scan_all(m, data, 6, 1, ends, masks, 4);
+    check(n == 2 && ends[0] == 4 && ends[1] == 6,
+	  "overlap: split scan got %u matches", n);
+    matcher_free(m);
+}
+
+static void
+test_limits(void)
+{
+    struct matcher *m = matcher_alloc();
+    char buf[MATCH_MAX_LEN + 1];
+    gensiods ends[2];
+    uint32_t masks[2];
+    unsigned int i, n;
+
+    check(matcher_add(m, "x", 0, MATCH_LOG) == GE_INVAL,
+	  "limits: empty pattern allowed");
+    memset(buf, 'a', sizeof(buf));
+    check(matcher_add(m, buf, sizeof(buf), MATCH_LOG) == GE_TOOBIG,
+	  "limits: too long a pattern allowed");
+
+    /* Nothing added, nothing found. */
+    check(matcher_compile(m) == 0, "limits: empty compile failed");
+    n = scan_all(m, (const unsigned char *) "abc", 3, 0, ends, masks, 2);
+    check(n == 0, "limits: empty matcher matched");
+
+    /* Fill all the patterns, the last one must report bit 31. */
+    for (i = 0; i < MATCH_MAX_PATTERNS; i++) {
+	snprintf(buf, sizeof(buf), "<%u>", i);
+	check(matcher_add(m, buf, strlen(buf), i == 31 ? MATCH_CLOSE : 0) == 0,
+	      "limits: pattern %u not added", i);
+    }
+    check(matcher_add(m, "z", 1, MATCH_LOG) == GE_TOOBIG,
+	  "limits: too many patterns allowed");
+    check(matcher_actions(m) == MATCH_CLOSE, "limits: wrong actions %x",
+	  matcher_actions(m));
+    check(matcher_pattern_actions(m, 31) == MATCH_CLOSE,
+	  "limits: wrong actions for pattern 31");
+    check(strcmp(matcher_pattern_str(m, 31), "<31>") == 0,
+	  "limits: wrong string for pattern 31");
+    check(matcher_compile(m) == 0, "limits: compile failed");
+    n = scan_all(m, (const unsigned char *) "..<31>..", 8, 0,
+		 ends, masks, 2);
+    check(n == 1 && ends[0] == 6 && masks[0] == 0x80000000U,
+	  "limits: pattern 31 not reported");
+    matcher_free(m);
+}
+
+static void
+test_str(void)
+{
+    struct matcher *m = matcher_alloc();
+
+    matcher_add(m, "a\\\r\n", 4, MATCH_LOG);
+    check(strcmp(matcher_pattern_str(m, 0), "a\\x5c\\x0d\\x0a") == 0,
+	  "str: got %s", matcher_pattern_str(m, 0));
+    matcher_free(m);
+}
+
+/*
+ * Compare with the slow search on random data over a small alphabet,
+ * so there are plenty of partial matches.
+ */
+static void
+test_random(const char *name, const char **pats, unsigned int npats,
+	    const char *alphabet)
+{
+    struct matcher *m = make_matcher(pats, npats);
+    unsigned char data[4096];
+    gensiods ends1[1024], ends2[1024];
+    uint32_t masks1[1024], masks2[1024];
+    unsigned int i, n1, n2, round, alen = strlen(alphabet);
+    gensiods chunk;
+
+    for (round = 0; round < 200; round++) {
+	for (i = 0; i < sizeof(data); i++)
+	    data[i] = alphabet[rand() % alen];
+	chunk = rand() % 17;
+	n1 = scan_all(m, data, sizeof(data), chunk, ends1, masks1, 1024);
+	n2 = naive_all(pats, npats, data, sizeof(data), ends2, masks2, 1024);
+	check(n1 == n2, "%s: round %u, %u matches, expected %u",
+	      name, round, n1, n2);
+	if (n1 != n2)
+	    break;
+	if (n1 > 1024)
+	    n1 = 1024;
+	for (i = 0; i < n1; i++) {
+	    if (ends1[i] != ends2[i] || masks1[i] != masks2[i])
+		break;
+	}
+	check(i == n1, "%s: round %u, match %u at %lu/%x, expected %lu/%x",
+	      name, round, i, (unsigned long) ends1[i],
+	      (unsigned int) masks1[i], (unsigned long) ends2[i],
+	      (unsigned int) masks2[i]);
+	if (i != n1)
+	    break;
+    }
+    matcher_free(m);
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* Up to MATCH_MEMCHR_MAX start bytes uses memchr() to skip. */
+    static const char *few[] = { "abc", "bca", "cab", "aa" };
+    /* More start bytes uses the start row of the table. */
+    static const char *many[] = { "ab", "bcd", "cd", "da", "eee", "fa" };
+    unsigned int seed = 1;
+
+    if (argc > 1)
+	seed = strtoul(argv[1], NULL, 0);
+    srand(seed);
+
+    test_overlap();
+    test_limits();
+    test_str();
+    test_random("memchr skip", few, 4, "abcx");
+    test_random("table skip", many, 6, "abcdefx");
+
+    if (failures) {
+	printf("match_test: %d failures, seed %u\n", failures, seed);
+	return 1;
+    }
+    printf("match_test: passed\n");
+    return 0;
+}
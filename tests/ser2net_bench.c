@@ -0,0 +1,994 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * End to end ser2net benchmark.  This runs a real ser2net with a
+ * generated config of N connections, each on a pty pair, and opens M
+ * network connections to each.  Then, in turn, it measures:
+ *
+ *   connect - Connections are opened one at a time, each is done when
+ *	the banner arrives, giving the accept rate and connect times.
+ *   dev-to-net - Data is written into every pty as fast as ser2net
+ *	takes it, and counted as it arrives on the network side.
+ *   net-to-dev - Every network connection writes as fast as it can,
+ *	and the data is counted as it comes out of the ptys.
+ *   latency - The first connection of each port sends a small
+ *	message, the pty side echoes it back, and the round trip time
+ *	is recorded.
+ *
+ * With udp, each network connection is a connected UDP socket, and
+ * the datagrams per second ser2net sends are reported, too.
+ *
+ * The CPU time ser2net used in the data phases is read from /proc.
+ * The results are appended to the output file as one JSON object per
+ * run, so runs can be collected and compared between releases.
+ *
+ * Usage: ser2net_bench [options], see usage() below.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+enum accepter_type { ACC_TCP, ACC_TELNET, ACC_SSL, ACC_UDP, ACC_STDIO };
+static const char *accepter_names[] = { "tcp", "telnet", "ssl", "udp",
+					"stdio" };
+
+static enum accepter_type acc_type = ACC_TCP;
+static unsigned int nports = 1;
+static unsigned int nconns = 1;
+static unsigned int nthreads = 1;
+static unsigned int duration = 5;
+static unsigned int blocksize = 4096;
+static unsigned int base_port = 3500;
+static unsigned int max_datagram;
+static const char *ser2net_exec;
+static const char *srcdir = ".";
+static const char *outfile;
+static bool verbose;
+
+#define PING_SIZE 16
+#define MAX_UDP_SIZE 65507
+#define MAX_SAMPLES 1000000
+
+struct bport;
+
+struct bconn {
+    struct bport *port;
+    int rfd;
+    int wfd;
+#ifdef HAVE_OPENSSL
+    SSL *ssl;
+#endif
+    int tn_state;
+    unsigned char tn_cmd;
+    uint64_t rx;
+    uint64_t rx_packets;
+
+    /* For the latency phase. */
+    unsigned int ping_rx;
+    bool ping_out;
+    uint64_t ping_sent;
+};
+
+struct bport {
+    int master;
+    char slave[64];
+    struct bconn *conns;
+
+    /* Data from the pty waiting to be echoed back in the latency phase. */
+    unsigned char echo[PING_SIZE * 16];
+    unsigned int echo_len;
+    uint64_t rx;
+};
+
+enum phase { PHASE_DRAIN, PHASE_DEV_TO_NET, PHASE_NET_TO_DEV, PHASE_LATENCY };
+
+static struct bport *ports;
+static pid_t ser2net_pid;
+static int ser2net_stdin = -1, ser2net_stdout = -1;
+static unsigned char blockdata[65536];
+static const unsigned char pingdata[PING_SIZE] = "ser2net ping....";
+
+static uint32_t *connect_samples;
+static unsigned int num_connect_samples;
+static uint32_t *rtt_samples;
+static unsigned int num_rtt_samples;
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX *ssl_ctx;
+#endif
+
+static void
+fail(const char *fmt, ...) __attribute__ ((format (printf, 1, 2), noreturn));
+
+static void
+fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "ser2net_bench: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    if (ser2net_pid > 0)
+	kill(ser2net_pid, SIGKILL);
+    exit(1);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* CPU time used by ser2net so far, in milliseconds. */
+static double
+ser2net_cpu_ms(void)
+{
+    char path[64], buf[1024], *s;
+    unsigned long utime, stime;
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) ser2net_pid);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return -1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+	return -1;
+    buf[len] = '\0';
+
+    /* Skip past the command name, it may have spaces in it. */
+    s = strrchr(buf, ')');
+    if (!s || sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		     "%lu %lu", &utime, &stime) != 2)
+	return -1;
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts the samples. */
+static uint32_t
+percentile(uint32_t *samples, unsigned int count, unsigned int pct)
+{
+    unsigned int i;
+
+    if (count == 0)
+	return 0;
+    qsort(samples, count, sizeof(*samples), cmp_u32);
+    i = ((uint64_t) count * pct + 99) / 100;
+    if (i > 0)
+	i--;
+    return samples[i];
+}
+
+static void
+add_sample(uint32_t *samples, unsigned int *count, uint64_t ns)
+{
+    if (*count < MAX_SAMPLES)
+	samples[(*count)++] = ns / 1000;
+}
+
+/*
+ * ser2net ports.
+ */
+
+static void
+open_ptys(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < nports; i++) {
+	struct bport *p = &ports[i];
+
+	p->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (p->master == -1 || grantpt(p->master) || unlockpt(p->master))
+	    fail("Unable to allocate a pty: %s", strerror(errno));
+	if (ptsname_r(p->master, p->slave, sizeof(p->slave)))
+	    fail("Unable to get the pty name: %s", strerror(errno));
+	set_nonblock(p->master);
+    }
+}
+
+static char *
+accepter_str(unsigned int portnum)
+{
+    static char buf[1024];
+    unsigned int tcpport = base_port + portnum;
+
+    switch (acc_type) {
+    case ACC_TCP:
+	snprintf(buf, sizeof(buf), "tcp,localhost,%u", tcpport);
+	break;
+    case ACC_TELNET:
+	snprintf(buf, sizeof(buf), "telnet,tcp,localhost,%u", tcpport);
+	break;
+    case ACC_SSL:
+	snprintf(buf, sizeof(buf),
+		 "ssl(key=%s/key.pem,cert=%s/cert.pem),tcp,localhost,%u",
+		 srcdir, srcdir, tcpport);
+	break;
+    case ACC_UDP:
+	snprintf(buf, sizeof(buf), "udp,localhost,%u", tcpport);
+	break;
+    case ACC_STDIO:
+	snprintf(buf, sizeof(buf), "stdio");
+	break;
+    }
+    return buf;
+}
+
+static char *
+write_config(void)
+{
+    static char name[] = "/tmp/ser2net_bench_XXXXXX";
+    unsigned int i;
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(name);
+    if (fd == -1)
+	fail("Unable to create the config file: %s", strerror(errno));
+    f = fdopen(fd, "w");
+    if (!f)
+	fail("Unable to open the config file: %s", strerror(errno));
+
+    fprintf(f, "%%YAML 1.1\n---\n");
+    for (i = 0; i < nports; i++) {
+	fprintf(f, "connection: &bench%u\n", i);
+	fprintf(f, "  accepter: %s\n", accepter_str(i));
+	fprintf(f, "  connector: serialdev,%s,115200n81,local\n",
+		ports[i].slave);
+	fprintf(f, "  options:\n");
+	fprintf(f, "    max-connections: %u\n", nconns);
+	fprintf(f, "    banner: \"R\"\n");
+	if (max_datagram)
+	    fprintf(f, "    max-datagram-size: %u\n", max_datagram);
+    }
+    fclose(f);
+    return name;
+}
+
+static void
+start_ser2net(const char *cfgfile)
+{
+    char threads[16], buf[256];
+    int in[2], out[2];
+    size_t len = 0;
+    int devnull;
+
+    if (pipe(in) || pipe(out))
+	fail("Unable to create pipes: %s", strerror(errno));
+
+    snprintf(threads, sizeof(threads), "%u", nthreads);
+    ser2net_pid = fork();
+    if (ser2net_pid == -1)
+	fail("Unable to fork: %s", strerror(errno));
+    if (ser2net_pid == 0) {
+	dup2(in[0], 0);
+	dup2(out[1], 1);
+	if (!verbose) {
+	    devnull = open("/dev/null", O_WRONLY);
+	    if (devnull != -1)
+		dup2(devnull, 2);
+	}
+	close(in[0]);
+	close(in[1]);
+	close(out[0]);
+	close(out[1]);
+	execl(ser2net_exec, ser2net_exec, "-r", "-d", "-u", "-c", cfgfile,
+	      "-t", threads, (char *) NULL);
+	fprintf(stderr, "Unable to run %s: %s\n", ser2net_exec,
+		strerror(errno));
+	_exit(1);
+    }
+    close(in[0]);
+    close(out[1]);
+    ser2net_stdin = in[1];
+    ser2net_stdout = out[0];
+
+    /* Wait for ser2net to say it's ready, a byte at a time to not eat data. */
+    while (len < sizeof(buf) - 1) {
+	struct pollfd pfd = { ser2net_stdout, POLLIN, 0 };
+
+	if (poll(&pfd, 1, 5000) != 1)
+	    fail("Timed out waiting for ser2net to start");
+	if (read(ser2net_stdout, buf + len, 1) != 1)
+	    fail("ser2net exited on startup");
+	len++;
+	buf[len] = '\0';
+	if (len >= 6 && strcmp(buf + len - 6, "Ready\n") == 0)
+	    break;
+    }
+}
+
+static void
+stop_ser2net(void)
+{
+    int status;
+
+    kill(ser2net_pid, SIGTERM);
+    waitpid(ser2net_pid, &status, 0);
+    ser2net_pid = 0;
+}
+
+/*
+ * Network connections.
+ */
+
+static void
+conn_raw_write_all(struct bconn *c, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+	ssize_t rv = write(c->wfd, buf, len);
+
+	if (rv < 0) {
+	    if (errno == EAGAIN || errno == EINTR) {
+		struct pollfd pfd = { c->wfd, POLLOUT, 0 };
+
+		poll(&pfd, 1, 1000);
+		continue;
+	    }
+	    fail("Network write error: %s", strerror(errno));
+	}
+	buf += rv;
+	len -= rv;
+    }
+}
+
+#define TN_IAC	255
+#define TN_DONT	254
+#define TN_DO	253
+#define TN_WONT	252
+#define TN_WILL	251
+#define TN_SB	250
+#define TN_SE	240
+
+enum { TN_DATA, TN_GOT_IAC, TN_GOT_CMD, TN_IN_SB, TN_IN_SB_IAC };
+
+/*
+ * Strip telnet commands from the data in place, refusing any option
+ * the server asks for.  Returns the amount of data left.
+ */
+static size_t
+telnet_filter(struct bconn *c, unsigned char *buf, size_t len)
+{
+    unsigned char reply[3];
+    size_t i, out = 0;
+
+    for (i = 0; i < len; i++) {
+	unsigned char ch = buf[i];
+
+	switch (c->tn_state) {
+	case TN_DATA:
+	    if (ch == TN_IAC)
+		c->tn_state = TN_GOT_IAC;
+	    else
+		buf[out++] = ch;
+	    break;
+
+	case TN_GOT_IAC:
+	    if (ch == TN_IAC) {
+		buf[out++] = ch;
+		c->tn_state = TN_DATA;
+	    } else if (ch >= TN_WILL) {
+		c->tn_cmd = ch;
+		c->tn_state = TN_GOT_CMD;
+	    } else if (ch == TN_SB) {
+		c->tn_state = TN_IN_SB;
+	    } else {
+		c->tn_state = TN_DATA;
+	    }
+	    break;
+
+	case TN_GOT_CMD:
+	    if (c->tn_cmd == TN_DO || c->tn_cmd == TN_WILL) {
+		reply[0] = TN_IAC;
+		reply[1] = c->tn_cmd == TN_DO ? TN_WONT : TN_DONT;
+		reply[2] = ch;
+		conn_raw_write_all(c, reply, 3);
+	    }
+	    c->tn_state = TN_DATA;
+	    break;
+
+	case TN_IN_SB:
+	    if (ch == TN_IAC)
+		c->tn_state = TN_IN_SB_IAC;
+	    break;
+
+	case TN_IN_SB_IAC:
+	    c->tn_state = ch == TN_SE ? TN_DATA : TN_IN_SB;
+	    break;
+	}
+    }
+    return out;
+}
+
+/* Returns the bytes read, 0 if nothing is ready.  Fails on close. */
+static ssize_t
+conn_read(struct bconn *c, unsigned char *buf, size_t len)
+{
+    ssize_t rv;
+
+#ifdef HAVE_OPENSSL
+    if (c->ssl) {
+	rv = SSL_read(c->ssl, buf, len);
+	if (rv <= 0) {
+	    int err = SSL_get_error(c->ssl, rv);
+
+	    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		return 0;
+	    fail("SSL read error on port %u", (unsigned int)
+		 (c->port - ports));
+	}
+	return rv;
+    }
+#endif
+    rv = read(c->rfd, buf, len);
+    if (rv < 0) {
+	if (errno == EAGAIN || errno == EINTR)
+	    return 0;
+	fail("Network read error: %s", strerror(errno));
+    }
+    if (acc_type == ACC_UDP) {
+	/* An empty datagram is not a close. */
+	c->rx_packets++;
+	return rv;
+    }
+    if (rv == 0)
+	fail("Network connection closed by ser2net on port %u",
+	     (unsigned int) (c->port - ports));
+    if (acc_type == ACC_TELNET)
+	rv = telnet_filter(c, buf, rv);
+    return rv;
+}
+
+/*
+ * Returns the bytes written, 0 if it would block.  With SSL a write
+ * that would block must be retried with the same data, so only write
+ * from blockdata or pingdata.
+ */
+static ssize_t
+conn_write(struct bconn *c, const unsigned char *buf, size_t len)
+{
+    ssize_t rv;
+
+#ifdef HAVE_OPENSSL
+    if (c->ssl) {
+	rv = SSL_write(c->ssl, buf, len);
+	if (rv <= 0) {
+	    int err = SSL_get_error(c->ssl, rv);
+
+	    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		return 0;
+	    fail("SSL write error");
+	}
+	return rv;
+    }
+#endif
+    rv = write(c->wfd, buf, len);
+    if (rv < 0) {
+	if (errno == EAGAIN || errno == EINTR)
+	    return 0;
+	fail("Network write error: %s", strerror(errno));
+    }
+    return rv;
+}
+
+static int
+net_connect(unsigned int tcpport)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, acc_type == ACC_UDP ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd == -1)
+	fail("Unable to create socket: %s", strerror(errno));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcpport);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	fail("Unable to connect to port %u: %s", tcpport, strerror(errno));
+    if (acc_type != ACC_UDP)
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Open a connection and wait for the banner. */
+static void
+open_conn(struct bport *p, struct bconn *c)
+{
+    unsigned int portnum = p - ports;
+    unsigned char ch;
+    uint64_t start, end;
+
+    c->port = p;
+    if (acc_type == ACC_STDIO) {
+	/* ser2net accepted this at startup, the banner is drained later. */
+	c->rfd = ser2net_stdout;
+	c->wfd = ser2net_stdin;
+	set_nonblock(c->rfd);
+	set_nonblock(c->wfd);
+	return;
+    }
+
+    start = now_ns();
+    c->rfd = c->wfd = net_connect(base_port + portnum);
+    if (acc_type == ACC_UDP) {
+	/*
+	 * ser2net doesn't know about us until a packet arrives.  The
+	 * byte goes to the pty, it is drained before the data phases.
+	 */
+	if (write(c->wfd, pingdata, 1) != 1)
+	    fail("Unable to send to port %u: %s", base_port + portnum,
+		 strerror(errno));
+    }
+#ifdef HAVE_OPENSSL
+    if (acc_type == ACC_SSL) {
+	c->ssl = SSL_new(ssl_ctx);
+	if (!c->ssl || !SSL_set_fd(c->ssl, c->rfd) || SSL_connect(c->ssl) != 1)
+	    fail("SSL connect to port %u failed", base_port + portnum);
+	SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+#endif
+    set_nonblock(c->rfd);
+    for (;;) {
+	struct pollfd pfd = { c->rfd, POLLIN, 0 };
+
+	if (conn_read(c, &ch, 1) == 1)
+	    break;
+	if (poll(&pfd, 1, 5000) == 0)
+	    fail("Timed out waiting for the banner on port %u",
+		 base_port + portnum);
+    }
+    end = now_ns();
+    add_sample(connect_samples, &num_connect_samples, end - start);
+}
+
+static void
+close_conn(struct bconn *c)
+{
+#ifdef HAVE_OPENSSL
+    if (c->ssl) {
+	SSL_free(c->ssl);
+	c->ssl = NULL;
+    }
+#endif
+    if (acc_type != ACC_STDIO)
+	close(c->rfd);
+}
+
+/*
+ * The main loop, run one phase for the given time.
+ */
+
+static void
+handle_master(struct bport *p, enum phase phase, short revents)
+{
+    unsigned char buf[65536];
+    ssize_t rv;
+
+    if (revents & POLLIN) {
+	if (phase == PHASE_LATENCY) {
+	    rv = read(p->master, p->echo + p->echo_len,
+		      sizeof(p->echo) - p->echo_len);
+	    if (rv > 0)
+		p->echo_len += rv;
+	} else {
+	    while ((rv = read(p->master, buf, sizeof(buf))) > 0)
+		p->rx += rv;
+	}
+    }
+
+    if (phase == PHASE_DEV_TO_NET && (revents & POLLOUT)) {
+	write(p->master, blockdata, blocksize);
+    } else if (phase == PHASE_LATENCY && p->echo_len) {
+	rv = write(p->master, p->echo, p->echo_len);
+	if (rv > 0) {
+	    memmove(p->echo, p->echo + rv, p->echo_len - rv);
+	    p->echo_len -= rv;
+	}
+    }
+}
+
+static void
+handle_conn(struct bconn *c, enum phase phase, short revents, bool pinger)
+{
+    unsigned char buf[65536];
+    ssize_t rv;
+
+    if (revents & POLLIN) {
+	while ((rv = conn_read(c, buf, sizeof(buf))) > 0) {
+	    c->rx += rv;
+	    if (pinger && c->ping_out) {
+		c->ping_rx += rv;
+		if (c->ping_rx >= PING_SIZE) {
+		    add_sample(rtt_samples, &num_rtt_samples,
+			       now_ns() - c->ping_sent);
+		    c->ping_out = false;
+		    c->ping_rx = 0;
+		}
+	    }
+	}
+    }
+
+    if (phase == PHASE_NET_TO_DEV && (revents & POLLOUT)) {
+	conn_write(c, blockdata, blocksize);
+    } else if (phase == PHASE_LATENCY && pinger && !c->ping_out) {
+	rv = conn_write(c, pingdata, PING_SIZE);
+	if (rv == PING_SIZE) {
+	    c->ping_sent = now_ns();
+	    c->ping_out = true;
+	} else if (rv > 0) {
+	    fail("Short ping write");
+	}
+    }
+}
+
+/*
+ * Run a phase for the given time.  For PHASE_DRAIN, just read and
+ * throw away data until nothing comes in for 200ms.
+ */
+static void
+run_phase(enum phase phase, unsigned int msecs)
+{
+    unsigned int nfds = nports * (nconns + 1), i, j, n;
+    struct pollfd *fds = calloc(nfds, sizeof(*fds));
+    uint64_t end = now_ns() + (uint64_t) msecs * 1000000;
+    int rv;
+
+    if (!fds)
+	fail("Out of memory");
+
+    for (;;) {
+	n = 0;
+	for (i = 0; i < nports; i++) {
+	    fds[n].fd = ports[i].master;
+	    fds[n].events = POLLIN;
+	    if (phase == PHASE_DEV_TO_NET ||
+			(phase == PHASE_LATENCY && ports[i].echo_len))
+		fds[n].events |= POLLOUT;
+	    n++;
+	    for (j = 0; j < nconns; j++) {
+		struct bconn *c = &ports[i].conns[j];
+
+		fds[n].fd = c->rfd;
+		fds[n].events = POLLIN;
+		n++;
+		if (phase == PHASE_NET_TO_DEV) {
+		    /* The write side is a separate fd for stdio. */
+		    if (c->wfd == c->rfd)
+			fds[n - 1].events |= POLLOUT;
+		}
+	    }
+	}
+
+	rv = poll(fds, n, phase == PHASE_DRAIN ? 200 : 10);
+	if (rv < 0 && errno != EINTR)
+	    fail("poll error: %s", strerror(errno));
+	if (phase == PHASE_DRAIN && rv == 0)
+	    break;
+
+	n = 0;
+	for (i = 0; i < nports; i++) {
+	    if (fds[n].revents & (POLLERR | POLLHUP))
+		fail("pty for port %u closed", i);
+	    handle_master(&ports[i], phase, fds[n].revents);
+	    n++;
+	    for (j = 0; j < nconns; j++) {
+		short revents = fds[n].revents;
+
+		if (phase == PHASE_NET_TO_DEV && ports[i].conns[j].wfd !=
+			    ports[i].conns[j].rfd)
+		    revents |= POLLOUT;
+		handle_conn(&ports[i].conns[j], phase, revents, j == 0);
+		n++;
+	    }
+	}
+	if (phase != PHASE_DRAIN && now_ns() >= end)
+	    break;
+    }
+    free(fds);
+}
+
+static uint64_t
+total_conn_rx(void)
+{
+    uint64_t total = 0;
+    unsigned int i, j;
+
+    for (i = 0; i < nports; i++)
+	for (j = 0; j < nconns; j++)
+	    total += ports[i].conns[j].rx;
+    return total;
+}
+
+static uint64_t
+total_conn_packets(void)
+{
+    uint64_t total = 0;
+    unsigned int i, j;
+
+    for (i = 0; i < nports; i++)
+	for (j = 0; j < nconns; j++)
+	    total += ports[i].conns[j].rx_packets;
+    return total;
+}
+
+static uint64_t
+total_port_rx(void)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < nports; i++)
+	total += ports[i].rx;
+    return total;
+}
+
+static void
+reset_counts(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < nports; i++) {
+	ports[i].rx = 0;
+	for (j = 0; j < nconns; j++) {
+	    ports[i].conns[j].rx = 0;
+	    ports[i].conns[j].rx_packets = 0;
+	}
+    }
+}
+
+/*
+ * Run a throughput phase and return the bytes/sec through ser2net.
+ * The CPU used per MB is returned in cpu_per_mb, and the datagrams/sec
+ * received on the network side in pkts_per_sec if it is not NULL.
+ */
+static double
+run_throughput(enum phase phase, double *cpu_per_mb, double *pkts_per_sec)
+{
+    double cpu_start, cpu_end, mb;
+    uint64_t start, end, bytes;
+
+    run_phase(PHASE_DRAIN, 0);
+    reset_counts();
+    cpu_start = ser2net_cpu_ms();
+    start = now_ns();
+    run_phase(phase, duration * 1000);
+    end = now_ns();
+    cpu_end = ser2net_cpu_ms();
+
+    if (phase == PHASE_DEV_TO_NET)
+	bytes = total_conn_rx();
+    else
+	bytes = total_port_rx();
+    mb = bytes / 1e6;
+    *cpu_per_mb = -1;
+    if (cpu_start >= 0 && cpu_end >= 0 && mb > 0)
+	*cpu_per_mb = (cpu_end - cpu_start) / mb;
+    if (pkts_per_sec)
+	*pkts_per_sec = total_conn_packets() * 1e9 / (end - start);
+    return bytes * 1e9 / (end - start);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+"Usage: %s [options]\n"
+"  -a tcp|telnet|ssl|udp|stdio  The accepter type, default tcp\n"
+"  -p <n>    Number of ser2net connections (ptys), default 1\n"
+"  -c <n>    Network connections per port, default 1\n"
+"  -t <n>    Threads for ser2net (its -t option), default 1\n"
+"  -s <n>    Seconds to run each phase, default 5\n"
+"  -b <n>    Write size, default 4096\n"
+"  -P <n>    First TCP port number, default 3500\n"
+"  -m <n>    Set max-datagram-size on the ports, for udp\n"
+"  -e <path> The ser2net executable, default $SER2NET_EXEC or ser2net\n"
+"  -S <dir>  Directory with the test certificates, default $TESTPATH or .\n"
+"  -o <file> Append the JSON results to this file, default stdout\n"
+"  -v        Show ser2net's output\n", name);
+    exit(1);
+}
+
+static unsigned int
+get_uint(const char *name, const char *str)
+{
+    char *end;
+    unsigned long v = strtoul(str, &end, 0);
+
+    if (end == str || *end || v == 0 || v > 1000000)
+	fail("Invalid value for %s: %s", name, str);
+    return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+    double d2n, d2n_cpu, d2n_pps, n2d, n2d_cpu, connect_secs = 0;
+    unsigned int i, j;
+    char *cfgfile;
+    FILE *out = stdout;
+    int opt;
+
+    ser2net_exec = getenv("SER2NET_EXEC");
+    if (!ser2net_exec)
+	ser2net_exec = "ser2net";
+    if (getenv("TESTPATH"))
+	srcdir = getenv("TESTPATH");
+
+    while ((opt = getopt(argc, argv, "a:p:c:t:s:b:P:m:e:S:o:v")) != -1) {
+	switch (opt) {
+	case 'a':
+	    for (i = 0; i <= ACC_STDIO; i++) {
+		if (strcmp(optarg, accepter_names[i]) == 0)
+		    break;
+	    }
+	    if (i > ACC_STDIO)
+		fail("Unknown accepter type: %s", optarg);
+	    acc_type = i;
+	    break;
+	case 'p': nports = get_uint("-p", optarg); break;
+	case 'c': nconns = get_uint("-c", optarg); break;
+	case 't': nthreads = get_uint("-t", optarg); break;
+	case 's': duration = get_uint("-s", optarg); break;
+	case 'b': blocksize = get_uint("-b", optarg); break;
+	case 'P': base_port = get_uint("-P", optarg); break;
+	case 'm': max_datagram = get_uint("-m", optarg); break;
+	case 'e': ser2net_exec = optarg; break;
+	case 'S': srcdir = optarg; break;
+	case 'o': outfile = optarg; break;
+	case 'v': verbose = true; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (blocksize > sizeof(blockdata))
+	fail("Write size may not be more than %u",
+	     (unsigned int) sizeof(blockdata));
+    if (acc_type == ACC_UDP && blocksize > MAX_UDP_SIZE)
+	fail("Write size may not be more than %u with udp", MAX_UDP_SIZE);
+    if (acc_type == ACC_STDIO && (nports != 1 || nconns != 1))
+	fail("stdio only supports one port with one connection");
+#ifdef HAVE_OPENSSL
+    if (acc_type == ACC_SSL) {
+	SSL_library_init();
+	ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+	if (!ssl_ctx)
+	    fail("Unable to allocate SSL context");
+	/* Just a benchmark, don't bother checking the test certificate. */
+	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+    }
+#else
+    if (acc_type == ACC_SSL)
+	fail("Built without OpenSSL, ssl is not available");
+#endif
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* No 0xff bytes, so telnet doesn't have to escape anything. */
+    for (i = 0; i < sizeof(blockdata); i++)
+	blockdata[i] = i % 255;
+
+    connect_samples = calloc(MAX_SAMPLES, sizeof(uint32_t));
+    rtt_samples = calloc(MAX_SAMPLES, sizeof(uint32_t));
+    ports = calloc(nports, sizeof(*ports));
+    if (!connect_samples || !rtt_samples || !ports)
+	fail("Out of memory");
+    for (i = 0; i < nports; i++) {
+	ports[i].conns = calloc(nconns, sizeof(struct bconn));
+	if (!ports[i].conns)
+	    fail("Out of memory");
+    }
+
+    open_ptys();
+    cfgfile = write_config();
+    start_ser2net(cfgfile);
+
+    for (i = 0; i < nports; i++)
+	for (j = 0; j < nconns; j++)
+	    open_conn(&ports[i], &ports[i].conns[j]);
+    for (i = 0; i < num_connect_samples; i++)
+	connect_secs += connect_samples[i] / 1e6;
+
+    d2n = run_throughput(PHASE_DEV_TO_NET, &d2n_cpu, &d2n_pps);
+    n2d = run_throughput(PHASE_NET_TO_DEV, &n2d_cpu, NULL);
+    run_phase(PHASE_DRAIN, 0);
+    run_phase(PHASE_LATENCY, duration * 1000);
+
+    for (i = 0; i < nports; i++)
+	for (j = 0; j < nconns; j++)
+	    close_conn(&ports[i].conns[j]);
+    stop_ser2net();
+    unlink(cfgfile);
+
+    if (outfile) {
+	out = fopen(outfile, "a");
+	if (!out)
+	    fail("Unable to open %s: %s", outfile, strerror(errno));
+    }
+    fprintf(out, "{\"accepter\": \"%s\", \"ports\": %u, \"conns\": %u, "
+	    "\"threads\": %u, \"seconds\": %u, \"blocksize\": %u, ",
+	    accepter_names[acc_type], nports, nconns, nthreads, duration,
+	    blocksize);
+    if (num_connect_samples)
+	fprintf(out, "\"accept_rate\": %.1f, \"connect_p50_us\": %u, "
+		"\"connect_p99_us\": %u, ",
+		num_connect_samples / connect_secs,
+		percentile(connect_samples, num_connect_samples, 50),
+		percentile(connect_samples, num_connect_samples, 99));
+    if (acc_type == ACC_UDP)
+	fprintf(out, "\"max_datagram_size\": %u, "
+		"\"dev_to_net_packets_per_sec\": %.0f, ",
+		max_datagram, d2n_pps);
+    fprintf(out, "\"dev_to_net_bytes_per_sec\": %.0f, "
+	    "\"dev_to_net_cpu_ms_per_mb\": %.3f, "
+	    "\"net_to_dev_bytes_per_sec\": %.0f, "
+	    "\"net_to_dev_cpu_ms_per_mb\": %.3f, "
+	    "\"rtt_samples\": %u, \"rtt_p50_us\": %u, \"rtt_p99_us\": %u}\n",
+	    d2n, d2n_cpu, n2d, n2d_cpu, num_rtt_samples,
+	    percentile(rtt_samples, num_rtt_samples, 50),
+	    percentile(rtt_samples, num_rtt_samples, 99));
+    if (out != stdout)
+	fclose(out);
+
+    return 0;
+}
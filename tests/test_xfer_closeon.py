@@ -0,0 +1,52 @@
+#!/usr/bin/python
+
+# Check that a closeon string closes the connection, and that none of
+# the device data after it is passed on.
+
+import gensio
+import utils
+
+o = utils.o
+
+class CloseWatch:
+    """Count the data that comes in and wait for the close"""
+
+    def __init__(self, o):
+        self.waiter = gensio.waiter(o)
+        self.extra = 0
+        self.closed = False
+
+    def read_callback(self, io, err, buf, auxdata):
+        if (err):
+            self.closed = True
+            io.read_cb_enable(False)
+            self.waiter.wake()
+            return 0
+        self.extra += len(buf)
+        return len(buf)
+
+    def write_callback(self, io):
+        io.write_cb_enable(False)
+
+print("Transfer closeon:")
+ser2net, io1, io2 = utils.setup_2_ser2net(o,
+                        "3023:raw:100:/dev/ttyPipeA0:9600N81 closeon=bye\n",
+                        "tcp,localhost,3023",
+                        "serialdev,/dev/ttyPipeB0,9600N81")
+try:
+    io1.handler.set_compare("hello bye")
+    io2.handler.set_write_data("hello bye, this is not sent")
+    if (io1.handler.wait_timeout(2000) == 0):
+        raise Exception("Timed out waiting for the data up to closeon")
+
+    watch = CloseWatch(o)
+    io1.set_cbs(watch)
+    io1.read_cb_enable(True)
+    if (watch.waiter.wait_timeout(1, 2000) == 0):
+        raise Exception("Connection was not closed after closeon")
+    if (watch.extra):
+        raise Exception("Got %d bytes after the closeon string" %
+                        watch.extra)
+finally:
+    utils.finish_2_ser2net(ser2net, io1, io2)
+print("  Success!")
@@ -0,0 +1,452 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Unit tests for the timing wheel.  The wheel runs on fake os
+ * functions with a monotonic clock the test moves by hand and a single
+ * timer that is fired when the clock reaches it, so entries can be
+ * driven across the 64 and 4096 second level boundaries quickly.
+ *
+ * Usage: timewheel_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Pull in the wheel directly so this doesn't need the rest of ser2net. */
+#include "timewheel.c"
+
+static int failures;
+
+#define check(cond, ...)				\
+    do {						\
+	if (!(cond)) {					\
+	    printf("%s:%d: ", __FILE__, __LINE__);	\
+	    printf(__VA_ARGS__);			\
+	    printf("\n");				\
+	    failures++;					\
+	}						\
+    } while (0)
+
+/* The fake os functions, one wheel and so one timer at a time. */
+struct gensio_lock {
+    int held;
+};
+
+struct gensio_timer {
+    void (*handler)(struct gensio_timer *t, void *cb_data);
+    void *cb_data;
+    bool running;
+    unsigned long expires;
+};
+
+static unsigned long fake_now;
+
+static struct gensio_lock *
+fake_alloc_lock(struct gensio_os_funcs *o)
+{
+    return calloc(1, sizeof(struct gensio_lock));
+}
+
+static void
+fake_free_lock(struct gensio_lock *l)
+{
+    check(!l->held, "lock freed while held");
+    free(l);
+}
+
+static void
+fake_lock(struct gensio_lock *l)
+{
+    check(!l->held, "lock taken twice");
+    l->held = 1;
+}
+
+static void
+fake_unlock(struct gensio_lock *l)
+{
+    check(l->held, "lock released while not held");
+    l->held = 0;
+}
+
+static struct gensio_timer *fake_timer;
+
+static struct gensio_timer *
+fake_alloc_timer(struct gensio_os_funcs *o,
+		 void (*handler)(struct gensio_timer *t, void *cb_data),
+		 void *cb_data)
+{
+    struct gensio_timer *t = calloc(1, sizeof(*t));
+
+    if (t) {
+	t->handler = handler;
+	t->cb_data = cb_data;
+	fake_timer = t;
+    }
+    return t;
+}
+
+static void
+fake_free_timer(struct gensio_timer *t)
+{
+    fake_timer = NULL;
+    free(t);
+}
+
+static int
+fake_start_timer_abs(struct gensio_timer *t, struct timeval *timeout)
+{
+    check(!t->running, "timer started while running");
+    t->running = true;
+    t->expires = timeout->tv_sec;
+    return 0;
+}
+
+static int
+fake_stop_timer(struct gensio_timer *t)
+{
+    if (!t->running)
+	return GE_TIMEDOUT;
+    t->running = false;
+    return 0;
+}
+
+static void
+fake_get_monotonic_time(struct gensio_os_funcs *o, struct timeval *tv)
+{
+    tv->tv_sec = fake_now;
+    tv->tv_usec = 0;
+}
+
+static struct gensio_os_funcs fake_o = {
+    .alloc_lock = fake_alloc_lock,
+    .free_lock = fake_free_lock,
+    .lock = fake_lock,
+    .unlock = fake_unlock,
+    .alloc_timer = fake_alloc_timer,
+    .free_timer = fake_free_timer,
+    .start_timer_abs = fake_start_timer_abs,
+    .stop_timer = fake_stop_timer,
+    .get_monotonic_time = fake_get_monotonic_time,
+};
+
+/* Fire the timer if its time has come. */
+static void
+fake_run_timer(void)
+{
+    if (fake_timer && fake_timer->running && fake_now >= fake_timer->expires) {
+	fake_timer->running = false;
+	fake_timer->handler(fake_timer, fake_timer->cb_data);
+    }
+}
+
+/* Move the clock a second at a time, like a timer that is never late. */
+static void
+step_to(unsigned long t)
+{
+    while (fake_now < t) {
+	fake_now++;
+	fake_run_timer();
+    }
+}
+
+/* Move the clock all at once, like a timer that runs late. */
+static void
+jump_to(unsigned long t)
+{
+    fake_now = t;
+    fake_run_timer();
+}
+
+struct test_entry {
+    struct twheel_entry e;
+    unsigned long want;		/* When it should fire, 0 for never. */
+    unsigned int fired;
+    unsigned long fired_at;
+};
+
+static void
+test_handler(struct twheel_entry *e, void *cb_data)
+{
+    struct test_entry *te = cb_data;
+
+    te->fired++;
+    te->fired_at = fake_now;
+}
+
+static void
+check_fired(const char *name, struct test_entry *te, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+	if (!te[i].want) {
+	    check(te[i].fired == 0, "%s: entry %u fired, it shouldn't have",
+		  name, i);
+	    continue;
+	}
+	check(te[i].fired == 1, "%s: entry %u fired %u times", name, i,
+	      te[i].fired);
+	check(te[i].fired_at == te[i].want,
+	      "%s: entry %u fired at %lu, expected %lu", name, i,
+	      te[i].fired_at, te[i].want);
+    }
+}
+
+static void
+check_idle(const char *name, struct twheel *w)
+{
+    check(w->count == 0, "%s: %u entries left in the wheel", name, w->count);
+    check(!w->expired, "%s: entries left on the expired list", name);
+    check(!w->timer_running && !fake_timer->running,
+	  "%s: timer still running", name);
+}
+
+#define NENTS(a) (sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Entries on each side of the level 1, 2 and 3 boundaries, both
+ * relative to when they were added and relative to the absolute
+ * times the levels cascade at.
+ */
+static void
+test_levels(unsigned long start)
+{
+    static const unsigned long deltas[] = {
+	1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 8191, 8192,
+	262143, 262144, 262145
+    };
+    struct test_entry te[NENTS(deltas) + 6];
+    struct twheel *w;
+    unsigned int i, n = 0;
+    char name[40];
+
+    snprintf(name, sizeof(name), "levels from %lu", start);
+    fake_now = start;
+    w = twheel_alloc(&fake_o);
+    memset(te, 0, sizeof(te));
+    for (i = 0; i < NENTS(deltas); i++)
+	te[n++].want = start + deltas[i];
+    /* The next 64 and 4096 second cascade, and just around them. */
+    te[n++].want = (start | 63) + 1;
+    te[n++].want = (start | 63) + 2;
+    te[n++].want = (start | 4095) + 4096;
+    te[n++].want = (start | 4095) + 1;
+    te[n++].want = (start | 4095) + 2;
+    te[n++].want = (start | 4095) + 65;
+    for (i = 0; i < n; i++) {
+	twheel_entry_init(&te[i].e, test_handler, &te[i]);
+	twheel_add(w, &te[i].e, te[i].want);
+    }
+    check(w->count == n, "%s: count %u after adding %u", name, w->count, n);
+
+    step_to(start + 262145 + 1);
+    check_fired(name, te, n);
+    check_idle(name, w);
+    twheel_free(w);
+}
+
+/*
+ * A timer that runs late has to do several ticks at once, including
+ * the cascades, and everything that came due fires once.
+ */
+static void
+test_late(void)
+{
+    static const unsigned long deltas[] = { 1, 63, 64, 200, 4096, 5000 };
+    struct test_entry te[NENTS(deltas)];
+    unsigned long start = 1000;
+    struct twheel *w;
+    unsigned int i;
+
+    fake_now = start;
+    w = twheel_alloc(&fake_o);
+    memset(te, 0, sizeof(te));
+    for (i = 0; i < NENTS(deltas); i++) {
+	twheel_entry_init(&te[i].e, test_handler, &te[i]);
+	twheel_add(w, &te[i].e, start + deltas[i]);
+    }
+
+    /* Everything up to 4096 is late and fires at the jump. */
+    jump_to(start + 4500);
+    for (i = 0; i < NENTS(deltas); i++)
+	te[i].want = deltas[i] <= 4500 ? start + 4500 : 0;
+    check_fired("late", te, NENTS(deltas));
+    check(w->count == 1, "late: count %u, expected 1", w->count);
+
+    te[NENTS(deltas) - 1].want = start + 5000;
+    step_to(start + 5001);
+    check_fired("late", te, NENTS(deltas));
+    check_idle("late", w);
+    twheel_free(w);
+}
+
+/*
+ * With nothing in it the wheel doesn't tick, adding to it after a
+ * long time has to catch up to the clock instead of ticking through
+ * the gap, and an entry added in the past fires on the next tick.
+ */
+static void
+test_idle(void)
+{
+    struct test_entry te[2];
+    struct twheel *w;
+
+    fake_now = 500;
+    w = twheel_alloc(&fake_o);
+    memset(te, 0, sizeof(te));
+    twheel_entry_init(&te[0].e, test_handler, &te[0]);
+    twheel_entry_init(&te[1].e, test_handler, &te[1]);
+
+    fake_now = 10000000;
+    check(!fake_timer->running, "idle: timer running while empty");
+    te[0].want = fake_now + 70;
+    twheel_add(w, &te[0].e, te[0].want);
+    check(w->now == fake_now, "idle: wheel at %lu, clock at %lu",
+	  w->now, fake_now);
+    te[1].want = fake_now + 1;
+    twheel_add(w, &te[1].e, fake_now - 5);
+    step_to(fake_now + 71);
+    check_fired("idle", te, 2);
+    check_idle("idle", w);
+
+    /* Moving an entry that is in the wheel. */
+    memset(te, 0, sizeof(te));
+    twheel_entry_init(&te[0].e, test_handler, &te[0]);
+    twheel_add(w, &te[0].e, fake_now + 5000);
+    te[0].want = fake_now + 10;
+    twheel_add(w, &te[0].e, te[0].want);
+    check(w->count == 1, "idle: count %u after moving", w->count);
+    step_to(fake_now + 5001);
+    check_fired("idle move", te, 1);
+    check_idle("idle move", w);
+
+    /* Deleting the only entry leaves the timer to run out. */
+    memset(te, 0, sizeof(te));
+    twheel_entry_init(&te[0].e, test_handler, &te[0]);
+    twheel_add(w, &te[0].e, fake_now + 100);
+    twheel_del(w, &te[0].e);
+    twheel_del(w, &te[0].e);
+    check(w->count == 0, "idle: count %u after delete", w->count);
+    step_to(fake_now + 101);
+    check_fired("idle del", te, 1);
+    check_idle("idle del", w);
+    twheel_free(w);
+}
+
+/*
+ * All of these expire on the same tick and go on the expired list
+ * together.  The first handler to run deletes one of the others and
+ * re-adds the other while they are still waiting on the list, and
+ * re-adds itself.
+ */
+static struct twheel *exp_w;
+static struct test_entry exp_te[3];
+static bool exp_first_done;
+static unsigned long exp_when;
+
+static void
+exp_handler(struct twheel_entry *e, void *cb_data)
+{
+    struct test_entry *te = cb_data;
+    unsigned int i = te - exp_te;
+
+    te->fired++;
+    te->fired_at = fake_now;
+    if (exp_first_done)
+	return;
+    exp_first_done = true;
+
+    check(exp_te[(i + 1) % 3].e.fired && exp_te[(i + 2) % 3].e.fired,
+	  "expired: the others are not on the expired list");
+    twheel_del(exp_w, &exp_te[(i + 1) % 3].e);
+    exp_te[(i + 1) % 3].want = 0;
+    twheel_add(exp_w, &exp_te[(i + 2) % 3].e, exp_when + 10);
+    exp_te[(i + 2) % 3].want = exp_when + 10;
+    check(exp_w->count == 1, "expired: count %u after del and add",
+	  exp_w->count);
+}
+
+static void
+test_expired(void)
+{
+    unsigned int i;
+
+    fake_now = 2000;
+    exp_w = twheel_alloc(&fake_o);
+    memset(exp_te, 0, sizeof(exp_te));
+    exp_when = 2000 + 64;
+    for (i = 0; i < 3; i++) {
+	twheel_entry_init(&exp_te[i].e, exp_handler, &exp_te[i]);
+	exp_te[i].want = exp_when;
+	twheel_add(exp_w, &exp_te[i].e, exp_when);
+    }
+
+    step_to(exp_when + 20);
+    check_fired("expired", exp_te, 3);
+    check_idle("expired", exp_w);
+
+    /* Deleted with nothing else in the wheel, then added back. */
+    memset(exp_te, 0, sizeof(exp_te));
+    exp_first_done = true;
+    twheel_entry_init(&exp_te[0].e, exp_handler, &exp_te[0]);
+    twheel_entry_init(&exp_te[1].e, exp_handler, &exp_te[1]);
+    twheel_add(exp_w, &exp_te[0].e, fake_now + 1);
+    twheel_add(exp_w, &exp_te[1].e, fake_now + 1);
+    exp_w->o->lock(exp_w->lock);
+    fake_now++;
+    while (exp_w->now < fake_now)
+	tw_tick(exp_w);
+    exp_w->o->unlock(exp_w->lock);
+    check(exp_w->count == 0 && exp_te[0].e.fired && exp_te[1].e.fired,
+	  "expired: ticked entries not on the expired list");
+    twheel_del(exp_w, &exp_te[0].e);
+    check(!exp_te[0].e.fired && exp_w->count == 0,
+	  "expired: delete from the expired list, count %u", exp_w->count);
+    twheel_add(exp_w, &exp_te[0].e, fake_now + 3);
+    check(!exp_te[0].e.fired && exp_w->count == 1,
+	  "expired: add back, count %u", exp_w->count);
+    exp_te[0].want = fake_now + 3;
+    exp_te[1].want = fake_now;
+    fake_run_timer();
+    step_to(fake_now + 4);
+    check_fired("expired re-add", exp_te, 2);
+    check_idle("expired re-add", exp_w);
+    twheel_free(exp_w);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_levels(1000);
+    test_levels(4095);
+    test_levels(4096);
+    test_levels(262143);
+    test_late();
+    test_idle();
+    test_expired();
+
+    if (failures) {
+	printf("timewheel_test: %d failures\n", failures);
+	return 1;
+    }
+    printf("timewheel_test: passed\n");
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Microbenchmark for hexdump trace formatting.  This compares the old
+ * per-byte snprintf() formatter with trace_hexdump(), checks that
+ * they produce the same output, and prints bytes/sec for each.
+ *
+ * Usage: trace_bench [total bytes [block size]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+/* Pull in the formatter directly so this doesn't need the rest of ser2net. */
+#include "trace.c"
+
+/* The sink just keeps a running count so the output can't be optimized out. */
+static size_t sink_total;
+
+static void
+sink(const char *data, size_t len)
+{
+    sink_total += len + (unsigned char) data[len - 1];
+}
+
+/* The old formatter, from before trace_hexdump(). */
+static int
+old_timestamp(bool dotime, char *buf, int size)
+{
+    time_t result;
+    if (!dotime)
+        return 0;
+    result = time(NULL);
+    return strftime(buf, size, "%Y/%m/%d %H:%M:%S ", localtime(&result));
+}
+
+static int
+old_trace_write_end(char *out, int size, const unsigned char *start, int col)
+{
+    int pos = 0, w;
+
+    strncat(out, " |", size - pos);
+    pos += 2;
+    for(w = 0; w < col; w++) {
+        pos += snprintf(out + pos, size - pos, "%c",
+			isprint(start[w]) ? start[w] : '.');
+    }
+    strncat(out + pos, "|\n", size - pos);
+    pos += 2;
+    return pos;
+}
+
+static void
+old_trace_write(bool dotime, const unsigned char *buf, size_t buf_len,
+		const char *prefix, void (*out_func)(const char *, size_t))
+{
+    int w, col = 0, pos;
+    size_t q;
+    static char out[1024];
+    const unsigned char *start;
+
+    pos = old_timestamp(dotime, out, sizeof(out));
+    pos += snprintf(out + pos, sizeof(out) - pos, "%s ", prefix);
+
+    start = buf;
+    for (q = 0; q < buf_len; q++) {
+        pos += snprintf(out + pos, sizeof(out) - pos, "%02x ", buf[q]);
+        col++;
+        if (col >= 8) {
+            old_trace_write_end(out + pos, sizeof(out) - pos, start, col);
+            out_func(out, strlen(out));
+            pos = old_timestamp(dotime, out, sizeof(out));
+            pos += snprintf(out + pos, sizeof(out) - pos, "%s ", prefix);
+            col = 0;
+            start = buf + q + 1;
+        }
+    }
+    if (col > 0) {
+        for (w = 8; w > col; w--) {
+            strncat(out + pos, "   ", sizeof(out) - pos);
+            pos += 3;
+        }
+        old_trace_write_end(out + pos, sizeof(out) - pos, start, col);
+        out_func(out, strlen(out));
+    }
+}
+
+/* The new formatter, the same as do_trace() in dataxfer.c. */
+static void
+new_trace_write(bool dotime, struct trace_tstamp *ts,
+		const unsigned char *buf, size_t buf_len, const char *prefix,
+		void (*out_func)(const char *, size_t))
+{
+    char hdr[64], out[TRACE_HEXDUMP_LINE_LEN(sizeof(hdr)) * 32];
+    size_t hdrlen = 0, outlen, done;
+
+    if (dotime)
+	hdrlen = trace_timestamp(ts, hdr, sizeof(hdr));
+    hdrlen += snprintf(hdr + hdrlen, sizeof(hdr) - hdrlen, "%s ", prefix);
+
+    while (buf_len > 0) {
+	done = trace_hexdump(out, sizeof(out), &outlen, hdr, hdrlen,
+			     buf, buf_len);
+	out_func(out, outlen);
+	buf += done;
+	buf_len -= done;
+    }
+}
+
+static char *cmp_buf;
+static size_t cmp_len;
+
+static void
+cmp_sink(const char *data, size_t len)
+{
+    memcpy(cmp_buf + cmp_len, data, len);
+    cmp_len += len;
+}
+
+/* Make sure the two formatters give the same output for every length. */
+static int
+check_output(const unsigned char *data)
+{
+    struct trace_tstamp ts;
+    char *old_out;
+    size_t old_len, len;
+
+    cmp_buf = malloc(64 * 1024);
+    old_out = malloc(64 * 1024);
+    if (!cmp_buf || !old_out) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    for (len = 1; len <= 1000; len++) {
+	cmp_len = 0;
+	old_trace_write(false, data, len, "term", cmp_sink);
+	memcpy(old_out, cmp_buf, cmp_len);
+	old_len = cmp_len;
+
+	memset(&ts, 0, sizeof(ts));
+	cmp_len = 0;
+	new_trace_write(false, &ts, data, len, "term", cmp_sink);
+
+	if (old_len != cmp_len || memcmp(old_out, cmp_buf, cmp_len) != 0) {
+	    fprintf(stderr, "Output mismatch at length %zu\n", len);
+	    return 1;
+	}
+    }
+
+    free(old_out);
+    free(cmp_buf);
+    return 0;
+}
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t total = 16 * 1024 * 1024, block = 64, done, i;
+    unsigned char *data;
+    struct trace_tstamp ts;
+    double start, old_time, new_time;
+    int dotime;
+
+    if (argc > 1)
+	total = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+	block = strtoul(argv[2], NULL, 0);
+    if (block == 0 || total < block) {
+	fprintf(stderr, "Invalid sizes\n");
+	return 1;
+    }
+
+    data = malloc(block > 1000 ? block : 1000);
+    if (!data) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+    for (i = 0; i < (block > 1000 ? block : 1000); i++)
+	data[i] = i * 37;
+
+    if (check_output(data))
+	return 1;
+
+    printf("hexdump trace, %zu bytes in %zu byte blocks\n", total, block);
+    for (dotime = 0; dotime < 2; dotime++) {
+	start = now_sec();
+	for (done = 0; done < total; done += block)
+	    old_trace_write(dotime, data, block, "term", sink);
+	old_time = now_sec() - start;
+
+	memset(&ts, 0, sizeof(ts));
+	start = now_sec();
+	for (done = 0; done < total; done += block)
+	    new_trace_write(dotime, &ts, data, block, "term", sink);
+	new_time = now_sec() - start;
+
+	printf("  %-12s old: %8.2f MB/s  new: %8.2f MB/s  (%.1fx)\n",
+	       dotime ? "timestamp" : "no timestamp",
+	       total / old_time / 1e6, total / new_time / 1e6,
+	       old_time / new_time);
+    }
+
+    /* Print this so the compiler can't ignore the output. */
+    printf("  (%zu)\n", sink_total);
+
+    return 0;
+}
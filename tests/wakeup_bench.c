@@ -0,0 +1,215 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Wakeup latency benchmark.  This models the threads of ser2net -t
+ * waiting in the selector: each thread blocks in ppoll() with the
+ * wake signal unblocked, the same as the selector's epoll_pwait().  A
+ * waker thread then wakes one of them, either with pthread_kill() or
+ * by writing to an eventfd all the waiters watch, and the time from
+ * the send until the waiter runs is recorded.
+ *
+ * Usage: wakeup_bench [threads [iterations]]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define WAKE_SIG SIGUSR1
+
+static int use_eventfd;
+static int efd;
+static int dummy_fd;
+static atomic_int stop;
+static atomic_uint_fast64_t send_ns;
+static atomic_uint_fast64_t wake_ns;
+static atomic_ulong eintrs;
+static atomic_ulong wakeups;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+wake_handler(int sig)
+{
+}
+
+static void *
+waiter(void *data)
+{
+    struct pollfd pfd[2];
+    sigset_t mask;
+    uint64_t val;
+    int rv, n = 1;
+
+    /* Only take the signal while waiting, like the selector. */
+    pthread_sigmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, WAKE_SIG);
+
+    pfd[0].fd = dummy_fd;
+    pfd[0].events = POLLIN;
+    if (use_eventfd) {
+	pfd[1].fd = efd;
+	pfd[1].events = POLLIN;
+	n = 2;
+    }
+
+    while (!atomic_load(&stop)) {
+	rv = ppoll(pfd, n, NULL, &mask);
+	atomic_fetch_add(&wakeups, 1);
+	if (rv < 0 && errno == EINTR)
+	    atomic_fetch_add(&eintrs, 1);
+	if (use_eventfd && rv > 0 && (pfd[1].revents & POLLIN)) {
+	    /* Only one waiter gets the count, the rest go back to sleep. */
+	    if (read(efd, &val, sizeof(val)) != sizeof(val))
+		continue;
+	}
+	if (atomic_load(&send_ns) && !atomic_load(&wake_ns))
+	    atomic_store(&wake_ns, now_ns());
+    }
+    return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+run(int nthreads, int iterations, int do_eventfd)
+{
+    pthread_t *threads;
+    uint64_t *lat, val = 1;
+    unsigned long nintr, nwake;
+    int i;
+
+    use_eventfd = do_eventfd;
+    atomic_store(&stop, 0);
+    atomic_store(&eintrs, 0);
+    atomic_store(&wakeups, 0);
+    threads = calloc(nthreads, sizeof(*threads));
+    lat = calloc(iterations, sizeof(*lat));
+    if (!threads || !lat) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&threads[i], NULL, waiter, NULL)) {
+	    fprintf(stderr, "Unable to create thread\n");
+	    return 1;
+	}
+    }
+    usleep(100000);
+
+    for (i = 0; i < iterations; i++) {
+	atomic_store(&wake_ns, 0);
+	atomic_store(&send_ns, now_ns());
+	if (do_eventfd) {
+	    if (write(efd, &val, sizeof(val)) != sizeof(val))
+		return 1;
+	} else {
+	    pthread_kill(threads[i % nthreads], WAKE_SIG);
+	}
+	while (!atomic_load(&wake_ns))
+	    ;
+	lat[i] = atomic_load(&wake_ns) - atomic_load(&send_ns);
+	atomic_store(&send_ns, 0);
+	/* Let everything settle back into ppoll(). */
+	usleep(50);
+    }
+
+    nintr = atomic_load(&eintrs);
+    nwake = atomic_load(&wakeups);
+    atomic_store(&stop, 1);
+    for (i = 0; i < nthreads; i++) {
+	pthread_kill(threads[i], WAKE_SIG);
+	pthread_join(threads[i], NULL);
+    }
+
+    qsort(lat, iterations, sizeof(*lat), cmp_u64);
+    printf("  %-8s median: %6.2f us  p99: %7.2f us  max: %8.2f us"
+	   "  thread wakeups: %lu  EINTRs: %lu\n",
+	   do_eventfd ? "eventfd" : "signal",
+	   lat[iterations / 2] / 1e3, lat[iterations * 99 / 100] / 1e3,
+	   lat[iterations - 1] / 1e3, nwake, nintr);
+
+    free(lat);
+    free(threads);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sigaction act;
+    sigset_t mask;
+    int nthreads = 8, iterations = 20000, pipefds[2];
+
+    if (argc > 1)
+	nthreads = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+	iterations = strtoul(argv[2], NULL, 0);
+    if (nthreads <= 0 || iterations <= 0) {
+	fprintf(stderr, "Invalid parameters\n");
+	return 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = wake_handler;
+    sigemptyset(&act.sa_mask);
+    sigaction(WAKE_SIG, &act, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, WAKE_SIG);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    efd = eventfd(0, EFD_NONBLOCK);
+    if (efd == -1 || pipe(pipefds) == -1) {
+	fprintf(stderr, "Unable to allocate fds: %s\n", strerror(errno));
+	return 1;
+    }
+    dummy_fd = pipefds[0];
+
+    printf("wakeup latency, %d threads, %d wakeups\n", nthreads, iterations);
+    if (run(nthreads, iterations, 0))
+	return 1;
+    if (run(nthreads, iterations, 1))
+	return 1;
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * The timing wheel.  Level 0 has a slot for each of the next 64
+ * seconds, level 1 a slot for each of the next 64 64 second periods,
+ * and so on.  When level 0 wraps, the next level 1 slot is spread out
+ * into level 0, and the same up the levels.  So adding and removing
+ * are O(1), and a tick only looks at one slot plus the occasional
+ * cascade.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <gensio/gensio.h>
+
+#include "timewheel.h"
+
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+#define TW_MAX_DELTA	((1UL << (TW_BITS * TW_LEVELS)) - 1)
+
+struct twheel {
+    struct gensio_os_funcs *o;
+    struct gensio_lock *lock;
+
+    /* Held while handlers run, for twheel_del_sync(). */
+    struct gensio_lock *cb_lock;
+
+    struct gensio_timer *timer;
+    bool timer_running;
+
+    unsigned long now;		/* The last tick processed. */
+    unsigned int count;		/* Entries in the slots. */
+    struct twheel_entry *slots[TW_LEVELS][TW_SIZE];
+
+    /* Entries whose time has come, waiting for their handler. */
+    struct twheel_entry *expired;
+};
+
+unsigned long
+twheel_now(struct twheel *w)
+{
+    struct timeval tv;
+
+    w->o->get_monotonic_time(w->o, &tv);
+    return tv.tv_sec;
+}
+
+static void
+tw_link(struct twheel_entry **head, struct twheel_entry *e)
+{
+    e->next = *head;
+    if (e->next)
+	e->next->pprev = &e->next;
+    e->pprev = head;
+    *head = e;
+}
+
+static void
+tw_unlink(struct twheel *w, struct twheel_entry *e)
+{
+    *e->pprev = e->next;
+    if (e->next)
+	e->next->pprev = e->pprev;
+    e->next = NULL;
+    e->pprev = NULL;
+    if (e->fired)
+	e->fired = false;
+    else
+	w->count--;
+}
+
+/* Put the entry in its slot, e->expires must not be before w->now. */
+static void
+tw_insert(struct twheel *w, struct twheel_entry *e)
+{
+    unsigned long delta = e->expires - w->now;
+    unsigned int level;
+
+    if (delta > TW_MAX_DELTA) {
+	/* Way out there, the handler will have to re-add it. */
+	e->expires = w->now + TW_MAX_DELTA;
+	delta = TW_MAX_DELTA;
+    }
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+	if (delta < (1UL << (TW_BITS * (level + 1))))
+	    break;
+    }
+    tw_link(&w->slots[level][(e->expires >> (TW_BITS * level)) & TW_MASK], e);
+    w->count++;
+}
+
+static void
+tw_cascade(struct twheel *w, unsigned int level)
+{
+    unsigned int slot = (w->now >> (TW_BITS * level)) & TW_MASK;
+    struct twheel_entry *e, *next;
+
+    e = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    for (; e; e = next) {
+	next = e->next;
+	w->count--;
+	tw_insert(w, e);
+    }
+}
+
+static void
+tw_tick(struct twheel *w)
+{
+    struct twheel_entry *e;
+    unsigned int level;
+
+    w->now++;
+
+    /* Cascade every level whose lower levels just wrapped, top first. */
+    for (level = 1; level < TW_LEVELS; level++) {
+	if (w->now & ((1UL << (TW_BITS * level)) - 1))
+	    break;
+    }
+    while (--level > 0)
+	tw_cascade(w, level);
+
+    while ((e = w->slots[0][w->now & TW_MASK])) {
+	tw_unlink(w, e);
+	tw_link(&w->expired, e);
+	e->fired = true;
+    }
+}
+
+static void
+tw_start_timer(struct twheel *w)
+{
+    struct timeval then = { w->now + 1, 0 };
+
+    w->o->start_timer_abs(w->timer, &then);
+    w->timer_running = true;
+}
+
+static void
+tw_timeout(struct gensio_timer *t, void *cb_data)
+{
+    struct twheel *w = cb_data;
+    struct twheel_entry *e;
+    unsigned long now;
+
+    w->o->lock(w->cb_lock);
+    w->o->lock(w->lock);
+    w->timer_running = false;
+    now = twheel_now(w);
+    while (w->now < now) {
+	if (w->count == 0) {
+	    w->now = now;
+	    break;
+	}
+	tw_tick(w);
+    }
+    if (w->count > 0)
+	tw_start_timer(w);
+
+    while ((e = w->expired)) {
+	tw_unlink(w, e);
+	w->o->unlock(w->lock);
+	e->handler(e, e->cb_data);
+	w->o->lock(w->lock);
+    }
+    w->o->unlock(w->lock);
+    w->o->unlock(w->cb_lock);
+}
+
+void
+twheel_entry_init(struct twheel_entry *e,
+		  void (*handler)(struct twheel_entry *e, void *cb_data),
+		  void *cb_data)
+{
+    memset(e, 0, sizeof(*e));
+    e->handler = handler;
+    e->cb_data = cb_data;
+}
+
+void
+twheel_add(struct twheel *w, struct twheel_entry *e, unsigned long expires)
+{
+    w->o->lock(w->lock);
+    if (e->pprev)
+	tw_unlink(w, e);
+    if (w->count == 0 && !w->timer_running)
+	/* The wheel has been idle, catch up. */
+	w->now = twheel_now(w);
+    if (expires <= w->now)
+	expires = w->now + 1;
+    e->expires = expires;
+    tw_insert(w, e);
+    if (!w->timer_running)
+	tw_start_timer(w);
+    w->o->unlock(w->lock);
+}
+
+void
+twheel_del(struct twheel *w, struct twheel_entry *e)
+{
+    w->o->lock(w->lock);
+    if (e->pprev)
+	tw_unlink(w, e);
+    w->o->unlock(w->lock);
+}
+
+void
+twheel_del_sync(struct twheel *w, struct twheel_entry *e)
+{
+    w->o->lock(w->cb_lock);
+    twheel_del(w, e);
+    w->o->unlock(w->cb_lock);
+}
+
+struct twheel *
+twheel_alloc(struct gensio_os_funcs *o)
+{
+    struct twheel *w;
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+	return NULL;
+    w->o = o;
+    w->lock = o->alloc_lock(o);
+    if (!w->lock)
+	goto out_nomem;
+    w->cb_lock = o->alloc_lock(o);
+    if (!w->cb_lock)
+	goto out_nomem;
+    w->timer = o->alloc_timer(o, tw_timeout, w);
+    if (!w->timer)
+	goto out_nomem;
+    w->now = twheel_now(w);
+    return w;
+
+ out_nomem:
+    twheel_free(w);
+    return NULL;
+}
+
+void
+twheel_free(struct twheel *w)
+{
+    if (w->timer) {
+	w->o->stop_timer(w->timer);
+	w->o->free_timer(w->timer);
+    }
+    if (w->cb_lock)
+	w->o->free_lock(w->cb_lock);
+    if (w->lock)
+	w->o->free_lock(w->lock);
+    free(w);
+}
@@ -0,0 +1,77 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stdbool.h>
+#include <gensio/gensio.h>
+
+/*
+ * A hierarchical timing wheel with one second resolution.  Many
+ * entries share a single gensio timer, and the timer only runs while
+ * there are entries in the wheel, so an entry that isn't added costs
+ * nothing.  Times are in seconds of the monotonic clock.
+ */
+struct twheel;
+
+struct twheel_entry {
+    struct twheel_entry *next;
+    struct twheel_entry **pprev;	/* NULL if not in the wheel. */
+    unsigned long expires;
+    bool fired;				/* Waiting for the handler to run. */
+    void (*handler)(struct twheel_entry *e, void *cb_data);
+    void *cb_data;
+};
+
+/* Returns NULL on out of memory. */
+struct twheel *twheel_alloc(struct gensio_os_funcs *o);
+
+/* The wheel must be empty. */
+void twheel_free(struct twheel *w);
+
+/* The current time, in seconds. */
+unsigned long twheel_now(struct twheel *w);
+
+void twheel_entry_init(struct twheel_entry *e,
+		       void (*handler)(struct twheel_entry *e, void *cb_data),
+		       void *cb_data);
+
+/*
+ * Call the entry's handler at the given time, or at the next tick if
+ * that has already passed.  If the entry is already in the wheel it
+ * is moved.  The handler is called without any locks held.
+ */
+void twheel_add(struct twheel *w, struct twheel_entry *e,
+		unsigned long expires);
+
+/*
+ * Remove the entry from the wheel.  Its handler may still be running,
+ * or about to run, when this returns.
+ */
+void twheel_del(struct twheel *w, struct twheel_entry *e);
+
+/*
+ * Remove the entry and wait for a running handler to finish.  This
+ * must not be called from a handler or with any lock a handler
+ * takes.  Use it before freeing the entry.
+ */
+void twheel_del_sync(struct twheel *w, struct twheel_entry *e);
+
+#endif /* TIMEWHEEL_H */
@@ -0,0 +1,740 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * This file holds the trace file writer.  Trace data is put into a
+ * per-file ring by the data path and written out in large batches by
+ * a writer thread, so a slow trace file doesn't slow down the port.
+ * It also holds the binary trace format, which is written straight
+ * into a memory mapped file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gensio/gensio.h>
+
+#include "trace.h"
+#include "metrics.h"
+
+struct gensio_enum_val trace_overflow_enums[] = {
+    { "drop", TRACE_OVERFLOW_DROP },
+    { "block", TRACE_OVERFLOW_BLOCK },
+    { NULL }
+};
+
+struct gensio_enum_val trace_format_enums[] = {
+    { "text", TRACE_FORMAT_TEXT },
+    { "binary", TRACE_FORMAT_BINARY },
+    { NULL }
+};
+
+static void
+trace_log_error(const char *name, int err)
+{
+    syslog(LOG_ERR, "Unable to write to trace file %s: %s", name,
+	   strerror(err));
+}
+
+size_t
+trace_timestamp(struct trace_tstamp *ts, char *buf, size_t size)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != ts->sec || ts->len == 0) {
+	localtime_r(&now, &tm);
+	ts->len = strftime(ts->str, sizeof(ts->str), "%Y/%m/%d %H:%M:%S ",
+			   &tm);
+	ts->sec = now;
+    }
+    if (ts->len >= size)
+	return 0;
+    memcpy(buf, ts->str, ts->len);
+    return ts->len;
+}
+
+static const char hexchars[] = "0123456789abcdef";
+
+/* Printable ASCII goes out as is, everything else as '.'. */
+static const char printchars[256] =
+    "................................"
+    " !\"#$%&'()*+,-./0123456789:;<=>?"
+    "@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_"
+    "`abcdefghijklmnopqrstuvwxyz{|}~."
+    "................................"
+    "................................"
+    "................................"
+    "................................";
+
+size_t
+trace_hexdump(char *out, size_t outsize, size_t *outlen,
+	      const char *hdr, size_t hdrlen,
+	      const unsigned char *buf, size_t len)
+{
+    size_t linelen = TRACE_HEXDUMP_LINE_LEN(hdrlen);
+    size_t done = 0, i, n;
+    char *o = out, *ascii;
+
+    while (done < len && (size_t) (o - out) + linelen <= outsize) {
+	n = len - done;
+	if (n > TRACE_HEXDUMP_BYTES)
+	    n = TRACE_HEXDUMP_BYTES;
+
+	memcpy(o, hdr, hdrlen);
+	o += hdrlen;
+
+	/* The ASCII part starts after the hex part and the " |". */
+	ascii = o + TRACE_HEXDUMP_BYTES * 3 + 2;
+	for (i = 0; i < n; i++) {
+	    unsigned char c = buf[done + i];
+
+	    o[0] = hexchars[c >> 4];
+	    o[1] = hexchars[c & 0xf];
+	    o[2] = ' ';
+	    o += 3;
+	    ascii[i] = printchars[c];
+	}
+	for (; i < TRACE_HEXDUMP_BYTES; i++) {
+	    memcpy(o, "   ", 3);
+	    o += 3;
+	}
+	o[0] = ' ';
+	o[1] = '|';
+	o = ascii + n;
+	o[0] = '|';
+	o[1] = '\n';
+	o += 2;
+
+	done += n;
+    }
+
+    *outlen = o - out;
+    return done;
+}
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/*
+ * The ring is single producer (the port, which holds its lock while
+ * adding data) and single consumer (the writer thread).  head is only
+ * changed by the producer and tail only by the writer, so no lock is
+ * needed on the data path.
+ */
+struct trace_queue {
+    int fd;
+    char *name;
+    enum trace_overflow overflow;
+    metrics_counter dropped;
+
+    unsigned char *buf;
+    size_t size;
+    atomic_size_t head;		/* Position of the next byte to add. */
+    atomic_size_t tail;		/* Position of the next byte to write. */
+
+    atomic_bool failed;		/* A write failed, discard everything. */
+    atomic_bool closing;	/* Free when everything is written. */
+
+    /* Protected by trace_lock. */
+    struct trace_queue *next;
+};
+
+/* How long the writer waits before writing out a partial batch. */
+#define TRACE_FLUSH_INTERVAL_MS	100
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t trace_thread;
+static bool trace_thread_running;
+static bool trace_thread_stop;
+static struct trace_queue *trace_queues;
+
+static void
+trace_wake_writer(void)
+{
+    pthread_cond_signal(&trace_cond);
+}
+
+/* Write what is in the queue.  Returns true if anything was done. */
+static bool
+trace_queue_flush(struct trace_queue *q)
+{
+    size_t head, tail, len, off;
+    struct iovec iov[2];
+    int iovcnt = 1;
+    ssize_t rv;
+
+    head = atomic_load_explicit(&q->head, memory_order_acquire);
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (head == tail)
+	return false;
+
+    if (atomic_load(&q->failed)) {
+	tail = head;
+	goto out;
+    }
+
+    len = head - tail;
+    off = tail % q->size;
+    iov[0].iov_base = q->buf + off;
+    iov[0].iov_len = len;
+    if (len > q->size - off) {
+	iov[0].iov_len = q->size - off;
+	iov[1].iov_base = q->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	iovcnt = 2;
+    }
+
+    rv = writev(q->fd, iov, iovcnt);
+    if (rv < 0) {
+	if (errno == EINTR || errno == EAGAIN)
+	    return true;
+
+	/* Fatal error writing to the file, log it and discard the data. */
+	trace_log_error(q->name, errno);
+	atomic_store(&q->failed, true);
+	tail = head;
+    } else {
+	tail += rv;
+    }
+
+ out:
+    atomic_store_explicit(&q->tail, tail, memory_order_release);
+    return true;
+}
+
+static void
+trace_queue_destroy(struct trace_queue *q)
+{
+    if (q->fd != -1)
+	close(q->fd);
+    free(q->buf);
+    free(q->name);
+    free(q);
+}
+
+static void *
+trace_writer(void *dummy)
+{
+    struct trace_queue *q, **qp;
+    struct timespec ts;
+    sigset_t sigs;
+    bool did_work;
+
+    /* Signals are handled by the main threads. */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    pthread_mutex_lock(&trace_lock);
+    for (;;) {
+	did_work = false;
+	qp = &trace_queues;
+	while ((q = *qp)) {
+	    /* Queues are only removed here, so q stays valid. */
+	    pthread_mutex_unlock(&trace_lock);
+	    if (trace_queue_flush(q))
+		did_work = true;
+	    pthread_mutex_lock(&trace_lock);
+
+	    if (atomic_load(&q->closing) &&
+			atomic_load(&q->head) == atomic_load(&q->tail)) {
+		/* New queues may have been added before q, find it again. */
+		for (qp = &trace_queues; *qp != q; qp = &(*qp)->next)
+		    ;
+		*qp = q->next;
+		trace_queue_destroy(q);
+	    } else {
+		qp = &q->next;
+	    }
+	}
+
+	if (did_work)
+	    continue;
+	if (trace_thread_stop)
+	    break;
+
+	if (!trace_queues) {
+	    pthread_cond_wait(&trace_cond, &trace_lock);
+	    continue;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += TRACE_FLUSH_INTERVAL_MS * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return NULL;
+}
+
+int
+trace_queue_alloc(int fd, const char *name, size_t size,
+		  enum trace_overflow overflow, struct trace_queue **rq)
+{
+    struct trace_queue *q;
+    int rv = 0;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+	return ENOMEM;
+    q->buf = malloc(size);
+    q->name = strdup(name);
+    if (!q->buf || !q->name) {
+	q->fd = -1;
+	trace_queue_destroy(q);
+	return ENOMEM;
+    }
+    q->fd = fd;
+    q->size = size;
+    q->overflow = overflow;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->failed, false);
+    atomic_init(&q->closing, false);
+    atomic_init(&q->dropped, 0);
+
+    pthread_mutex_lock(&trace_lock);
+    /* Start the writer on first use, after we have daemonized. */
+    if (!trace_thread_running) {
+	rv = pthread_create(&trace_thread, NULL, trace_writer, NULL);
+	if (!rv)
+	    trace_thread_running = true;
+    }
+    if (!rv) {
+	q->next = trace_queues;
+	trace_queues = q;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (rv) {
+	q->fd = -1;
+	trace_queue_destroy(q);
+	return rv;
+    }
+
+    *rq = q;
+    return 0;
+}
+
+void
+trace_queue_write(struct trace_queue *q, const void *data, size_t len)
+{
+    const unsigned char *d = data;
+    size_t head, tail, room, off, n;
+    struct timespec ts = { 0, 1000000 };
+
+    if (atomic_load(&q->failed)) {
+	metrics_add(&q->dropped, len);
+	return;
+    }
+
+    while (len > 0) {
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	room = q->size - (head - tail);
+
+	if (room < len && q->overflow == TRACE_OVERFLOW_DROP) {
+	    /* Don't put partial data in, the output would be garbled. */
+	    metrics_add(&q->dropped, len);
+	    trace_wake_writer();
+	    return;
+	}
+	if (room == 0) {
+	    /* TRACE_OVERFLOW_BLOCK, wait for the writer to make room. */
+	    trace_wake_writer();
+	    nanosleep(&ts, NULL);
+	    if (atomic_load(&q->failed)) {
+		metrics_add(&q->dropped, len);
+		return;
+	    }
+	    continue;
+	}
+
+	n = len;
+	if (n > room)
+	    n = room;
+	off = head % q->size;
+	if (n > q->size - off) {
+	    memcpy(q->buf + off, d, q->size - off);
+	    memcpy(q->buf, d + (q->size - off), n - (q->size - off));
+	} else {
+	    memcpy(q->buf + off, d, n);
+	}
+	atomic_store_explicit(&q->head, head + n, memory_order_release);
+	d += n;
+	len -= n;
+
+	/* Let data batch up, but don't let the writer fall behind. */
+	if (head - tail < q->size / 4 && head + n - tail >= q->size / 4)
+	    trace_wake_writer();
+    }
+}
+
+size_t
+trace_queue_dropped(struct trace_queue *q)
+{
+    return metrics_get(&q->dropped);
+}
+
+void
+trace_queue_free(struct trace_queue *q)
+{
+    atomic_store(&q->closing, true);
+    trace_wake_writer();
+}
+
+void
+trace_shutdown(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_thread_stop = true;
+    trace_wake_writer();
+    pthread_mutex_unlock(&trace_lock);
+
+    if (trace_thread_running)
+	pthread_join(trace_thread, NULL);
+    trace_thread_running = false;
+}
+
+#else /* USE_PTHREADS */
+
+/* Without threads, just write the data directly. */
+struct trace_queue {
+    int fd;
+    char *name;
+    metrics_counter dropped;
+};
+
+int
+trace_queue_alloc(int fd, const char *name, size_t size,
+		  enum trace_overflow overflow, struct trace_queue **rq)
+{
+    struct trace_queue *q;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+	return ENOMEM;
+    q->name = strdup(name);
+    if (!q->name) {
+	free(q);
+	return ENOMEM;
+    }
+    q->fd = fd;
+    *rq = q;
+    return 0;
+}
+
+void
+trace_queue_write(struct trace_queue *q, const void *data, size_t len)
+{
+    const unsigned char *d = data;
+    ssize_t rv;
+
+    while (len > 0) {
+	if (q->fd == -1) {
+	    metrics_add(&q->dropped, len);
+	    return;
+	}
+
+	rv = write(q->fd, d, len);
+	if (rv < 0) {
+	    if (errno == EINTR)
+		continue;
+
+	    /* Fatal error writing to the file, log it and close the file. */
+	    trace_log_error(q->name, errno);
+	    close(q->fd);
+	    q->fd = -1;
+	    continue;
+	}
+	d += rv;
+	len -= rv;
+    }
+}
+
+size_t
+trace_queue_dropped(struct trace_queue *q)
+{
+    return metrics_get(&q->dropped);
+}
+
+void
+trace_queue_free(struct trace_queue *q)
+{
+    if (q->fd != -1)
+	close(q->fd);
+    free(q->name);
+    free(q);
+}
+
+void
+trace_shutdown(void)
+{
+}
+
+#endif /* USE_PTHREADS */
+
+struct trace_bin {
+    int fd;
+    size_t mapsize;
+    struct trace_bin_hdr *hdr;
+    unsigned char *data;
+
+    /*
+     * Two rings mapped from the same file would corrupt each other,
+     * so the open ones are kept to refuse a second open.
+     */
+    dev_t dev;
+    ino_t ino;
+    struct trace_bin *next;
+};
+
+static struct trace_bin *trace_bins;
+#ifdef USE_PTHREADS
+static pthread_mutex_t trace_bins_lock = PTHREAD_MUTEX_INITIALIZER;
+#define trace_bins_lock()	pthread_mutex_lock(&trace_bins_lock)
+#define trace_bins_unlock()	pthread_mutex_unlock(&trace_bins_lock)
+#else
+#define trace_bins_lock()	do { } while (0)
+#define trace_bins_unlock()	do { } while (0)
+#endif
+
+static uint64_t
+trace_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* How far apart the two clocks may drift and still be the same boot. */
+#define TRACE_BIN_CLOCK_SLOP_NS	(60 * (uint64_t) 1000000000)
+
+/*
+ * Can the ring already in the file be added to?  It has to be the
+ * same size, and from this boot so the record times still match the
+ * time bases in the header.
+ */
+static bool
+trace_bin_reusable(struct trace_bin_hdr *hdr, size_t size)
+{
+    uint64_t mono, real, d1, d2;
+
+    if (memcmp(hdr->magic, TRACE_BIN_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->version != TRACE_BIN_VERSION ||
+		hdr->hdr_size != sizeof(*hdr) ||
+		hdr->data_size != ((size - sizeof(*hdr)) &
+				   ~(uint64_t) (TRACE_BIN_ALIGN - 1)) ||
+		hdr->tail > hdr->head ||
+		hdr->head - hdr->tail > hdr->data_size ||
+		hdr->tail % TRACE_BIN_ALIGN || hdr->head % TRACE_BIN_ALIGN)
+	return false;
+
+    mono = trace_clock_ns(CLOCK_MONOTONIC);
+    real = trace_clock_ns(CLOCK_REALTIME);
+    if (mono < hdr->mono_base_ns || real < hdr->real_base_ns)
+	return false;
+    d1 = mono - hdr->mono_base_ns;
+    d2 = real - hdr->real_base_ns;
+    if ((d1 > d2 ? d1 - d2 : d2 - d1) > TRACE_BIN_CLOCK_SLOP_NS)
+	return false;
+    return true;
+}
+
+int
+trace_bin_open(const char *filename, size_t size, struct trace_bin **rtb)
+{
+    struct trace_bin *tb, *t;
+    struct trace_bin_hdr *hdr;
+    struct stat st;
+    void *map;
+    int fd, err;
+    bool reuse;
+
+    if (size < sizeof(*hdr) + TRACE_BIN_RECLEN(1) * 2)
+	return EINVAL;
+
+    tb = calloc(1, sizeof(*tb));
+    if (!tb)
+	return ENOMEM;
+
+    fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+	err = errno;
+	goto out_err;
+    }
+    if (fstat(fd, &st) == -1) {
+	err = errno;
+	goto out_err_close;
+    }
+
+    trace_bins_lock();
+    for (t = trace_bins; t; t = t->next) {
+	if (t->dev == st.st_dev && t->ino == st.st_ino)
+	    break;
+    }
+    if (t) {
+	trace_bins_unlock();
+	err = EBUSY;
+	goto out_err_close;
+    }
+
+    /*
+     * Allocate the whole file now so we don't have to wait for the
+     * filesystem to find blocks when touching a new page.  Not all
+     * filesystems support this, ftruncate() is enough for those.
+     */
+    err = posix_fallocate(fd, 0, size);
+    if (err && err != EOPNOTSUPP && err != EINVAL)
+	goto out_err_unlock;
+    err = 0;
+    if (ftruncate(fd, size) == -1) {
+	err = errno;
+	goto out_err_unlock;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	err = errno;
+	goto out_err_unlock;
+    }
+
+    hdr = map;
+    reuse = (size_t) st.st_size == size && trace_bin_reusable(hdr, size);
+    if (!reuse) {
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = TRACE_BIN_VERSION;
+	hdr->hdr_size = sizeof(*hdr);
+	hdr->data_size = ((size - sizeof(*hdr)) &
+			  ~(uint64_t) (TRACE_BIN_ALIGN - 1));
+	hdr->mono_base_ns = trace_clock_ns(CLOCK_MONOTONIC);
+	hdr->real_base_ns = trace_clock_ns(CLOCK_REALTIME);
+	/* Set the magic last so a partial header is never valid. */
+	memcpy(hdr->magic, TRACE_BIN_MAGIC, sizeof(hdr->magic));
+    }
+
+    tb->fd = fd;
+    tb->mapsize = size;
+    tb->hdr = hdr;
+    tb->data = ((unsigned char *) map) + hdr->hdr_size;
+    tb->dev = st.st_dev;
+    tb->ino = st.st_ino;
+    tb->next = trace_bins;
+    trace_bins = tb;
+    trace_bins_unlock();
+    *rtb = tb;
+    return 0;
+
+ out_err_unlock:
+    trace_bins_unlock();
+ out_err_close:
+    close(fd);
+ out_err:
+    free(tb);
+    return err;
+}
+
+/* Throw away the oldest records until there is room for len bytes. */
+static void
+trace_bin_make_room(struct trace_bin *tb, uint64_t len)
+{
+    struct trace_bin_hdr *hdr = tb->hdr;
+    struct trace_bin_rec *rec;
+
+    while (hdr->head + len - hdr->tail > hdr->data_size) {
+	rec = (struct trace_bin_rec *) (tb->data +
+					hdr->tail % hdr->data_size);
+	hdr->tail += TRACE_BIN_RECLEN(rec->len);
+    }
+}
+
+void
+trace_bin_write(struct trace_bin *tb, enum trace_rec_type type,
+		unsigned int netcon, const void *data, size_t len)
+{
+    struct trace_bin_hdr *hdr = tb->hdr;
+    struct trace_bin_rec *rec;
+    uint64_t pos, reclen, maxlen;
+    uint8_t flags = 0;
+
+    maxlen = hdr->data_size - sizeof(*rec);
+    if (len > maxlen) {
+	len = maxlen;
+	flags |= TRACE_REC_FLAG_TRUNCATED;
+    }
+    reclen = TRACE_BIN_RECLEN(len);
+
+    pos = hdr->head % hdr->data_size;
+    if (pos + reclen > hdr->data_size) {
+	/* Doesn't fit at the end, pad it out and start at the beginning. */
+	trace_bin_make_room(tb, hdr->data_size - pos);
+	rec = (struct trace_bin_rec *) (tb->data + pos);
+	rec->len = hdr->data_size - pos - sizeof(*rec);
+	rec->type = TRACE_REC_PAD;
+	rec->flags = 0;
+	rec->netcon = TRACE_NETCON_NONE;
+	rec->ts_ns = 0;
+	hdr->head += hdr->data_size - pos;
+	pos = 0;
+    }
+
+    trace_bin_make_room(tb, reclen);
+    rec = (struct trace_bin_rec *) (tb->data + pos);
+    rec->len = len;
+    rec->type = type;
+    rec->flags = flags;
+    rec->netcon = netcon;
+    rec->ts_ns = trace_clock_ns(CLOCK_MONOTONIC);
+    memcpy(rec + 1, data, len);
+    hdr->head += reclen;
+}
+
+void
+trace_bin_close(struct trace_bin *tb)
+{
+    struct trace_bin **p;
+
+    trace_bins_lock();
+    for (p = &trace_bins; *p; p = &(*p)->next) {
+	if (*p == tb) {
+	    *p = tb->next;
+	    break;
+	}
+    }
+    trace_bins_unlock();
+    munmap(tb->hdr, tb->mapsize);
+    close(tb->fd);
+    free(tb);
+}
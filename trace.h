@@ -0,0 +1,160 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <gensio/gensio.h>
+
+/*
+ * Trace output is queued here and written to the file by a separate
+ * writer thread, so the data path never waits on the trace file.
+ * Without pthreads, the data is written directly.
+ */
+struct trace_queue;
+
+/* What to do when the trace queue is full. */
+enum trace_overflow { TRACE_OVERFLOW_DROP, TRACE_OVERFLOW_BLOCK };
+extern struct gensio_enum_val trace_overflow_enums[];
+
+/*
+ * Allocate a queue for the given open file.  The queue owns the fd
+ * after this and will close it when the queue is freed.  The name is
+ * used for logging.  Returns 0 or an errno.
+ */
+int trace_queue_alloc(int fd, const char *name, size_t size,
+		      enum trace_overflow overflow, struct trace_queue **rq);
+
+/*
+ * Add data to the queue.  Only one caller may add to a queue at a
+ * time, the caller must provide the locking for that.
+ */
+void trace_queue_write(struct trace_queue *q, const void *data, size_t len);
+
+/* The number of bytes that were thrown away because the queue was full. */
+size_t trace_queue_dropped(struct trace_queue *q);
+
+/* Write out anything remaining, close the file, and free the queue. */
+void trace_queue_free(struct trace_queue *q);
+
+/* Wait for all the queues to be written and stop the writer. */
+void trace_shutdown(void);
+
+/*
+ * The formatted time, only recalculated when the second changes.
+ * Zero it to initialize it.
+ */
+struct trace_tstamp {
+    time_t sec;
+    size_t len;
+    char str[32];
+};
+
+/*
+ * Put the current local time, as "YYYY/MM/DD HH:MM:SS ", into buf.
+ * Returns the length, or 0 if it didn't fit.
+ */
+size_t trace_timestamp(struct trace_tstamp *ts, char *buf, size_t size);
+
+/* Data bytes in one hexdump line, and the line size after the header. */
+#define TRACE_HEXDUMP_BYTES	8
+#define TRACE_HEXDUMP_LINE_LEN(hdrlen) ((hdrlen) + TRACE_HEXDUMP_BYTES * 4 + 4)
+
+/*
+ * Format as much of buf as fits into out as canonical hex+ASCII lines,
+ * each one starting with hdr.  The output length is returned in
+ * outlen, the return value is the number of bytes of buf consumed.
+ */
+size_t trace_hexdump(char *out, size_t outsize, size_t *outlen,
+		     const char *hdr, size_t hdrlen,
+		     const unsigned char *buf, size_t len);
+
+/*
+ * Binary trace files.  These are a fixed size file, mapped into
+ * memory, holding a ring of records.  When the ring is full the oldest
+ * records are overwritten.  Everything is in host byte order.  Use
+ * ser2net-tracedump to decode them.
+ */
+enum trace_format { TRACE_FORMAT_TEXT, TRACE_FORMAT_BINARY };
+extern struct gensio_enum_val trace_format_enums[];
+
+#define TRACE_BIN_MAGIC		"s2ntrace"
+#define TRACE_BIN_VERSION	1
+
+/* At the beginning of the file, the ring data follows. */
+struct trace_bin_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t hdr_size;		/* Offset of the ring data in the file. */
+    uint64_t data_size;		/* Size of the ring data. */
+    uint64_t head;		/* Total bytes ever written to the ring. */
+    uint64_t tail;		/* Position of the oldest record. */
+    uint64_t mono_base_ns;	/* CLOCK_MONOTONIC when the file was opened */
+    uint64_t real_base_ns;	/* and CLOCK_REALTIME at the same time. */
+    uint64_t reserved;
+};
+
+/*
+ * Each record is this followed by len bytes of data, padded out to
+ * TRACE_BIN_ALIGN.  A record never wraps, a pad record fills the end
+ * of the ring if the next record doesn't fit there.
+ */
+struct trace_bin_rec {
+    uint32_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t netcon;		/* Connection number, or TRACE_NETCON_NONE */
+    uint64_t ts_ns;		/* CLOCK_MONOTONIC */
+};
+
+#define TRACE_BIN_ALIGN		16
+#define TRACE_BIN_RECLEN(len) \
+    (sizeof(struct trace_bin_rec) + \
+     (((len) + TRACE_BIN_ALIGN - 1) & ~(uint64_t) (TRACE_BIN_ALIGN - 1)))
+
+enum trace_rec_type {
+    TRACE_REC_PAD = 0,		/* Fill to the end of the ring, skip it. */
+    TRACE_REC_DEV = 1,		/* Data read from the device. */
+    TRACE_REC_NET = 2,		/* Data read from the network. */
+    TRACE_REC_EVENT = 3		/* Text, like connection open and close. */
+};
+
+#define TRACE_REC_FLAG_TRUNCATED	(1 << 0)
+#define TRACE_NETCON_NONE		0xffff
+
+struct trace_bin;
+
+/*
+ * Open or create the file with the given total size.  If it already
+ * holds a ring of that size from this boot, new records are added to
+ * it, otherwise it is started over.  A file can only be open once,
+ * EBUSY is returned if it is already open.  Returns 0 or an errno.
+ */
+int trace_bin_open(const char *filename, size_t size, struct trace_bin **rtb);
+
+/* Add a record.  The caller must make sure only one writer is active. */
+void trace_bin_write(struct trace_bin *tb, enum trace_rec_type type,
+		     unsigned int netcon, const void *data, size_t len);
+
+void trace_bin_close(struct trace_bin *tb);
+
+#endif /* TRACE_H */
@@ -0,0 +1,262 @@
+/*
+ *  ser2net - A program for allowing telnet connection to serial ports
+ *  Copyright (C) 2001-2020  Corey Minyard <minyard@acm.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * ser2net-tracedump - Decode the binary trace files written with
+ * "trace-format: binary", either as the same hexdump the text traces
+ * use or as a pcap file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+
+/*
+ * pcap files use the nanosecond magic number and the first user
+ * link type.  Each packet starts with a 4 byte pseudo header: the
+ * record type, the record flags, and the connection number in network
+ * order.
+ */
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_LINKTYPE_USER0	147
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+static const char *progname;
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+	    "Usage: %s [-p] [-o outfile] tracefile\n"
+	    "  -p - Output a pcap file instead of a hexdump.\n"
+	    "  -o - Write to the given file instead of stdout.\n",
+	    progname);
+    exit(1);
+}
+
+static void
+output(FILE *f, const void *data, size_t len)
+{
+    if (len > 0 && fwrite(data, 1, len, f) != len) {
+	fprintf(stderr, "%s: Error writing output: %s\n", progname,
+		strerror(errno));
+	exit(1);
+    }
+}
+
+static void
+pcap_start(FILE *f)
+{
+    struct pcap_file_hdr h;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = PCAP_MAGIC_NSEC;
+    h.version_major = 2;
+    h.version_minor = 4;
+    h.snaplen = 0xffffffff;
+    h.linktype = PCAP_LINKTYPE_USER0;
+    output(f, &h, sizeof(h));
+}
+
+static void
+pcap_rec(FILE *f, const struct trace_bin_rec *rec, uint64_t ns)
+{
+    struct pcap_rec_hdr h;
+    unsigned char pseudo[4];
+    uint16_t netcon = htons(rec->netcon);
+
+    h.ts_sec = ns / 1000000000;
+    h.ts_nsec = ns % 1000000000;
+    h.incl_len = rec->len + sizeof(pseudo);
+    h.orig_len = h.incl_len;
+    pseudo[0] = rec->type;
+    pseudo[1] = rec->flags;
+    memcpy(pseudo + 2, &netcon, 2);
+    output(f, &h, sizeof(h));
+    output(f, pseudo, sizeof(pseudo));
+    output(f, rec + 1, rec->len);
+}
+
+static void
+hexdump_rec(FILE *f, const struct trace_bin_rec *rec, uint64_t ns)
+{
+    char hdr[64], out[TRACE_HEXDUMP_LINE_LEN(sizeof(hdr)) * 32];
+    const unsigned char *buf = (const unsigned char *) (rec + 1);
+    size_t hdrlen, outlen, done, len = rec->len;
+    time_t sec = ns / 1000000000;
+    struct tm tm;
+
+    if (rec->type == TRACE_REC_EVENT) {
+	/* Events are already formatted text lines. */
+	output(f, buf, len);
+	return;
+    }
+
+    localtime_r(&sec, &tm);
+    hdrlen = strftime(hdr, sizeof(hdr), "%Y/%m/%d %H:%M:%S", &tm);
+    hdrlen += snprintf(hdr + hdrlen, sizeof(hdr) - hdrlen, ".%09lu ",
+		       (unsigned long) (ns % 1000000000));
+    if (rec->type == TRACE_REC_DEV)
+	hdrlen += snprintf(hdr + hdrlen, sizeof(hdr) - hdrlen, "term ");
+    else
+	hdrlen += snprintf(hdr + hdrlen, sizeof(hdr) - hdrlen, "tcp %u ",
+			   rec->netcon);
+
+    while (len > 0) {
+	done = trace_hexdump(out, sizeof(out), &outlen, hdr, hdrlen,
+			     buf, len);
+	output(f, out, outlen);
+	buf += done;
+	len -= done;
+    }
+    if (rec->flags & TRACE_REC_FLAG_TRUNCATED) {
+	outlen = snprintf(out, sizeof(out), "%s(truncated)\n", hdr);
+	output(f, out, outlen);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *outfile = NULL;
+    struct trace_bin_hdr hdr;
+    const struct trace_bin_rec *rec;
+    const unsigned char *map, *data;
+    struct stat st;
+    uint64_t pos, reclen;
+    FILE *out = stdout;
+    int c, fd, do_pcap = 0;
+
+    progname = argv[0];
+    while ((c = getopt(argc, argv, "po:h")) != -1) {
+	switch (c) {
+	case 'p':
+	    do_pcap = 1;
+	    break;
+	case 'o':
+	    outfile = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind + 1 != argc)
+	usage();
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+	fprintf(stderr, "%s: Unable to open %s: %s\n", progname,
+		argv[optind], strerror(errno));
+	return 1;
+    }
+    if ((size_t) st.st_size < sizeof(hdr)) {
+	fprintf(stderr, "%s: %s is too short\n", progname, argv[optind]);
+	return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	fprintf(stderr, "%s: Unable to map %s: %s\n", progname,
+		argv[optind], strerror(errno));
+	return 1;
+    }
+
+    /* Take a copy of the header, ser2net may be still writing it. */
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, TRACE_BIN_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != TRACE_BIN_VERSION) {
+	fprintf(stderr, "%s: %s is not a ser2net binary trace file\n",
+		progname, argv[optind]);
+	return 1;
+    }
+    if (hdr.hdr_size < sizeof(hdr) ||
+		hdr.hdr_size + hdr.data_size > (uint64_t) st.st_size ||
+		hdr.data_size % TRACE_BIN_ALIGN != 0 ||
+		hdr.tail > hdr.head || hdr.head - hdr.tail > hdr.data_size) {
+	fprintf(stderr, "%s: %s has an invalid header\n", progname,
+		argv[optind]);
+	return 1;
+    }
+    data = map + hdr.hdr_size;
+
+    if (outfile) {
+	out = fopen(outfile, "w");
+	if (!out) {
+	    fprintf(stderr, "%s: Unable to open %s: %s\n", progname,
+		    outfile, strerror(errno));
+	    return 1;
+	}
+    }
+
+    if (do_pcap)
+	pcap_start(out);
+
+    for (pos = hdr.tail; pos < hdr.head; pos += reclen) {
+	uint64_t ns;
+
+	rec = (const struct trace_bin_rec *) (data + pos % hdr.data_size);
+	reclen = TRACE_BIN_RECLEN(rec->len);
+	if (reclen > hdr.head - pos ||
+		pos % hdr.data_size + reclen > hdr.data_size) {
+	    fprintf(stderr, "%s: Corrupt record at %llu, stopping\n",
+		    progname, (unsigned long long) pos);
+	    break;
+	}
+	if (rec->type == TRACE_REC_PAD)
+	    continue;
+
+	/* Convert the monotonic time to wall clock time. */
+	ns = hdr.real_base_ns + (rec->ts_ns - hdr.mono_base_ns);
+	if (do_pcap)
+	    pcap_rec(out, rec, ns);
+	else
+	    hexdump_rec(out, rec, ns);
+    }
+
+    if (fclose(out) != 0) {
+	fprintf(stderr, "%s: Error writing output: %s\n", progname,
+		strerror(errno));
+	return 1;
+    }
+    return 0;
+}
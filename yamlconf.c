@@ -21,6 +21,7 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <yaml.h>
 #include <syslog.h>
 #include <sys/types.h>
@@ -34,6 +35,8 @@
 #include "dataxfer.h"
 #include "readconfig.h"
 #include "led.h"
+#include "metrics.h"
+#include "tap.h"
 
 //#define DEBUG 1
 
@@ -105,13 +108,26 @@ struct alias {
     struct alias *next;
 };
 
+/* What the config cache checks to tell if a file has changed. */
+struct yfile_sig {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+};
+
 struct yfile {
     char *name;
     char *value;
     unsigned int namelen;
+    struct yfile_sig sig;
     struct yfile *next;
+    struct yfile *all_next;
 };
 
+/* The aliases and included files are kept in hash tables by name. */
+#define YCONF_HASH_SIZE 64
+
 struct scalar_next_state;
 
 struct option_info {
@@ -178,15 +194,40 @@ struct yconf {
     unsigned int curr_option;
     unsigned int options_len;
 
-    struct alias *aliases;
+    struct alias *aliases[YCONF_HASH_SIZE];
 
-    struct yfile *files;
+    struct yfile *files[YCONF_HASH_SIZE];
+    struct yfile *all_files; /* All of them, chained on all_next. */
+
+    /* If not NULL, record what the config does here, see ycache_record(). */
+    struct ybuf *cache;
+    unsigned int cache_count;
 
     yaml_parser_t parser;
     yaml_event_t e;
     struct absout *eout;
 };
 
+/* Used to build the config cache. */
+struct ybuf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    bool err; /* Ran out of memory, the contents are no good. */
+};
+
+/* 64-bit FNV-1a, for telling if a file has changed. */
+static uint64_t
+ycache_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; len > 0; p++, len--)
+	hash = (hash ^ *p) * 0x100000001b3ULL;
+    return hash;
+}
+
 static void
 dofree(char **val)
 {
@@ -243,12 +284,18 @@ syslog_eprint(struct absout *e, const char *str, ...)
     return 0;
 }
 
+static unsigned int
+yconf_hash(const char *name, unsigned int len)
+{
+    return ser2net_strhash(name, len) % YCONF_HASH_SIZE;
+}
+
 static struct alias *
 lookup_alias_len(struct yconf *y, const char *name, unsigned int len)
 {
     struct alias *a;
 
-    a = y->aliases;
+    a = y->aliases[yconf_hash(name, len)];
     while (a && (a->namelen != len || strncmp(a->name, name, len) != 0))
 	a = a->next;
     return a;
@@ -265,6 +312,7 @@ add_alias(struct yconf *y, const char *iname, const char *ivalue)
 {
     struct alias *a;
     char *name, *value;
+    unsigned int h;
 
     name = strdup(iname);
     if (!name) {
@@ -290,8 +338,9 @@ add_alias(struct yconf *y, const char *iname, const char *ivalue)
 	    y->eout->out(y->eout, "Out of memory allocating alias");
 	    return -1;
 	}
-	a->next = y->aliases;
-	y->aliases = a;
+	h = yconf_hash(name, strlen(name));
+	a->next = y->aliases[h];
+	y->aliases[h] = a;
     }
     a->name = name;
     a->value = value;
@@ -302,12 +351,13 @@ add_alias(struct yconf *y, const char *iname, const char *ivalue)
 static struct yfile *
 lookup_filename_len(struct yconf *y, const char *filename, unsigned int len)
 {
-    struct yfile *f = y->files;
+    unsigned int h = yconf_hash(filename, len);
+    struct yfile *f = y->files[h];
     int infd, rv;
     char *name, *value = NULL;
     struct stat stat;
 
-    while (f && f->namelen == len && strncmp(f->name, filename, len) != 0)
+    while (f && (f->namelen != len || strncmp(f->name, filename, len) != 0))
 	f = f->next;
     if (f)
 	return f;
@@ -354,8 +404,14 @@ lookup_filename_len(struct yconf *y, const char *filename, unsigned int len)
     f->name = name;
     f->namelen = strlen(name);
     f->value = value;
-    f->next = y->files;
-    y->files = f;
+    f->sig.size = stat.st_size;
+    f->sig.mtime_sec = stat.st_mtim.tv_sec;
+    f->sig.mtime_nsec = stat.st_mtim.tv_nsec;
+    f->sig.hash = ycache_hash(value, rv);
+    f->next = y->files[h];
+    y->files[h] = f;
+    f->all_next = y->all_files;
+    y->all_files = f;
 
     return f;
 
@@ -546,7 +602,9 @@ enum main_map_types {
     MAIN_MAP_CONNECTION,
     MAIN_MAP_ROTATOR,
     MAIN_MAP_LED,
-    MAIN_MAP_ADMIN
+    MAIN_MAP_ADMIN,
+    MAIN_MAP_METRICS,
+    MAIN_MAP_TAP
 };
 
 static struct map_info sc_default_map = {
@@ -573,6 +631,14 @@ static struct map_info sc_admin_map = {
     "admin", sc_admin, MAIN_LEVEL, MAIN_MAP_ADMIN, false
 };
 
+static struct map_info sc_metrics_map = {
+    "metrics", sc_admin, MAIN_LEVEL, MAIN_MAP_METRICS, false
+};
+
+static struct map_info sc_tap_map = {
+    "tap", sc_admin, MAIN_LEVEL, MAIN_MAP_TAP, false
+};
+
 static struct scalar_next_state sc_main[] = {
     { "define", IN_DEFINE },
     { "default", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_default_map },
@@ -583,6 +649,9 @@ static struct scalar_next_state sc_main[] = {
     { "rotator", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_rotator_map },
     { "led", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_led_map },
     { "admin", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_admin_map },
+    { "metrics", IN_MAIN_NAME, WHICH_INFO_MAP,
+      .map_info = &sc_metrics_map },
+    { "tap", IN_MAIN_NAME, WHICH_INFO_MAP, .map_info = &sc_tap_map },
     {}
 };
 
@@ -919,6 +988,114 @@ yhandle_mapping_start(struct yconf *y)
     return 0;
 }
 
+/*
+ * The config cache.  With a cache file set, the result of parsing the
+ * config is saved in it: a record of each main level map with its
+ * values after aliases and included files are expanded.  The next
+ * time, if the config and every file it included still have the same
+ * size, time and contents, the records are replayed through
+ * yhandle_mapping_end() instead of parsing the YAML.
+ *
+ * The file is a header (magic, version, the ser2net version), the
+ * signature of the config and of each included file, the records, and
+ * a hash of all that.  It's only meant to be read by the same ser2net
+ * on the same machine, so numbers are in host order.
+ */
+#define YCACHE_MAGIC	"ser2ncch"
+#define YCACHE_VERSION	1
+#define YCACHE_NULLSTR	0xffffffff
+
+static const char *yaml_cache_file;
+
+void
+yaml_set_cache_file(const char *name)
+{
+    yaml_cache_file = name;
+}
+
+static void
+ybuf_add(struct ybuf *b, const void *data, size_t len)
+{
+    if (b->err)
+	return;
+    if (b->len + len > b->size) {
+	size_t new_size = b->size ? b->size * 2 : 4096;
+	unsigned char *new_data;
+
+	while (new_size < b->len + len)
+	    new_size *= 2;
+	new_data = realloc(b->data, new_size);
+	if (!new_data) {
+	    b->err = true;
+	    return;
+	}
+	b->data = new_data;
+	b->size = new_size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void
+ybuf_add_u32(struct ybuf *b, uint32_t v)
+{
+    ybuf_add(b, &v, sizeof(v));
+}
+
+static void
+ybuf_add_u64(struct ybuf *b, uint64_t v)
+{
+    ybuf_add(b, &v, sizeof(v));
+}
+
+/* Strings are stored with their nil so they can be used in place. */
+static void
+ybuf_add_str(struct ybuf *b, const char *s)
+{
+    if (!s) {
+	ybuf_add_u32(b, YCACHE_NULLSTR);
+	return;
+    }
+    ybuf_add_u32(b, strlen(s) + 1);
+    ybuf_add(b, s, strlen(s) + 1);
+}
+
+static void
+ybuf_add_sig(struct ybuf *b, const struct yfile_sig *sig)
+{
+    ybuf_add_u64(b, sig->size);
+    ybuf_add_u64(b, sig->mtime_sec);
+    ybuf_add_u64(b, sig->mtime_nsec);
+    ybuf_add_u64(b, sig->hash);
+}
+
+/* Save what is about to be done at the end of a main level map. */
+static void
+ycache_record(struct yconf *y)
+{
+    struct ybuf *b = y->cache;
+    unsigned int i;
+
+    y->cache_count++;
+    ybuf_add_u32(b, y->map_info->map_type);
+    ybuf_add_u32(b, y->e.start_mark.line);
+    ybuf_add_u32(b, y->e.start_mark.column);
+    ybuf_add_u32(b, y->timeout);
+    ybuf_add_u32(b, y->enable);
+    ybuf_add_str(b, y->name);
+    ybuf_add_str(b, y->accepter);
+    ybuf_add_str(b, y->driver);
+    ybuf_add_str(b, y->connector);
+    ybuf_add_str(b, y->value);
+    ybuf_add_str(b, y->class);
+    ybuf_add_u32(b, y->curr_option);
+    for (i = 0; i < y->curr_option; i++)
+	ybuf_add_str(b, y->options[i]);
+    ybuf_add_u32(b, y->curr_connection);
+    for (i = 0; i < y->curr_connection; i++)
+	ybuf_add_str(b, y->connections[i]);
+}
+
 static int
 yhandle_mapping_end(struct yconf *y)
 {
@@ -932,6 +1109,8 @@ yhandle_mapping_end(struct yconf *y)
 	break;
 
     case IN_MAIN_MAP:
+	if (y->cache)
+	    ycache_record(y);
 	switch (y->map_info->map_type) {
 	case MAIN_MAP_DEFAULT:
 	    if (!y->name) {
@@ -939,6 +1118,7 @@ yhandle_mapping_end(struct yconf *y)
 		return -1;
 	    }
 	    err = gensio_set_default(so, y->class, y->name, y->value, 0);
+	    config_context_default(y->class, y->name, y->value, false);
 	    if (err) {
 		eout->out(eout, "Unable to set default name %s:%s:%s: %s",
 			  y->class ? y->class : "",
@@ -959,6 +1139,7 @@ yhandle_mapping_end(struct yconf *y)
 		return -1;
 	    }
 	    err = gensio_del_default(so, y->class, y->name, false);
+	    config_context_default(y->class, y->name, NULL, true);
 	    if (err) {
 		eout->out(eout, "Unable to set default name %s:%s:%s: %s",
 			  y->class ? y->class : "",
@@ -1055,6 +1236,32 @@ yhandle_mapping_end(struct yconf *y)
 	    y->state = MAIN_LEVEL;
 	    yconf_cleanup_main(y);
 	    break;
+
+	case MAIN_MAP_METRICS:
+	    if (!y->accepter) {
+		eout->out(eout, "No accepter given in metrics");
+		return -1;
+	    }
+	    /* NULL terminate the options. */
+	    if (add_option(y, NULL, NULL, "metrics"))
+		return -1;
+	    metrics_init(y->accepter, (const char **) y->options, eout);
+	    y->state = MAIN_LEVEL;
+	    yconf_cleanup_main(y);
+	    break;
+
+	case MAIN_MAP_TAP:
+	    if (!y->accepter) {
+		eout->out(eout, "No accepter given in tap");
+		return -1;
+	    }
+	    /* NULL terminate the options. */
+	    if (add_option(y, NULL, NULL, "tap"))
+		return -1;
+	    tap_init(y->accepter, (const char **) y->options, eout);
+	    y->state = MAIN_LEVEL;
+	    yconf_cleanup_main(y);
+	    break;
 	}
 	break;
 
@@ -1070,6 +1277,334 @@ yhandle_mapping_end(struct yconf *y)
     return 0;
 }
 
+static struct map_info *main_maps[] = {
+    [MAIN_MAP_DEFAULT] = &sc_default_map,
+    [MAIN_MAP_DELDEFAULT] = &sc_deldefault_map,
+    [MAIN_MAP_CONNECTION] = &sc_connection_map,
+    [MAIN_MAP_ROTATOR] = &sc_rotator_map,
+    [MAIN_MAP_LED] = &sc_led_map,
+    [MAIN_MAP_ADMIN] = &sc_admin_map,
+    [MAIN_MAP_METRICS] = &sc_metrics_map,
+    [MAIN_MAP_TAP] = &sc_tap_map
+};
+#define NUM_MAIN_MAPS (sizeof(main_maps) / sizeof(*main_maps))
+
+/* Reading the cache, err is set if it runs off the end or is bad. */
+struct yreader {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool err;
+};
+
+static const void *
+yr_get(struct yreader *r, size_t len)
+{
+    const void *rv = r->p;
+
+    if (r->err || len > (size_t) (r->end - r->p)) {
+	r->err = true;
+	return NULL;
+    }
+    r->p += len;
+    return rv;
+}
+
+static uint32_t
+yr_u32(struct yreader *r)
+{
+    const void *p = yr_get(r, sizeof(uint32_t));
+    uint32_t v = 0;
+
+    if (p)
+	memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t
+yr_u64(struct yreader *r)
+{
+    const void *p = yr_get(r, sizeof(uint64_t));
+    uint64_t v = 0;
+
+    if (p)
+	memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static const char *
+yr_str(struct yreader *r)
+{
+    uint32_t len = yr_u32(r);
+    const char *s;
+
+    if (r->err || len == YCACHE_NULLSTR)
+	return NULL;
+    s = yr_get(r, len);
+    if (s && (len == 0 || s[len - 1] != '\0')) {
+	r->err = true;
+	return NULL;
+    }
+    return s;
+}
+
+static void
+yr_sig(struct yreader *r, struct yfile_sig *sig)
+{
+    sig->size = yr_u64(r);
+    sig->mtime_sec = yr_u64(r);
+    sig->mtime_nsec = yr_u64(r);
+    sig->hash = yr_u64(r);
+}
+
+static bool
+ycache_sig_same(const struct yfile_sig *a, const struct yfile_sig *b)
+{
+    return (a->size == b->size && a->mtime_sec == b->mtime_sec &&
+	    a->mtime_nsec == b->mtime_nsec && a->hash == b->hash);
+}
+
+/* Get the signature of an open file.  Returns false if it can't. */
+static bool
+ycache_fd_sig(int fd, struct yfile_sig *sig)
+{
+    struct stat st;
+    unsigned char *data;
+    size_t pos = 0;
+    ssize_t rv;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+	return false;
+    data = malloc(st.st_size + 1);
+    if (!data)
+	return false;
+    while (pos < (size_t) st.st_size) {
+	rv = pread(fd, data + pos, st.st_size - pos, pos);
+	if (rv <= 0)
+	    break;
+	pos += rv;
+    }
+    sig->size = st.st_size;
+    sig->mtime_sec = st.st_mtim.tv_sec;
+    sig->mtime_nsec = st.st_mtim.tv_nsec;
+    sig->hash = ycache_hash(data, pos);
+    free(data);
+    return pos == (size_t) st.st_size;
+}
+
+static bool
+ycache_file_same(const char *name, const struct yfile_sig *sig)
+{
+    struct yfile_sig cur;
+    int fd;
+    bool rv;
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1)
+	return false;
+    rv = ycache_fd_sig(fd, &cur) && ycache_sig_same(&cur, sig);
+    close(fd);
+    return rv;
+}
+
+static int
+ycache_setstr(struct yconf *y, char **oval, const char *ival)
+{
+    if (!ival)
+	return 0;
+    *oval = strdup(ival);
+    if (!*oval) {
+	y->eout->out(y->eout, "Out of memory replaying config cache");
+	return -1;
+    }
+    return 0;
+}
+
+/* Do what one cached record says. */
+static int
+ycache_replay_one(struct yconf *y, struct yreader *r)
+{
+    uint32_t type, i, count;
+    const char *s;
+
+    type = yr_u32(r);
+    if (r->err || type >= NUM_MAIN_MAPS)
+	return -1;
+    y->map_info = main_maps[type];
+    y->state = IN_MAIN_MAP;
+    y->e.start_mark.line = yr_u32(r);
+    y->e.start_mark.column = yr_u32(r);
+    y->timeout = yr_u32(r);
+    y->enable = yr_u32(r);
+    if (ycache_setstr(y, &y->name, yr_str(r)) ||
+	    ycache_setstr(y, &y->accepter, yr_str(r)) ||
+	    ycache_setstr(y, &y->driver, yr_str(r)) ||
+	    ycache_setstr(y, &y->connector, yr_str(r)) ||
+	    ycache_setstr(y, &y->value, yr_str(r)) ||
+	    ycache_setstr(y, &y->class, yr_str(r)))
+	return -1;
+    count = yr_u32(r);
+    for (i = 0; !r->err && i < count; i++) {
+	s = yr_str(r);
+	if (s && add_option(y, s, NULL, "config cache"))
+	    return -1;
+    }
+    count = yr_u32(r);
+    for (i = 0; !r->err && i < count; i++) {
+	s = yr_str(r);
+	if (s && add_connection(y, s, "config cache"))
+	    return -1;
+    }
+    if (r->err)
+	return -1;
+    return yhandle_mapping_end(y);
+}
+
+/*
+ * Try to use the cache for the config with the given signature.
+ * Returns 1 if the cache can't be used, otherwise the result of
+ * replaying it.  Nothing has been done if it returns 1.
+ */
+static int
+ycache_load(struct yconf *y, const struct yfile_sig *mainsig)
+{
+    struct yreader r;
+    struct yfile_sig sig;
+    unsigned char *data = NULL;
+    const char *name;
+    uint32_t i, count;
+    uint64_t sum;
+    struct stat st;
+    size_t pos = 0;
+    ssize_t rv;
+    int fd, err = 1;
+
+    fd = open(yaml_cache_file, O_RDONLY);
+    if (fd == -1) {
+	if (errno != ENOENT)
+	    syslog(LOG_WARNING, "Unable to open config cache %s: %s",
+		   yaml_cache_file, strerror(errno));
+	return 1;
+    }
+    if (fstat(fd, &st) == -1 ||
+	    st.st_size < (off_t) (strlen(YCACHE_MAGIC) + sizeof(uint64_t)))
+	goto out;
+    data = malloc(st.st_size);
+    if (!data)
+	goto out;
+    while (pos < (size_t) st.st_size) {
+	rv = read(fd, data + pos, st.st_size - pos);
+	if (rv <= 0)
+	    goto out;
+	pos += rv;
+    }
+
+    r.p = data;
+    r.end = data + pos - sizeof(uint64_t);
+    r.err = false;
+    memcpy(&sum, r.end, sizeof(sum));
+    if (ycache_hash(data, pos - sizeof(uint64_t)) != sum ||
+	    memcmp(yr_get(&r, strlen(YCACHE_MAGIC)), YCACHE_MAGIC,
+		   strlen(YCACHE_MAGIC)) != 0 ||
+	    yr_u32(&r) != YCACHE_VERSION) {
+	syslog(LOG_WARNING, "Config cache %s is not valid, ignoring it",
+	       yaml_cache_file);
+	goto out;
+    }
+    name = yr_str(&r);
+    if (!name || strcmp(name, VERSION) != 0)
+	goto out_stale;
+    yr_sig(&r, &sig);
+    if (r.err || !ycache_sig_same(&sig, mainsig))
+	goto out_stale;
+    count = yr_u32(&r);
+    for (i = 0; !r.err && i < count; i++) {
+	name = yr_str(&r);
+	yr_sig(&r, &sig);
+	if (!name || r.err || !ycache_file_same(name, &sig))
+	    goto out_stale;
+    }
+
+    count = yr_u32(&r);
+    if (r.err)
+	goto out_stale;
+    syslog(LOG_INFO, "Using config cache %s", yaml_cache_file);
+    err = 0;
+    for (i = 0; !err && i < count; i++) {
+	err = ycache_replay_one(y, &r);
+	if (err && r.err)
+	    syslog(LOG_ERR, "Config cache %s is truncated", yaml_cache_file);
+    }
+    goto out;
+
+ out_stale:
+    syslog(LOG_INFO, "Config cache %s is out of date", yaml_cache_file);
+ out:
+    if (data)
+	free(data);
+    close(fd);
+    return err;
+}
+
+/* The parse worked, write the cache for next time. */
+static void
+ycache_save(struct yconf *y, const struct yfile_sig *mainsig)
+{
+    struct ybuf b;
+    struct yfile *f;
+    unsigned int nfiles = 0;
+    char *tmpname;
+    int fd, err;
+
+    memset(&b, 0, sizeof(b));
+    ybuf_add(&b, YCACHE_MAGIC, strlen(YCACHE_MAGIC));
+    ybuf_add_u32(&b, YCACHE_VERSION);
+    ybuf_add_str(&b, VERSION);
+    ybuf_add_sig(&b, mainsig);
+    for (f = y->all_files; f; f = f->all_next)
+	nfiles++;
+    ybuf_add_u32(&b, nfiles);
+    for (f = y->all_files; f; f = f->all_next) {
+	ybuf_add_str(&b, f->name);
+	ybuf_add_sig(&b, &f->sig);
+    }
+    ybuf_add_u32(&b, y->cache_count);
+    ybuf_add(&b, y->cache->data, y->cache->len);
+    ybuf_add_u64(&b, ycache_hash(b.data, b.len));
+    if (b.err || y->cache->err) {
+	syslog(LOG_WARNING, "Out of memory writing config cache %s",
+	       yaml_cache_file);
+	goto out;
+    }
+
+    tmpname = malloc(strlen(yaml_cache_file) + 5);
+    if (!tmpname)
+	goto out;
+    sprintf(tmpname, "%s.tmp", yaml_cache_file);
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+	goto out_err;
+    if (write(fd, b.data, b.len) != (ssize_t) b.len) {
+	close(fd);
+	goto out_unlink;
+    }
+    if (close(fd) == -1 || rename(tmpname, yaml_cache_file) == -1)
+	goto out_unlink;
+    free(tmpname);
+    goto out;
+
+ out_unlink:
+    err = errno;
+    unlink(tmpname);
+    errno = err;
+ out_err:
+    syslog(LOG_WARNING, "Unable to write config cache %s: %s",
+	   yaml_cache_file, strerror(errno));
+    free(tmpname);
+ out:
+    if (b.data)
+	free(b.data);
+}
+
 int
 yaml_readconfig(FILE *f)
 {
@@ -1078,8 +1613,12 @@ yaml_readconfig(FILE *f)
     struct absout yeout = { .out = syslog_eprint, .data = &y };
     struct absout *eout = &yeout;
     int err = 0;
+    struct ybuf cache;
+    struct yfile_sig mainsig;
+    unsigned int i;
 
     memset(&y, 0, sizeof(y));
+    memset(&cache, 0, sizeof(cache));
     y.enable = true;
     y.options = malloc(sizeof(char *) * 10);
     if (!y.options) {
@@ -1097,6 +1636,14 @@ yaml_readconfig(FILE *f)
     y.state = BEGIN_DOC;
     y.eout = eout;
 
+    if (yaml_cache_file && ycache_fd_sig(fileno(f), &mainsig)) {
+	err = ycache_load(&y, &mainsig);
+	if (err != 1)
+	    goto out_cleanup;
+	err = 0;
+	y.cache = &cache;
+    }
+
     yaml_parser_initialize(&y.parser);
     yaml_parser_set_input_file(&y.parser, f);
 
@@ -1192,20 +1739,28 @@ yaml_readconfig(FILE *f)
 
     yaml_parser_delete(&y.parser);
 
+    if (!err && y.cache)
+	ycache_save(&y, &mainsig);
+
+ out_cleanup:
     yconf_cleanup_main(&y);
     free(y.options);
     free(y.connections);
-    while (y.aliases) {
-	struct alias *a = y.aliases;
-	y.aliases = a->next;
-	free(a->name);
-	free(a->value);
-	free(a);
+    if (cache.data)
+	free(cache.data);
+    for (i = 0; i < YCONF_HASH_SIZE; i++) {
+	while (y.aliases[i]) {
+	    struct alias *a = y.aliases[i];
+	    y.aliases[i] = a->next;
+	    free(a->name);
+	    free(a->value);
+	    free(a);
+	}
     }
 
-    while (y.files) {
-	struct yfile *f = y.files;
-	y.files = f->next;
+    while (y.all_files) {
+	struct yfile *f = y.all_files;
+	y.all_files = f->all_next;
 	free(f->name);
 	free(f->value);
 	free(f);